@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2008 David Ingram
+ *
+ * This program is released under a Creative Commons
+ * Attribution-NonCommerical-ShareAlike2.5 License.
+ *
+ * For more information, please see
+ *   http://creativecommons.org/licenses/by-nc-sa/2.5/
+ *
+ * You are free:
+ *
+ *   * to copy, distribute, display, and perform the work
+ *   * to make derivative works
+ *
+ * Under the following conditions:
+ *   Attribution:   You must attribute the work in the manner specified by the
+ *                  author or licensor.
+ *   Noncommercial: You may not use this work for commercial purposes.
+ *   Share Alike:   If you alter, transform, or build upon this work, you may
+ *                  distribute the resulting work only under a license identical
+ *                  to this one.
+ *
+ *   * For any reuse or distribution, you must make clear to others the
+ *     license terms of this work.
+ *   * Any of these conditions can be waived if you get permission from the
+ *     copyright holder.
+ *
+ * Your fair use and other rights are in no way affected by the above.
+ */
+
+#include <pthread.h>
+#include <insight.h>
+#if defined(_DEBUG_ARENA) && !defined(_DEBUG)
+#define _DEBUG
+#endif
+#include <debug.h>
+#include <arena.h>
+
+/** A block of memory in a request arena */
+typedef struct arena_block {
+  struct arena_block *next;   /**< The next (older) block */
+  size_t              size;   /**< Usable size of \a data */
+  size_t              used;   /**< Bytes of \a data handed out so far */
+  char                data[]; /**< The memory itself */
+} arena_block;
+
+/** The blocks of this thread's arena, most recent first */
+static __thread arena_block *arena_blocks = NULL;
+
+/** Number of arena_begin() calls on this thread not yet ended */
+static __thread int arena_depth = 0;
+
+/** Key used to free a thread's arena when the thread exits */
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Free every block of an arena.
+ *
+ * @param blocks The most recent block of the arena.
+ */
+static void _arena_free_blocks(void *blocks) {
+  arena_block *b = blocks, *next;
+  for (; b; b = next) {
+    next = b->next;
+    free(b);
+  }
+}
+
+static void _arena_key_create(void) {
+  pthread_key_create(&arena_key, _arena_free_blocks);
+}
+
+/**
+ * Set the most recent block of this thread's arena, and make sure it will be
+ * freed if the thread exits.
+ *
+ * @param b The new most recent block.
+ */
+static void _arena_set_blocks(arena_block *b) {
+  pthread_once(&arena_key_once, _arena_key_create);
+  pthread_setspecific(arena_key, b);
+  arena_blocks = b;
+}
+
+/**
+ * Start a request on this thread. Until the matching arena_end(), memory from
+ * arena_alloc() and friends comes from the thread's arena and need not be
+ * freed. Requests may nest, in which case only the outermost one releases
+ * the arena.
+ */
+void arena_begin(void) {
+  arena_depth++;
+}
+
+/**
+ * End a request on this thread. When the outermost request ends, everything
+ * allocated from the arena is released at once: the first block is kept for
+ * the next request and any others are returned to the system.
+ */
+void arena_end(void) {
+  arena_block *keep;
+
+  if (arena_depth <= 0) {
+    PMSG(LOG_ERR, "arena_end() called outside a request");
+    return;
+  }
+  if (--arena_depth) return;
+
+  /* the oldest block is the only one of the default size that is kept */
+  for (keep = arena_blocks; keep && keep->next; keep = keep->next);
+  if (keep && keep->size != ARENA_BLOCK_SIZE) keep = NULL;
+  while (arena_blocks != keep) {
+    arena_block *next = arena_blocks->next;
+    free(arena_blocks);
+    arena_blocks = next;
+  }
+  _arena_set_blocks(keep);
+  if (keep) keep->used = 0;
+  DEBUG("Arena reset");
+}
+
+/**
+ * Check whether this thread is inside a request.
+ *
+ * @returns Non-zero if allocations come from the request arena.
+ */
+int arena_active(void) {
+  return arena_depth > 0;
+}
+
+/**
+ * Check whether a pointer lies in this thread's request arena.
+ *
+ * @param ptr The pointer to check.
+ * @returns Non-zero if \a ptr was allocated from the arena.
+ */
+int arena_owns(const void *ptr) {
+  const arena_block *b;
+  const char *p = ptr;
+
+  if (!p) return 0;
+  for (b = arena_blocks; b; b = b->next) {
+    if (p >= b->data && p < b->data + b->size) return 1;
+  }
+  return 0;
+}
+
+/**
+ * Allocate memory for the current request. Inside a request the memory comes
+ * from the thread's arena by bumping a pointer, and is released when the
+ * request ends; outside one it comes from malloc(). Either way, it may be
+ * released with afree().
+ *
+ * @param size The number of bytes to allocate.
+ * @returns The memory, or NULL if it could not be allocated.
+ */
+void *arena_alloc(size_t size) {
+  arena_block *b;
+
+  if (!arena_depth) return malloc(size);
+
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  if (!size) size = ARENA_ALIGN;
+  b = arena_blocks;
+  if (!b || b->size - b->used < size) {
+    /* large requests get a block of their own behind the current one, so
+     * that the rest of the current block is not wasted */
+    size_t bsize = (size > ARENA_BLOCK_SIZE/4) ? size : ARENA_BLOCK_SIZE;
+    if (!(b = malloc(sizeof(arena_block) + bsize))) {
+      PMSG(LOG_ERR, "Failed to allocate arena block");
+      errno = ENOMEM;
+      return NULL;
+    }
+    b->size = bsize;
+    b->used = 0;
+    if (bsize != ARENA_BLOCK_SIZE && arena_blocks) {
+      b->next = arena_blocks->next;
+      arena_blocks->next = b;
+    } else {
+      b->next = arena_blocks;
+      _arena_set_blocks(b);
+    }
+  }
+  b->used += size;
+  return b->data + b->used - size;
+}
+
+/**
+ * Allocate zeroed memory for the current request, as for arena_alloc().
+ *
+ * @param nmemb The number of elements.
+ * @param size  The size of each element.
+ * @returns The memory, or NULL if it could not be allocated.
+ */
+void *arena_calloc(size_t nmemb, size_t size) {
+  void *ret;
+  if (size && nmemb > (size_t)-1 / size) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if ((ret = arena_alloc(nmemb * size))) {
+    memset(ret, 0, nmemb * size);
+  }
+  return ret;
+}
+
+/**
+ * Duplicate a string for the current request, as for arena_alloc().
+ *
+ * @param s The string to duplicate.
+ * @returns The copy, or NULL if it could not be allocated.
+ */
+char *arena_strdup(const char *s) {
+  return arena_strndup(s, strlen(s));
+}
+
+/**
+ * Duplicate at most \a n characters of a string for the current request, as
+ * for arena_alloc(). The copy is always null-terminated.
+ *
+ * @param s The string to duplicate.
+ * @param n The maximum number of characters to copy.
+ * @returns The copy, or NULL if it could not be allocated.
+ */
+char *arena_strndup(const char *s, size_t n) {
+  char *ret;
+  n = strnlen(s, n);
+  if ((ret = arena_alloc(n+1))) {
+    memcpy(ret, s, n);
+    ret[n] = '\0';
+  }
+  return ret;
+}
@@ -0,0 +1,64 @@
+#ifndef __ARENA_H
+#define __ARENA_H
+/*
+ * Copyright (C) 2008 David Ingram
+ *
+ * This program is released under a Creative Commons
+ * Attribution-NonCommerical-ShareAlike2.5 License.
+ *
+ * For more information, please see
+ *   http://creativecommons.org/licenses/by-nc-sa/2.5/
+ *
+ * You are free:
+ *
+ *   * to copy, distribute, display, and perform the work
+ *   * to make derivative works
+ *
+ * Under the following conditions:
+ *   Attribution:   You must attribute the work in the manner specified by the
+ *                  author or licensor.
+ *   Noncommercial: You may not use this work for commercial purposes.
+ *   Share Alike:   If you alter, transform, or build upon this work, you may
+ *                  distribute the resulting work only under a license identical
+ *                  to this one.
+ *
+ *   * For any reuse or distribution, you must make clear to others the
+ *     license terms of this work.
+ *   * Any of these conditions can be waived if you get permission from the
+ *     copyright holder.
+ *
+ * Your fair use and other rights are in no way affected by the above.
+ */
+
+#include <stddef.h>
+
+/** Size of each block of a request arena */
+#define ARENA_BLOCK_SIZE 16384
+
+/** Alignment of allocations from a request arena */
+#define ARENA_ALIGN 16
+
+/**
+ * Release memory from arena_alloc() and friends: memory in the current
+ * request arena is left to be reclaimed when the request ends, and anything
+ * else (allocated outside a request) is freed.
+ */
+#define afree(x) do {\
+  if (arena_owns(x)) {\
+    x = NULL;\
+  } else {\
+    ifree(x);\
+  }\
+} while (0)
+
+/* Prototypes */
+void arena_begin(void);
+void arena_end(void);
+int arena_active(void);
+int arena_owns(const void *ptr);
+void *arena_alloc(size_t size);
+void *arena_calloc(size_t nmemb, size_t size);
+char *arena_strdup(const char *s);
+char *arena_strndup(const char *s, size_t n);
+
+#endif
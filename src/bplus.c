@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <assert.h>
+#include <math.h>
 
 #if defined(_DEBUG_BPLUS) && !defined(_DEBUG)
 #define _DEBUG
@@ -135,6 +136,17 @@ void tree_dump_dot_item(FILE *target, fileptr root) {
 #endif
       }
       break;
+    case MAGIC_LIMBONODE:
+      {
+        tlnode *node = (tlnode*)&block;
+        unsigned int i;
+        fprintf(target, "id%lu [label=\"LIMBO %lu\\n" "keycount: %u\", shape=\"box\", style=\"filled\", fillcolor=\"#cccccc\"];\n", root, root, node->keycount);
+        for(i=0;!node->leaf && i<=node->keycount;i++) {
+          fprintf(target, "id%lu -> id%lu;\n", root, node->ptrs[i]);
+          tree_dump_dot_item(target, node->ptrs[i]);
+        }
+      }
+      break;
   }
 }
 
@@ -189,6 +201,10 @@ void tree_dump_tree(FILE *target, fileptr root, int indent) {
         if (node->inode_root) {
           tree_dump_tree(target, node->inode_root, indent+2);
         }
+        fprintf(target, "%s  stats root:  %lu\n", ind, node->stats_root);
+        if (node->stats_root) {
+          tree_dump_tree(target, node->stats_root, indent+2);
+        }
       }
       break;
     case MAGIC_TREENODE:
@@ -265,6 +281,21 @@ void tree_dump_tree(FILE *target, fileptr root, int indent) {
         fprintf(target, "\n");
       }
       break;
+    case MAGIC_LIMBONODE:
+      {
+        tlnode *node = (tlnode*)&block;
+        unsigned int i;
+        fprintf(target, "%s [%lu:LIMBO NODE]\n", ind, root);
+        fprintf(target, "%s  leaf:     %u\n", ind, node->leaf);
+        fprintf(target, "%s  keycount: %u\n", ind, node->keycount);
+        fprintf(target, "%s  keys:", ind);
+        for(i=0;i<node->keycount;i++) fprintf(target, " [%08lX]", node->keys[i]);
+        fprintf(target, "\n");
+        for(i=0;!node->leaf && i<=node->keycount;i++) {
+          tree_dump_tree(target, node->ptrs[i], indent+2);
+        }
+      }
+      break;
   }
 }
 
@@ -474,6 +505,7 @@ int tree_open (char *path) {
   BLOCK_TYPE_CHECK(tdata);
   BLOCK_TYPE_CHECK(tinode);
   BLOCK_TYPE_CHECK(tidata);
+  BLOCK_TYPE_CHECK(tlnode);
 #undef BLOCK_TYPE_CHECK
 
   if (tree_fp >= 0) {
@@ -506,10 +538,13 @@ int tree_open (char *path) {
       fstat(tree_fp, &s);
       last_modified = s.st_mtime;
 #ifdef TREE_CACHE_ENABLED
-      return tree_cache_init();
-#else
-      return 0;
+      if ((result=tree_cache_init())) return result;
 #endif
+      if (tree_sb->version < TREE_FILE_VERSION && (result=tree_upgrade())) {
+        PMSG(LOG_ERR, "Failed to upgrade tree store: %s", strerror(-result));
+        return -result;
+      }
+      return 0;
     }
 
   } else if ( (tree_fp = open(path, O_RDWR|O_CREAT, 0644)) >= 0) {
@@ -564,6 +599,8 @@ int tree_close (void) {
       return EIO;
     }
     tree_fp = -1;
+    /* the keys of the next tree opened are unrelated to these */
+    key_generation++;
 #ifdef TREE_STATS_ENABLED
     /* dump statistics */
     if (tree_stats) {
@@ -682,6 +719,24 @@ int tree_read (fileptr block, tblock *data) {
   return 0;
 }
 
+/**
+ * Hint that a block will be read soon, so the kernel can start fetching it
+ * while other blocks are processed. FUSE calls are handled on a single
+ * thread, so this is how independent reads (such as the subtags of a tag)
+ * are overlapped. Blocks already in the block cache are ignored.
+ *
+ * @param block Block index that will be read.
+ */
+void tree_prefetch(fileptr block) {
+  if (!block) return;
+#ifdef TREE_CACHE_ENABLED
+  if (block_cache && block_cache[tree_get_cache_loc(block)].addr==block) return;
+#endif
+#ifdef HAVE_POSIX_FADVISE
+  posix_fadvise(tree_fp, (off_t)block * TREEBLOCK_SIZE, TREEBLOCK_SIZE, POSIX_FADV_WILLNEED);
+#endif
+}
+
 /**
  * Actually write a block.
  *
@@ -999,10 +1054,12 @@ int tree_sub_key_count(fileptr root) {
 #endif
 
 /**
- * Set the tree last modified time to the current time.
+ * Set the tree last modified time to the current time, and bump the store
+ * generation.
  */
 static inline void _tree_touch() {
   last_modified=time(NULL);
+  generation++;
 }
 
 /**
@@ -1014,6 +1071,29 @@ time_t tree_get_mtime() {
   return last_modified;
 }
 
+/**
+ * Get the store generation. This changes whenever a block is written, so
+ * anything derived from the store is still valid if the generation has not
+ * changed since it was computed.
+ *
+ * @returns The current store generation.
+ */
+unsigned long tree_get_generation() {
+  return generation;
+}
+
+/**
+ * Get the key generation. This changes whenever a key is removed from the
+ * top-level tree or from the subkeys of a data block, but not from the inode,
+ * limbo or statistics trees, so a cached mapping from tag names to data blocks
+ * is still valid if the key generation has not changed since it was made.
+ *
+ * @returns The current key generation.
+ */
+unsigned long tree_get_key_generation() {
+  return key_generation;
+}
+
 /**
  * Get the tree root index.
  *
@@ -1374,6 +1454,34 @@ static int tree_insert_recurse (fileptr root, char **key, fileptr *ptr) {
   return tmp;
 }
 
+/**
+ * Check whether a tree hangs directly off the superblock, other than the root
+ * tree. Such trees have no data node of their own, so a root split or merge
+ * must update the superblock instead (see tree_set_sb_root()).
+ *
+ * @param root The root index of the tree.
+ * @returns Non-zero if \a root is the root of one of these trees.
+ */
+static int tree_is_sb_root(fileptr root) {
+  return root && (root==tree_sb->inode_root || root==tree_sb->stats_root);
+}
+
+/**
+ * Replace the root of a tree hanging directly off the superblock, and write
+ * the superblock.
+ *
+ * @param oldroot The current root index of the tree.
+ * @param newroot The new root index of the tree.
+ */
+static void tree_set_sb_root(fileptr oldroot, fileptr newroot) {
+  if (oldroot==tree_sb->inode_root) {
+    tree_sb->inode_root=newroot;
+  } else if (oldroot==tree_sb->stats_root) {
+    tree_sb->stats_root=newroot;
+  }
+  tree_write_sb(tree_sb);
+}
+
 /**
  * Insert a data block into the root tree with the given key.
  *
@@ -1398,6 +1506,7 @@ fileptr tree_insert (const tkey key, tblock *data) {
 fileptr tree_sub_insert(fileptr root, const tkey key, tblock *data) {
   fileptr newnode;
   fileptr ptr, split;
+  int sbroot=0;
   tdata dataroot;
   /* TODO: replace with strndup() */
   char *ikey = malloc(sizeof(char)*TREEKEY_SIZE); /* TODO: check for failure */
@@ -1410,10 +1519,10 @@ fileptr tree_sub_insert(fileptr root, const tkey key, tblock *data) {
     initDataNode(&dataroot);
     dataroot.subkeys=tree_sb->root_index;
     root=0;
-  } else if (root==tree_sb->inode_root) {
+  } else if ((sbroot=tree_is_sb_root(root))) {
     DEBUG("Faking data node");
     initDataNode(&dataroot);
-    dataroot.subkeys=tree_sb->inode_root;
+    dataroot.subkeys=root;
   } else {
     DEBUG("Fetching block %lu", root);
     errno=0;
@@ -1481,9 +1590,8 @@ fileptr tree_sub_insert(fileptr root, const tkey key, tblock *data) {
       if (!root) {
         tree_sb->root_index=dataroot.subkeys;
         tree_write_sb(tree_sb);
-      } else if (root==tree_sb->inode_root) {
-        tree_sb->inode_root=dataroot.subkeys;
-        tree_write_sb(tree_sb);
+      } else if (sbroot) {
+        tree_set_sb_root(root, dataroot.subkeys);
       } else {
         tree_write(root, (tblock*)&dataroot);
       }
@@ -1753,12 +1861,14 @@ static int tree_remove_recurse (fileptr root, char **key, fileptr *ptr) {
       PMSG(LOG_ERR, "Problem reading data block");
       return -EIO;
     }
-    if (dblock.subkeys) {
+    /* trees hanging off the superblock hold other kinds of block, which
+     * have neither subkeys nor inode chains */
+    if (dblock.magic==MAGIC_DATANODE && dblock.subkeys) {
       PMSG(LOG_WARNING, "Node has subkeys - must not be deleted!");
       errno=ENOTEMPTY;
       return -ENOTEMPTY;
     }
-    if (dblock.inodecount > DATA_INODE_MAX) {
+    if (dblock.magic==MAGIC_DATANODE && dblock.inodecount > DATA_INODE_MAX) {
       DEBUG("Node has inode blocks - must delete those too!");
       if (inode_free_chain(dblock.next_inodes)) {
         PMSG(LOG_ERR, "Failed to free attached inode chain");
@@ -1798,6 +1908,7 @@ int tree_remove (const tkey key) {
  */
 int tree_sub_remove(fileptr root, const tkey key) {
   fileptr ptr=0;
+  int sbroot=0;
   int merge;
   tdata dataroot;
   char *ikey = malloc(sizeof(char)*TREEKEY_SIZE); /* TODO: check for failure */
@@ -1812,6 +1923,10 @@ int tree_sub_remove(fileptr root, const tkey key) {
     initDataNode(&dataroot);
     dataroot.subkeys=tree_sb->root_index;
     root=0;
+  } else if ((sbroot=tree_is_sb_root(root))) {
+    DEBUG("Faking data node");
+    initDataNode(&dataroot);
+    dataroot.subkeys=root;
   } else {
     DEBUG("Fetching block %lu", root);
     errno=0;
@@ -1850,10 +1965,12 @@ int tree_sub_remove(fileptr root, const tkey key) {
       if (!root) {
         tree_sb->root_index=dataroot.subkeys;
         tree_write_sb(tree_sb);
+      } else if (sbroot) {
+        tree_set_sb_root(root, dataroot.subkeys);
       } else {
         tree_write(root, (tblock*)&dataroot);
       }
-    } else if (root && !node.keycount && !node.ptrs[0]) {
+    } else if (root && !sbroot && !node.keycount && !node.ptrs[0]) {
       /* if node is an empty leaf and we're not at the superblock level, we can
        * free it to reclaim some more space! */
       DEBUG("Can free node %lu as it's not part of the root tree", root);
@@ -1861,6 +1978,7 @@ int tree_sub_remove(fileptr root, const tkey key) {
     }
 
   }
+  if (!sbroot) key_generation++;
   free(ikey);
   return 0;
 }
@@ -1946,6 +2064,75 @@ int tree_map_keys(const fileptr root, int (*func)(const char *, const fileptr, v
 
   return ret;
 }
+
+/**
+ * Apply a user-defined function to the keys of the tree rooted at \a root
+ * that lie between two bounds (inclusive), in order. The tree is descended
+ * once to the lower bound, and only the leaves holding keys in the range are
+ * read. The function is called as for tree_map_keys(), and may return 1 to
+ * stop early without error.
+ *
+ * @param root The root of the tree, or a data node (whose subkey tree is
+ * used). If zero, the root tree is used.
+ * @param lo   The lowest key to visit, or NULL for no lower bound.
+ * @param hi   The highest key to visit, or NULL for no upper bound.
+ * @param func The function to apply.
+ * @param data User-defined data to be passed to \a func.
+ * @returns Zero on success, or a negative error code (or the non-zero return
+ * value of \a func) on failure.
+ */
+int tree_map_range(fileptr root, const char *lo, const char *hi, int (*func)(const char *, const fileptr, void *), void *data) {
+  tnode node;
+  int ret, i=0;
+
+  if (!root) root = tree_sb->root_index;
+  if (tree_read(root, (tblock*)&node)) {
+    PMSG(LOG_ERR, "I/O error reading block\n");
+    return -EIO;
+  }
+  if (node.magic == MAGIC_DATANODE) {
+    DEBUG("Starting at data node; using subkeys");
+    root = ((tdata*)&node)->subkeys;
+    if (!root) return 0;
+    if (tree_read(root, (tblock*)&node)) {
+      PMSG(LOG_ERR, "I/O error reading block\n");
+      return -EIO;
+    }
+  }
+  if (node.magic != MAGIC_TREENODE) {
+    PMSG(LOG_ERR, "Invalid magic number (%lX) for block %lu", node.magic, root);
+    return -EBADF;
+  }
+
+  /* descend to the leaf that would hold the lower bound */
+  while (!node.leaf) {
+    root = node.ptrs[lo ? tree_find_key(&node, lo) : 0];
+    if (tree_read(root, (tblock*)&node)) {
+      PMSG(LOG_ERR, "I/O error reading block\n");
+      return -EIO;
+    }
+  }
+  while (lo && i<node.keycount && strncmp(node.keys[i], lo, TREEKEY_SIZE) < 0) {
+    i++;
+  }
+
+  while (1) {
+    for (; i<node.keycount; i++) {
+      if (hi && strncmp(node.keys[i], hi, TREEKEY_SIZE) > 0) return 0;
+      DEBUG("Applying function to key[%d] = \"%s\"", i, node.keys[i]);
+      if ((ret = func(node.keys[i], node.ptrs[i+1], data))) {
+        return (ret==1) ? 0 : ret;
+      }
+    }
+    if (!node.ptrs[0]) return 0;
+    if (tree_read(node.ptrs[0], (tblock*)&node)) {
+      PMSG(LOG_ERR, "I/O error reading block\n");
+      return -EIO;
+    }
+    i = 0;
+  }
+}
+
 #if defined(_DEBUG_TREE_MAP_KEYS) && defined(_DEBUG_ONCE)
 #undef _DEBUG_ONCE
 #undef _DEBUG
@@ -2026,525 +2213,1838 @@ size_t tree_get_full_key_len(fileptr dataptr) {
  */
 char *tree_get_full_key(fileptr dataptr) {
   signed long key_len = tree_get_full_key_len(dataptr);
-  PMSG(LOG_ERR, "Full key length: %lu", key_len);
+  DEBUG("Full key length: %lu", key_len);
   if (key_len==0) return NULL;
   char *ret = calloc(key_len+1, sizeof(char));
   tdata dnode;
 
   do {
-    PMSG(LOG_ERR, "Reading block %lu", dataptr);
+    DEBUG("Reading block %lu", dataptr);
     if (tree_read(dataptr, (tblock*)&dnode)) {
       PMSG(LOG_ERR, "Error reading block %lu", dataptr);
       errno = EIO;
       return NULL;
     }
     size_t this_len = strlen(dnode.name);
-    PMSG(LOG_ERR, "Name length: %lu", this_len);
+    DEBUG("Name length: %lu", this_len);
     key_len -= this_len;
-    PMSG(LOG_ERR, "Key len now: %lu", key_len);
-    PMSG(LOG_ERR, "strncpy(%p, %p, %lu)", &ret[key_len], dnode.name, key_len);
+    DEBUG("Key len now: %lu", key_len);
+    DEBUG("strncpy(%p, %p, %lu)", &ret[key_len], dnode.name, key_len);
     strncpy(&ret[key_len], dnode.name, this_len); /* to avoid copying the terminating null */
-    PMSG(LOG_ERR, "strncpy(%p, %p, %lu) done", &ret[key_len], dnode.name, key_len);
-    PMSG(LOG_ERR, "dnode.parent: %lu", dnode.parent);
+    DEBUG("strncpy(%p, %p, %lu) done", &ret[key_len], dnode.name, key_len);
+    DEBUG("dnode.parent: %lu", dnode.parent);
     if (dnode.parent) {
       ret[--key_len]=INSIGHT_SUBKEY_SEP_C;
-      PMSG(LOG_ERR, "ret[%lu] = '%c'", key_len, INSIGHT_SUBKEY_SEP_C);
+      DEBUG("ret[%lu] = '%c'", key_len, INSIGHT_SUBKEY_SEP_C);
     }
     dataptr = dnode.parent;
   } while (dataptr);
 
-  PMSG(LOG_ERR, "Returning \"%s\"", ret);
+  DEBUG("Returning \"%s\"", ret);
 
   return ret;
 }
 
 /**
- * Follow the linked list of inodes starting at the given block number, freeing
- * all of them.
+ * Find an inode in a given limbo tree node, using binary search.
  *
- * @param block The block index of the first inode block to be freed.
+ * @param node  The node to search.
+ * @param inode The inode for which to search.
+ * @returns The index of the first key in the node that is greater than \a inode.
  */
-int inode_free_chain(fileptr block) {
-  fileptr inodeptr;
-  tinode ib;
+static int limbo_find_key(tlnode *node, fileptr inode) {
+  int lo=0, hi=node->keycount;
+  while (lo<hi) {
+    int mid = lo + (hi-lo)/2;
+    if (node->keys[mid] > inode)
+      hi=mid;
+    else
+      lo=mid+1;
+  }
+  return lo;
+}
 
-  for (inodeptr = block; inodeptr; inodeptr=ib.next_inodes) {
-    if (tree_read(inodeptr, (tblock*)&ib) || tree_free(inodeptr)) {
-      PMSG(LOG_ERR, "Problem reading inode block");
+/**
+ * Search the inode limbo tree for the given inode.
+ *
+ * @param inode The inode for which to search.
+ * @returns One if the inode is in limbo, zero if not, or a negative error code
+ * on failure.
+ */
+int limbo_search(fileptr inode) {
+  tlnode node;
+  fileptr root = tree_sb->inode_limbo;
+  int index;
+
+  DEBUG("Searching limbo for %08lX", inode);
+  while (root) {
+    if (tree_read(root, (tblock*)&node)) {
+      PMSG(LOG_ERR, "Problem reading limbo block %lu", root);
       return -EIO;
     }
+    if (node.magic != MAGIC_LIMBONODE) {
+      PMSG(LOG_ERR, "Block %lu is not a limbo block!", root);
+      return -EBADF;
+    }
+    index = limbo_find_key(&node, inode);
+    if (node.leaf) {
+      return (index && node.keys[index-1]==inode) ? 1 : 0;
+    }
+    root = node.ptrs[index];
   }
-
   return 0;
 }
 
 /**
- * Insert the given inode into the given data block. If block is zero, insert into the limbo list.
+ * Recursively insert an inode into the limbo tree.
  *
- * @param block The data block index, or zero for the limbo list.
- * @param inode The inode to be inserted.
- * @returns Zero on success, error code on failure.
+ * @param[in]     root The root of the (sub)tree to insert into.
+ * @param[in,out] key  The inode to insert, filled with the promoted key if we
+ *                     split.
+ * @param[out]    ptr  Filled with the index of the new block if we split.
+ * @retval 0 Success.
+ * @retval 1 Success, but \a root split; \a key and \a ptr should be inserted
+ * into the parent.
+ * @retval -EEXIST The inode is already in limbo.
+ * @retval (other) A negative error code on failure.
  */
-int inode_insert(fileptr block, fileptr inode) {
-  DEBUG("Inserting %08lX into inode list at block %lu", inode, block);
-  int count = inode_get_all(block, NULL, 0);
-  DEBUG("Need %d inodes of space", count);
-  if (count < 0) {
-    PMSG(LOG_ERR, "IO error in getting inode list");
-    return EIO;
-  }
+static int limbo_insert_recurse(fileptr root, fileptr *key, fileptr *ptr) {
+  tlnode node, newnode;
+  fileptr keys[DORDER], ptrs[DORDER+1];
+  unsigned int k, index, half;
+  int res;
 
-  fileptr *inodes = malloc((count+1)*sizeof(fileptr));
-  if (!inodes) {
-    PMSG(LOG_ERR, "Failed to allocate memory for inodes array");
-    return ENOMEM;
+  if (tree_read(root, (tblock*)&node)) {
+    PMSG(LOG_ERR, "Problem reading limbo block %lu", root);
+    return -EIO;
   }
-  fileptr *inodes_new = calloc(count+2, sizeof(fileptr));
-  if (!inodes_new) {
-    PMSG(LOG_ERR, "Failed to allocate memory for inodes array");
-    ifree(inodes);
-    return ENOMEM;
+  if (node.magic != MAGIC_LIMBONODE) {
+    PMSG(LOG_ERR, "Block %lu is not a limbo block!", root);
+    return -EBADF;
   }
-  if (inode_get_all(block, inodes, count)<0) {
-    PMSG(LOG_ERR, "Failed to get inode array from block %lu", block);
-    ifree(inodes_new);
-    ifree(inodes);
-    return EIO;
+
+  index = limbo_find_key(&node, *key);
+  if (node.leaf) {
+    if (index && node.keys[index-1]==*key) {
+      DEBUG("Inode %08lX already in limbo", *key);
+      return -EEXIST;
+    }
+  } else {
+    res = limbo_insert_recurse(node.ptrs[index], key, ptr);
+    if (res<=0) return res;
   }
 
-  /* insert node */
-  int res = set_union(inodes, &inode, inodes_new, count, 1, count+1, sizeof(fileptr), inodecmp);
-  if (res<0) {
-    PMSG(LOG_ERR, "Set union failed!");
-    return -res;
+  /* build the new key (and, for internal nodes, pointer) sequence */
+  for (k=0; k<index; k++) keys[k] = node.keys[k];
+  keys[index] = *key;
+  for (k=index; k<node.keycount; k++) keys[k+1] = node.keys[k];
+  if (!node.leaf) {
+    for (k=0; k<=index; k++) ptrs[k] = node.ptrs[k];
+    ptrs[index+1] = *ptr;
+    for (k=index+1; k<=node.keycount; k++) ptrs[k+1] = node.ptrs[k];
   }
 
-  /* save array back to target block */
-  if (inode_put_all(block, inodes_new, res)<0) {
-    PMSG(LOG_ERR, "Failed to save inode array to block %lu", block);
-    free(inodes_new);
-    free(inodes);
-    return EIO;
+  if ((unsigned int)node.keycount+1 < DORDER) {
+    node.keycount++;
+    memcpy(node.keys, keys, node.keycount*sizeof(fileptr));
+    if (!node.leaf) memcpy(node.ptrs, ptrs, (node.keycount+1)*sizeof(fileptr));
+    if (tree_write(root, (tblock*)&node)) {
+      PMSG(LOG_ERR, "Problem writing limbo block %lu", root);
+      return -EIO;
+    }
+    return 0;
   }
 
-  free(inodes_new);
-  free(inodes);
-  return 0;
+  DEBUG("Splitting limbo block %lu", root);
+  /* DORDER keys to share out between this node and a new sibling */
+  half = DORDER/2;
+  initLimboNode(&newnode);
+  newnode.leaf = node.leaf;
+  node.keycount = half;
+  memcpy(node.keys, keys, half*sizeof(fileptr));
+  if (node.leaf) {
+    /* leaves keep every key; the first key of the new leaf is copied up */
+    newnode.keycount = DORDER - half;
+    memcpy(newnode.keys, &keys[half], newnode.keycount*sizeof(fileptr));
+  } else {
+    /* internal nodes move the middle key up */
+    memcpy(node.ptrs, ptrs, (half+1)*sizeof(fileptr));
+    newnode.keycount = DORDER - half - 1;
+    memcpy(newnode.keys, &keys[half+1], newnode.keycount*sizeof(fileptr));
+    memcpy(newnode.ptrs, &ptrs[half+1], (newnode.keycount+1)*sizeof(fileptr));
+  }
+  *key = keys[half];
+
+  if (!(*ptr = tree_alloc())) {
+    PMSG(LOG_ERR, "Allocation failed");
+    return -ENOSPC;
+  }
+  if (tree_write(*ptr, (tblock*)&newnode) || tree_write(root, (tblock*)&node)) {
+    PMSG(LOG_ERR, "Problem writing limbo blocks");
+    return -EIO;
+  }
+  return 1;
 }
 
 /**
- * Remove the given inode from the given data block. If block is zero, remove from the limbo list.
+ * Insert an inode into the limbo tree, creating the tree if required and
+ * growing it at the root if necessary.
  *
- * @param block The data block index, or zero for the limbo list.
- * @param inode The inode to be inserted.
- * @returns Zero on success, error code on failure.
+ * @param inode The inode to insert.
+ * @returns Zero on success, or a negative error code on failure (including
+ * <tt>-EEXIST</tt> if the inode is already in limbo).
  */
-int inode_remove(fileptr block, fileptr inode) {
-  fileptr *inodes;
-  DEBUG("Remove %08lX from inode list at block %lu", inode, block);
-  int count = inode_get_all(block, NULL, 0);
-  DEBUG("Need %d inodes of space", count);
-  if (count < 0) {
-    PMSG(LOG_ERR, "IO error in getting inode list");
-    return EIO;
+static int limbo_insert(fileptr inode) {
+  tlnode node;
+  fileptr key = inode, ptr = 0;
+  int res;
+
+  DEBUG("Inserting %08lX into limbo", inode);
+  if (!tree_sb->inode_limbo) {
+    DEBUG("Creating inode limbo tree");
+    initLimboNode(&node);
+    node.leaf = 1;
+    if (!(tree_sb->inode_limbo = tree_alloc())) {
+      PMSG(LOG_ERR, "Allocation failed");
+      return -ENOSPC;
+    }
+    if (tree_write(tree_sb->inode_limbo, (tblock*)&node)) {
+      PMSG(LOG_ERR, "Problem writing limbo root");
+      return -EIO;
+    }
   }
 
-  DEBUG("Allocating space");
-  inodes = malloc(count*sizeof(fileptr));
-  if (!inodes) {
-    PMSG(LOG_ERR, "Failed to allocate memory for inodes array");
-    return ENOMEM;
+  res = limbo_insert_recurse(tree_sb->inode_limbo, &key, &ptr);
+  if (res<0) return res;
+  if (res) {
+    DEBUG("Splitting the limbo root");
+    initLimboNode(&node);
+    node.leaf = 0;
+    node.keycount = 1;
+    node.keys[0] = key;
+    node.ptrs[0] = tree_sb->inode_limbo;
+    node.ptrs[1] = ptr;
+    if (!(ptr = tree_alloc())) {
+      PMSG(LOG_ERR, "Allocation failed");
+      return -ENOSPC;
+    }
+    if (tree_write(ptr, (tblock*)&node)) {
+      PMSG(LOG_ERR, "Problem writing limbo root");
+      return -EIO;
+    }
+    tree_sb->inode_limbo = ptr;
   }
-  DEBUG("Retrieving inodes");
-  if (inode_get_all(block, inodes, count)<0) {
-    PMSG(LOG_ERR, "Failed to get inode array from block %lu", block);
-    ifree(inodes);
-    return EIO;
+  tree_sb->limbo_count++;
+  if (tree_write_sb(tree_sb)) {
+    PMSG(LOG_ERR, "Problem writing superblock");
+    return -EIO;
   }
+  return 0;
+}
 
-  /* find node */
-  /* TODO: make this binary search */
-  DEBUG("Finding target");
-  int i;
-  for (i=0; i<count; i++) {
-    if (inodes[i]==inode) break;
-  }
+/**
+ * Recursively remove an inode from the limbo tree. Nodes are not rebalanced,
+ * but any node that becomes empty is freed and removed from its parent.
+ *
+ * @param root  The root of the (sub)tree to remove from.
+ * @param inode The inode to remove.
+ * @retval 0 Success.
+ * @retval 1 Success, but \a root is now empty and has been freed.
+ * @retval -ENOENT The inode is not in limbo.
+ * @retval (other) A negative error code on failure.
+ */
+static int limbo_remove_recurse(fileptr root, fileptr inode) {
+  tlnode node;
+  int index, res;
 
-  if (i>=count) {
-    DEBUG("Target lost");
-    /* not found */
-    ifree(inodes);
-    return ENOENT;
+  if (tree_read(root, (tblock*)&node)) {
+    PMSG(LOG_ERR, "Problem reading limbo block %lu", root);
+    return -EIO;
   }
-  DEBUG("Eliminating target at position %d", i);
-
-  /* remove node */
-  while (i++<count-1) {
-    inodes[i-1]=inodes[i];
+  if (node.magic != MAGIC_LIMBONODE) {
+    PMSG(LOG_ERR, "Block %lu is not a limbo block!", root);
+    return -EBADF;
   }
 
-  DEBUG("Saving array back to target %lu", block);
-  /* save array back to target block */
-  if (inode_put_all(block, inodes, count-1)<0) {
-    PMSG(LOG_ERR, "Failed to save inode array to block %lu", block);
-    ifree(inodes);
-    return EIO;
+  index = limbo_find_key(&node, inode);
+  if (node.leaf) {
+    if (!index || node.keys[index-1]!=inode) return -ENOENT;
+    node.keycount--;
+    memmove(&node.keys[index-1], &node.keys[index], (node.keycount-(index-1))*sizeof(fileptr));
+  } else {
+    res = limbo_remove_recurse(node.ptrs[index], inode);
+    if (res<=0) return res;
+    DEBUG("Child %d of limbo block %lu is empty; unlinking", index, root);
+    if (!node.keycount) {
+      /* that was our only child */
+      return tree_free(root) ? -EIO : 1;
+    }
+    /* drop the child pointer along with the separator key next to it */
+    node.keycount--;
+    if (index) {
+      memmove(&node.keys[index-1], &node.keys[index], (node.keycount-(index-1))*sizeof(fileptr));
+      memmove(&node.ptrs[index], &node.ptrs[index+1], (node.keycount-(index-1))*sizeof(fileptr));
+    } else {
+      memmove(&node.keys[0], &node.keys[1], node.keycount*sizeof(fileptr));
+      memmove(&node.ptrs[0], &node.ptrs[1], (node.keycount+1)*sizeof(fileptr));
+    }
   }
-  DEBUG("Done!");
 
-  ifree(inodes);
+  if (node.leaf && !node.keycount) {
+    return tree_free(root) ? -EIO : 1;
+  }
+  if (tree_write(root, (tblock*)&node)) {
+    PMSG(LOG_ERR, "Problem writing limbo block %lu", root);
+    return -EIO;
+  }
   return 0;
 }
 
 /**
- * Write all inodes to the given block, following links as required. The \a
- * block argument may refer to either a data block or the superblock (if zero).
- * Additional inode blocks will be allocated if required, and they may also be
- * freed.
+ * Remove an inode from the limbo tree, shrinking the tree at the root where
+ * possible.
  *
- * @note The input inodes array will be sorted if it is not already.
+ * @param inode The inode to remove.
+ * @returns Zero on success, or a negative error code on failure (including
+ * <tt>-ENOENT</tt> if the inode is not in limbo).
+ */
+static int limbo_remove(fileptr inode) {
+  tlnode node;
+  int res;
+
+  DEBUG("Removing %08lX from limbo", inode);
+  if (!tree_sb->inode_limbo) return -ENOENT;
+
+  res = limbo_remove_recurse(tree_sb->inode_limbo, inode);
+  if (res<0) return res;
+  if (res) {
+    DEBUG("Limbo is now empty");
+    tree_sb->inode_limbo = 0;
+  } else {
+    /* collapse internal roots with a single child */
+    for (;;) {
+      if (tree_read(tree_sb->inode_limbo, (tblock*)&node)) {
+        PMSG(LOG_ERR, "Problem reading limbo root");
+        return -EIO;
+      }
+      if (node.leaf || node.keycount) break;
+      DEBUG("Collapsing limbo root %lu", tree_sb->inode_limbo);
+      if (tree_free(tree_sb->inode_limbo)) return -EIO;
+      tree_sb->inode_limbo = node.ptrs[0];
+    }
+  }
+  tree_sb->limbo_count--;
+  if (tree_write_sb(tree_sb)) {
+    PMSG(LOG_ERR, "Problem writing superblock");
+    return -EIO;
+  }
+  return 0;
+}
+
+/**
+ * Recursively free every block of the limbo (sub)tree rooted at \a root.
  *
- * @param[in] block  The block index to write an inode list for.
- * @param[in] inodes A pointer to an array of inodes.
- * @param[in] count  Number of inodes in the array.
+ * @param root The root of the (sub)tree to free.
  * @returns Zero on success, or a negative error code on failure.
  */
-int inode_put_all(fileptr block, fileptr *inodes, unsigned int count) {
-  tdata datablock;
-  unsigned int curinode=0;
-  bzero(&datablock, sizeof(datablock));
-
-  DEBUG("inode_put_all(block: %lu, inodes: %p, count: %d)", block, inodes, count);
+static int limbo_free_recurse(fileptr root) {
+  tlnode node;
+  int i;
 
-  if (!inodes) {
-    PMSG(LOG_ERR, "No inode list given");
-    return -ENOENT;
+  if (tree_read(root, (tblock*)&node)) {
+    PMSG(LOG_ERR, "Problem reading limbo block %lu", root);
+    return -EIO;
   }
-
-  /* XXX: make sure the list is sorted */
-  qsort(inodes, count, sizeof(fileptr), inodecmp);
-
-  if (!block) {
-    DEBUG("Starting at superblock and writing inodes in limbo");
-    tree_sb->limbo_count = count;
-    datablock.inodecount = tree_sb->limbo_count;
-    if (count && !tree_sb->inode_limbo) {
-      DEBUG("Creating inode limbo area");
-      tree_sb->inode_limbo = tree_alloc();
-    } else if (!count && tree_sb->inode_limbo) {
-      DEBUG("Freeing limbo inode block chain");
-      if (inode_free_chain(tree_sb->inode_limbo)) {
-        PMSG(LOG_ERR, "Could not free inode chain");
-        return -EIO;
-      }
-      tree_sb->inode_limbo=0;
-      tree_write_sb(tree_sb);
+  if (!node.leaf) {
+    for (i=0; i<=node.keycount; i++) {
+      if (limbo_free_recurse(node.ptrs[i])) return -EIO;
     }
+  }
+  return tree_free(root) ? -EIO : 0;
+}
 
-    datablock.next_inodes = tree_sb->inode_limbo;
-  } else {
-    DEBUG("Starting at block index %lu", block);
-    if (tree_read(block, (tblock*)&datablock)) {
-      PMSG(LOG_ERR, "Problem reading data block");
-      return -EIO;
-    }
-
-    DEBUG("Copying %u inodes from user buffer direct to block", MIN(count, DATA_INODE_MAX));
-    datablock.inodecount = MIN(count, DATA_INODE_MAX);
-    memcpy(datablock.inodes, inodes, datablock.inodecount*sizeof(fileptr));
-    curinode += datablock.inodecount;
-    datablock.inodecount = count;
-
-    if (curinode<count && !datablock.next_inodes) {
-      DEBUG("Creating inode block");
-      datablock.next_inodes = tree_alloc();
-    } else if (curinode >= count && datablock.next_inodes) {
-      DEBUG("Freeing inode block chain");
-      if (inode_free_chain(datablock.next_inodes)) {
-        PMSG(LOG_ERR, "Could not free inode chain");
-        return -EIO;
-      }
-      datablock.next_inodes=0;
-    }
+/**
+ * Recursively fetch the inodes in the limbo (sub)tree rooted at \a root, in
+ * ascending order.
+ *
+ * @param[in]     root   The root of the (sub)tree to read.
+ * @param[out]    inodes The array to fill.
+ * @param[in]     max    Maximum number of inodes the array can contain.
+ * @param[in,out] cur    Number of inodes already in the array.
+ * @returns Zero on success, or a negative error code on failure.
+ */
+static int limbo_get_all_recurse(fileptr root, fileptr *inodes, unsigned int max, unsigned int *cur) {
+  tlnode node;
+  int i;
 
-    DUMPBLOCK((tblock*)&datablock);
-    if (tree_write(block, (tblock*)&datablock)) {
-      PMSG(LOG_ERR, "Problem writing data block");
-      return -EIO;
-    }
+  if (tree_read(root, (tblock*)&node)) {
+    PMSG(LOG_ERR, "Problem reading limbo block %lu", root);
+    return -EIO;
+  }
+  if (node.magic != MAGIC_LIMBONODE) {
+    PMSG(LOG_ERR, "Block %lu is not a limbo block!", root);
+    return -EBADF;
+  }
+  if (node.leaf) {
+    unsigned int n = MIN(node.keycount, max - *cur);
+    memcpy(&inodes[*cur], node.keys, n*sizeof(fileptr));
+    *cur += n;
+    return 0;
+  }
+  for (i=0; i<=node.keycount && *cur<max; i++) {
+    int res = limbo_get_all_recurse(node.ptrs[i], inodes, max, cur);
+    if (res) return res;
   }
+  return 0;
+}
 
-  fileptr inodeptr;
+/**
+ * Convert a limbo list in the old (version 1.0) format, which is a chain of
+ * inode blocks hanging off the superblock, into a limbo tree.
+ *
+ * @returns Zero on success, or a negative error code on failure.
+ */
+static int limbo_upgrade() {
+  fileptr inodeptr, chain = tree_sb->inode_limbo;
+  unsigned long count = tree_sb->limbo_count;
+  fileptr *inodes;
+  unsigned int curinode = 0, i;
   tinode ib;
+  int res;
 
-  DUMPUINT(curinode);
-  DUMPUINT(count);
-  for (inodeptr = datablock.next_inodes; curinode<count; inodeptr=ib.next_inodes) {
-    if (!inodeptr) {
-      PMSG(LOG_ERR, "Followed a null pointer!");
-      return -EIO;
-    }
-    if (tree_read(inodeptr, (tblock*)&ib)) {
-      PMSG(LOG_ERR, "Problem verifying inode block");
+  FMSG(LOG_INFO, "Converting inode limbo list (%lu inodes) to limbo tree", count);
+  inodes = calloc(count?count:1, sizeof(fileptr));
+  if (!inodes) {
+    PMSG(LOG_ERR, "Failed to allocate memory for inodes array");
+    return -ENOMEM;
+  }
+  for (inodeptr = chain; inodeptr && curinode<count; inodeptr=ib.next_inodes) {
+    if (tree_read(inodeptr, (tblock*)&ib) || ib.magic != MAGIC_INODEBLOCK) {
+      PMSG(LOG_ERR, "Problem reading inode block %lu", inodeptr);
+      ifree(inodes);
       return -EIO;
     }
-    DUMPBLOCK((tblock*)&ib);
+    i = MIN(ib.inodecount, count-curinode);
+    memcpy(&inodes[curinode], ib.inodes, i*sizeof(fileptr));
+    curinode += i;
+  }
+  if (inode_free_chain(chain)) {
+    PMSG(LOG_ERR, "Could not free inode chain");
+    ifree(inodes);
+    return -EIO;
+  }
 
-    if (ib.magic == MAGIC_FREEBLOCK) {
-      /* XXX: taking a big chance here */
-      initInodeBlock(&ib);
-    } else if (ib.magic != MAGIC_INODEBLOCK) {
-      PMSG(LOG_ERR, "Failed to verify inode");
-      return -EIO;
-    }
-    ib.inodecount = MIN(count-curinode, INODE_MAX);
-    DEBUG("Copying %u inodes from user buffer (start: %u) to disk block %lu", ib.inodecount, curinode, inodeptr);
-    memcpy(ib.inodes, &inodes[curinode], ib.inodecount*sizeof(fileptr));
-    curinode += ib.inodecount;
-    if (curinode<count && !ib.next_inodes) {
-      DUMPUINT(curinode);
-      DUMPUINT(count);
-      DEBUG("Creating another inode block");
-      ib.next_inodes=tree_alloc();
-      if (!ib.next_inodes) {
-        PMSG(LOG_ERR, "Failed to allocate another inode block");
-        return -ENOSPC;
-      }
-      DEBUG("New inode block number: %lu", ib.next_inodes);
-    } else if (curinode >= count && ib.next_inodes) {
-      DEBUG("Freeing chain starting at block %lu", ib.next_inodes);
-      if (inode_free_chain(ib.next_inodes)) {
-        PMSG(LOG_ERR, "Could not free inode chain");
-        return -EIO;
-      }
-      ib.next_inodes=0;
-      DEBUG("Chain freed");
-    }
-    DUMPBLOCK((tblock*)&ib);
-    if (tree_write(inodeptr, (tblock*)&ib)) {
-      PMSG(LOG_ERR, "Problem writing data block");
-      return -EIO;
+  tree_sb->inode_limbo = 0;
+  tree_sb->limbo_count = 0;
+  for (i=0; i<curinode; i++) {
+    if ((res = limbo_insert(inodes[i])) && res != -EEXIST) {
+      ifree(inodes);
+      return res;
     }
   }
-
+  ifree(inodes);
   return 0;
 }
 
 /**
- * Callback function mapped across a tree to get all of the associated inodes.
+ * Empty an inode data block for inode_refs_upgrade(). Blocks in the old
+ * format were never chained, so only the first block needs resetting.
  *
- * @param key  The key for the current item
- * @param ptr  The pointer associated with the current item
- * @param data User-defined data (in this case, a pointer to an anonymous
- *             struct containing the number of inodes and an array of inodes)
+ * @param key  The current key (unused)
+ * @param ptr  The inode data block
+ * @param data User-defined data (unused)
  * @return Zero on success, or <tt>-EIO</tt> on failure.
  */
-static int _rec_inode_func(const char *key, const fileptr ptr, void *data) {
-  struct {
-    int count;
-    fileptr *list;
-  } *pdata = data;
-  int subcount;
+static int _refs_reset_func(const char *key, const fileptr ptr, void *data) {
+  tidata ib;
   (void) key;
-  DEBUG("Fetching sublist items from block %lu", ptr);
-  fileptr *sublist = inode_get_all_recurse(ptr, &subcount);
-  if (!sublist) {
-    PMSG(LOG_ERR, "Failed to get sublist");
-    return -EIO;
-  }
-  DEBUG("Got %d items from sublist", subcount);
-  fileptr *oldlist = pdata->list;
-  pdata->list = calloc(pdata->count + subcount, sizeof(fileptr));
-  DEBUG("Merging sublist and previous list");
-  pdata->count = set_union(oldlist, sublist, pdata->list, pdata->count, subcount, pdata->count+subcount, sizeof(fileptr), inodecmp);
-  DEBUG("Union complete");
-  DEBUG("Union contains %d items", pdata->count);
-  if (pdata->count<0) {
-    PMSG(LOG_ERR, "Set union failed");
+  (void) data;
+  initInodeDataBlock(&ib);
+  if (tree_write(ptr, (tblock*)&ib)) {
+    PMSG(LOG_ERR, "Problem writing inode data block %lu", ptr);
     return -EIO;
   }
-  ifree(oldlist);
-  ifree(sublist);
   return 0;
 }
 
 /**
- * Fetch all inodes recursively from the given block, following links as
- * required. The \a block argument may refer to either a data block, an inode
- * block, a tree block, or the superblock (if zero).
+ * Record a tag against each of the inodes in its inode list, then do the
+ * same for its subtags, for inode_refs_upgrade().
  *
- * @param[in]  block  The first block index to read.
- * @param[out] count  The number of inodes in the array
- * @returns An array of inodes that should be freed after use, or NULL if an
- * error occurred.
+ * @param key  The current key (unused)
+ * @param ptr  The data block of the tag
+ * @param data User-defined data (unused)
+ * @return Zero on success, or a negative error code on failure.
  */
-fileptr *inode_get_all_recurse(fileptr block, int *count) {
-  if (!block) {
-    DEBUG("Starting at superblock");
-    *count = inode_get_all(block, NULL, 0);
-    if (*count<0) {
-      PMSG(LOG_ERR, "Problem reading inode list");
-      return NULL;
+static int _refs_rebuild_func(const char *key, const fileptr ptr, void *data) {
+  tdata dblock;
+  tkey ikey;
+  fileptr *inodes, iblock;
+  int count, i, res=0;
+  (void) key;
+
+  if (tree_read(ptr, (tblock*)&dblock) || dblock.magic != MAGIC_DATANODE) {
+    PMSG(LOG_ERR, "Problem reading data block %lu", ptr);
+    return -EIO;
+  }
+  if ((count = inode_get_all(ptr, NULL, 0)) < 0) return count;
+  if (count) {
+    if (!(inodes = malloc(count * sizeof(fileptr)))) {
+      PMSG(LOG_ERR, "Failed to allocate memory for inodes array");
+      return -ENOMEM;
     }
-    fileptr *list = calloc(*count?*count:1, sizeof(fileptr));
-    if (!list) {
-      PMSG(LOG_ERR, "Failed to allocate memory for list");
-      return NULL;
+    if ((res = inode_get_all(ptr, inodes, count)) < 0) {
+      ifree(inodes);
+      return res;
     }
-    if (*count) {
-      inode_get_all(block, list, *count);
+    for (i=0; i<count && !res; i++) {
+      /* same key as hex_to_string() */
+      snprintf(ikey, TREEKEY_SIZE, "%08lX", (unsigned long)inodes[i] & 0xffffffffUL);
+      if (!(iblock = tree_sub_search(tree_sb->inode_root, ikey))) {
+        PMSG(LOG_WARNING, "Inode %s is tagged but has no inode data block", ikey);
+        continue;
+      }
+      res = -inode_ref_insert(iblock, ptr);
     }
-    return list;
+    ifree(inodes);
   }
-
-  tblock readblock;
-
-  DEBUG("Starting at block index %lu", block);
-  if (tree_read(block, &readblock)) {
-    PMSG(LOG_ERR, "Problem reading block");
-    return NULL;
+  if (!res && dblock.subkeys) {
+    res = tree_map_keys(dblock.subkeys, _refs_rebuild_func, data);
   }
+  return res;
+}
 
-  switch (readblock.magic) {
-    case MAGIC_DATANODE:
-      {
-        DEBUG("Fetching list from this node");
-        int count1 = inode_get_all(block, NULL, 0);
-        if (count1<0) {
-          PMSG(LOG_ERR, "Problem reading inode list");
-          return NULL;
-        }
-        fileptr *thislist = calloc(count1?count1:1, sizeof(fileptr));
-        if (!thislist) {
-          PMSG(LOG_ERR, "Failed to allocate memory for list");
-          return NULL;
-        }
-        DEBUG("Fetching %d inodes from this node", count1);
-        inode_get_all(block, thislist, count1);
-        if (!((tdata*)&readblock)->subkeys) {
-          DEBUG("No subkeys, so no union needed");
-          *count = count1;
-          return thislist;
-        }
-        int count2=0;
-        DEBUG("Fetching subkeys list");
-        fileptr *sublist = inode_get_all_recurse(((tdata*)&readblock)->subkeys, &count2);
-        DEBUG("Fetched %d inodes from subkeys", count2);
-        if (!sublist) {
-          PMSG(LOG_ERR, "Error getting sublist");
-          ifree(thislist);
-          return NULL;
-        }
-        fileptr *outlist = calloc(count1+count2, sizeof(fileptr));
-        *count = set_union(thislist, sublist, outlist, count1, count2, count1+count2, sizeof(fileptr), inodecmp);
-        ifree(thislist);
-        ifree(sublist);
-        return outlist;
-      }
-      break;
-
-    case MAGIC_TREENODE:
-      {
-        struct {
-          int count;
-          fileptr *list;
-        } pdata;
-
-        DEBUG("Allocating list");
-        pdata.list=calloc(1, sizeof(fileptr)); /* TODO: check for failure */
-        pdata.count= 0;
-
-        DEBUG("Mapping across keys");
-        int ret = tree_map_keys(block, _rec_inode_func, &pdata);
-        if (ret<0) {
-          PMSG(LOG_ERR, "Mapping across keys failed");
-          errno=ret;
-          return NULL;
-        }
-        DEBUG("Success");
-        *count = pdata.count;
-        return pdata.list;
-      }
-      break;
+/**
+ * Rebuild the tag references of every inode in the old (version 1.1 and
+ * earlier) format, whose inode data blocks were neither sorted nor chained
+ * and did not reliably hold the inode's tags. Every inode data block is
+ * emptied, then refilled from the inode lists of the tags.
+ *
+ * @returns Zero on success, or a negative error code on failure.
+ */
+static int inode_refs_upgrade() {
+  int res;
 
-    default:
-      PMSG(LOG_ERR, "Unknown block magic %08lX", readblock.magic);
-      return NULL;
+  if (!tree_sb->inode_root) return 0;
+  FMSG(LOG_INFO, "Rebuilding inode tag references");
+  if ((res = tree_map_keys(tree_sb->inode_root, _refs_reset_func, NULL))) {
+    return res;
   }
+  return tree_map_keys(tree_sb->root_index, _refs_rebuild_func, NULL);
 }
 
 /**
- * Fetch all inodes from the given block, following links as required. The \a
- * block argument may refer to either a data block or the superblock (if zero).
+ * Bring a tree store written in an older file format up to date, converting
+ * each part whose format has changed since.
  *
- * @param[in]  block  The first block index to read.
- * @param[out] inodes A pointer which will be filled with an array of inodes.
- * If NULL, then the function returns the space required.
- * @param[in]  max    Maximum number of inodes the array can contain.
- * @returns Zero on success, the number of inodes if \a inodes is NULL, or a
- * negative error code on failure.
+ * @returns Zero on success, or a negative error code on failure.
  */
-int inode_get_all(fileptr block, fileptr *inodes, unsigned int max) {
-  tdata datablock;
-  unsigned int curinode=0;
-
-  bzero(&datablock, sizeof(tdata));
-
-  if (!block) {
-    DEBUG("Starting at superblock and reading inodes in limbo");
-    if (!inodes) {
-      DEBUG("Number of array entries required: %lu", tree_sb->limbo_count);
-      return (int)tree_sb->limbo_count;
-    }
-    datablock.inodecount = tree_sb->limbo_count;
-    datablock.next_inodes = tree_sb->inode_limbo;
-  } else {
-    DEBUG("Starting at block index %lu", block);
-    if (tree_read(block, (tblock*)&datablock)) {
-      PMSG(LOG_ERR, "Problem reading data block");
-      return -EIO;
-    }
-    if (!inodes) {
-      DEBUG("Number of array entries required: %u", datablock.inodecount);
-      return datablock.inodecount;
-    }
-    if (datablock.inodecount > max) {
-      PMSG(LOG_ERR, "Number of inodes (%u) greater than output array size (%d)", datablock.inodecount, max);
-      return -ENOMEM;
-    }
+static int tree_upgrade() {
+  int res;
 
-    DEBUG("Copying inodes to user buffer");
-    memcpy(inodes, datablock.inodes, MIN(datablock.inodecount, DATA_INODE_MAX)*sizeof(fileptr));
-    curinode += MIN(datablock.inodecount, DATA_INODE_MAX);
+  FMSG(LOG_INFO, "Upgrading tree store from version %d.%d", (tree_sb->version>>8), (tree_sb->version & 0xff));
+  if (tree_sb->version < TREE_VERSION_LIMBO_TREE && (res = limbo_upgrade())) {
+    return res;
+  }
+  if (tree_sb->version < TREE_VERSION_SORTED_REFS && (res = inode_refs_upgrade())) {
+    return res;
   }
 
-  DEBUG("Following pointers if required...");
+  tree_sb->version = TREE_FILE_VERSION;
+  return tree_write_sb(tree_sb) ? -EIO : 0;
+}
 
-  fileptr inodeptr=0;
+/**
+ * Follow the linked list of inodes starting at the given block number, freeing
+ * all of them.
+ *
+ * @param block The block index of the first inode block to be freed.
+ */
+int inode_free_chain(fileptr block) {
+  fileptr inodeptr;
   tinode ib;
-  /* read last inode pointer of block while( nextptr = ((tinode*)&dblock)->inodes[INODE_MAX-1] ), and free that block */
-  for (inodeptr = datablock.next_inodes; inodeptr; inodeptr=ib.next_inodes) {
-    DEBUG("Following pointer... to block %lu", inodeptr);
-    if (tree_read(inodeptr, (tblock*)&ib)) {
+
+  for (inodeptr = block; inodeptr; inodeptr=ib.next_inodes) {
+    if (tree_read(inodeptr, (tblock*)&ib) || tree_free(inodeptr)) {
       PMSG(LOG_ERR, "Problem reading inode block");
       return -EIO;
     }
-    if (ib.magic != MAGIC_INODEBLOCK) {
-      PMSG(LOG_ERR, "Block %lu is not an inode block!", inodeptr);
-      return -EBADF;
-    }
-    if (curinode + ib.inodecount > datablock.inodecount) {
-      PMSG(LOG_WARNING, "Inode block %lu stores more inodes (%u) than the data block %lu says (%u)!", inodeptr, ib.inodecount, block, datablock.inodecount);
-      return 0;
-    } else if (curinode + ib.inodecount > max) {
-      PMSG(LOG_WARNING, "Did not allocate enough space for all inodes; truncating");
-      memcpy(&inodes[curinode], ib.inodes, (ib.inodecount - (max-curinode))*sizeof(fileptr));
-      return 0;
-    } else {
-      memcpy(&inodes[curinode], ib.inodes, ib.inodecount*sizeof(fileptr));
-    }
-    curinode += MIN(ib.inodecount, INODE_MAX);
   }
 
   return 0;
 }
+
+/**
+ * Insert the given inode into the given data block. If block is zero, insert into the limbo tree.
+ *
+ * @param block The data block index, or zero for the limbo tree.
+ * @param inode The inode to be inserted.
+ * @returns Zero on success, error code on failure.
+ */
+int inode_insert(fileptr block, fileptr inode) {
+  return inode_insert_all(block, &inode, 1);
+}
+
+/**
+ * Insert several inodes into the given data block in a single pass. If block
+ * is zero, insert into the limbo tree. Inodes already present are ignored.
+ *
+ * @param block     The data block index, or zero for the limbo tree.
+ * @param inodes_in The inodes to be inserted, in ascending order without
+ *                  duplicates.
+ * @param n         The number of inodes in \a inodes_in.
+ * @returns Zero on success, error code on failure.
+ */
+int inode_insert_all(fileptr block, const fileptr *inodes_in, unsigned int n) {
+  unsigned int i;
+  DEBUG("Inserting %u inodes into inode list at block %lu", n, block);
+  if (!block) {
+    for (i=0; i<n; i++) {
+      int res = limbo_insert(inodes_in[i]);
+      if (res && res!=-EEXIST) return -res;
+    }
+    return 0;
+  }
+  int count = inode_get_all(block, NULL, 0);
+  DEBUG("Need %d inodes of space", count);
+  if (count < 0) {
+    PMSG(LOG_ERR, "IO error in getting inode list");
+    return EIO;
+  }
+
+  fileptr *inodes = malloc((count+1)*sizeof(fileptr));
+  if (!inodes) {
+    PMSG(LOG_ERR, "Failed to allocate memory for inodes array");
+    return ENOMEM;
+  }
+  if (inode_get_all(block, inodes, count)<0) {
+    PMSG(LOG_ERR, "Failed to get inode array from block %lu", block);
+    ifree(inodes);
+    return EIO;
+  }
+
+  if (n == 1) {
+    /* shift a single inode into place; the array has room for one more */
+    int res = inodeset_insert(inodes, count, inodes_in[0]);
+    if (res == count) {
+      ifree(inodes);
+      return 0;
+    }
+    if (inode_put_all(block, inodes, res)<0) {
+      PMSG(LOG_ERR, "Failed to save inode array to block %lu", block);
+      ifree(inodes);
+      return EIO;
+    }
+    ifree(inodes);
+    return 0;
+  }
+
+  fileptr *inodes_new = calloc(count+n+1, sizeof(fileptr));
+  if (!inodes_new) {
+    PMSG(LOG_ERR, "Failed to allocate memory for inodes array");
+    ifree(inodes);
+    return ENOMEM;
+  }
+
+  /* insert nodes */
+  int res = set_union_inode(inodes, inodes_in, inodes_new, count, n, count+n);
+  if (res<0) {
+    PMSG(LOG_ERR, "Set union failed!");
+    ifree(inodes_new);
+    ifree(inodes);
+    return -res;
+  }
+
+  /* save array back to target block */
+  if (inode_put_all(block, inodes_new, res)<0) {
+    PMSG(LOG_ERR, "Failed to save inode array to block %lu", block);
+    free(inodes_new);
+    free(inodes);
+    return EIO;
+  }
+
+  free(inodes_new);
+  free(inodes);
+  return 0;
+}
+
+/**
+ * Remove the given inode from the given data block. If block is zero, remove from the limbo tree.
+ *
+ * @param block The data block index, or zero for the limbo tree.
+ * @param inode The inode to be inserted.
+ * @returns Zero on success, error code on failure.
+ */
+int inode_remove(fileptr block, fileptr inode) {
+  fileptr *inodes;
+  DEBUG("Remove %08lX from inode list at block %lu", inode, block);
+  if (!block) {
+    return -limbo_remove(inode);
+  }
+  int count = inode_get_all(block, NULL, 0);
+  DEBUG("Need %d inodes of space", count);
+  if (count < 0) {
+    PMSG(LOG_ERR, "IO error in getting inode list");
+    return EIO;
+  }
+
+  DEBUG("Allocating space");
+  inodes = malloc(count*sizeof(fileptr));
+  if (!inodes) {
+    PMSG(LOG_ERR, "Failed to allocate memory for inodes array");
+    return ENOMEM;
+  }
+  DEBUG("Retrieving inodes");
+  if (inode_get_all(block, inodes, count)<0) {
+    PMSG(LOG_ERR, "Failed to get inode array from block %lu", block);
+    ifree(inodes);
+    return EIO;
+  }
+
+  /* remove node */
+  DEBUG("Eliminating target");
+  int res = inodeset_remove(inodes, count, inode);
+  if (res==count) {
+    DEBUG("Target lost");
+    /* not found */
+    ifree(inodes);
+    return ENOENT;
+  }
+
+  DEBUG("Saving array back to target %lu", block);
+  /* save array back to target block */
+  if (inode_put_all(block, inodes, res)<0) {
+    PMSG(LOG_ERR, "Failed to save inode array to block %lu", block);
+    ifree(inodes);
+    return EIO;
+  }
+  DEBUG("Done!");
+
+  ifree(inodes);
+  return 0;
+}
+
+/**
+ * Write all inodes to the given block, following links as required. The \a
+ * block argument may refer to either a data block or the superblock (if zero).
+ * Additional inode blocks will be allocated if required, and they may also be
+ * freed.
+ *
+ * @note The input inodes array will be sorted if it is not already. Sorted
+ * input, the common case, is only scanned.
+ *
+ * @param[in] block  The block index to write an inode list for.
+ * @param[in] inodes A pointer to an array of inodes.
+ * @param[in] count  Number of inodes in the array.
+ * @returns Zero on success, or a negative error code on failure.
+ */
+int inode_put_all(fileptr block, fileptr *inodes, unsigned int count) {
+  tdata datablock;
+  unsigned int curinode=0;
+  bzero(&datablock, sizeof(datablock));
+
+  DEBUG("inode_put_all(block: %lu, inodes: %p, count: %d)", block, inodes, count);
+
+  if (!inodes) {
+    PMSG(LOG_ERR, "No inode list given");
+    return -ENOENT;
+  }
+
+  if (set_sort_inode(inodes, count)<0) {
+    PMSG(LOG_ERR, "Failed to sort inode list");
+    return -ENOMEM;
+  }
+
+  if (!block) {
+    DEBUG("Starting at superblock and writing inodes in limbo");
+    if (tree_sb->inode_limbo && limbo_free_recurse(tree_sb->inode_limbo)) {
+      PMSG(LOG_ERR, "Could not free limbo tree");
+      return -EIO;
+    }
+    tree_sb->inode_limbo=0;
+    tree_sb->limbo_count=0;
+    for (curinode=0; curinode<count; curinode++) {
+      int res = limbo_insert(inodes[curinode]);
+      if (res && res!=-EEXIST) {
+        PMSG(LOG_ERR, "Could not insert inode into limbo tree");
+        return res;
+      }
+    }
+    return tree_write_sb(tree_sb) ? -EIO : 0;
+  } else {
+    DEBUG("Starting at block index %lu", block);
+    if (tree_read(block, (tblock*)&datablock)) {
+      PMSG(LOG_ERR, "Problem reading data block");
+      return -EIO;
+    }
+
+    DEBUG("Copying %u inodes from user buffer direct to block", MIN(count, DATA_INODE_MAX));
+    datablock.inodecount = MIN(count, DATA_INODE_MAX);
+    memcpy(datablock.inodes, inodes, datablock.inodecount*sizeof(fileptr));
+    curinode += datablock.inodecount;
+    datablock.inodecount = count;
+
+    if (curinode<count && !datablock.next_inodes) {
+      DEBUG("Creating inode block");
+      datablock.next_inodes = tree_alloc();
+    } else if (curinode >= count && datablock.next_inodes) {
+      DEBUG("Freeing inode block chain");
+      if (inode_free_chain(datablock.next_inodes)) {
+        PMSG(LOG_ERR, "Could not free inode chain");
+        return -EIO;
+      }
+      datablock.next_inodes=0;
+    }
+
+    DUMPBLOCK((tblock*)&datablock);
+    if (tree_write(block, (tblock*)&datablock)) {
+      PMSG(LOG_ERR, "Problem writing data block");
+      return -EIO;
+    }
+  }
+
+  fileptr inodeptr;
+  tinode ib;
+
+  DUMPUINT(curinode);
+  DUMPUINT(count);
+  for (inodeptr = datablock.next_inodes; curinode<count; inodeptr=ib.next_inodes) {
+    if (!inodeptr) {
+      PMSG(LOG_ERR, "Followed a null pointer!");
+      return -EIO;
+    }
+    if (tree_read(inodeptr, (tblock*)&ib)) {
+      PMSG(LOG_ERR, "Problem verifying inode block");
+      return -EIO;
+    }
+    DUMPBLOCK((tblock*)&ib);
+
+    if (ib.magic == MAGIC_FREEBLOCK) {
+      /* XXX: taking a big chance here */
+      initInodeBlock(&ib);
+    } else if (ib.magic != MAGIC_INODEBLOCK) {
+      PMSG(LOG_ERR, "Failed to verify inode");
+      return -EIO;
+    }
+    ib.inodecount = MIN(count-curinode, INODE_MAX);
+    DEBUG("Copying %u inodes from user buffer (start: %u) to disk block %lu", ib.inodecount, curinode, inodeptr);
+    memcpy(ib.inodes, &inodes[curinode], ib.inodecount*sizeof(fileptr));
+    curinode += ib.inodecount;
+    if (curinode<count && !ib.next_inodes) {
+      DUMPUINT(curinode);
+      DUMPUINT(count);
+      DEBUG("Creating another inode block");
+      ib.next_inodes=tree_alloc();
+      if (!ib.next_inodes) {
+        PMSG(LOG_ERR, "Failed to allocate another inode block");
+        return -ENOSPC;
+      }
+      DEBUG("New inode block number: %lu", ib.next_inodes);
+    } else if (curinode >= count && ib.next_inodes) {
+      DEBUG("Freeing chain starting at block %lu", ib.next_inodes);
+      if (inode_free_chain(ib.next_inodes)) {
+        PMSG(LOG_ERR, "Could not free inode chain");
+        return -EIO;
+      }
+      ib.next_inodes=0;
+      DEBUG("Chain freed");
+    }
+    DUMPBLOCK((tblock*)&ib);
+    if (tree_write(inodeptr, (tblock*)&ib)) {
+      PMSG(LOG_ERR, "Problem writing data block");
+      return -EIO;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Push a block onto the stack of blocks still to be visited by
+ * inode_get_all_recurse().
+ *
+ * @param g     The gather state.
+ * @param block The block index to push.
+ * @returns Zero on success, or <tt>-ENOMEM</tt> on failure.
+ */
+static int inode_gather_push(inode_gather *g, fileptr block) {
+  if (g->stack_count == g->stack_size) {
+    int newsize = g->stack_size ? g->stack_size * 2 : 16;
+    fileptr *tmp = realloc(g->stack, newsize * sizeof(fileptr));
+    if (!tmp) {
+      PMSG(LOG_ERR, "Failed to grow block stack");
+      return -ENOMEM;
+    }
+    g->stack = tmp;
+    g->stack_size = newsize;
+  }
+  g->stack[g->stack_count++] = block;
+  return 0;
+}
+
+/**
+ * Callback function mapped across a tree to queue each data node for a visit
+ * by inode_get_all_recurse().
+ *
+ * @param key  The key for the current item
+ * @param ptr  The pointer associated with the current item
+ * @param data User-defined data (in this case, the inode_gather state)
+ * @return Zero on success, or a negative error code on failure.
+ */
+static int _rec_inode_func(const char *key, const fileptr ptr, void *data) {
+  (void) key;
+  DEBUG("Queueing block %lu", ptr);
+  return inode_gather_push((inode_gather*)data, ptr);
+}
+
+/**
+ * Visit a single block for inode_get_all_recurse(). A data node has its inode
+ * list added to the gathered runs and its subkey tree queued; a tree node has
+ * every data node it points to queued.
+ *
+ * @param g     The gather state.
+ * @param block The block index to visit.
+ * @returns Zero on success, or a negative error code on failure.
+ */
+static int inode_gather_block(inode_gather *g, fileptr block) {
+  tblock readblock;
+
+  DEBUG("Visiting block index %lu", block);
+  if (tree_read(block, &readblock)) {
+    PMSG(LOG_ERR, "Problem reading block");
+    return -EIO;
+  }
+
+  switch (readblock.magic) {
+    case MAGIC_DATANODE:
+      {
+        /* start fetching the subtags while this tag's chain is read */
+        tree_prefetch(((tdata*)&readblock)->subkeys);
+        int count = inode_get_all(block, NULL, 0);
+        if (count<0) {
+          PMSG(LOG_ERR, "Problem reading inode list");
+          return count;
+        }
+        if (count) {
+          if (g->set_count == g->set_size) {
+            int newsize = g->set_size ? g->set_size * 2 : 16;
+            fileptr **sets = realloc(g->sets, newsize * sizeof(fileptr*));
+            if (sets) g->sets = sets;
+            size_t *counts = sets ? realloc(g->counts, newsize * sizeof(size_t)) : NULL;
+            if (!counts) {
+              PMSG(LOG_ERR, "Failed to grow list of inode lists");
+              return -ENOMEM;
+            }
+            g->counts = counts;
+            g->set_size = newsize;
+          }
+          fileptr *list = malloc(count * sizeof(fileptr));
+          if (!list) {
+            PMSG(LOG_ERR, "Failed to allocate memory for list");
+            return -ENOMEM;
+          }
+          DEBUG("Fetching %d inodes from this node", count);
+          int res = inode_get_all(block, list, count);
+          if (res<0) {
+            PMSG(LOG_ERR, "Problem reading inode list");
+            ifree(list);
+            return res;
+          }
+          g->sets[g->set_count] = list;
+          g->counts[g->set_count] = count;
+          g->set_count++;
+          g->total += count;
+        }
+        if (((tdata*)&readblock)->subkeys) {
+          return inode_gather_push(g, ((tdata*)&readblock)->subkeys);
+        }
+        return 0;
+      }
+
+    case MAGIC_TREENODE:
+      {
+        int first = g->stack_count, res, i;
+        DEBUG("Mapping across keys");
+        res = tree_map_keys(block, _rec_inode_func, g);
+        if (!res && g->stack_count - first >= INODE_PREFETCH_MIN) {
+          /* the subtags are independent, so fetch them all at once */
+          for (i=first; i<g->stack_count; i++) {
+            tree_prefetch(g->stack[i]);
+          }
+        }
+        return res;
+      }
+
+    default:
+      PMSG(LOG_ERR, "Unknown block magic %08lX", readblock.magic);
+      return -EIO;
+  }
+}
+
+/**
+ * Visit every block queued on a gather stack, then merge the gathered inode
+ * lists into a single sorted array. The gather state is freed.
+ *
+ * @param[in]  g     The gather state.
+ * @param[in]  ret   Zero, or a negative error code if queueing blocks failed.
+ * @param[out] count The number of inodes in the array.
+ * @returns An array of inodes that should be freed after use, or NULL if an
+ * error occurred (with \c errno set).
+ */
+static fileptr *inode_gather_finish(inode_gather *g, int ret, int *count) {
+  fileptr *outlist = NULL;
+  int i;
+
+  while (!ret && g->stack_count) {
+    ret = inode_gather_block(g, g->stack[--g->stack_count]);
+  }
+  if (g->stack) ifree(g->stack);
+
+  if (ret<0) {
+    PMSG(LOG_ERR, "Failed to gather inode lists");
+    errno = -ret;
+  } else {
+    DEBUG("Merging %d lists with %d inodes in total", g->set_count, g->total);
+    outlist = calloc(g->total?g->total:1, sizeof(fileptr));
+    if (!outlist) {
+      PMSG(LOG_ERR, "Failed to allocate memory for list");
+      errno = ENOMEM;
+    } else {
+      ret = g->set_count ? set_union_n_inode((const fileptr * const *)g->sets, g->counts,
+                                             g->set_count, outlist, g->total) : 0;
+      if (ret<0) {
+        errno = -ret;
+        ifree(outlist);
+      } else {
+        *count = ret;
+      }
+    }
+  }
+
+  for (i=0; i<g->set_count; i++) {
+    ifree(g->sets[i]);
+  }
+  if (g->sets) ifree(g->sets);
+  if (g->counts) ifree(g->counts);
+  return outlist;
+}
+
+/**
+ * Fetch all inodes recursively from the given block, following links as
+ * required. The \a block argument may refer to either a data block, an inode
+ * block, a tree block, or the superblock (if zero).
+ *
+ * The hierarchy is walked with an explicit stack, collecting every sorted
+ * inode list below \a block, and the lists are then combined with a single
+ * k-way merge into one buffer.
+ *
+ * @param[in]  block  The first block index to read.
+ * @param[out] count  The number of inodes in the array
+ * @returns An array of inodes that should be freed after use, or NULL if an
+ * error occurred.
+ */
+fileptr *inode_get_all_recurse(fileptr block, int *count) {
+  if (!block) {
+    DEBUG("Starting at superblock");
+    *count = inode_get_all(block, NULL, 0);
+    if (*count<0) {
+      PMSG(LOG_ERR, "Problem reading inode list");
+      return NULL;
+    }
+    fileptr *list = calloc(*count?*count:1, sizeof(fileptr));
+    if (!list) {
+      PMSG(LOG_ERR, "Failed to allocate memory for list");
+      return NULL;
+    }
+    if (*count) {
+      inode_get_all(block, list, *count);
+    }
+    return list;
+  }
+
+  inode_gather g;
+
+  bzero(&g, sizeof(g));
+  DEBUG("Starting at block index %lu", block);
+  return inode_gather_finish(&g, inode_gather_push(&g, block), count);
+}
+
+/**
+ * Fetch all inodes recursively from the subtags of a tag whose keys lie
+ * between two bounds (inclusive). The subkey tree is positioned once at the
+ * lower bound and its leaves are scanned up to the upper bound, then the
+ * inode lists of the matching subtags (and their own subtags) are combined
+ * with a single k-way merge.
+ *
+ * @param[in]  block The data block of the tag, or zero for the root tree.
+ * @param[in]  lo    The lowest subtag key to include, or NULL for no bound.
+ * @param[in]  hi    The highest subtag key to include, or NULL for no bound.
+ * @param[out] count The number of inodes in the array.
+ * @returns An array of inodes that should be freed after use, or NULL if an
+ * error occurred.
+ */
+fileptr *inode_get_all_range(fileptr block, const char *lo, const char *hi, int *count) {
+  inode_gather g;
+  int ret, i;
+
+  bzero(&g, sizeof(g));
+  DEBUG("Gathering subtags of block %lu from \"%s\" to \"%s\"", block, lo?lo:"", hi?hi:"");
+  ret = tree_map_range(block, lo, hi, _rec_inode_func, &g);
+  if (!ret && g.stack_count >= INODE_PREFETCH_MIN) {
+    for (i=0; i<g.stack_count; i++) {
+      tree_prefetch(g.stack[i]);
+    }
+  }
+  return inode_gather_finish(&g, ret, count);
+}
+
+/**
+ * Fetch all inodes from the given block, following links as required. The \a
+ * block argument may refer to either a data block or the superblock (if zero).
+ *
+ * @param[in]  block  The first block index to read.
+ * @param[out] inodes A pointer which will be filled with an array of inodes.
+ * If NULL, then the function returns the space required.
+ * @param[in]  max    Maximum number of inodes the array can contain.
+ * @returns Zero on success, the number of inodes if \a inodes is NULL, or a
+ * negative error code on failure.
+ */
+int inode_get_all(fileptr block, fileptr *inodes, unsigned int max) {
+  tdata datablock;
+  unsigned int curinode=0;
+
+  bzero(&datablock, sizeof(tdata));
+
+  if (!block) {
+    DEBUG("Starting at superblock and reading inodes in limbo");
+    if (!inodes) {
+      DEBUG("Number of array entries required: %lu", tree_sb->limbo_count);
+      return (int)tree_sb->limbo_count;
+    }
+    if (tree_sb->limbo_count > max) {
+      PMSG(LOG_WARNING, "Did not allocate enough space for all inodes; truncating");
+    }
+    return tree_sb->inode_limbo ? limbo_get_all_recurse(tree_sb->inode_limbo, inodes, max, &curinode) : 0;
+  } else {
+    DEBUG("Starting at block index %lu", block);
+    if (tree_read(block, (tblock*)&datablock)) {
+      PMSG(LOG_ERR, "Problem reading data block");
+      return -EIO;
+    }
+    if (!inodes) {
+      DEBUG("Number of array entries required: %u", datablock.inodecount);
+      return datablock.inodecount;
+    }
+    if (datablock.inodecount > max) {
+      PMSG(LOG_ERR, "Number of inodes (%u) greater than output array size (%d)", datablock.inodecount, max);
+      return -ENOMEM;
+    }
+
+    DEBUG("Copying inodes to user buffer");
+    memcpy(inodes, datablock.inodes, MIN(datablock.inodecount, DATA_INODE_MAX)*sizeof(fileptr));
+    curinode += MIN(datablock.inodecount, DATA_INODE_MAX);
+  }
+
+  DEBUG("Following pointers if required...");
+
+  fileptr inodeptr=0;
+  tinode ib;
+  /* read last inode pointer of block while( nextptr = ((tinode*)&dblock)->inodes[INODE_MAX-1] ), and free that block */
+  for (inodeptr = datablock.next_inodes; inodeptr; inodeptr=ib.next_inodes) {
+    DEBUG("Following pointer... to block %lu", inodeptr);
+    if (tree_read(inodeptr, (tblock*)&ib)) {
+      PMSG(LOG_ERR, "Problem reading inode block");
+      return -EIO;
+    }
+    if (ib.magic != MAGIC_INODEBLOCK) {
+      PMSG(LOG_ERR, "Block %lu is not an inode block!", inodeptr);
+      return -EBADF;
+    }
+    if (curinode + ib.inodecount > datablock.inodecount) {
+      PMSG(LOG_WARNING, "Inode block %lu stores more inodes (%u) than the data block %lu says (%u)!", inodeptr, ib.inodecount, block, datablock.inodecount);
+      return 0;
+    } else if (curinode + ib.inodecount > max) {
+      PMSG(LOG_WARNING, "Did not allocate enough space for all inodes; truncating");
+      memcpy(&inodes[curinode], ib.inodes, (ib.inodecount - (max-curinode))*sizeof(fileptr));
+      return 0;
+    } else {
+      memcpy(&inodes[curinode], ib.inodes, ib.inodecount*sizeof(fileptr));
+    }
+    curinode += MIN(ib.inodecount, INODE_MAX);
+  }
+
+  return 0;
+}
+
+/**
+ * Open a streaming cursor over the inodes of the given block. The \a block
+ * argument may refer to either a data block or the superblock (if zero), as
+ * for inode_get_all(). No blocks are read until the first inode is requested.
+ *
+ * @param block The data block index, or zero for the limbo tree.
+ * @returns A cursor to be closed with inode_cursor_close(), or NULL if memory
+ * could not be allocated.
+ */
+inode_cursor *inode_cursor_open(fileptr block) {
+  inode_cursor *cur = calloc(1, sizeof(inode_cursor));
+  if (!cur) {
+    PMSG(LOG_ERR, "Failed to allocate inode cursor");
+    errno = ENOMEM;
+    return NULL;
+  }
+  DEBUG("Opened inode cursor on block %lu", block);
+  cur->block = block;
+  return cur;
+}
+
+/**
+ * Refill the buffer of an inode cursor with the next block of inodes. For a
+ * data block this reads the next block of the chain; for the limbo tree it
+ * descends to the leaf holding the first inode not less than \a from.
+ *
+ * @param cur  The cursor to refill.
+ * @param from The smallest inode of interest (limbo tree only).
+ * @returns Zero on success (the buffer is empty at the end of the list), or a
+ * negative error code on failure.
+ */
+static int inode_cursor_fill(inode_cursor *cur, fileptr from) {
+  cur->count = cur->pos = 0;
+
+  if (!cur->block) {
+    tlnode node;
+    fileptr root;
+    cur->started = 1;
+    while ((root = tree_sb->inode_limbo)) {
+      fileptr bound = 0;
+      int index;
+      while (1) {
+        if (tree_read(root, (tblock*)&node)) {
+          PMSG(LOG_ERR, "Problem reading limbo block %lu", root);
+          return -EIO;
+        }
+        if (node.magic != MAGIC_LIMBONODE) {
+          PMSG(LOG_ERR, "Block %lu is not a limbo block!", root);
+          return -EBADF;
+        }
+        if (node.leaf) break;
+        index = limbo_find_key(&node, from);
+        /* the tightest separator above the path is where the next leaf starts */
+        if (index < node.keycount) bound = node.keys[index];
+        root = node.ptrs[index];
+      }
+      /* skip keys less than from */
+      for (index=0; index<node.keycount && node.keys[index]<from; index++);
+      if (index < node.keycount) {
+        cur->count = node.keycount - index;
+        memcpy(cur->buf, &node.keys[index], cur->count * sizeof(fileptr));
+        return 0;
+      }
+      if (!bound) return 0;
+      from = bound;
+    }
+    return 0;
+  }
+
+  if (!cur->started) {
+    tdata datablock;
+    cur->started = 1;
+    if (tree_read(cur->block, (tblock*)&datablock)) {
+      PMSG(LOG_ERR, "Problem reading data block");
+      return -EIO;
+    }
+    if (datablock.magic != MAGIC_DATANODE) {
+      PMSG(LOG_ERR, "Block %lu is not a data block!", cur->block);
+      return -EBADF;
+    }
+    cur->count = MIN(datablock.inodecount, DATA_INODE_MAX);
+    memcpy(cur->buf, datablock.inodes, cur->count * sizeof(fileptr));
+    cur->next = datablock.next_inodes;
+    tree_prefetch(cur->next);
+    return 0;
+  }
+
+  if (cur->next) {
+    tinode ib;
+    if (tree_read(cur->next, (tblock*)&ib)) {
+      PMSG(LOG_ERR, "Problem reading inode block");
+      return -EIO;
+    }
+    if (ib.magic != MAGIC_INODEBLOCK) {
+      PMSG(LOG_ERR, "Block %lu is not an inode block!", cur->next);
+      return -EBADF;
+    }
+    cur->count = MIN(ib.inodecount, INODE_MAX);
+    memcpy(cur->buf, ib.inodes, cur->count * sizeof(fileptr));
+    cur->next = ib.next_inodes;
+    tree_prefetch(cur->next);
+  }
+  return 0;
+}
+
+/**
+ * Fetch the next inode from a cursor.
+ *
+ * @param[in]  cur   The cursor to read from.
+ * @param[out] inode Filled with the next inode, if there is one.
+ * @returns One if an inode was produced, zero at the end of the list, or a
+ * negative error code on failure.
+ */
+int inode_cursor_next(inode_cursor *cur, fileptr *inode) {
+  while (cur->pos >= cur->count) {
+    int res;
+    if (cur->started && (cur->block ? !cur->next : !cur->count)) {
+      cur->count = cur->pos = 0;
+      return 0;
+    }
+    res = inode_cursor_fill(cur, cur->started ? cur->last+1 : 0);
+    if (res) return res;
+  }
+  *inode = cur->last = cur->buf[cur->pos++];
+  return 1;
+}
+
+/**
+ * Move a cursor forward so that the next inode it produces is the first one
+ * not less than \a target. Cursors only move forward: seeking to a target
+ * below the current position has no effect.
+ *
+ * @param cur    The cursor to move.
+ * @param target The inode to seek to.
+ * @returns Zero on success, or a negative error code on failure.
+ */
+int inode_cursor_seek(inode_cursor *cur, fileptr target) {
+  if (cur->started && cur->pos < cur->count && cur->buf[cur->count-1] < target) {
+    /* nothing of interest left in this block */
+    cur->pos = cur->count;
+  }
+  if (cur->pos >= cur->count) {
+    if (!cur->block) {
+      if (cur->started && target <= cur->last) return 0;
+      return inode_cursor_fill(cur, target);
+    }
+    /* walk the chain until a block reaches the target */
+    do {
+      int res;
+      if (cur->started && !cur->next) {
+        cur->count = cur->pos = 0;
+        return 0;
+      }
+      res = inode_cursor_fill(cur, target);
+      if (res) return res;
+    } while (!cur->count || cur->buf[cur->count-1] < target);
+  }
+
+  /* binary search within the current block */
+  unsigned int lo = cur->pos, hi = cur->count;
+  while (lo < hi) {
+    unsigned int mid = lo + (hi-lo)/2;
+    if (cur->buf[mid] < target)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  cur->pos = lo;
+  return 0;
+}
+
+/**
+ * Close a cursor opened with inode_cursor_open().
+ *
+ * @param cur The cursor to close.
+ */
+void inode_cursor_close(inode_cursor *cur) {
+  ifree(cur);
+}
+
+/**
+ * Find a reference in a given inode data block, using binary search.
+ *
+ * @param ib  The inode data block to search.
+ * @param ref The reference for which to search.
+ * @returns The index of the first reference in the block that is not less
+ * than \a ref.
+ */
+static int inode_ref_find(tidata *ib, fileptr ref) {
+  int lo=0, hi=ib->refcount;
+  while (lo<hi) {
+    int mid = lo + (hi-lo)/2;
+    if (ib->refs[mid] < ref)
+      lo=mid+1;
+    else
+      hi=mid;
+  }
+  return lo;
+}
+
+/**
+ * Find the block in the reference chain starting at \a block that holds (or
+ * should hold) the given reference. References are sorted across the whole
+ * chain, so this is the first block whose last reference is not less than \a
+ * ref, or the last block in the chain.
+ *
+ * @param[in]  block The first inode data block in the chain.
+ * @param[in]  ref   The reference for which to search.
+ * @param[out] ib    Filled with the contents of the block found.
+ * @param[out] prev  If not NULL, filled with the address of the previous block
+ *                   in the chain (or zero if the block found is the first).
+ * @returns The address of the block found, or zero on failure (and sets errno).
+ */
+static fileptr inode_ref_find_block(fileptr block, fileptr ref, tidata *ib, fileptr *prev) {
+  if (prev) *prev=0;
+  for (;;) {
+    if (tree_read(block, (tblock*)ib)) {
+      PMSG(LOG_ERR, "Problem reading inode data block %lu", block);
+      errno=EIO;
+      return 0;
+    }
+    if (ib->magic != MAGIC_INODEDATA) {
+      PMSG(LOG_ERR, "Block %lu is not an inode data block!", block);
+      errno=EBADF;
+      return 0;
+    }
+    if (!ib->next_refs || (ib->refcount && ib->refs[ib->refcount-1] >= ref)) {
+      return block;
+    }
+    if (prev) *prev=block;
+    block=ib->next_refs;
+  }
+}
+
+/**
+ * Check whether the given inode data block chain contains a reference.
+ *
+ * @param block The first inode data block in the chain.
+ * @param ref   The reference for which to search.
+ * @returns One if the reference is present, zero if not, or a negative error
+ * code on failure.
+ */
+int inode_ref_search(fileptr block, fileptr ref) {
+  tidata ib;
+  int i;
+
+  if (!inode_ref_find_block(block, ref, &ib, NULL)) {
+    return -errno;
+  }
+  i = inode_ref_find(&ib, ref);
+  return (i<ib.refcount && ib.refs[i]==ref) ? 1 : 0;
+}
+
+/**
+ * Insert a reference into the given inode data block chain, keeping it
+ * sorted. If the target block is full, it is split and the upper half of its
+ * references moved into a new block following it in the chain.
+ *
+ * @param block The first inode data block in the chain.
+ * @param ref   The reference to insert.
+ * @returns Zero on success (including if the reference is already present),
+ * or an error code on failure.
+ */
+int inode_ref_insert(fileptr block, fileptr ref) {
+  tidata ib, nb;
+  fileptr target, newblock;
+  int i;
+
+  DEBUG("Inserting reference %lu into inode data chain at block %lu", ref, block);
+  if (!(target = inode_ref_find_block(block, ref, &ib, NULL))) {
+    return errno;
+  }
+  i = inode_ref_find(&ib, ref);
+  if (i<ib.refcount && ib.refs[i]==ref) {
+    DEBUG("Reference already present");
+    return 0;
+  }
+
+  if (ib.refcount >= REF_MAX) {
+    DEBUG("Splitting inode data block %lu", target);
+    if (!(newblock = tree_alloc())) {
+      PMSG(LOG_ERR, "Failed to allocate another inode data block");
+      return ENOSPC;
+    }
+    initInodeDataBlock(&nb);
+    nb.refcount = ib.refcount - REF_MAX/2;
+    memcpy(nb.refs, &ib.refs[REF_MAX/2], nb.refcount*sizeof(fileptr));
+    nb.next_refs = ib.next_refs;
+    zero_mem(&ib.refs[REF_MAX/2], nb.refcount*sizeof(fileptr));
+    ib.refcount = REF_MAX/2;
+    ib.next_refs = newblock;
+    if ((unsigned int)i > REF_MAX/2) {
+      /* new reference belongs in the new block */
+      i -= REF_MAX/2;
+      memmove(&nb.refs[i+1], &nb.refs[i], (nb.refcount-i)*sizeof(fileptr));
+      nb.refs[i] = ref;
+      nb.refcount++;
+      if (tree_write(newblock, (tblock*)&nb) || tree_write(target, (tblock*)&ib)) {
+        PMSG(LOG_ERR, "Problem writing inode data blocks");
+        return EIO;
+      }
+      return 0;
+    }
+    if (tree_write(newblock, (tblock*)&nb)) {
+      PMSG(LOG_ERR, "Problem writing inode data block");
+      return EIO;
+    }
+  }
+
+  memmove(&ib.refs[i+1], &ib.refs[i], (ib.refcount-i)*sizeof(fileptr));
+  ib.refs[i] = ref;
+  ib.refcount++;
+  if (tree_write(target, (tblock*)&ib)) {
+    PMSG(LOG_ERR, "Problem writing inode data block");
+    return EIO;
+  }
+  return 0;
+}
+
+/**
+ * Remove a reference from the given inode data block chain. Blocks after the
+ * first that become empty are unlinked and freed; if the first block becomes
+ * empty, the next block is pulled into its place.
+ *
+ * @param block The first inode data block in the chain.
+ * @param ref   The reference to remove.
+ * @retval 0 Success.
+ * @retval ENOENT The reference was not found.
+ * @retval (other) An error code on failure.
+ */
+int inode_ref_remove(fileptr block, fileptr ref) {
+  tidata ib, pb;
+  fileptr target, prev;
+  int i;
+
+  DEBUG("Removing reference %lu from inode data chain at block %lu", ref, block);
+  if (!(target = inode_ref_find_block(block, ref, &ib, &prev))) {
+    return errno;
+  }
+  i = inode_ref_find(&ib, ref);
+  if (i>=ib.refcount || ib.refs[i]!=ref) {
+    DEBUG("Could not find ref!");
+    return ENOENT;
+  }
+
+  ib.refcount--;
+  memmove(&ib.refs[i], &ib.refs[i+1], (ib.refcount-i)*sizeof(fileptr));
+  ib.refs[ib.refcount] = 0;
+
+  if (ib.refcount || (!ib.next_refs && !prev)) {
+    return tree_write(target, (tblock*)&ib) ? EIO : 0;
+  }
+
+  if (prev) {
+    DEBUG("Unlinking empty inode data block %lu", target);
+    if (tree_read(prev, (tblock*)&pb)) {
+      PMSG(LOG_ERR, "Problem reading inode data block");
+      return EIO;
+    }
+    pb.next_refs = ib.next_refs;
+    if (tree_write(prev, (tblock*)&pb)) {
+      PMSG(LOG_ERR, "Problem writing inode data block");
+      return EIO;
+    }
+    return tree_free(target) ? EIO : 0;
+  }
+
+  DEBUG("Pulling block %lu to head of inode data chain", ib.next_refs);
+  prev = ib.next_refs;
+  if (tree_read(prev, (tblock*)&ib) || tree_write(target, (tblock*)&ib)) {
+    PMSG(LOG_ERR, "Problem moving inode data block");
+    return EIO;
+  }
+  return tree_free(prev) ? EIO : 0;
+}
+
+/**
+ * Fetch all references from the given inode data block chain, in ascending
+ * order.
+ *
+ * @param[in]  block The first inode data block in the chain.
+ * @param[out] refs  A pointer which will be filled with an array of
+ * references. If NULL, then the function returns the space required.
+ * @param[in]  max   Maximum number of references the array can contain.
+ * @returns Zero on success, the number of references if \a refs is NULL, or a
+ * negative error code on failure.
+ */
+int inode_ref_get_all(fileptr block, fileptr *refs, unsigned int max) {
+  tidata ib;
+  unsigned int count=0;
+
+  for (; block; block=ib.next_refs) {
+    if (tree_read(block, (tblock*)&ib)) {
+      PMSG(LOG_ERR, "Problem reading inode data block %lu", block);
+      return -EIO;
+    }
+    if (ib.magic != MAGIC_INODEDATA) {
+      PMSG(LOG_ERR, "Block %lu is not an inode data block!", block);
+      return -EBADF;
+    }
+    if (refs) {
+      if (count + ib.refcount > max) {
+        PMSG(LOG_WARNING, "Did not allocate enough space for all references; truncating");
+        memcpy(&refs[count], ib.refs, (max-count)*sizeof(fileptr));
+        return 0;
+      }
+      memcpy(&refs[count], ib.refs, ib.refcount*sizeof(fileptr));
+    }
+    count += ib.refcount;
+  }
+
+  return refs ? 0 : (int)count;
+}
+
+/**
+ * Generate the key under which the statistics of a tag are stored.
+ *
+ * @param[out] key   Filled with the key.
+ * @param[in]  block The data block of the tag.
+ */
+static void tag_stats_key(tkey key, fileptr block) {
+  snprintf(key, TREEKEY_SIZE, "%08lx", (unsigned long)block);
+}
+
+/**
+ * Get the root of the tag statistics tree, creating it if necessary.
+ *
+ * @returns The root index, or zero on failure (and sets errno).
+ */
+static fileptr tag_stats_root(void) {
+  tnode root;
+
+  if (tree_sb->stats_root) return tree_sb->stats_root;
+
+  DEBUG("Creating tag statistics tree");
+  initTreeNode(&root);
+  root.leaf=1;
+  if (!(tree_sb->stats_root = tree_alloc())) {
+    PMSG(LOG_ERR, "Failed to allocate tag statistics root");
+    return 0;
+  }
+  if (tree_write(tree_sb->stats_root, (tblock*)&root) || tree_write_sb(tree_sb)) {
+    PMSG(LOG_ERR, "Problem writing tag statistics root");
+    errno=EIO;
+    return 0;
+  }
+  return tree_sb->stats_root;
+}
+
+/**
+ * Add an inode to the HyperLogLog sketch of a statistics block. The inode is
+ * mixed first, as inodes from the same part of the hash space would
+ * otherwise crowd into the same few registers.
+ *
+ * @param stats The statistics block.
+ * @param inode The inode to add.
+ */
+static void tag_stats_hll_add(tstats *stats, fileptr inode) {
+  unsigned int h = (unsigned int)(inode ^ ((unsigned long)inode >> 16 >> 16));
+  unsigned int rest;
+  unsigned char rank=1;
+
+  h ^= h >> 16;
+  h *= 0x85ebca6bU;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35U;
+  h ^= h >> 16;
+
+  rest = h << TAGSTATS_HLL_BITS;
+  while (rank <= 32-TAGSTATS_HLL_BITS && !(rest & 0x80000000U)) {
+    rest <<= 1;
+    rank++;
+  }
+  if (stats->hll[h >> (32-TAGSTATS_HLL_BITS)] < rank) {
+    stats->hll[h >> (32-TAGSTATS_HLL_BITS)] = rank;
+  }
+}
+
+/**
+ * Fetch the stored statistics of a tag. Nothing is built or written, so this
+ * is safe to call when only reading; callers should fall back to some other
+ * estimate if the tag has no statistics yet.
+ *
+ * @param[in]  block The data block of the tag.
+ * @param[out] stats Filled with the statistics.
+ * @retval 0 Success.
+ * @retval EINVAL \a block is zero.
+ * @retval ENOENT No statistics have been stored for the tag.
+ * @retval (other) An error code on failure.
+ */
+int tag_stats_get(fileptr block, tstats *stats) {
+  tkey key;
+  fileptr sblock;
+
+  if (!block) return EINVAL;
+  if (!tree_sb->stats_root) return ENOENT;
+
+  tag_stats_key(key, block);
+  if (!(sblock = tree_sub_search(tree_sb->stats_root, key))) {
+    return (errno && errno!=ENOENT) ? errno : ENOENT;
+  }
+  if (tree_read(sblock, (tblock*)stats)) {
+    PMSG(LOG_ERR, "Problem reading tag statistics block %lu", sblock);
+    return EIO;
+  }
+  if (stats->magic != MAGIC_TAGSTATS) {
+    PMSG(LOG_ERR, "Block %lu is not a tag statistics block!", sblock);
+    return EBADF;
+  }
+  return 0;
+}
+
+/**
+ * Build the statistics of a tag from its recursive inode list and store them,
+ * replacing any that were stored before.
+ *
+ * @param[in]  block The data block of the tag.
+ * @param[out] stats Filled with the statistics, if not NULL.
+ * @retval 0 Success.
+ * @retval EINVAL \a block is zero.
+ * @retval (other) An error code on failure.
+ */
+int tag_stats_build(fileptr block, tstats *stats) {
+  tkey key;
+  tstats built;
+  fileptr *inodes;
+  int count, i, res;
+
+  if (!block) return EINVAL;
+
+  DEBUG("Building statistics for tag block %lu", block);
+  if (!(inodes = inode_get_all_recurse(block, &count))) {
+    return errno ? errno : EIO;
+  }
+  initTagStats(&built);
+  built.closure = count;
+  if (count) {
+    built.min_inode = inodes[0];
+    built.max_inode = inodes[count-1];
+  }
+  for (i=0; i<count; i++) {
+    tag_stats_hll_add(&built, inodes[i]);
+  }
+  ifree(inodes);
+
+  if ((res = tag_stats_remove(block))) return res;
+  tag_stats_key(key, block);
+  if (!tag_stats_root() || !tree_sub_insert(tree_sb->stats_root, key, (tblock*)&built)) {
+    PMSG(LOG_WARNING, "Could not store statistics for tag block %lu", block);
+    return errno ? errno : EIO;
+  }
+  if (stats) memcpy(stats, &built, sizeof(tstats));
+  return 0;
+}
+
+/**
+ * Record that an inode has joined or left the set of inodes below a tag. If
+ * the tag has no statistics yet, they are built from its inode lists, which
+ * must already include the change.
+ *
+ * @param block The data block of the tag.
+ * @param inode The inode concerned.
+ * @param delta Positive if the inode is now below the tag, negative if it no
+ *              longer is.
+ * @returns Zero on success, or an error code on failure.
+ */
+int tag_stats_update(fileptr block, fileptr inode, int delta) {
+  tkey key;
+  tstats stats;
+  fileptr sblock;
+
+  if (!block || !delta) return 0;
+
+  if (!tree_sb->stats_root) return tag_stats_build(block, NULL);
+  tag_stats_key(key, block);
+  if (!(sblock = tree_sub_search(tree_sb->stats_root, key))) {
+    return (errno && errno!=ENOENT) ? errno : tag_stats_build(block, NULL);
+  }
+  if (tree_read(sblock, (tblock*)&stats)) {
+    PMSG(LOG_ERR, "Problem reading tag statistics block %lu", sblock);
+    return EIO;
+  }
+
+  if (delta > 0) {
+    if (!stats.closure++ || inode < stats.min_inode) stats.min_inode = inode;
+    if (stats.closure==1 || inode > stats.max_inode) stats.max_inode = inode;
+    tag_stats_hll_add(&stats, inode);
+  } else if (stats.closure && !--stats.closure) {
+    /* empty again, so everything can be reset exactly */
+    initTagStats(&stats);
+  }
+
+  if (tree_write(sblock, (tblock*)&stats)) {
+    PMSG(LOG_ERR, "Problem writing tag statistics block %lu", sblock);
+    return EIO;
+  }
+  return 0;
+}
+
+/**
+ * Discard the statistics of a tag, for instance when the tag is removed.
+ *
+ * @param block The data block of the tag.
+ * @returns Zero on success (including if there were no statistics), or an
+ * error code on failure.
+ */
+int tag_stats_remove(fileptr block) {
+  tkey key;
+  int res;
+
+  if (!block || !tree_sb->stats_root) return 0;
+
+  tag_stats_key(key, block);
+  if (!tree_sub_search(tree_sb->stats_root, key)) {
+    return (errno && errno!=ENOENT) ? errno : 0;
+  }
+  res = tree_sub_remove(tree_sb->stats_root, key);
+  return (res<0) ? -res : res;
+}
+
+/**
+ * Estimate the number of distinct inodes added to a HyperLogLog sketch.
+ *
+ * @param hll The sketch registers.
+ * @returns The estimated cardinality.
+ */
+static unsigned long tag_stats_hll_estimate(const unsigned char *hll) {
+  const double m = TAGSTATS_HLL_REGS;
+  double sum=0, est;
+  unsigned int i, zeros=0;
+
+  for (i=0; i<TAGSTATS_HLL_REGS; i++) {
+    sum += 1.0 / (double)(1UL << hll[i]);
+    if (!hll[i]) zeros++;
+  }
+  est = (0.7213 / (1 + 1.079/m)) * m * m / sum;
+  if (est <= 2.5*m && zeros) {
+    /* small range correction: linear counting */
+    est = m * log(m / zeros);
+  }
+  return (unsigned long)(est + 0.5);
+}
+
+/**
+ * Estimate the number of distinct inodes below a tag from its sketch. This
+ * is mostly useful for comparison with tag_stats_union(); the \a closure
+ * field of the statistics is exact.
+ *
+ * @param stats The statistics of the tag.
+ * @returns The estimated cardinality.
+ */
+unsigned long tag_stats_estimate(const tstats *stats) {
+  return tag_stats_hll_estimate(stats->hll);
+}
+
+/**
+ * Estimate the number of distinct inodes below either of two tags, by
+ * merging their sketches.
+ *
+ * @param a The statistics of the first tag.
+ * @param b The statistics of the second tag.
+ * @returns The estimated cardinality of the union.
+ */
+unsigned long tag_stats_union(const tstats *a, const tstats *b) {
+  unsigned char hll[TAGSTATS_HLL_REGS];
+  unsigned int i;
+
+  for (i=0; i<TAGSTATS_HLL_REGS; i++) {
+    hll[i] = MAX(a->hll[i], b->hll[i]);
+  }
+  return tag_stats_hll_estimate(hll);
+}
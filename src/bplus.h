@@ -11,8 +11,8 @@
 #define TREEKEY_SIZE 33
 /** Order of the tree - i.e. how many pointers are stored */
 #define ORDER ((TREEBLOCK_SIZE - 2*sizeof(short))/(sizeof(fileptr)+sizeof(tkey))+1)
-/** Order of the inode tree - i.e. how many pointers are stored */
-#define DORDER ((TREEBLOCK_SIZE - 2*sizeof(short))/(sizeof(fileptr)+sizeof(fileptr))+1)
+/** Order of the inode-keyed trees - i.e. how many pointers are stored */
+#define DORDER ((TREEBLOCK_SIZE - sizeof(unsigned long) - 2*sizeof(short) + sizeof(fileptr))/(sizeof(fileptr)+sizeof(fileptr)))
 
 /**
  * @defgroup MagicDefs Magic numbers
@@ -24,12 +24,18 @@
 #define MAGIC_FREEBLOCK   0xf1eeb10cU /**< Free block (free block) */
 #define MAGIC_INODEBLOCK  0x10deb10cU /**< Inode block (inode block) */
 #define MAGIC_INODEDATA   0x1d7ab10cU /**< Inode tree data block */
+#define MAGIC_LIMBONODE   0x11b0b10cU /**< Inode limbo tree node (limbo block) */
 #define MAGIC_STRINGENTRY 0x7ec5b10cU /**< String table entry (text block) [currently unused] */
 #define MAGIC_INODETABLE  0x7ab1b10cU /**< Inode translation table entry (table block) [currently unused] */
+#define MAGIC_TAGSTATS    0x57a7b10cU /**< Tag statistics block (stat block) */
 /*@}*/
 
 /** File format that this code will write */
-#define TREE_FILE_VERSION 0x0100
+#define TREE_FILE_VERSION 0x0102
+/** First file format with the inode limbo stored as a tree */
+#define TREE_VERSION_LIMBO_TREE 0x0101
+/** First file format with sorted, chained tag references in inode data blocks */
+#define TREE_VERSION_SORTED_REFS 0x0102
 
 /** Initialise a tree node (zero it and set its magic number) */
 #define initTreeNode(n) do { bzero((n),sizeof(tnode)); (n)->magic=MAGIC_TREENODE; } while (0)
@@ -41,6 +47,10 @@
 #define initInodeBlock(n) do { bzero((n),sizeof(tinode)); (n)->magic=MAGIC_INODEBLOCK; } while (0)
 /** Initialise a inode data block (zero it and set its magic number) */
 #define initInodeDataBlock(n) do { bzero((n),sizeof(tidata)); (n)->magic=MAGIC_INODEDATA; } while (0)
+/** Initialise a limbo tree node (zero it and set its magic number) */
+#define initLimboNode(n) do { bzero((n),sizeof(tlnode)); (n)->magic=MAGIC_LIMBONODE; } while (0)
+/** Initialise a tag statistics block (zero it and set its magic number) */
+#define initTagStats(n) do { bzero((n),sizeof(tstats)); (n)->magic=MAGIC_TAGSTATS; } while (0)
 
 #ifndef _TYPE_FILEPTR
 #define _TYPE_FILEPTR
@@ -72,10 +82,11 @@ typedef struct /** @cond */ __attribute__((__packed__)) /** @endcond */ {
   fileptr root_index;         /**< Address of root of top-level tree */
   fileptr max_size;           /**< Max size of tree file, in blocks (not including superblock) */
   fileptr free_head;          /**< Address of first free block (0 if none) */
-  fileptr inode_limbo;        /**< Address of first block of the inode limbo area */
+  fileptr inode_limbo;        /**< Address of the root of the inode limbo tree */
   unsigned long limbo_count;  /**< Number of inodes total in limbo */
   fileptr inode_root;         /**< Address of the root of the inode tree */
-  char padding[TREEBLOCK_SIZE - (2*sizeof(unsigned long) + 2*sizeof(unsigned short) + 5*sizeof(fileptr))]; /**< Unused space */
+  fileptr stats_root;         /**< Address of the root of the tag statistics tree (0 until first used) */
+  char padding[TREEBLOCK_SIZE - (2*sizeof(unsigned long) + 2*sizeof(unsigned short) + 6*sizeof(fileptr))]; /**< Unused space */
 } tsblock;
 
 /** Node in the tree */
@@ -136,16 +147,48 @@ typedef struct /** @cond */ __attribute__((__packed__)) /** @endcond */ {
 } tinode;
 
 /** Maximum number of references in an inode data block */
-#define REF_MAX ((TREEBLOCK_SIZE - 2*sizeof(short) - sizeof(unsigned long))/sizeof(fileptr))
+#define REF_MAX ((TREEBLOCK_SIZE - 2*sizeof(short) - sizeof(unsigned long) - sizeof(fileptr))/sizeof(fileptr))
 
 /** Data block in the inode tree */
 typedef struct /** @cond */ __attribute__((__packed__)) /** @endcond */ {
   unsigned long magic;        /**< Magic number 0x1d7ab10c */
   unsigned short refcount;    /**< Number of references held in this block */
   short unused;               /**< Unused */
-  fileptr refs[REF_MAX];      /**< List of references */
+  fileptr refs[REF_MAX];      /**< Sorted list of references */
+  fileptr next_refs;          /**< Address of next block of references (all greater than these), or zero if none */
 } tidata;
 
+/** Node in the inode limbo tree. Keys are the inodes themselves, so the tree
+ * is a set: leaf nodes hold only keys, and internal nodes hold separator keys
+ * with child pointers (keys in \a ptrs[i] are less than \a keys[i]). */
+typedef struct /** @cond */ __attribute__((__packed__)) /** @endcond */ {
+  unsigned long  magic;            /**< Magic number 0x11b0b10c */
+  unsigned short leaf;             /**< 0x01 if this node is a leaf node, 0x00 otherwise */
+  unsigned short keycount;         /**< The number of keys in this node */
+  fileptr        ptrs[DORDER];     /**< Addresses of child nodes if not leaf, unused otherwise */
+  fileptr        keys[DORDER-1];   /**< The keys (inodes) stored in this node */
+                                   /** unused space */
+  char           unused[TREEBLOCK_SIZE - sizeof(unsigned long) - 2*sizeof(short) - DORDER*(sizeof(fileptr)) - (DORDER-1)*(sizeof(fileptr))];
+} tlnode;
+
+/** Number of bits of an inode hash used to pick a HyperLogLog register */
+#define TAGSTATS_HLL_BITS 8
+/** Number of HyperLogLog registers in a tag statistics block */
+#define TAGSTATS_HLL_REGS (1<<TAGSTATS_HLL_BITS)
+
+/** Statistics about the inodes below a tag (the tag itself and all of its
+ * subtags), kept in the tag statistics tree keyed by the tag's data block
+ * address. The closure count is exact; the inode bounds may be loose after
+ * removals, and the sketch only ever grows. */
+typedef struct /** @cond */ __attribute__((__packed__)) /** @endcond */ {
+  unsigned long magic;        /**< Magic number 0x57a7b10c */
+  unsigned long closure;      /**< Number of distinct inodes below the tag */
+  fileptr min_inode;          /**< Lower bound of the inodes below the tag */
+  fileptr max_inode;          /**< Upper bound of the inodes below the tag */
+  unsigned char hll[TAGSTATS_HLL_REGS]; /**< HyperLogLog sketch registers */
+  char padding[TREEBLOCK_SIZE - 2*sizeof(unsigned long) - 2*sizeof(fileptr) - TAGSTATS_HLL_REGS]; /**< Unused space */
+} tstats;
+
 /** If a data node has this flag, it is a synonym for another node, and its \a
  * subkeys field is the address of the synonym target (another data block) */
 #define DATA_FLAGS_SYNONYM 0x01
@@ -159,6 +202,19 @@ typedef struct /** @cond */ __attribute__((__packed__)) /** @endcond */ {
 /** Flag clear macro */
 #define CLEAR_FLAG(v,f) do { (v) = ((v) | (f)) ^ (f); } while (0)
 
+/** Streaming cursor over the inode list of a data block or of the limbo tree.
+ * Inodes are produced in ascending order one block at a time, so the whole
+ * list is never held in memory. */
+typedef struct {
+  fileptr      block;         /**< Data block being read, or zero for the limbo tree */
+  fileptr      next;          /**< Next inode block in the chain, or zero if none */
+  fileptr      last;          /**< The last inode produced */
+  int          started;       /**< Non-zero once the first block has been read */
+  unsigned int count;         /**< Number of inodes in \a buf */
+  unsigned int pos;           /**< Index of the next inode in \a buf */
+  fileptr      buf[TREEBLOCK_SIZE/sizeof(fileptr)]; /**< Inodes from the current block */
+} inode_cursor;
+
 /*****************************************************************************
  * FUNCTION PROTOTYPES
  ****************************************************************************/
@@ -166,9 +222,12 @@ typedef struct /** @cond */ __attribute__((__packed__)) /** @endcond */ {
 int     tree_open         (char *path);
 int     tree_close        (void);
 int     tree_read         (fileptr block, tblock *data);
+void    tree_prefetch     (fileptr block);
 int     tree_write        (fileptr block, tblock *data);
 int     tree_grow         (fileptr newsize);
 time_t  tree_get_mtime    ();
+unsigned long tree_get_generation();
+unsigned long tree_get_key_generation();
 fileptr tree_get_root     ();
 fileptr tree_get_iroot    ();
 int     tree_get_min      (tnode *node);
@@ -186,16 +245,34 @@ fileptr tree_sub_insert   (fileptr node, const tkey key, tblock *data);
 int     tree_read_sb      (tsblock *super);
 int     tree_write_sb     (tsblock *super);
 int     tree_map_keys     (const fileptr root, int (*func)(const char *, const fileptr, void *), void *data);
+int     tree_map_range    (fileptr root, const char *lo, const char *hi, int (*func)(const char *, const fileptr, void *), void *data);
 int     tree_get_all_keys (fileptr root, tkey *keys, unsigned int max);
 size_t  tree_get_full_key_len(fileptr dataptr);
 char   *tree_get_full_key (fileptr dataptr);
 
 int inode_free_chain(fileptr block);
 int inode_insert(fileptr block, fileptr inode);
+int inode_insert_all(fileptr block, const fileptr *inodes, unsigned int n);
 int inode_remove(fileptr block, fileptr inode);
 int inode_put_all(fileptr block, fileptr *inodes, unsigned int count);
 int inode_get_all(fileptr block, fileptr *inodes, unsigned int max);
 fileptr *inode_get_all_recurse(fileptr block, int *count);
+fileptr *inode_get_all_range(fileptr block, const char *lo, const char *hi, int *count);
+int limbo_search(fileptr inode);
+int inode_ref_search(fileptr block, fileptr ref);
+int inode_ref_insert(fileptr block, fileptr ref);
+int inode_ref_remove(fileptr block, fileptr ref);
+int inode_ref_get_all(fileptr block, fileptr *refs, unsigned int max);
+inode_cursor *inode_cursor_open(fileptr block);
+int inode_cursor_next(inode_cursor *cur, fileptr *inode);
+int inode_cursor_seek(inode_cursor *cur, fileptr target);
+void inode_cursor_close(inode_cursor *cur);
+int tag_stats_get(fileptr block, tstats *stats);
+int tag_stats_build(fileptr block, tstats *stats);
+int tag_stats_update(fileptr block, fileptr inode, int delta);
+int tag_stats_remove(fileptr block);
+unsigned long tag_stats_estimate(const tstats *stats);
+unsigned long tag_stats_union(const tstats *a, const tstats *b);
 void tree_dump_tree(FILE *target, fileptr root, int indent);
 void tree_dump_dot(FILE *target, fileptr root);
 
@@ -61,6 +61,25 @@ static cache_ent *block_cache;
 #define CACHE_COUNT (CACHE_MAX_SIZE/sizeof(cache_ent))
 #endif
 
+/* ***************************************************************************
+ *  RECURSIVE INODE FETCHING
+ ************************************************************************** */
+
+/** Smallest number of sibling subtags worth prefetching together */
+#define INODE_PREFETCH_MIN 2
+
+/** Work state for gathering inode lists below a block */
+typedef struct {
+  fileptr *stack;     /**< Blocks still to be visited */
+  int stack_count;    /**< Number of blocks on the stack */
+  int stack_size;     /**< Allocated size of the stack */
+  fileptr **sets;     /**< Inode lists gathered so far, each in ascending order */
+  size_t *counts;     /**< Number of inodes in each of \a sets */
+  int set_count;      /**< Number of gathered lists */
+  int set_size;       /**< Allocated size of \a sets and \a counts */
+  int total;          /**< Sum of the gathered list lengths */
+} inode_gather;
+
 /* ***************************************************************************
  *  STATIC PROTOTYPES
  ************************************************************************** */
@@ -73,6 +92,19 @@ static int      tree_find_key      (tnode *node, const char *key);
 static int      tree_insert_key    (tnode *node, unsigned int keyindex, char **key, fileptr *ptr);
 static int      tree_insert_recurse(fileptr root, char **key, fileptr *ptr);
 static int      _tree_write        (fileptr block, tblock *data);
+static int      limbo_find_key     (tlnode *node, fileptr inode);
+static int      limbo_insert       (fileptr inode);
+static int      limbo_remove       (fileptr inode);
+static int      limbo_free_recurse (fileptr root);
+static int      limbo_upgrade      ();
+static int      inode_refs_upgrade ();
+static int      tree_upgrade       ();
+static int      inode_ref_find     (tidata *ib, fileptr ref);
+static fileptr  inode_ref_find_block(fileptr block, fileptr ref, tidata *ib, fileptr *prev);
+static int      inode_gather_push  (inode_gather *g, fileptr block);
+static int      inode_gather_block (inode_gather *g, fileptr block);
+static fileptr *inode_gather_finish(inode_gather *g, int ret, int *count);
+static int      inode_cursor_fill  (inode_cursor *cur, fileptr from);
 #ifdef TREE_CACHE_ENABLED
 static int      tree_cache_init    ();
 static int      tree_cache_flush   (int clear);
@@ -88,6 +120,9 @@ static int tree_fp = -1;
 static tsblock *tree_sb;
 /** Time of last tree change */
 static time_t last_modified;
+static unsigned long generation;
+/** Changes whenever a key is removed from the tag trees */
+static unsigned long key_generation;
 
 #ifdef TREE_CACHE_ENABLED
 /**
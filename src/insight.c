@@ -38,6 +38,9 @@
 #include <string_helpers.h>
 #include <query_engine.h>
 #include <set_ops.h>
+#include <arena.h>
+#include <tag_dict.h>
+#include <tag_cache.h>
 
 static int   insight_getattr(const char *path, struct stat *stbuf);
 static int   insight_readlink(const char *path, char *buf, size_t size);
@@ -88,6 +91,7 @@ static void *insight_init(void);
 enum {
     KEY_HELP,
     KEY_VERSION,
+    KEY_VIEW,
 };
 
 static struct fuse_opt insight_opts[] = {
@@ -100,6 +104,7 @@ static struct fuse_opt insight_opts[] = {
   INSIGHTFS_OPT("-v",         verbose,      1),
   INSIGHTFS_OPT("-q",         quiet,        1),
 
+  FUSE_OPT_KEY("--view=",       KEY_VIEW),
   FUSE_OPT_KEY("-V",            KEY_VERSION),
   FUSE_OPT_KEY("--version",     KEY_VERSION),
   FUSE_OPT_KEY("-h",            KEY_HELP),
@@ -107,43 +112,93 @@ static struct fuse_opt insight_opts[] = {
   FUSE_OPT_END
 };
 
+/**
+ * Define a FUSE operation that runs \a op as a request, so that the
+ * temporaries it allocates from the request arena are all released in one
+ * go when it returns.
+ */
+#define ARENA_OP(op, params, args) \
+static int op##_req params { \
+  int res; \
+  arena_begin(); \
+  res = op args; \
+  arena_end(); \
+  return res; \
+}
+
+ARENA_OP(insight_getattr,  (const char *path, struct stat *stbuf), (path, stbuf))
+ARENA_OP(insight_readlink, (const char *path, char *buf, size_t size), (path, buf, size))
+ARENA_OP(insight_readdir,  (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi), (path, buf, filler, offset, fi))
+ARENA_OP(insight_mknod,    (const char *path, mode_t mode, dev_t rdev), (path, mode, rdev))
+ARENA_OP(insight_mkdir,    (const char *path, mode_t mode), (path, mode))
+ARENA_OP(insight_unlink,   (const char *path), (path))
+ARENA_OP(insight_rmdir,    (const char *path), (path))
+ARENA_OP(insight_rename,   (const char *from, const char *to), (from, to))
+ARENA_OP(insight_symlink,  (const char *from, const char *to), (from, to))
+ARENA_OP(insight_link,     (const char *from, const char *to), (from, to))
+ARENA_OP(insight_chmod,    (const char *path, mode_t mode), (path, mode))
+ARENA_OP(insight_chown,    (const char *path, uid_t uid, gid_t gid), (path, uid, gid))
+ARENA_OP(insight_truncate, (const char *path, off_t size), (path, size))
+#if FUSE_VERSION >= 26
+ARENA_OP(insight_utimens,  (const char *path, const struct timespec tv[2]), (path, tv))
+#else
+ARENA_OP(insight_utime,    (const char *path, struct utimbuf *buf), (path, buf))
+#endif
+ARENA_OP(insight_open,     (const char *path, struct fuse_file_info *fi), (path, fi))
+ARENA_OP(insight_read,     (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi), (path, buf, size, offset, fi))
+ARENA_OP(insight_write,    (const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi), (path, buf, size, offset, fi))
+#if FUSE_VERSION >= 25
+ARENA_OP(insight_statvfs,  (const char *path, struct statvfs *stbuf), (path, stbuf))
+#else
+ARENA_OP(insight_statfs,   (const char *path, struct statfs *stbuf), (path, stbuf))
+#endif
+ARENA_OP(insight_release,  (const char *path, struct fuse_file_info *fi), (path, fi))
+ARENA_OP(insight_fsync,    (const char *path, int isdatasync, struct fuse_file_info *fi), (path, isdatasync, fi))
+ARENA_OP(insight_access,   (const char *path, int mode), (path, mode))
+#ifdef HAVE_SETXATTR
+ARENA_OP(insight_setxattr, (const char *path, const char *name, const char *value, size_t size, int flags), (path, name, value, size, flags))
+ARENA_OP(insight_getxattr, (const char *path, const char *name, char *value, size_t size), (path, name, value, size))
+ARENA_OP(insight_listxattr, (const char *path, char *list, size_t size), (path, list, size))
+ARENA_OP(insight_removexattr, (const char *path, const char *name), (path, name))
+#endif /* HAVE_SETXATTR */
+
 static struct fuse_operations insight_oper = {
-  .getattr    = insight_getattr,
-  .readdir    = insight_readdir,
-  .open       = insight_open,
-  .read       = insight_read,
-  .mkdir      = insight_mkdir,
+  .getattr    = insight_getattr_req,
+  .readdir    = insight_readdir_req,
+  .open       = insight_open_req,
+  .read       = insight_read_req,
+  .mkdir      = insight_mkdir_req,
   .destroy    = insight_destroy,
-  .rmdir      = insight_rmdir,
-  .readlink   = insight_readlink,
-  .mknod      = insight_mknod,
-  .symlink    = insight_symlink,
-  .unlink     = insight_unlink,
-  .rename     = insight_rename,
-  .link       = insight_link,
-  .chmod      = insight_chmod,
-  .chown      = insight_chown,
-  .truncate   = insight_truncate,
+  .rmdir      = insight_rmdir_req,
+  .readlink   = insight_readlink_req,
+  .mknod      = insight_mknod_req,
+  .symlink    = insight_symlink_req,
+  .unlink     = insight_unlink_req,
+  .rename     = insight_rename_req,
+  .link       = insight_link_req,
+  .chmod      = insight_chmod_req,
+  .chown      = insight_chown_req,
+  .truncate   = insight_truncate_req,
 #if FUSE_VERSION >= 26
-  .utimens    = insight_utimens,
+  .utimens    = insight_utimens_req,
 #else
-  .utime      = insight_utime,
+  .utime      = insight_utime_req,
 #endif
-  .write      = insight_write,
+  .write      = insight_write_req,
 #if FUSE_VERSION >= 25
-  .statfs     = insight_statvfs,
+  .statfs     = insight_statvfs_req,
 #else
-  .statfs     = insight_statfs,
+  .statfs     = insight_statfs_req,
 #endif
-  .release    = insight_release,
-  .fsync      = insight_fsync,
+  .release    = insight_release_req,
+  .fsync      = insight_fsync_req,
 #ifdef HAVE_SETXATTR
-  .setxattr   = insight_setxattr,
-  .getxattr   = insight_getxattr,
-  .listxattr  = insight_listxattr,
-  .removexattr= insight_removexattr,
+  .setxattr   = insight_setxattr_req,
+  .getxattr   = insight_getxattr_req,
+  .listxattr  = insight_listxattr_req,
+  .removexattr= insight_removexattr_req,
 #endif
-  .access     = insight_access,
+  .access     = insight_access_req,
   .init       = insight_init,
 };
 
@@ -198,6 +253,8 @@ static int tag_ensure_create(const char *tag) {
       }
       DEBUG("Successfully inserted \"%s\" into parent", curtag);
       ifree(the_tag);
+      tag_dict_invalidate();
+      tag_cache_created();
 
       attrid = get_tag(curtag);
       if (!attrid) {
@@ -220,44 +277,109 @@ static int tag_ensure_create(const char *tag) {
   return attrid;
 }
 
-static int limbo_search(fileptr inode) {
-  profile_init_start();
-  fileptr *inodes=NULL;
-  int i, count = inode_get_all(0, NULL, 0);
-  if (count>0) {
-    inodes = calloc(count, sizeof(fileptr));
-    inode_get_all(0, inodes, count);
-  } else if (count==0) {
-    /* can't be found if no inodes in list */
-    profile_stop();
-    return 0;
-  } else if (count<0) {
-    DEBUG("Error calling inode_get_all(): %s", strerror(-count));
-    profile_stop();
-    return count;
+/**
+ * Add the ancestors of each tag in an array to it, then sort it and remove
+ * duplicates.
+ *
+ * @param[in]     tags  Array of tag data blocks, which is consumed.
+ * @param[in,out] count Number of tags in the array.
+ * @returns The sorted, unique array of implied tags to be freed after use,
+ * or NULL on failure.
+ */
+static fileptr *attr_implied(fileptr *tags, int *count) {
+  int n=*count, size=*count, i;
+  tdata dnode;
+
+  for (i=0; i<*count; i++) {
+    fileptr cur = tags[i];
+    for (;;) {
+      if (tree_read(cur, (tblock*)&dnode)) {
+        PMSG(LOG_ERR, "IO error reading data block");
+        ifree(tags);
+        return NULL;
+      }
+      if (!(cur = dnode.parent)) break;
+      if (n == size) {
+        fileptr *tmp = realloc(tags, (size ? size*2 : 8) * sizeof(fileptr));
+        if (!tmp) {
+          ifree(tags);
+          return NULL;
+        }
+        tags = tmp;
+        size = size ? size*2 : 8;
+      }
+      tags[n++] = cur;
+    }
+  }
+  if (set_sort_inode(tags, n)<0) {
+    ifree(tags);
+    return NULL;
   }
+  *count = inodeset_uniq(tags, n);
+  return tags;
+}
 
-  for (i=0; i<count; i++) {
-    if (inodes[i]==inode)
-      break;
+/**
+ * Update the statistics of the tags whose closures gained or lost a file when
+ * some of its tags were added or removed: the changed tags themselves and
+ * those of their ancestors that the file's other tags do not imply.
+ *
+ * @param inode   The inode of the file, with its tags already updated.
+ * @param changed Sorted array of the tags that were actually added or removed.
+ * @param n       Number of tags in \a changed.
+ * @param delta   One if the tags were added, minus one if they were removed.
+ */
+static void attr_stats_apply(fileptr inode, const fileptr *changed, int n, int delta) {
+  fileptr *others, *affected;
+  int nothers, i;
+
+  if (!n) return;
+  if (!(others = tags_from_inode(inode, &nothers))) {
+    PMSG(LOG_WARNING, "Could not find the tags of inode %08lx; statistics not updated", inode);
+    return;
   }
-  ifree(inodes);
-  profile_stop();
-  return (i<count)?(i+1):0;
+  /* the changed tags say nothing about the file's other memberships */
+  nothers = set_diff_inode(others, changed, others, nothers, n, nothers);
+  if (!(others = attr_implied(others, &nothers))) {
+    PMSG(LOG_WARNING, "Could not find the tags of inode %08lx; statistics not updated", inode);
+    return;
+  }
+  if (!(affected = malloc(n*sizeof(fileptr)))) {
+    ifree(others);
+    return;
+  }
+  memcpy(affected, changed, n*sizeof(fileptr));
+  if (!(affected = attr_implied(affected, &n))) {
+    ifree(others);
+    return;
+  }
+  n = set_diff_inode(affected, others, affected, n, nothers, n);
+  for (i=0; i<n; i++) {
+    if (tag_stats_update(affected[i], inode, delta)) {
+      PMSG(LOG_WARNING, "Could not update statistics of tag %lu", affected[i]);
+    }
+  }
+  ifree(affected);
+  ifree(others);
 }
 
-static int attr_add(fileptr inode, fileptr attrid) {
+/**
+ * Record the given (sorted, unique) attributes against an inode in the inode
+ * tree, taking the inode out of limbo first if necessary. The attributes'
+ * own inode lists are not touched.
+ *
+ * @param inode   The inode to update.
+ * @param attrids Sorted array of attribute data block indices.
+ * @param n       Number of attributes in \a attrids.
+ * @returns Zero on success, or a negative error code on failure.
+ */
+static int attr_add_refs(fileptr inode, const fileptr *attrids, int n) {
   profile_init_start();
-  DEBUG("attr_add(inode: %08lx, attrid: %lu)", inode, attrid);
-  char s_hash[9];
+  tkey s_hash;
+  fileptr piblock;
+  int i=0;
   hex_to_string(s_hash, inode);
 
-  if (!attrid) {
-    DEBUG("Cannot add null attribute");
-    profile_stop();
-    return -ENOENT;
-  }
-
   DEBUG("Searching limbo");
   int searchres=limbo_search(inode);
 
@@ -277,60 +399,70 @@ static int attr_add(fileptr inode, fileptr attrid) {
       return -EIO;
     }
 
-    /* add to inode tree with attrid */
+    /* add to inode tree with as many attrids as fit */
     DEBUG("Adding entry to inode tree");
     tidata iblock;
     initInodeDataBlock(&iblock);
-    if (!tree_sub_insert(tree_get_iroot(), s_hash, (tblock*)&iblock)) {
+    iblock.refcount = MIN((unsigned int)n, REF_MAX);
+    memcpy(iblock.refs, attrids, iblock.refcount*sizeof(fileptr));
+    if (!(piblock=tree_sub_insert(tree_get_iroot(), s_hash, (tblock*)&iblock))) {
       PMSG(LOG_ERR, "Tree insertion failed");
       profile_stop();
       return -ENOSPC;
     }
-
-    /* add to attribute list         */
-    DEBUG("Adding to attribute list");
-    int res = inode_insert(attrid, inode);
-    if (res) {
-      DEBUG("Inode addition failed: %s", strerror(res));
-      if (res==ENOENT) res=EPERM;
-      profile_stop();
-      return -res;
-    }
+    i = iblock.refcount;
   } else {
-    /* add attrid to inode tree      */
-    tidata iblock;
-    fileptr piblock;
-
     DEBUG("Adding to inode tree");
     piblock = tree_sub_search(tree_get_iroot(), s_hash);
+    if (!piblock) {
+      DEBUG("Inode not found in inode tree");
+      profile_stop();
+      return -ENOENT;
+    }
+  }
 
-    if (tree_read(piblock, (tblock*)&iblock)) {
-      PMSG(LOG_ERR, "IO error reading inode data block");
+  /* add remaining attrids to inode tree */
+  for (; i<n; i++) {
+    if ((errno=inode_ref_insert(piblock, attrids[i]))) {
+      PMSG(LOG_ERR, "IO error adding to inode data block: %s", strerror(errno));
       profile_stop();
       return -EIO;
     }
+  }
 
-    iblock.refs[iblock.refcount] = inode;
-    iblock.refcount++;
+  profile_stop();
+  return 0;
+}
 
-    qsort(iblock.refs, iblock.refcount, sizeof(fileptr), inodecmp);
+static int attr_add(fileptr inode, fileptr attrid) {
+  profile_init_start();
+  unsigned long generation = tree_get_generation();
+  DEBUG("attr_add(inode: %08lx, attrid: %lu)", inode, attrid);
 
-    if (tree_write(piblock, (tblock*)&iblock)) {
-      PMSG(LOG_ERR, "IO error writing inode data block");
-      profile_stop();
-      return -EIO;
-    }
+  if (!attrid) {
+    DEBUG("Cannot add null attribute");
+    profile_stop();
+    return -ENOENT;
+  }
 
-    /* add to attribute list         */
-    DEBUG("Adding to attribute list");
-    int res = inode_insert(attrid, inode);
-    if (res) {
-      DEBUG("Inode insertion failed: %s", strerror(res));
-      if (res==ENOENT) res=EPERM;
-      profile_stop();
-      return -res;
-    }
+  int fresh = !inode_has_tag(inode, attrid);
+  int res = attr_add_refs(inode, &attrid, 1);
+  if (res) {
+    profile_stop();
+    return res;
+  }
+
+  /* add to attribute list         */
+  DEBUG("Adding to attribute list");
+  res = inode_insert(attrid, inode);
+  if (res) {
+    DEBUG("Inode insertion failed: %s", strerror(res));
+    if (res==ENOENT) res=EPERM;
+    profile_stop();
+    return -res;
   }
+  if (fresh) attr_stats_apply(inode, &attrid, 1, 1);
+  query_view_update(&inode, 1, generation);
   profile_stop();
   return 0;
 }
@@ -380,10 +512,181 @@ static int auto_attr_addbyname_rec(fileptr inode, const char *attr) {
   return res;
 }
 
+/**
+ * Look up a tag by name, creating it (and any missing parents) if it does not
+ * exist yet.
+ *
+ * @param tag The fully-qualified tag name.
+ * @returns The tag's data block index, or zero on failure.
+ */
+static fileptr tag_resolve_create(const char *tag) {
+  fileptr attrid = get_tag(tag);
+  if (!attrid) {
+    int res = tag_ensure_create(tag);
+    attrid = (res<0) ? 0 : (fileptr)res;
+  }
+  return attrid;
+}
+
+/**
+ * Apply several tags to a single file. Each tag is resolved (and created if
+ * necessary) once, the inode tree entry is updated once, and then each tag's
+ * inode list is updated in order of block index.
+ *
+ * @param inode The inode to tag.
+ * @param tags  Array of fully-qualified tag names.
+ * @param n     Number of tags in \a tags.
+ * @returns Zero on success, or a negative error code on failure.
+ */
+static int attr_addbynames_rec(fileptr inode, const char **tags, int n) {
+  profile_init_start();
+  unsigned long generation = tree_get_generation();
+  int i, count, nfresh, res;
+
+  if (!tags || n<0) {
+    profile_stop();
+    return -EINVAL;
+  }
+  if (!n) {
+    profile_stop();
+    return 0;
+  }
+
+  /* second half holds the tags the file does not have yet */
+  fileptr *attrids = calloc(2*n, sizeof(fileptr));
+  if (!attrids) {
+    profile_stop();
+    return -ENOMEM;
+  }
+  fileptr *fresh = attrids+n;
+  for (i=0; i<n; i++) {
+    if (!tags[i] || !*tags[i]) {
+      ifree(attrids);
+      profile_stop();
+      return -EINVAL;
+    }
+    if (!(attrids[i] = tag_resolve_create(tags[i]))) {
+      PMSG(LOG_ERR, "Could not create tag \"%s\"", tags[i]);
+      ifree(attrids);
+      profile_stop();
+      return -ENOSPC;
+    }
+  }
+
+  /* sort the work by target block */
+  if (set_sort_inode(attrids, n)<0) {
+    ifree(attrids);
+    profile_stop();
+    return -ENOMEM;
+  }
+  count = inodeset_uniq(attrids, n);
+  for (i=nfresh=0; i<count; i++) {
+    if (!inode_has_tag(inode, attrids[i])) fresh[nfresh++] = attrids[i];
+  }
+
+  if ((res = attr_add_refs(inode, attrids, count))) {
+    ifree(attrids);
+    profile_stop();
+    return res;
+  }
+
+  DEBUG("Adding to %d attribute lists", count);
+  for (i=0; i<count; i++) {
+    if ((res = inode_insert(attrids[i], inode))) {
+      DEBUG("Inode insertion failed: %s", strerror(res));
+      if (res==ENOENT) res=EPERM;
+      ifree(attrids);
+      profile_stop();
+      return -res;
+    }
+  }
+
+  attr_stats_apply(inode, fresh, nfresh, 1);
+  ifree(attrids);
+  query_view_update(&inode, 1, generation);
+  profile_stop();
+  return 0;
+}
+
+/**
+ * Apply a single tag to several files. The tag is resolved (and created if
+ * necessary) once, and its inode list is rewritten in a single pass.
+ *
+ * @param tag    The fully-qualified tag name.
+ * @param inodes Array of inodes to tag.
+ * @param n      Number of inodes in \a inodes.
+ * @returns Zero on success, or a negative error code on failure.
+ */
+static int attr_tag_files_rec(const char *tag, fileptr *inodes, int n) {
+  profile_init_start();
+  unsigned long generation = tree_get_generation();
+  int i, count, nfresh, res;
+
+  if (!tag || !*tag || !inodes || n<0) {
+    profile_stop();
+    return -EINVAL;
+  }
+  if (!n) {
+    profile_stop();
+    return 0;
+  }
+
+  fileptr attrid = tag_resolve_create(tag);
+  if (!attrid) {
+    PMSG(LOG_ERR, "Could not create tag \"%s\"", tag);
+    profile_stop();
+    return -ENOSPC;
+  }
+
+  /* second half holds the files that do not have the tag yet */
+  fileptr *sorted = malloc(2*n*sizeof(fileptr));
+  if (!sorted) {
+    profile_stop();
+    return -ENOMEM;
+  }
+  fileptr *fresh = sorted+n;
+  memcpy(sorted, inodes, n*sizeof(fileptr));
+  if (set_sort_inode(sorted, n)<0) {
+    ifree(sorted);
+    profile_stop();
+    return -ENOMEM;
+  }
+  count = inodeset_uniq(sorted, n);
+  for (i=nfresh=0; i<count; i++) {
+    if (!inode_has_tag(sorted[i], attrid)) fresh[nfresh++] = sorted[i];
+  }
+
+  for (i=0; i<count; i++) {
+    if ((res = attr_add_refs(sorted[i], &attrid, 1))) {
+      ifree(sorted);
+      profile_stop();
+      return res;
+    }
+  }
+
+  DEBUG("Adding %d inodes to attribute list", count);
+  if ((res = inode_insert_all(attrid, sorted, count))) {
+    DEBUG("Inode insertion failed: %s", strerror(res));
+    if (res==ENOENT) res=EPERM;
+    ifree(sorted);
+    profile_stop();
+    return -res;
+  }
+
+  for (i=0; i<nfresh; i++) {
+    attr_stats_apply(fresh[i], &attrid, 1, 1);
+  }
+  query_view_update(sorted, count, generation);
+  ifree(sorted);
+  profile_stop();
+  return 0;
+}
+
 static int attr_del(fileptr inode, fileptr attrid) {
   profile_init_start();
+  unsigned long generation = tree_get_generation();
   DEBUG("attr_del(%08lx, %lu)", inode, attrid);
-  char s_hash[9];
+  tkey s_hash;
   hex_to_string(s_hash, inode);
 
   if (!attrid) {
@@ -432,6 +735,8 @@ static int attr_del(fileptr inode, fileptr attrid) {
         profile_stop();
         return -EIO;
       }
+      /* expressions naming the file no longer parse the same way */
+      query_parse_cache_clear();
 
       /* unlink symlink                 */
       DEBUG("Final unlink call: unlink(\"%s\")", finaldest);
@@ -464,45 +769,28 @@ static int attr_del(fileptr inode, fileptr attrid) {
 
     /* remove attrid from inode tree  */
     DEBUG("Removing attribute ref from inode tree");
-    tidata iblock;
     fileptr piblock;
 
     DEBUG("Fetching inode tree data block");
     if (tree_get_iroot()) {
       piblock = tree_sub_search(tree_get_iroot(), s_hash);
-
-      if (tree_read(piblock, (tblock*)&iblock)) {
-        PMSG(LOG_ERR, "IO error reading inode data block");
-        profile_stop();
-        return -EIO;
-      }
-
-      /* find ref */
-      DEBUG("Finding ref...");
-      /* TODO: make this binary search */
-      int i;
-      for (i=0; i<iblock.refcount; i++) {
-        if (iblock.refs[i]==attrid) break;
-      }
-
-      if (i>=iblock.refcount) {
-        /* not found */
-        DEBUG("Could not find ref!");
+      if (!piblock) {
+        DEBUG("Inode not found in inode tree");
         profile_stop();
         return -ENOENT;
       }
 
-      DEBUG("Removing node...");
-      /* remove node */
-      iblock.refcount--;
-      while (i++<iblock.refcount) {
-        iblock.refs[i-1]=iblock.refs[i];
+      DEBUG("Removing ref...");
+      if ((res=inode_ref_remove(piblock, attrid))) {
+        DEBUG("Could not remove ref: %s", strerror(res));
+        profile_stop();
+        return (res==ENOENT) ? -ENOENT : -EIO;
       }
 
       /* if (inode attr list not empty) {   */
-      if (iblock.refcount) {
-        if (tree_write(piblock, (tblock*)&iblock)) {
-          PMSG(LOG_ERR, "IO error writing inode data block");
+      if ((res=inode_ref_get_all(piblock, NULL, 0))) {
+        if (res<0) {
+          PMSG(LOG_ERR, "IO error reading inode data block");
           profile_stop();
           return -EIO;
         }
@@ -512,7 +800,7 @@ static int attr_del(fileptr inode, fileptr attrid) {
         /* remove entry from inode tree */
         DEBUG("Removing entry from inode tree");
         if ((errno=tree_sub_remove(tree_get_iroot(), s_hash))) {
-          PMSG(LOG_ERR, "Tree removal failed with error: %s", strerror(-res));
+          PMSG(LOG_ERR, "Tree removal failed with error: %s", strerror(-errno));
           profile_stop();
           return -EIO;
         }
@@ -528,6 +816,8 @@ static int attr_del(fileptr inode, fileptr attrid) {
   }
 
   DEBUG("All done.");
+  if (attrid) attr_stats_apply(inode, &attrid, 1, -1);
+  query_view_update(&inode, 1, generation);
   profile_stop();
   return 0;
 }
@@ -588,22 +878,22 @@ static int insight_getattr(const char *path, struct stat *stbuf) {
   }
 
   struct stat fstat;
-  char *canon_path = get_canonical_path(path);
-  char *last = strlast(canon_path+1, '/');
+  char *canon_path = get_canonical_path_arena(path);
+  char *last = strlast_arena(canon_path+1, '/');
 
   DEBUG("Getattr called on path \"%s\"", canon_path);
 
   if (get_file_link_by_name(last, &fstat)) {
-    ifree(last);
+    afree(last);
     DEBUG("Got a file\n");
 
     memcpy(stbuf, &fstat, sizeof(struct stat));
     qtree_free(&q, 1);
-    ifree(canon_path);
+    afree(canon_path);
     profile_stopf("path: %s", path);
     return 0;
 
-  } else if (validate_path(canon_path)) {
+  } else if (validate_path(canon_path) || query_has_virtual(q)) {
 
     /* steal a default stat structure */
     memcpy(stbuf, &insight.mountstat, sizeof(struct stat));
@@ -616,11 +906,11 @@ static int insight_getattr(const char *path, struct stat *stbuf) {
       DEBUG("Getattr on a subkey indicator directory");
       stbuf->st_mode = S_IFDIR | 0555;
       stbuf->st_nlink = 1;
-      char *tmpp = calloc(strlen(canon_path)+2, sizeof(char));
+      char *tmpp = arena_calloc(strlen(canon_path)+2, sizeof(char));
       if (!tmpp) {
         PMSG(LOG_ERR, "Failed to allocate temporary space for hash path");
-        ifree(canon_path);
-        ifree(last);
+        afree(canon_path);
+        afree(last);
         qtree_free(&q, 1);
         profile_stopf("path: %s", path);
         return -ENOMEM;
@@ -628,7 +918,7 @@ static int insight_getattr(const char *path, struct stat *stbuf) {
       strcpy(tmpp, canon_path);
       strcat(tmpp, ":");
       stbuf->st_ino = hash_path(tmpp);
-      ifree(tmpp);
+      afree(tmpp);
     } else {
       int subtag=0;
       fileptr tagdata;
@@ -641,20 +931,25 @@ static int insight_getattr(const char *path, struct stat *stbuf) {
 
       tagdata=get_last_tag(canon_path+1);
 
-      if (!tagdata) {
+      if (!tagdata && query_has_virtual(q)) {
+        /* a range of subtags or an expression is listed like a tag without
+         * subtags */
+        DEBUG("Getattr on a subtag range or query expression");
+        bzero(&dnode, sizeof(dnode));
+      } else if (!tagdata) {
         DEBUG("Tag \"%s\" not found\n", canon_path+1);
         qtree_free(&q, 1);
-        ifree(canon_path);
-        ifree(last);
+        afree(canon_path);
+        afree(last);
         profile_stopf("path: %s", path);
         return -ENOENT;
       }
       DEBUG("Found tag \"%s\"", canon_path+1);
-      if (tree_read(tagdata, (tblock*)&dnode)) {
+      if (tagdata && tree_read(tagdata, (tblock*)&dnode)) {
         PMSG(LOG_ERR, "IO error reading data block");
         qtree_free(&q, 1);
-        ifree(canon_path);
-        ifree(last);
+        afree(canon_path);
+        afree(last);
         profile_stopf("path: %s", path);
         return -EIO;
       }
@@ -671,23 +966,27 @@ static int insight_getattr(const char *path, struct stat *stbuf) {
           /* add sticky bit */
           stbuf->st_mode |= S_ISVTX;
         }
+        /* report how many files the directory lists, when the stored
+         * statistics can say so without listing it */
+        long estimate = query_estimate(q);
+        if (estimate >= 0) stbuf->st_size = estimate;
       }
       stbuf->st_nlink = 1;
       /* provide probably unique inodes for directories */
       stbuf->st_ino = hash_path(last);
-      ifree(last);
+      afree(last);
     }
   } else {
     DEBUG("Path does not exist\n");
-    ifree(last);
+    afree(last);
     qtree_free(&q, 1);
-    ifree(canon_path);
+    afree(canon_path);
     profile_stopf("path: %s", path);
     return -ENOENT;
   }
   DEBUG("Returning\n");
   qtree_free(&q, 1);
-  ifree(canon_path);
+  afree(canon_path);
   profile_stopf("path: %s", path);
   return 0;
 }
@@ -698,21 +997,22 @@ static int insight_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
   (void) fi;
   tnode node;
   unsigned int i;
-  char *canon_path = get_canonical_path(path);
+  char *canon_path = get_canonical_path_arena(path);
 
   DEBUG("readdir(path=\"%s\", buf=%p, offset=%lld)", canon_path, buf, offset);
 
-  if (!validate_path(canon_path)) {
+  DEBUG("Generating query tree");
+  qelem *q = path_to_query(path);
+
+  if (!q || !(validate_path(canon_path) || query_has_virtual(q))) {
     DEBUG("Path does not exist\n");
-    ifree(canon_path);
+    qtree_free(&q, 1);
+    afree(canon_path);
     profile_stopf("path: %s", path);
     return -ENOENT;
   }
 
-  char *last_tag=calloc(255, sizeof(char));
-
-  DEBUG("Generating query tree");
-  qelem *q = path_to_query(path); /* TODO: check for failure */
+  char *last_tag=arena_calloc(255, sizeof(char));
 
   DEBUG("Finding subtag parent...");
   (void)query_get_subtags(q, last_tag, 255);
@@ -723,8 +1023,8 @@ static int insight_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
   if (*last_tag && (tree_root=get_tag(last_tag))==0) {
     DEBUG("Tag \"%s\" not found\n", last_tag);
     qtree_free(&q, 1);
-    ifree(last_tag);
-    ifree(canon_path);
+    afree(last_tag);
+    afree(canon_path);
     profile_stopf("path: %s", path);
     return -ENOENT;
   }
@@ -734,16 +1034,16 @@ static int insight_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
   if (!filler) {
     PMSG(LOG_ERR, "Filler function is undefined!\n");
     qtree_free(&q, 1);
-    ifree(last_tag);
-    ifree(canon_path);
+    afree(last_tag);
+    afree(canon_path);
     profile_stopf("path: %s", path);
     return -EIO;
   }
   if (!buf) {
     PMSG(LOG_ERR, "Destination buffer is undefined!\n");
     qtree_free(&q, 1);
-    ifree(last_tag);
-    ifree(canon_path);
+    afree(last_tag);
+    afree(canon_path);
     profile_stopf("path: %s", path);
     return -EIO;
   }
@@ -755,34 +1055,42 @@ static int insight_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
   /* if subtag indicator then no files should be listed */
   if (!*last_tag) {
-    int inodecount, neg;
-    DEBUG("Fetching inode list");
-    fileptr *inodelist = query_to_inodes(q, &inodecount, &neg);
+    int res;
+    fileptr inode;
+    DEBUG("Opening query cursor");
+    qcursor *cur = query_cursor_open_path(canon_path, q);
 
-    DEBUG("query_to_inodes() has returned");
-    if (!inodelist) {
-      PMSG(LOG_ERR, "Error fetching inode list from query tree\n");
+    if (!cur) {
+      PMSG(LOG_ERR, "Error opening cursor on query tree\n");
       qtree_free(&q, 1);
-      ifree(last_tag);
-      ifree(canon_path);
+      afree(last_tag);
+      afree(canon_path);
       profile_stopf("path: %s", path);
       return -EIO;
     }
-    DEBUG("%d inodes to consider", inodecount);
 
-    for (i=0; i<(unsigned int)inodecount; i++) {
-      char *str = basename_from_inode(inodelist[i]);
+    /* names are streamed into the listing as the query produces them */
+    while ((res = query_cursor_next(cur, &inode)) == 1) {
+      char *str = basename_from_inode(inode);
       if (str) {
         DEBUG("Adding filename \"%s\" to listing", str);
         filler(buf, str, NULL, 0);
       } else {
-        FMSG(LOG_ERR, "Error getting filename for inode %08lX", inodelist[i]);
+        FMSG(LOG_ERR, "Error getting filename for inode %08lX", inode);
       }
       ifree(str);
     }
 
-    DEBUG("Freeing inode array");
-    ifree(inodelist);
+    DEBUG("Closing query cursor");
+    query_cursor_close(&cur);
+    if (res < 0) {
+      PMSG(LOG_ERR, "Error fetching inode list from query tree\n");
+      qtree_free(&q, 1);
+      afree(last_tag);
+      afree(canon_path);
+      profile_stopf("path: %s", path);
+      return -EIO;
+    }
   }
 
   DEBUG("Freeing query tree...");
@@ -792,8 +1100,8 @@ static int insight_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
   if (tree_sub_get_min(tree_root, &node)) {
     PMSG(LOG_ERR, "IO error: tree_sub_get_min() failed\n");
-    ifree(last_tag);
-    ifree(canon_path);
+    afree(last_tag);
+    afree(canon_path);
     profile_stopf("path: %s", path);
     return -EIO;
   }
@@ -803,8 +1111,8 @@ static int insight_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
       DEBUG("No subtags");
     else
       PMSG(LOG_ERR, "Something went very, very wrong\n");
-    ifree(last_tag);
-    ifree(canon_path);
+    afree(last_tag);
+    afree(canon_path);
     profile_stopf("path: %s", path);
     return 0;
   }
@@ -813,7 +1121,7 @@ static int insight_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
   /* add special directory containing subkeys of this key */
   if (strcmp(path, "/") != 0 && !*last_tag) {
     DEBUG("Getting last fragment");
-    char *lastbit = strlast(canon_path, '/');
+    char *lastbit = strlast_arena(canon_path, '/');
     tnode n;
 
     n.magic=0;
@@ -822,12 +1130,13 @@ static int insight_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     tree_root=get_tag(lastbit);
 
     DEBUG("Calling tree_sub_get_min(%lu)", tree_root);
-    int res=tree_sub_get_min(tree_root, &n);
+    /* ranges and expressions have no subkeys of their own */
+    int res=tree_root ? tree_sub_get_min(tree_root, &n) : ENOENT;
     if (res && res != ENOENT) {
       PMSG(LOG_ERR, "IO error: tree_sub_get_min() failed: %s\n", strerror(errno));
-      ifree(lastbit);
-      ifree(last_tag);
-      ifree(canon_path);
+      afree(lastbit);
+      afree(last_tag);
+      afree(canon_path);
       profile_stopf("path: %s", path);
       return -EIO;
     }
@@ -838,23 +1147,22 @@ static int insight_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
       filler(buf, INSIGHT_SUBKEY_IND, NULL, 0);
     }
 
-    ifree(lastbit);
+    afree(lastbit);
   }
 
 
   DEBUG("Getting directory list");
   unsigned int dirs_count;
-  char **dirs_list = path_get_dirs(canon_path, &dirs_count);
+  const char **dirs_list = path_get_dirs(canon_path, &dirs_count);
   DEBUG("Directory list returned %u entries", dirs_count);
 
   for (i=0; i<dirs_count; i++) {
     filler(buf, dirs_list[i], NULL, 0);
-    ifree(dirs_list[i]);
   }
-  ifree(dirs_list);
+  if (dirs_list) afree(dirs_list);
 
-  ifree(last_tag);
-  ifree(canon_path);
+  afree(last_tag);
+  afree(canon_path);
 
   DEBUG("Done\n");
 
@@ -865,16 +1173,16 @@ static int insight_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 static int insight_mkdir(const char *path, mode_t mode) {
   (void) mode;
 
-  char *canon_path = get_canonical_path(path);
+  char *canon_path = get_canonical_path_arena(path);
   char *cp_orig = canon_path; /* for later free()ing */
-  char *newtag = strlast(canon_path, '/');
-  char *newdir = strlast(path, '/');
-  char *dup = strdup(path);
+  char *newtag = strlast_arena(canon_path, '/');
+  char *newdir = strlast_arena(path, '/');
+  char *dup = arena_strdup(path);
   char *canon_parent = rindex(dup, '/');
   *canon_parent='\0';
-  canon_parent = get_canonical_path(dup);
+  canon_parent = get_canonical_path_arena(dup);
   char *cpar_orig = canon_parent; /* for later free()ing */
-  ifree(dup);
+  afree(dup);
 
   if (canon_parent[0]=='/')
     canon_parent++;
@@ -884,17 +1192,17 @@ static int insight_mkdir(const char *path, mode_t mode) {
 
   if (strcmp(newdir, INSIGHT_SUBKEY_IND)==0) {
     PMSG(LOG_WARNING, "Cannot create directories named \"%s\"", INSIGHT_SUBKEY_IND);
-    ifree(newtag);
-    ifree(cp_orig);
-    ifree(cpar_orig);
+    afree(newtag);
+    afree(cp_orig);
+    afree(cpar_orig);
     return -EPERM;
   }
 
   if (*newdir == '_') {
     PMSG(LOG_WARNING, "Cannot create directories that begin with an underscore");
-    ifree(newtag);
-    ifree(cp_orig);
-    ifree(cpar_orig);
+    afree(newtag);
+    afree(cp_orig);
+    afree(cpar_orig);
     return -EPERM;
   }
 
@@ -905,9 +1213,9 @@ static int insight_mkdir(const char *path, mode_t mode) {
 
   if (!*newdir) {
     DEBUG("Invalid (empty) directory name");
-    ifree(newtag);
-    ifree(cp_orig);
-    ifree(cpar_orig);
+    afree(newtag);
+    afree(cp_orig);
+    afree(cpar_orig);
     return -EPERM;
   }
 
@@ -915,9 +1223,9 @@ static int insight_mkdir(const char *path, mode_t mode) {
 
   if (!validate_path(canon_parent)) {
     DEBUG("Path does not exist\n");
-    ifree(newtag);
-    ifree(cp_orig);
-    ifree(cpar_orig);
+    afree(newtag);
+    afree(cp_orig);
+    afree(cpar_orig);
     return -ENOENT;
   }
 
@@ -947,20 +1255,20 @@ static int insight_mkdir(const char *path, mode_t mode) {
     last_char_in(canon_path)='\0';
     subtag=1;
   }
-  ifree(cp_orig);
+  afree(cp_orig);
 
   if (*parent_tag && (tree_root=get_tag(parent_tag))==0) {
     DEBUG("Tag \"%s\" not found", parent_tag);
-    ifree(newtag);
-    ifree(cpar_orig);
+    afree(newtag);
+    afree(cpar_orig);
     return -ENOENT;
   }
   DEBUG("Found tag \"%s\"; tree root now %lu", parent_tag, tree_root);
 
   if (tree_sub_search(tree_root, newdir)) {
     DEBUG("Tag \"%s\" already exists in parent \"%s\"\n", newdir, parent_tag);
-    ifree(newtag);
-    ifree(cpar_orig);
+    afree(newtag);
+    afree(cpar_orig);
     return -EEXIST;
   }
 
@@ -969,34 +1277,34 @@ static int insight_mkdir(const char *path, mode_t mode) {
   DEBUG("Creating tag \"%s\"", newtag);
   if (!tag_ensure_create(newtag)) {
     PMSG(LOG_ERR, "Tree insertion failed");
-    ifree(newtag);
-    ifree(cpar_orig);
+    afree(newtag);
+    afree(cpar_orig);
     return -ENOSPC;
   }
 
   DEBUG("Successfully inserted \"%s\" into parent \"%s\"", newdir, parent_tag);
 
-  ifree(cpar_orig);
-  ifree(newtag);
+  afree(cpar_orig);
+  afree(newtag);
   return 0;
 }
 
 static int insight_rmdir(const char *path) {
-  char *olddir = strlast(path, '/');
-  char *dup = strdup(path);
+  char *olddir = strlast_arena(path, '/');
+  char *dup = arena_strdup(path);
   char *canon_parent = rindex(dup, '/');
   *canon_parent='\0';
-  canon_parent = get_canonical_path(dup);
+  canon_parent = get_canonical_path_arena(dup);
   char *cp_orig = canon_parent; /* for freeing */
-  ifree(dup);
+  afree(dup);
 
   if (canon_parent[0]=='/')
     canon_parent++;
 
   if (strcmp(olddir, INSIGHT_SUBKEY_IND)==0) {
     PMSG(LOG_WARNING, "Cannot remove directories named \"%s\"\n", INSIGHT_SUBKEY_IND);
-    ifree(cp_orig);
-    ifree(olddir);
+    afree(cp_orig);
+    afree(olddir);
     return -EPERM;
   }
 
@@ -1007,8 +1315,8 @@ static int insight_rmdir(const char *path) {
 
   if (!*olddir) {
     DEBUG("Invalid (empty) directory name\n");
-    ifree(cp_orig);
-    ifree(olddir);
+    afree(cp_orig);
+    afree(olddir);
     return -EPERM;
   }
 
@@ -1016,8 +1324,8 @@ static int insight_rmdir(const char *path) {
 
   if (!validate_path(canon_parent)) {
     DEBUG("Path does not exist\n");
-    ifree(cp_orig);
-    ifree(olddir);
+    afree(cp_orig);
+    afree(olddir);
     return -ENOENT;
   }
 
@@ -1035,44 +1343,88 @@ static int insight_rmdir(const char *path) {
 
   if (*parent_tag && (tree_root=get_tag(parent_tag))==0) {
     DEBUG("Tag \"%s\" not found\n", parent_tag);
-    ifree(cp_orig);
-    ifree(olddir);
+    afree(cp_orig);
+    afree(olddir);
     return -ENOENT;
   }
   DEBUG("Found tag \"%s\"; tree root now %lu", parent_tag, tree_root);
 
-  if (!tree_sub_search(tree_root, olddir)) {
+  fileptr tagblock=tree_sub_search(tree_root, olddir);
+  if (!tagblock) {
     DEBUG("Tag \"%s\" does not exist in parent \"%s\"\n", olddir, parent_tag);
-    ifree(cp_orig);
-    ifree(olddir);
+    afree(cp_orig);
+    afree(olddir);
     return -ENOENT;
   }
 
+  tdata dnode;
+  if (tree_read(tagblock, (tblock*)&dnode)) {
+    PMSG(LOG_ERR, "IO error reading data block");
+    afree(cp_orig);
+    afree(olddir);
+    return -EIO;
+  }
+  if (dnode.subkeys) {
+    DEBUG("Tag \"%s\" still has subtags\n", olddir);
+    afree(cp_orig);
+    afree(olddir);
+    return -ENOTEMPTY;
+  }
+
+  /* untag the files first, so that no inode keeps a reference to the tag's
+   * data block once it is freed and reused */
+  int res=inode_get_all(tagblock, NULL, 0);
+  if (res>0) {
+    fileptr *inodes = arena_calloc(res, sizeof(fileptr));
+    int count = res, i;
+    if (!inodes) {
+      res = -ENOMEM;
+    } else {
+      res = inode_get_all(tagblock, inodes, count);
+      for (i=0; !res && i<count; i++) {
+        DEBUG("Untagging inode %08lx", inodes[i]);
+        res = attr_del(inodes[i], tagblock);
+      }
+      afree(inodes);
+    }
+  }
+  if (res<0) {
+    PMSG(LOG_ERR, "Failed to untag files: %s\n", strerror(-res));
+    afree(cp_orig);
+    afree(olddir);
+    return res;
+  }
+
   DEBUG("About to remove \"%s\" from parent \"%s\"", olddir, parent_tag);
 
-  int res=tree_sub_remove(tree_root, olddir);
+  if (tag_stats_remove(tagblock)) {
+    PMSG(LOG_WARNING, "Could not discard statistics of tag %lu", tagblock);
+  }
+  res=tree_sub_remove(tree_root, olddir);
 
   if (res<0) {
     PMSG(LOG_ERR, "Tree removal failed with error: %s\n", strerror(-res));
-    ifree(cp_orig);
-    ifree(olddir);
+    afree(cp_orig);
+    afree(olddir);
     return res;
   } else if (res) {
     PMSG(LOG_ERR, "IO error: Tree removal failed\n");
-    ifree(cp_orig);
-    ifree(olddir);
+    afree(cp_orig);
+    afree(olddir);
     return -EIO;
   }
   DEBUG("Successfully removed \"%s\" from parent \"%s\"\n", olddir, parent_tag);
-  ifree(cp_orig);
-  ifree(olddir);
+  tag_dict_invalidate();
+  tag_cache_invalidate();
+  afree(cp_orig);
+  afree(olddir);
 
   return 0;
 }
 
 static int insight_unlink(const char *path) {
   unsigned long hash;
-  char *canon_path = get_canonical_path(path);
+  char *canon_path = get_canonical_path_arena(path);
 
   /* TODO: check paths are valid and exist! */
 
@@ -1080,13 +1432,13 @@ static int insight_unlink(const char *path) {
 
   if (!*canon_path) {
     FMSG(LOG_ERR, "Asked to unlink file with null path!");
-    ifree(canon_path);
+    afree(canon_path);
     return -EINVAL;
   }
 
   if (strcount(canon_path+1, '/')>1) {
     DEBUG("Only makes sense to remove from single-level directories");
-    ifree(canon_path);
+    afree(canon_path);
     return -EPERM;
   }
 
@@ -1096,10 +1448,13 @@ static int insight_unlink(const char *path) {
 
   fileptr attrid=0;
   int count;
-  char **bits = strsplit(canon_path, '/', &count);
+  char **bits = strsplit_arena(canon_path, '/', &count);
+  if (!bits) {
+    afree(canon_path);
+    return -ENOMEM;
+  }
 
-  while (!*(bits[count-1])) {
-    ifree(bits[count-1]);
+  while (count && !*(bits[count-1])) {
     count--;
   }
 
@@ -1116,11 +1471,8 @@ static int insight_unlink(const char *path) {
     attrid=0;
   }
 
-  for (count--;count>=0; count--) {
-    ifree(bits[count]);
-  }
-  ifree(bits);
-  ifree(canon_path);
+  afree(bits);
+  afree(canon_path);
 
   /* remove attribute */
   int res = attr_del(hash, attrid);
@@ -1141,14 +1493,15 @@ static int insight_mknod(const char *path, mode_t mode, dev_t rdev) {
     return -EPERM;
   }
 
-  char *canon_path = get_canonical_path(path)+1;
+  char *canon_path = get_canonical_path_arena(path)+1;
 
   DEBUG("Mknod: \"%s\"", canon_path);
   int res=0;
   int count;
-  char **bits = strsplit(canon_path, '/', &count);
+  char **bits = strsplit_arena(canon_path, '/', &count);
   canon_path--;
-  ifree(canon_path);
+  afree(canon_path);
+  if (!bits) return -ENOMEM;
 
   if (count<2) {
     DEBUG("Need a tag");
@@ -1175,10 +1528,7 @@ static int insight_mknod(const char *path, mode_t mode, dev_t rdev) {
     }
   }
 
-  for (count--;count>=0; count--) {
-    ifree(bits[count]);
-  }
-  ifree(bits);
+  afree(bits);
   return res;
 }
 
@@ -1191,7 +1541,7 @@ static int insight_rename(const char *from, const char *to) {
 }
 
 static int insight_readlink(const char *path, char *buf, size_t size) {
-  char *canon_path = get_canonical_path(path);
+  char *canon_path = get_canonical_path_arena(path);
   if (errno) {
     DEBUG("Error in get_canonical_path.");
     return -ENOENT;
@@ -1289,6 +1639,8 @@ static int insight_symlink(const char *from, const char *to) {
     PMSG(LOG_ERR, "IO error: Failed to insert inode into tree: %s", strerror(errno));
     return -EIO;
   }
+  /* expressions naming the file no longer parse the same way */
+  query_parse_cache_clear();
 
   DEBUG("Calling plugins for attribute assignments...");
   /* TODO: check result - not that there's much we can do */
@@ -1350,8 +1702,8 @@ static int insight_symlink(const char *from, const char *to) {
 
 static int insight_link(const char *from, const char *to) {
   unsigned long hash;
-  char *canon_from = get_canonical_path(from+1);
-  char *canon_to   = get_canonical_path(to)+1;
+  char *canon_from = get_canonical_path_arena(from+1);
+  char *canon_to   = get_canonical_path_arena(to)+1;
 
   /* TODO: check paths are valid and exist! */
 
@@ -1367,23 +1719,21 @@ static int insight_link(const char *from, const char *to) {
     return -EPERM;
   }
 
-  char *last_bit = strlast(canon_from, '/');
+  char *last_bit = strlast_arena(canon_from, '/');
   /* calculate an inode number for the path */
   DEBUG("Hashing \"%s\"...", last_bit);
   hash = hash_path(last_bit);
-  ifree(canon_from);
+  afree(canon_from);
 
   int count;
-  char **bits = strsplit(canon_to, '/', &count);
+  char **bits = strsplit_arena(canon_to, '/', &count);
+  if (!bits) return -ENOMEM;
 
   DEBUG("Getting block for \"%s\"", bits[count-2]);
   fileptr attrid = get_tag(bits[count-2]);
   DEBUG("Block for \"%s\" is %lu", bits[count-2], attrid);
 
-  for (count--;count>=0; count--) {
-    ifree(bits[count]);
-  }
-  ifree(bits);
+  afree(bits);
 
   /* isnert attribute */
   int res = attr_add(hash, attrid);
@@ -1393,19 +1743,17 @@ static int insight_link(const char *from, const char *to) {
     return res;
   }
 
-  /* XXX: segfaults */
-  /* ifree(canon_from); */
-  /* ifree(canon_to); */
+  /* canon_to is offset into its allocation, which goes with the request */
 
   return 0;
 }
 
 static int insight_chmod(const char *path, mode_t mode) {
-  char *canon_path = get_canonical_path(path);
+  char *canon_path = get_canonical_path_arena(path);
 
   DEBUG("Change mode of \"%s\" to %05o", canon_path, mode & 07777);
 
-  char *last = strlast(canon_path+1, '/');
+  char *last = strlast_arena(canon_path+1, '/');
   unsigned long hash = hash_path(last);
 
   if (have_file_by_hash(hash)) {
@@ -1420,22 +1768,23 @@ static int insight_chmod(const char *path, mode_t mode) {
       return 0;
     }
   } else if (validate_path(canon_path)) {
-    char *last_tag = strlast(canon_path, '/');
+    char *last_tag = strlast_arena(canon_path, '/');
     int is_sticky = (mode & S_ISVTX);
     DEBUG("%setting nosub bit of tag: %s", is_sticky?"S":"Uns", last_tag);
     int tagblock = get_tag(last_tag);
     if (!tagblock) {
       PMSG(LOG_ERR, "Serious problem. Valid path but tag not found.");
-      ifree(last_tag);
+      afree(last_tag);
       return -EIO;
     }
 
     tdata dblock;
     if (tree_read(tagblock, (tblock*)&dblock)) {
       PMSG(LOG_ERR, "I/O error reading block");
-      ifree(last_tag);
+      afree(last_tag);
       return -EIO;
     }
+    int was_sticky = (dblock.flags & DATA_FLAGS_NOSUB) ? 1 : 0;
     if (is_sticky) {
       SET_FLAG(dblock.flags, DATA_FLAGS_NOSUB);
     } else {
@@ -1443,12 +1792,14 @@ static int insight_chmod(const char *path, mode_t mode) {
     }
     if (tree_write(tagblock, (tblock*)&dblock)) {
       PMSG(LOG_ERR, "I/O error writing block");
-      ifree(last_tag);
+      afree(last_tag);
       return -EIO;
     }
+    /* parsed expressions using the tag now have the wrong kind of term */
+    if (was_sticky != !!is_sticky) query_parse_cache_clear();
 
     DEBUG("Cannot really change mode of directories though");
-    ifree(last_tag);
+    afree(last_tag);
     return 0;
   } else {
     DEBUG("Could not find path");
@@ -1457,11 +1808,11 @@ static int insight_chmod(const char *path, mode_t mode) {
 }
 
 static int insight_chown(const char *path, uid_t uid, gid_t gid) {
-  char *canon_path = get_canonical_path(path);
+  char *canon_path = get_canonical_path_arena(path);
 
   DEBUG("Change ownership of \"%s\" to %d:%d", canon_path, uid, gid);
 
-  char *last = strlast(canon_path+1, '/');
+  char *last = strlast_arena(canon_path+1, '/');
   unsigned long hash = hash_path(last);
 
   if (have_file_by_hash(hash)) {
@@ -1485,11 +1836,11 @@ static int insight_chown(const char *path, uid_t uid, gid_t gid) {
 }
 
 static int insight_truncate(const char *path, off_t size) {
-  char *canon_path = get_canonical_path(path);
+  char *canon_path = get_canonical_path_arena(path);
 
   DEBUG("Truncate \"%s\" to %lld bytes", canon_path, size);
 
-  char *last = strlast(canon_path+1, '/');
+  char *last = strlast_arena(canon_path+1, '/');
   unsigned long hash = hash_path(last);
 
   if (have_file_by_hash(hash)) {
@@ -1515,11 +1866,11 @@ static int insight_truncate(const char *path, off_t size) {
 #if FUSE_VERSION >= 26
 
 static int insight_utimens(const char *path, const struct timespec ts[2]) {
-  char *canon_path = get_canonical_path(path);
+  char *canon_path = get_canonical_path_arena(path);
 
   DEBUG("Changing times of \"%s\"", path);
 
-  char *last = strlast(canon_path+1, '/');
+  char *last = strlast_arena(canon_path+1, '/');
   unsigned long hash = hash_path(last);
 
   if (have_file_by_hash(hash)) {
@@ -1533,24 +1884,24 @@ static int insight_utimens(const char *path, const struct timespec ts[2]) {
     if (utimes(fullname, tv)==-1) {
       PMSG(LOG_ERR, "utimes(\"%s\", tv) failed: %s", fullname, strerror(errno));
       ifree(fullname);
-      ifree(last);
-      ifree(canon_path);
+      afree(last);
+      afree(canon_path);
       return -errno;
     } else {
       ifree(fullname);
-      ifree(last);
-      ifree(canon_path);
+      afree(last);
+      afree(canon_path);
       return 0;
     }
   } else if (validate_path(canon_path)) {
     DEBUG("Cannot change times of directories");
-    ifree(last);
-    ifree(canon_path);
+    afree(last);
+    afree(canon_path);
     return -EPERM;
   } else {
     DEBUG("Could not find path");
-    ifree(last);
-    ifree(canon_path);
+    afree(last);
+    afree(canon_path);
     return -ENOENT;
   }
 }
@@ -1558,12 +1909,12 @@ static int insight_utimens(const char *path, const struct timespec ts[2]) {
 #else
 
 static int insight_utime(const char *path, struct utimbuf *buf) {
-  char *canon_path = get_canonical_path(path);
+  char *canon_path = get_canonical_path_arena(path);
 
   DEBUG("Changing times of \"%s\"", path);
 
 
-  if (have_file_by_name(strlast(canon_path+1, '/'))) {
+  if (have_file_by_name(strlast_arena(canon_path+1, '/'))) {
     char *fullname = fullname_from_inode(hash_path(canon_path+1));
     DEBUG("Change times of real file: %s", fullname);
     if (utime(fullname, buf)==-1) {
@@ -1587,11 +1938,11 @@ static int insight_utime(const char *path, struct utimbuf *buf) {
 
 static int insight_open(const char *path, struct fuse_file_info *fi) {
   profile_init_start();
-  char *canon_path = get_canonical_path(path);
+  char *canon_path = get_canonical_path_arena(path);
 
   DEBUG("Open on path \"%s\"", canon_path);
 
-  char *last = strlast(canon_path, '/');
+  char *last = strlast_arena(canon_path, '/');
 
   DEBUG("Last returned \"%s\"", last);
 
@@ -1601,33 +1952,33 @@ static int insight_open(const char *path, struct fuse_file_info *fi) {
     DEBUG("Opening real file: %s", fullname);
     if ((res=open(fullname, fi->flags|O_RDONLY))==-1) {
       PMSG(LOG_ERR, "open(\"%s\", %d) failed: %s", fullname, fi->flags, strerror(errno));
-      ifree(last);
+      afree(last);
       ifree(fullname);
-      ifree(canon_path);
+      afree(canon_path);
       profile_stop();
       return -errno;
     } else {
       DEBUG("Open succeeded; closing file");
       close(res);
       DEBUG("Closed, freeing last");
-      ifree(last);
+      afree(last);
       DEBUG("Freeing fullname");
       ifree(fullname);
-      ifree(canon_path);
+      afree(canon_path);
       DEBUG("Done");
       profile_stop();
       return 0;
     }
   } else if (validate_path(canon_path)) {
     PMSG(LOG_ERR, "Cannot open directories like files!");
-    ifree(last);
-    ifree(canon_path);
+    afree(last);
+    afree(canon_path);
     profile_stop();
     return -EISDIR;
   } else {
     DEBUG("Could not find path");
-    ifree(last);
-    ifree(canon_path);
+    afree(last);
+    afree(canon_path);
     profile_stop();
     return -ENOENT;
   }
@@ -1635,11 +1986,11 @@ static int insight_open(const char *path, struct fuse_file_info *fi) {
 
 static int insight_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
   profile_init_start();
-  char *canon_path = get_canonical_path(path);
+  char *canon_path = get_canonical_path_arena(path);
 
   //DEBUG("Read on path \"%s\"", canon_path);
 
-  char *last = strlast(canon_path, '/');
+  char *last = strlast_arena(canon_path, '/');
 
   if (have_file_by_name(last)) {
     unsigned long hash = hash_path(last);
@@ -1649,8 +2000,8 @@ static int insight_read(const char *path, char *buf, size_t size, off_t offset,
     if ((fd=open(fullname, fi->flags|O_RDONLY))==-1) {
       PMSG(LOG_ERR, "open(\"%s\", %d) failed: %s", fullname, fi->flags, strerror(errno));
       ifree(fullname);
-      ifree(last);
-      ifree(canon_path);
+      afree(last);
+      afree(canon_path);
       profile_stop();
       return -errno;
     } else {
@@ -1659,21 +2010,21 @@ static int insight_read(const char *path, char *buf, size_t size, off_t offset,
       tmp_errno=errno;
       close(fd);
       ifree(fullname);
-      ifree(last);
-      ifree(canon_path);
+      afree(last);
+      afree(canon_path);
       profile_stop();
       return (res==-1)?-tmp_errno:res;
     }
   } else if (validate_path(canon_path)) {
     PMSG(LOG_ERR, "Cannot read directories like files!");
-    ifree(last);
-    ifree(canon_path);
+    afree(last);
+    afree(canon_path);
     profile_stop();
     return -EISDIR;
   } else {
     DEBUG("Could not find path");
-    ifree(last);
-    ifree(canon_path);
+    afree(last);
+    afree(canon_path);
     profile_stop();
     return -ENOENT;
   }
@@ -1681,11 +2032,11 @@ static int insight_read(const char *path, char *buf, size_t size, off_t offset,
 
 static int insight_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
   profile_init_start();
-  char *canon_path = get_canonical_path(path);
+  char *canon_path = get_canonical_path_arena(path);
 
   //DEBUG("Write on path \"%s\"", canon_path);
 
-  char *last = strlast(canon_path, '/');
+  char *last = strlast_arena(canon_path, '/');
 
   if (have_file_by_name(last)) {
     unsigned long hash = hash_path(last);
@@ -1695,8 +2046,8 @@ static int insight_write(const char *path, const char *buf, size_t size, off_t o
     if ((fd=open(fullname, fi->flags|O_WRONLY))==-1) {
       PMSG(LOG_ERR, "open(\"%s\", %d) failed: %s", fullname, fi->flags, strerror(errno));
       ifree(fullname);
-      ifree(last);
-      ifree(canon_path);
+      afree(last);
+      afree(canon_path);
       profile_stop();
       return -errno;
     } else {
@@ -1705,21 +2056,21 @@ static int insight_write(const char *path, const char *buf, size_t size, off_t o
       tmp_errno=errno;
       close(fd);
       ifree(fullname);
-      ifree(last);
-      ifree(canon_path);
+      afree(last);
+      afree(canon_path);
       profile_stop();
       return (res==-1)?-tmp_errno:res;
     }
   } else if (validate_path(canon_path)) {
     PMSG(LOG_ERR, "Cannot write to directories like files!");
-    ifree(last);
-    ifree(canon_path);
+    afree(last);
+    afree(canon_path);
     profile_stop();
     return -EISDIR;
   } else {
     DEBUG("Could not find path");
-    ifree(last);
-    ifree(canon_path);
+    afree(last);
+    afree(canon_path);
     profile_stop();
     return -ENOENT;
   }
@@ -1775,8 +2126,8 @@ static int insight_access(const char *path, int mode) {
 #ifdef HAVE_SETXATTR
 /* xattr operations are optional and can safely be left unimplemented */
 static int insight_setxattr(const char *path, const char *name, const char *value, size_t size, int flags) {
-  char *canon_path = get_canonical_path(path);
-  char *last = strlast(canon_path+1, '/');
+  char *canon_path = get_canonical_path_arena(path);
+  char *last = strlast_arena(canon_path+1, '/');
 
   DEBUG("Set \"%s\" extended attribute of \"%s\"", name, canon_path);
 
@@ -1784,7 +2135,7 @@ static int insight_setxattr(const char *path, const char *name, const char *valu
   if (have_file_by_name(last)) {
     fileptr inode = hash_path(last);
     char *fullname = fullname_from_inode(inode);
-    ifree(last);
+    afree(last);
     if (strncmp(name, "insight.", 8)==0) {
       DEBUG("Insight namespace attribute");
       char *attr = calloc(strlen(name)+strlen(value)+1, sizeof(char)); /* TODO: check for failure */
@@ -1812,47 +2163,50 @@ static int insight_setxattr(const char *path, const char *name, const char *valu
           PMSG(LOG_ERR, "setxattr(\"%s\", \"%s\", ...) failed: %s", fullname, name, strerror(errno));
         }
         ifree(fullname);
-        ifree(canon_path);
+        afree(canon_path);
         return -errno;
       } else {
         ifree(fullname);
-        ifree(canon_path);
+        afree(canon_path);
         return res;
       }
     }
   } else if (validate_path(canon_path)) {
     DEBUG("Cannot set extended attributes on directories");
-    ifree(last);
-    ifree(canon_path);
+    afree(last);
+    afree(canon_path);
     return -EPERM;
   } else {
     DEBUG("Could not find path");
-    ifree(last);
-    ifree(canon_path);
+    afree(last);
+    afree(canon_path);
     return -ENOENT;
   }
 }
 
 static int insight_getxattr(const char *path, const char *name, char *value, size_t size) {
-  char *canon_path = get_canonical_path(path);
-  char *last = strlast(canon_path+1, '/');
+  char *canon_path = get_canonical_path_arena(path);
+  char *last = strlast_arena(canon_path+1, '/');
   DEBUG("Get \"%s\" extended attribute of \"%s\"", name, canon_path);
 
 
   if (have_file_by_name(last)) {
-    char *fullname = fullname_from_inode(hash_path(last));
-    ifree(last);
+    fileptr inode = hash_path(last);
+    char *fullname = fullname_from_inode(inode);
+    afree(last);
     if (strcmp(name, "insight")==0) {
       DEBUG("Insight namespace; no value\n");
       ifree(fullname);
-      ifree(canon_path);
+      afree(canon_path);
       return 0;
     } else if (strncmp(name, "insight.", 8)==0) {
       DEBUG("Insight attribute; no value\n");
-      /* TODO: check the attribute name is actually valid and applied to the file */
+      fileptr attrid = get_tag(name+8);
+      int res = attrid ? inode_has_tag(inode, attrid) : 0;
       ifree(fullname);
-      ifree(canon_path);
-      return 0;
+      afree(canon_path);
+      if (res<0) return -EIO;
+      return res ? 0 : -ENODATA;
     } else {
       DEBUG("Get attribute of real file: %s", fullname);
       int res = getxattr(fullname, name, value, size);
@@ -1862,38 +2216,39 @@ static int insight_getxattr(const char *path, const char *name, char *value, siz
           PMSG(LOG_ERR, "getxattr(\"%s\", \"%s\", ...) failed: %s\n", fullname, name, strerror(errno));
         }
         ifree(fullname);
-        ifree(canon_path);
+        afree(canon_path);
         return -errno;
       } else {
         DEBUG("\n");
         ifree(fullname);
-        ifree(canon_path);
+        afree(canon_path);
         return res;
       }
     }
   } else if (validate_path(canon_path)) {
     DEBUG("Cannot get extended attributes on directories\n");
-    ifree(last);
-    ifree(canon_path);
+    afree(last);
+    afree(canon_path);
     /* No attributes */
     return -ENODATA;
   } else {
     DEBUG("Could not find path\n");
-    ifree(last);
-    ifree(canon_path);
+    afree(last);
+    afree(canon_path);
     return -ENOENT;
   }
 }
 
 static int insight_listxattr(const char *path, char *list, size_t size) {
-  char *canon_path = get_canonical_path(path);
-  char *last = strlast(canon_path+1, '/');
+  char *canon_path = get_canonical_path_arena(path);
+  char *last = strlast_arena(canon_path+1, '/');
   DEBUG("List extended attributes of \"%s\"", canon_path);
 
 
   if (have_file_by_name(last)) {
-    char *fullname = fullname_from_inode(hash_path(last));
-    ifree(last);
+    fileptr inode = hash_path(last);
+    char *fullname = fullname_from_inode(inode);
+    afree(last);
 #ifdef _DEBUG
     if (!list || !size)
       DEBUG("Finding length of attribute list");
@@ -1904,7 +2259,7 @@ static int insight_listxattr(const char *path, char *list, size_t size) {
     if (res==-1 && errno != ENOTSUP && errno != ERANGE) {
       PMSG(LOG_ERR, "listxattr(\"%s\", ...) failed: %s\n", fullname, strerror(errno));
       ifree(fullname);
-      ifree(canon_path);
+      afree(canon_path);
       return -errno;
     } else {
 #ifdef _DEBUG
@@ -1914,81 +2269,67 @@ static int insight_listxattr(const char *path, char *list, size_t size) {
         DEBUG("Total size of attribute names: %d", res);
 #endif
       if (res<0) res=0;
-      /* TODO: get list of attributes applied to file and their names */
-      if (list && size>=(size_t)res) {
+      if (list && size>=(size_t)res+sizeof("insight")) {
         strcpy(&list[res], "insight");
       }
       res += strlen("insight") + 1;
 
-      char *last = strlast(canon_path, '/');
-      char s_hash[9];
-      hex_to_string(s_hash, hash_path(last));
-      DEBUG("Searching inode tree for inode %s", s_hash);
-      fileptr piblock = tree_sub_search(tree_get_iroot(), s_hash);
-
-      if (!piblock) {
-        PMSG(LOG_ERR, "Could not find inode in tree!");
-        ifree(last);
-        ifree(fullname);
-        ifree(canon_path);
-        return -EBADF;
-      }
-
-      DEBUG("Found block %d", piblock);
-
-      fileptr *inodes = NULL;
-      int i, count = inode_get_all(piblock, NULL, 0);
-      if (count==0) {
-        DEBUG("No attributes for inode");
-        ifree(last);
+      DEBUG("Fetching tags of inode %08lX", inode);
+      int i, count;
+      fileptr *tags = tags_from_inode(inode, &count);
+      if (!tags) {
         ifree(fullname);
-        ifree(canon_path);
-        return res;
-      } else if (count<0) {
-        DEBUG("Error!");
-        ifree(last);
-        ifree(fullname);
-        ifree(canon_path);
-        return count;
+        afree(canon_path);
+        return -EIO;
       }
 
-      inodes = calloc(count, sizeof(fileptr));
-      inode_get_all(piblock, inodes, count);
       for (i=0; i<count; i++) {
-        DEBUG("Attribute %08lx", inodes[i]);
+        char *tag = tree_get_full_key(tags[i]);
+        if (!tag) continue;
+        size_t len = strlen("insight.") + strlen(tag) + 1;
+        DEBUG("Attribute %08lx: %s", tags[i], tag);
+        if (list && size>=res+len) {
+          strcpy(&list[res], "insight.");
+          strcat(&list[res], tag);
+        }
+        res += len;
+        ifree(tag);
       }
-      ifree(inodes);
+      ifree(tags);
 
-      ifree(last);
       ifree(fullname);
-      ifree(canon_path);
+      afree(canon_path);
+      if (list && size && size<(size_t)res) {
+        DEBUG("Attribute list buffer too small");
+        return -ERANGE;
+      }
       DEBUG("\n");
       return res;
     }
   } else if (validate_path(canon_path)) {
     DEBUG("Cannot list extended attributes on directories");
-    ifree(last);
-    ifree(canon_path);
+    afree(last);
+    afree(canon_path);
     /* No attributes */
     return -ENODATA;
   } else {
     DEBUG("Could not find path");
-    ifree(last);
-    ifree(canon_path);
+    afree(last);
+    afree(canon_path);
     return -ENOENT;
   }
 }
 
 static int insight_removexattr(const char *path, const char *name) {
-  char *canon_path = get_canonical_path(path);
-  char *last = strlast(canon_path+1, '/');
+  char *canon_path = get_canonical_path_arena(path);
+  char *last = strlast_arena(canon_path+1, '/');
   DEBUG("Remove extended attribute \"%s\" of \"%s\"", name, canon_path);
 
 
   if (have_file_by_name(last)) {
     fileptr inode = hash_path(last);
     char *fullname = fullname_from_inode(inode);
-    ifree(last);
+    afree(last);
     if (strncmp(name, "insight.", 8)==0) {
       DEBUG("Insight namespace attribute");
       DEBUG("Remove Insight attribute \"%s\" of inode: %08lx", name+8, inode);
@@ -2006,23 +2347,23 @@ static int insight_removexattr(const char *path, const char *name) {
           PMSG(LOG_ERR, "removexattr(\"%s\", \"%s\") failed: %s", fullname, name, strerror(errno));
         }
         ifree(fullname);
-        ifree(canon_path);
+        afree(canon_path);
         return -errno;
       } else {
         ifree(fullname);
-        ifree(canon_path);
+        afree(canon_path);
         return res;
       }
     }
   } else if (validate_path(canon_path)) {
     DEBUG("Cannot remove extended attributes on directories");
-    ifree(last);
-    ifree(canon_path);
+    afree(last);
+    afree(canon_path);
     return -EPERM;
   } else {
     DEBUG("Could not find path");
-    ifree(last);
-    ifree(canon_path);
+    afree(last);
+    afree(canon_path);
     return -ENOENT;
   }
 
@@ -2050,6 +2391,9 @@ void insight_destroy(void *arg) {
   (void) arg;
   profile_init_start();
 	DEBUG("Cleaning up and exiting");
+  query_view_clear();
+  query_cache_clear();
+  query_parse_cache_clear();
   tree_close();
 	DEBUG("Tree store closed");
   profile_stop();
@@ -2082,6 +2426,8 @@ void usage(char *progname) {
     "    -r              Mount readonly\n"
     "    --store=PATH    Path to tree storage file\n"
     "    --repos=PATH    Path to symlink storage repository\n"
+    "    --view=PATH     Keep the listing of PATH up to date incrementally\n"
+    "                    (may be given more than once)\n"
     /* "    -v              Verbose (only has effect with syslog)\n" */
     "\n" /* FUSE options will follow... */
     , PACKAGE_VERSION, FUSE_USE_VERSION, progname
@@ -2113,6 +2459,21 @@ static int insight_opt_proc(void *data, const char *arg, int key, struct fuse_ar
       profile_stop();
       exit(1);
 
+    case KEY_VIEW:
+      {
+        char **tmp = realloc(insight.views, (insight.view_count+1) * sizeof(char*));
+        if (!tmp || !(tmp[insight.view_count] = strdup(arg + strlen("--view=")))) {
+          fprintf(stderr, "Out of memory\n");
+          if (tmp) insight.views = tmp;
+          profile_stop();
+          return -1;
+        }
+        insight.views = tmp;
+        insight.view_count++;
+      }
+      profile_stop();
+      return 0;
+
     case KEY_VERSION:
       fprintf(stderr, "Insight semantic filesystem for Linux %s (unstable)\n", VERSION);
 #if FUSE_VERSION >= 25
@@ -2451,6 +2812,8 @@ int main(int argc, char *argv[]) {
   insight.funcs.del_tag = attr_delbyname;
   insight.funcs.del_auto_tag = auto_attr_delbyname;
   insight.funcs.get_inode = hash_path;
+  insight.funcs.add_tags = attr_addbynames_rec;
+  insight.funcs.tag_files = attr_tag_files_rec;
   insight.funcs.log = insight_log;
 
   /* load plugins */
@@ -2474,6 +2837,16 @@ int main(int argc, char *argv[]) {
     plugin_load_all(plugin_dir);
   }
 
+  /* register materialised views */
+  int i;
+  for (i=0; i<insight.view_count; i++) {
+    if ((res = query_view_add(insight.views[i]))) {
+      MSG(LOG_WARNING, "Could not register view %s: %s", insight.views[i], strerror(-res));
+    } else if (!insight.quiet) {
+      MSG(LOG_INFO, "Registered view %s", insight.views[i]);
+    }
+  }
+
   /*
   FMSG(LOG_DEBUG, "Fuse options:");
   int fargc = args.argc;
@@ -2497,6 +2870,10 @@ int main(int argc, char *argv[]) {
   ifree(insight.mountpoint);
   ifree(insight.treestore);
   ifree(insight.repository);
+  for (i=0; i<insight.view_count; i++) {
+    ifree(insight.views[i]);
+  }
+  if (insight.views) ifree(insight.views);
 
   return res;
 }
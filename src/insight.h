@@ -57,6 +57,7 @@
 #include <dirent.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -123,6 +124,8 @@ struct insight {
   char  *repository;     /**< Path to the symlink repository */
   size_t repository_len; /**< Length of "repository" (for speed) */
   struct stat mountstat; /**< lstat() results for mountpoint */
+  char **views;          /**< Paths to register as materialised views */
+  int    view_count;     /**< Number of paths in "views" */
   struct insight_plugin *plugins; /**< Linked list of plugins */
   struct insight_funcs funcs; /**< Set of functions for export to plugins */
 };
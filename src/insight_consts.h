@@ -50,4 +50,22 @@
 /** Character used to indicate subkey to follow (e.g. the ":" in "/type:") */
 #define INSIGHT_SUBKEY_IND_C ':'
 
+/** Characters that make a path component a query expression (e.g. "/(jazz|blues)&!live") */
+#define INSIGHT_EXPR_CHARS "()|&!"
+
+/** Character joining two query expression terms that must both match */
+#define INSIGHT_EXPR_AND_C '&'
+
+/** Character joining two query expression terms of which one must match */
+#define INSIGHT_EXPR_OR_C '|'
+
+/** Character negating a query expression term */
+#define INSIGHT_EXPR_NOT_C '!'
+
+/** Character opening a parenthesised query expression */
+#define INSIGHT_EXPR_OPEN_C '('
+
+/** Character closing a parenthesised query expression */
+#define INSIGHT_EXPR_CLOSE_C ')'
+
 #endif
@@ -66,6 +66,9 @@ typedef struct insight_funcs {
   fileptr (*get_inode)(const char *);          /**< Retrieve the inode for a given file name/path */
 
   void (*log)(int, const char*, ...);          /**< Logging function (i.e. insight_log()) */
+
+  int (*add_tags)(fileptr, const char **, int);   /**< Apply several generic tags to a file in one operation. */
+  int (*tag_files)(const char *, fileptr *, int); /**< Apply a generic tag to several files in one operation. */
 } insight_funcs;
 
 /** Plugin cannot perform the action */
@@ -36,6 +36,9 @@
 #include <string_helpers.h>
 #include <path_helpers.h>
 #include <set_ops.h>
+#include <arena.h>
+#include <tag_dict.h>
+#include <tag_cache.h>
 
 /**
  * Create canonical path from the argument. A canonical path contains no
@@ -48,77 +51,83 @@
  * Each of these is converted to the canonical form <tt>/tag`subtag/</tt>. This
  * function also removes any leading or trailing slashes.
  *
+ * The result is allocated from the request arena, and should be released with
+ * afree().
+ *
  * @param path The path to be made canonical.
  * @returns The canonical version of \a path.
  */
-char *get_canonical_path(const char *path) {
+char *get_canonical_path_arena(const char *path) {
   errno=0;
 
   DEBUG("Path to canonicalise: %s", path);
 
   /* if there are no subkey indicators or it's empty, then it is trivially canonical. */
-  if (!path || !strlen(path) || !strstr(path, INSIGHT_SUBKEY_IND)) {
+  if (!path || !*path || !strchr(path, INSIGHT_SUBKEY_IND_C)) {
     DEBUG("Path already canonical");
-    return strdup(path);
+    return path ? arena_strdup(path) : NULL;
   }
 
-  int slashcount;
-  char **bits = strsplit((char*)(path+1), '/', &slashcount);
-
-  char *tmp=calloc(strlen(path)+1, sizeof(char));
+  /* every component grows by at most its leading separator */
+  size_t pathlen = strlen(path);
+  char *tmp=arena_alloc(pathlen+2);
+  char *out=tmp;
+  if (!tmp) {
+    PMSG(LOG_ERR, "Failed to allocate memory for canonical path");
+    errno=ENOMEM;
+    return NULL;
+  }
 
-  int i, prevsub=0;
-  for (i=0; i<slashcount; i++) {
-    DEBUG("Examining bits[%d] = \"%s\"", i, bits[i]);
+  strtokenizer t;
+  int prevsub=0;
+  strspan_foreach(t, path+1, pathlen-1, '/') {
+    strspan bit = t.tok;
+    int last = strtokenizer_last(&t);
+    DEBUG("Examining \"%.*s\"", (int)bit.len, bit.ptr);
     if (!prevsub) {
-      if (last_char_in(bits[i])==INSIGHT_SUBKEY_IND_C) {
+      if (strspan_ends_with(bit, INSIGHT_SUBKEY_IND_C)) {
         DEBUG("Ends in a colon");
         /* not just a colon */
-        if (strlen(bits[i])>1) {
+        if (bit.len>1) {
           /* remove colon unless we're incomplete (i.e. last element) */
-          if (i+1<slashcount) last_char_in(bits[i])='\0';
-          strcat(tmp, "/");
-          strcat(tmp, bits[i]);
-        } else if (i+1==slashcount) {
+          if (!last) bit.len--;
+          *out++='/';
+          memcpy(out, bit.ptr, bit.len);
+          out+=bit.len;
+        } else if (last) {
           /* add colon if we're incomplete (i.e. last element) */
-          strcat(tmp, INSIGHT_SUBKEY_IND);
+          *out++=INSIGHT_SUBKEY_IND_C;
         }
         prevsub=1;
       } else {
         DEBUG("Regular tag");
-        strcat(tmp, "/");
-        strcat(tmp, bits[i]);
+        *out++='/';
+        memcpy(out, bit.ptr, bit.len);
+        out+=bit.len;
       }
     } else {
       DEBUG("Subtag part");
-      if (bits[i][0]==INSIGHT_SUBKEY_IND_C && strlen(bits[i])==1) {
+      if (bit.len==1 && bit.ptr[0]==INSIGHT_SUBKEY_IND_C) {
         DEBUG("Looks like we have two %ss in a row.", INSIGHT_SUBKEY_IND);
         errno=ENOENT;
         prevsub=1;
-      } else if (last_char_in(bits[i])==INSIGHT_SUBKEY_IND_C) {
-        DEBUG("Next is still a subtag part");
-        if (i+1<slashcount) last_char_in(bits[i])='\0';
-        prevsub=1;
-        strcat(tmp, INSIGHT_SUBKEY_SEP);
-        strcat(tmp, bits[i]);
       } else {
-        prevsub=0;
-        strcat(tmp, INSIGHT_SUBKEY_SEP);
-        strcat(tmp, bits[i]);
+        if (strspan_ends_with(bit, INSIGHT_SUBKEY_IND_C)) {
+          DEBUG("Next is still a subtag part");
+          if (!last) bit.len--;
+          prevsub=1;
+        } else {
+          prevsub=0;
+        }
+        *out++=INSIGHT_SUBKEY_SEP_C;
+        memcpy(out, bit.ptr, bit.len);
+        out+=bit.len;
       }
     }
   }
+  *out='\0';
 
-  DEBUG("Freeing bits");
-
-  for (slashcount--;slashcount>=0; slashcount--) {
-    ifree(bits[slashcount]);
-  }
-  ifree(bits);
-
-  DEBUG("Bits free");
-
-  if (!strlen(tmp)) {
+  if (!*tmp) {
     DEBUG("Not allowing empty canonical path; using root");
     strcpy(tmp, "/");
   }
@@ -129,6 +138,25 @@ char *get_canonical_path(const char *path) {
   return tmp;
 }
 
+/**
+ * Create canonical path from the argument, as for get_canonical_path_arena(),
+ * in memory that outlives the current request.
+ *
+ * @param path The path to be made canonical.
+ * @returns The canonical version of \a path, to be freed with free().
+ */
+char *get_canonical_path(const char *path) {
+  char *canon = get_canonical_path_arena(path);
+  char *ret;
+  int err = errno;
+
+  if (!canon) return NULL;
+  ret = strdup(canon);
+  afree(canon);
+  errno = err;
+  return ret;
+}
+
 /**
  * Retrieve data block associated with tag. May require splitting it into
  * subtags. Will ignore any trailing INSIGHT_SUBKEY_IND character.
@@ -138,47 +166,63 @@ char *get_canonical_path(const char *path) {
  * otherwise.
  */
 fileptr get_tag(const char *tagname) {
-  char *dup=strdup(tagname);
+  return get_tag_span(tagname, tagname ? strlen(tagname) : 0);
+}
+
+/**
+ * Retrieve data block associated with a tag given as a span of characters, as
+ * for get_tag(). The tag is split in place, so no memory is allocated, and
+ * the result is remembered in the tag resolution cache.
+ *
+ * @param tagname The tag to find, which need not be terminated.
+ * @param len     The length of \a tagname.
+ * @return A pointer to the data block associated with tag, if found, or zero
+ * otherwise.
+ */
+fileptr get_tag_span(const char *tagname, size_t len) {
+  char key[TREEKEY_SIZE+1];
+  strtokenizer t;
   errno=0;
 
-  while (last_char_in(dup)==INSIGHT_SUBKEY_IND_C) {
+  while (len && tagname[len-1]==INSIGHT_SUBKEY_IND_C) {
     DEBUG("Removing trailing %s character", INSIGHT_SUBKEY_IND);
-    last_char_in(dup)='\0';
+    len--;
   }
 
-  DEBUG("Tag to find: %s", tagname);
+  DEBUG("Tag to find: %.*s", (int)len, tagname);
 
   /* if it's empty, then nothing to do. */
-  if (!dup || !strlen(dup)) {
+  if (!len) {
     DEBUG("Null tag");
-    ifree(dup);
     return 0;
   }
 
-  int sepcount, i;
-  char **bits = strsplit(dup, INSIGHT_SUBKEY_SEP_C, &sepcount);
-  fileptr cur_root = tree_get_root();
+  fileptr cur_root;
+  if (tag_cache_get(tagname, len, &cur_root)) {
+    if (!cur_root) errno=ENOENT;
+    return cur_root;
+  }
 
-  for (i=0; i<sepcount; i++) {
-    if (last_char_in(bits[i])==':')
-      last_char_in(bits[i])='\0';
-    DEBUG("Looking up tag[%d]=\"%s\" from subnode %lu", i, bits[i], cur_root);
-    cur_root = tree_sub_search(cur_root, bits[i]);
+  cur_root = tree_get_root();
+  strspan_foreach(t, tagname, len, INSIGHT_SUBKEY_SEP_C) {
+    size_t keylen = t.tok.len;
+    if (strspan_ends_with(t.tok, ':'))
+      keylen--;
+    /* keys are only compared up to TREEKEY_SIZE characters */
+    keylen = MIN(keylen, TREEKEY_SIZE);
+    memcpy(key, t.tok.ptr, keylen);
+    key[keylen]='\0';
+    DEBUG("Looking up tag \"%s\" from subnode %lu", key, cur_root);
+    cur_root = tree_sub_search(cur_root, key);
     if (!cur_root) {
       DEBUG("Could not find tag!");
       break;
     }
   }
 
-  DEBUG("Freeing dup");
-  ifree(dup);
-
-  DEBUG("Freeing bits");
-  for (sepcount--;sepcount>=0; sepcount--)
-    ifree(bits[sepcount]);
-  DEBUG("Freeing bits top-level");
-  ifree(bits);
-
+  /* only remember tags that are really missing, not I/O errors */
+  if (cur_root || errno==ENOENT)
+    tag_cache_put(tagname, len, cur_root);
   return cur_root;
 }
 
@@ -199,10 +243,8 @@ fileptr get_last_tag(const char *path) {
     return 0;
   }
 
-  char *tag = strlast(path, '/');
-  fileptr ret = get_tag(tag);
-  ifree(tag);
-  return ret;
+  const char *tag = rindex(path, '/');
+  return get_tag(tag ? tag+1 : path);
 }
 
 /**
@@ -214,26 +256,21 @@ fileptr get_last_tag(const char *path) {
  * @returns Non-zero if the path is valid, zero if the path is invalid.
  */
 int validate_path(const char *path) {
+  strtokenizer t;
+
   /* Empty and root paths are trivially valid */
   if (!*path || strcmp(path, "/")==0) return 1;
 
-  int count, i, isvalid=1;
-  char **bits = strsplit(path, '/', &count);
-
-  for (i=0; i<count && isvalid; i++) {
-    DEBUG("Examining tag \"%s\"", bits[i]);
-    isvalid &= (!*bits[i] || get_tag(bits[i]))?1:0;
-    DEBUG("%s", isvalid?"Valid":"Invalid!");
+  strsplit_foreach(t, path, '/') {
+    DEBUG("Examining tag \"%.*s\"", (int)t.tok.len, t.tok.ptr);
+    if (!get_tag_span(t.tok.ptr, t.tok.len)) {
+      DEBUG("Invalid!");
+      return 0;
+    }
   }
 
-  DEBUG("Freeing bits");
-  for (count--;count>=0; count--) {
-    ifree(bits[count]);
-  }
-  DEBUG("Freeing bits top-level");
-  ifree(bits);
-  DEBUG("Returning %d", isvalid);
-  return isvalid;
+  DEBUG("Valid");
+  return 1;
 }
 
 /**
@@ -312,39 +349,6 @@ char *gen_repos_path(const char *hash, int create) {
   return finaldest;
 }
 
-/**
- * Search the inode limbo list for a given inode and return its 1-based
- * position in the list if found.
- *
- * @param inode The inode to search for.
- * @returns The index in the limbo list + 1 if found, or zero if not.
- */
-static int limbo_search(fileptr inode) {
-  profile_init_start();
-  fileptr *inodes=NULL;
-  int i, count = inode_get_all(0, NULL, 0);
-  if (count>0) {
-    inodes = calloc(count, sizeof(fileptr));
-    inode_get_all(0, inodes, count);
-  } else if (count==0) {
-    /* can't be found if no inodes in list */
-    profile_stop();
-    return 0;
-  } else if (count<0) {
-    DEBUG("Error calling inode_get_all(): %s", strerror(-count));
-    profile_stop();
-    return count;
-  }
-
-  for (i=0; i<count; i++) {
-    if (inodes[i]==inode)
-      break;
-  }
-  ifree(inodes);
-  profile_stop();
-  return (i<count)?(i+1):0;
-}
-
 /**
  * Check to see if we have a file with the given hash in the inode tree or in
  * the inode limbo list.
@@ -353,7 +357,7 @@ static int limbo_search(fileptr inode) {
  * @return Zero if not found, otherwise non-zero.
  */
 int have_file_by_hash(const unsigned long hash) {
-  char s_hash[9];
+  tkey s_hash;
   hex_to_string(s_hash, hash);
   return tree_sub_search(tree_get_iroot(), s_hash) || limbo_search(hash)>0;
 }
@@ -469,36 +473,89 @@ char *fullname_from_inode(const fileptr inode) {
   return linkres;
 }
 
+/**
+ * Retrieve the tags applied to a file from its inode, using the inode tree.
+ *
+ * @param[in]  inode The inode to use.
+ * @param[out] count The number of tags in the returned array.
+ * @return A sorted array of tag data block indices that should be freed after
+ * use, or NULL on failure. A file with no tags gives an empty array.
+ */
+fileptr *tags_from_inode(const fileptr inode, int *count) {
+  tkey s_hash;
+  fileptr *tags;
+  fileptr piblock;
+
+  hex_to_string(s_hash, inode);
+  piblock = tree_sub_search(tree_get_iroot(), s_hash);
+  *count = piblock ? inode_ref_get_all(piblock, NULL, 0) : 0;
+  if (*count<0) {
+    PMSG(LOG_ERR, "Problem reading tags of inode %s", s_hash);
+    return NULL;
+  }
+  tags = calloc(*count?*count:1, sizeof(fileptr));
+  if (!tags) {
+    PMSG(LOG_ERR, "Failed to allocate memory");
+    return NULL;
+  }
+  if (*count && inode_ref_get_all(piblock, tags, *count)<0) {
+    PMSG(LOG_ERR, "Problem reading tags of inode %s", s_hash);
+    ifree(tags);
+    return NULL;
+  }
+  return tags;
+}
 
-static int _sibcallback(const char *key, const fileptr val, void *data) {
-  (void) val;
-  struct {
-    char **sibs;
-    char *prefix;
-    int cur;
-    int sibcount;
-  } *thing = data;
-  if (thing->cur >= thing->sibcount) {
-    PMSG(LOG_ERR, "\033[1;31mSERIOUS ERROR\033[m");
-    PMSG(LOG_ERR, "\033[1;31mcur: %d; sibcount: %d\033[m", thing->cur, thing->sibcount);
-    return -1;
-  }
-#ifdef _DEBUG
-  DEBUG("Key: \"%s\"", key);
-  DEBUG("Prefix: \"%s\"", thing->prefix);
-  char *fullkey = tree_get_full_key(val);
-  DEBUG("Full key: \"%s\"", fullkey);
-  ifree(fullkey);
-#endif
-  if (thing->prefix && *(thing->prefix)) {
-    thing->sibs[thing->cur] = calloc(strlen(thing->prefix)+strlen(key)+1, sizeof(char));
-    strcpy(thing->sibs[thing->cur], thing->prefix);
-    strcat(thing->sibs[thing->cur], key);
-  } else {
-    thing->sibs[thing->cur] = strdup(key);
-  }
-  thing->cur++;
-  return 0;
+/**
+ * Check whether a tag is applied directly to a file, using the inode tree.
+ *
+ * @param inode The inode of the file.
+ * @param tag   The tag data block index.
+ * @return One if the tag is applied to the file, zero if not, or a negative
+ * error code on failure.
+ */
+int inode_has_tag(const fileptr inode, const fileptr tag) {
+  tkey s_hash;
+  fileptr piblock;
+
+  hex_to_string(s_hash, inode);
+  piblock = tree_sub_search(tree_get_iroot(), s_hash);
+  return piblock ? inode_ref_search(piblock, tag) : 0;
+}
+
+
+/**
+ * Find the last INSIGHT_SUBKEY_SEP_C in the first \a len characters of \a tag.
+ *
+ * @param tag The tag name.
+ * @param len The number of characters of \a tag to search.
+ * @returns A pointer to the separator, or NULL if there is none.
+ */
+static const char *_path_last_sep(const char *tag, size_t len) {
+  while (len--) {
+    if (tag[len]==INSIGHT_SUBKEY_SEP_C) return tag+len;
+  }
+  return NULL;
+}
+
+/**
+ * Build the list of names to show for a set of interned tags.
+ *
+ * @param ids   The IDs of the tags.
+ * @param count The number of items in \a ids.
+ * @param skip  The number of characters to skip at the start of each name.
+ * @returns An array of names belonging to the tag dictionary, to be released
+ * with afree(), or NULL on failure.
+ */
+static const char **_path_dict_names(const uint32_t *ids, unsigned int count, size_t skip) {
+  const char **names = arena_alloc((count+1)*sizeof(char*));
+  unsigned int i;
+  if (!names) return NULL;
+  for (i=0; i<count; i++) {
+    names[i] = tag_dict_name(ids[i]) + skip;
+  }
+  names[count] = NULL;
+  return names;
 }
 
 /**
@@ -507,96 +564,66 @@ static int _sibcallback(const char *key, const fileptr val, void *data) {
  *
  * @param[in]  path  The path for which subkeys should be generated, which must end in INSIGHT_SUBKEY_IND_C
  * @param[out] count The number of subkeys in the list.
- * @return An array of subkeys.
+ * @return An array of subkeys belonging to the tag dictionary, to be released
+ * with afree(), or NULL on failure.
  */
-char **path_get_subkeys(const char *path, unsigned int *count) {
+static const char **path_get_subkeys(const char *path, unsigned int *count) {
 /* Basically:
- *  - build list of all directories in path
- *  - remove any that don't have the same prefix as the : item
- *  - remove the common prefix and add to array REM
- *  - get set of all subkeys of : item and add to array SET
+ *  - get set SET of the IDs of all subkeys of the : item
+ *  - get set REM of the IDs of directories in the path that are among them
  *  - do difference (SET-REM) and there's the answer
  */
-  char *prefix = rindex(path, '/');
-  if (!prefix) {
-    prefix = strdup(path);
-  } else {
-    prefix = strdup(prefix+1);
-  }
-  unsigned int prefixlen = strlen(prefix);
-  /* convert trailing INSIGHT_SUBKEY_IND_C */
-  if (prefix[prefixlen-1]==INSIGHT_SUBKEY_IND_C)
-    prefix[prefixlen-1]=INSIGHT_SUBKEY_SEP_C;
+  *count = 0;
+  const char *tag = rindex(path, '/');
+  tag = tag ? tag+1 : path;
+  size_t taglen = strlen(tag);
+  /* drop trailing INSIGHT_SUBKEY_IND_C */
+  if (taglen && tag[taglen-1]==INSIGHT_SUBKEY_IND_C)
+    taglen--;
   else {
     DEBUG("Not a subkey path");
-    ifree(prefix);
     return NULL;
   }
 
-  DEBUG("Prefix: %s", prefix);
-
-  unsigned int alloc_count=0, pathcount=0;
-  alloc_count+=strcount(path, '/');
-
-  int bitscount;
-  char **bits = strsplit(path, '/', &bitscount);
+  DEBUG("Children of %.*s", (int)taglen, tag);
+  fileptr tree_root = get_tag_span(tag, taglen);
+  unsigned int sibcount = 0;
+  const uint32_t *sibset = tree_root ? tag_dict_children(tree_root, tag, taglen, &sibcount) : NULL;
+  DEBUG("%d children", sibcount);
+  if (!sibset) return NULL;
 
-  char **path_set=calloc(alloc_count, sizeof(char*));
-  unsigned int i=0, p=0;
-  for (i=0; i<(unsigned int)bitscount; i++) {
-    if (!*bits[i])
-      continue;
-    if (strncmp(bits[i], prefix, prefixlen)!=0)
-      continue;
-    DEBUG("Adding \"%s\" to path set", bits[i]+prefixlen);
-    path_set[p++]=strdup(bits[i]+prefixlen);
+  uint32_t *path_set = arena_alloc((strcount(path, '/')+1)*sizeof(uint32_t));
+  uint32_t *outset = arena_alloc((sibcount+1)*sizeof(uint32_t));
+  if (!path_set || !outset) {
+    if (path_set) afree(path_set);
+    if (outset) afree(outset);
+    return NULL;
   }
 
-  DEBUG("Freeing bits");
-
-  for (bitscount--;bitscount>=0; bitscount--) {
-    ifree(bits[bitscount]);
+  strtokenizer t;
+  unsigned int p=0;
+  strsplit_foreach(t, path, '/') {
+    if (t.tok.len<=taglen || t.tok.ptr[taglen]!=INSIGHT_SUBKEY_SEP_C || memcmp(t.tok.ptr, tag, taglen)!=0)
+      continue;
+    /* names that have not been interned cannot be children */
+    if ((path_set[p] = tag_dict_lookup(t.tok.ptr, t.tok.len)))
+      p++;
   }
-  ifree(bits);
 
-  qsort(path_set, p, sizeof(char*), pstrcmp);
-  pathcount = set_uniq(path_set, p, sizeof(char*), pstrcmp);
+  set_sort_u32(path_set, p);
+  p = u32set_uniq(path_set, p);
 
-  for (i=pathcount; i<p; i++) {
-    ifree(path_set[i]);
+  int res = set_diff_u32(sibset, path_set, outset, sibcount, p, sibcount);
+  afree(path_set);
+  if (res<0) {
+    afree(outset);
+    return NULL;
   }
 
-  prefix[prefixlen-1]='\0';
-  DEBUG("Children of %s", prefix);
-  fileptr tree_root = get_tag(prefix);
-  prefix[prefixlen-1]=INSIGHT_SUBKEY_SEP_C;
-  unsigned int sibcount = tree_sub_key_count(tree_root);
-  DEBUG("%d children", sibcount);
-
-  char **sibset=calloc(sibcount+1, sizeof(char*));
-  struct {
-    char **sibs;
-    char *prefix;
-    int cur;
-    int sibcount;
-  } thing;
-  thing.sibs = sibset;
-  thing.cur=0;
-  thing.sibcount=sibcount;
-  thing.prefix=NULL;
-  tree_map_keys(tree_root, _sibcallback, (void*)&thing);
-
-  *count=set_diff(sibset, path_set, sibcount, pathcount, sizeof(char*), pstrcmp);
-  for (i=*count; i<sibcount; i++) {
-    ifree(sibset[i]);
-  }
-
-  for (i=0; i<pathcount; i++) {
-    ifree(path_set[i]);
-  }
-  ifree(path_set);
-  ifree(prefix);
-  return sibset;
+  const char **names = _path_dict_names(outset, res, taglen+1);
+  if (names) *count = res;
+  afree(outset);
+  return names;
 }
 
 #if defined(_DEBUG_PATH_DIRS) && !defined(_DEBUG)
@@ -610,159 +637,136 @@ char **path_get_subkeys(const char *path, unsigned int *count) {
  * removing duplicates and optimising names as necessary. This will call
  * path_get_subkeys() if the path ends in INSIGHT_SUBKEY_IND_C.
  *
+ * The set operations are done on the IDs of interned tag names, so the tags
+ * only need to be read from the tree the first time each parent is listed.
+ *
  * @param[in]  path  The path for which we should generate a directory list.
  * @param[out] count The number of directories in the list.
- * @return An array of directory names.
+ * @return An array of directory names belonging to the tag dictionary, to be
+ * released with afree(), or NULL on failure.
  */
-char **path_get_dirs(const char *path, unsigned int *count) {
-  unsigned int i;
-
+const char **path_get_dirs(const char *path, unsigned int *count) {
   if (last_char_in(path)==INSIGHT_SUBKEY_IND_C) {
     return path_get_subkeys(path, count);
   }
 
   DEBUG("Getting directories for path: %s", path);
-
-  unsigned int alloc_count=0, pathcount=0;
-  // count amount of space we'll need in PATHS set
-  alloc_count+=strcount(path, INSIGHT_SUBKEY_SEP_C);
-  alloc_count+=strcount(path, '/');
-  DEBUG("Path set count: %u", alloc_count);
+  *count = 0;
 
   if (strcmp(path, "/")==0) {
     DEBUG("Children of root");
-    *count = tree_sub_key_count(0);
-    DEBUG("%d children of root", *count);
-
-    char **sibset=calloc(*count+1, sizeof(char*));
-    struct {
-      char **sibs;
-      char *prefix;
-      int cur;
-      int sibcount;
-    } thing;
-    thing.sibs = sibset;
-    thing.cur=0;
-    thing.sibcount=*count;
-    thing.prefix=NULL;
-    tree_map_keys(0, _sibcallback, (void*)&thing);
-
-    return sibset;
-  }
+    unsigned int sibcount;
+    const uint32_t *sibset = tag_dict_children(0, "", 0, &sibcount);
+    if (!sibset) return NULL;
+    DEBUG("%d children of root", sibcount);
 
-  int bitscount;
-  char **bits = strsplit(path, '/', &bitscount);
-
-  char **path_set=calloc(alloc_count, sizeof(char*));
-  unsigned int p=0;
-  for (i=0; i<(unsigned int)bitscount; i++) {
-    char *tmp;
-    if (!*bits[i])
-      continue;
-    DEBUG("Adding \"%s\" to path set", bits[i]);
-    path_set[p++]=strdup(bits[i]);
-    while ((tmp=rindex(bits[i], INSIGHT_SUBKEY_SEP_C))) {
-      *tmp='\0';
-      path_set[p++]=strdup(bits[i]);
-      DEBUG("Adding \"%s\" to path set", bits[i]);
-    }
+    const char **names = _path_dict_names(sibset, sibcount, 0);
+    if (names) *count = sibcount;
+    return names;
   }
 
-  DEBUG("Freeing bits");
-
-  for (bitscount--;bitscount>=0; bitscount--) {
-    ifree(bits[bitscount]);
-  }
-  ifree(bits);
-
-  qsort(path_set, alloc_count, sizeof(char*), pstrcmp);
-  pathcount = set_uniq(path_set, alloc_count, sizeof(char*), pstrcmp);
+  unsigned int alloc_count=1, pathcount=0;
+  // count amount of space we'll need in PATHS set
+  alloc_count+=strcount(path, INSIGHT_SUBKEY_SEP_C);
+  alloc_count+=strcount(path, '/');
+  DEBUG("Path set count: %u", alloc_count);
 
-  for (i=pathcount; i<alloc_count; i++) {
-    ifree(path_set[i]);
+  uint32_t *path_set = arena_alloc(alloc_count*sizeof(uint32_t));
+  const uint32_t **sibsets = arena_alloc(alloc_count*sizeof(uint32_t*));
+  unsigned int *sibcounts = arena_alloc(alloc_count*sizeof(unsigned int));
+  fileptr *roots = arena_alloc(alloc_count*sizeof(fileptr));
+  if (!path_set || !sibsets || !sibcounts || !roots) {
+    if (path_set) afree(path_set);
+    if (sibsets) afree(sibsets);
+    if (sibcounts) afree(sibcounts);
+    if (roots) afree(roots);
+    return NULL;
   }
 
-
   /*
-   * for each element in PATHS:
-   *  - union set of all (fully-qualified) siblings with TAGS set
+   * for each element in PATHS, and each of its parents:
+   *  - gather the set of all (fully-qualified) siblings
    */
-  alloc_count=pathcount;
-  char **outset = malloc(alloc_count*sizeof(char*));
-  char **tmpset = NULL;
-  memcpy(outset, path_set, alloc_count*sizeof(char*));
-  char *curprefix=NULL;
-  int out_count;
-  for (i=0; i<pathcount; i++) {
-    /* get parent tag */
-    fileptr tree_root;
-    char *tmp=rindex(path_set[i], INSIGHT_SUBKEY_SEP_C);
-    if (!tmp) {
-      tree_root=0;
-      curprefix=strdup("");
-    } else {
-      *tmp='\0';
-      tree_root=get_tag(path_set[i]);
-      curprefix=calloc(strlen(path_set[i])+2, sizeof(char));
-      strcat(curprefix, path_set[i]);
-      strcat(curprefix, INSIGHT_SUBKEY_SEP);
-      *tmp=INSIGHT_SUBKEY_SEP_C;
+  strtokenizer t;
+  unsigned int nsets=0, total=0, k;
+  strsplit_foreach(t, path, '/') {
+    const char *tag = t.tok.ptr;
+    size_t len = t.tok.len;
+    while (len) {
+      fileptr tree_root=0;
+      const char *sep = _path_last_sep(tag, len);
+      size_t parentlen = sep ? (size_t)(sep-tag) : 0;
+      if (sep) {
+        tree_root=get_tag_span(tag, parentlen);
+        /* expressions and ranges have no parent tag */
+        if (!tree_root) {
+          DEBUG("No parent tag for \"%.*s\"", (int)len, tag);
+          len = parentlen;
+          continue;
+        }
+      }
+      DEBUG("Current parent: \"%.*s\"", (int)parentlen, tag);
+
+      for (k=0; k<nsets && roots[k]!=tree_root; k++);
+      if (k==nsets) {
+        unsigned int sibcount;
+        const uint32_t *sibset = tag_dict_children(tree_root, tag, parentlen, &sibcount);
+        if (sibset) {
+          DEBUG("%d siblings of tag \"%.*s\", including itself", sibcount, (int)len, tag);
+          roots[nsets] = tree_root;
+          sibsets[nsets] = sibset;
+          sibcounts[nsets++] = sibcount;
+          total += sibcount;
+        }
+      }
+      len = parentlen;
     }
-    DEBUG("Current prefix: \"%s\"", curprefix);
-
-    /* get set of all siblings */
-    unsigned int sibcount = tree_sub_key_count(tree_root);
-    DEBUG("%d siblings of tag \"%s\", including itself", sibcount, path_set[i]);
-
-    char **sibset=calloc(sibcount+1, sizeof(char*));
-    struct {
-      char **sibs;
-      char *prefix;
-      int cur;
-      int sibcount;
-    } thing;
-    thing.sibs = sibset;
-    thing.cur=0;
-    thing.sibcount=sibcount;
-    thing.prefix=curprefix;
-    DEBUG("tree_map_keys();");
-    tree_map_keys(tree_root, _sibcallback, (void*)&thing);
-    DEBUG("tree_map_keys(); // done");
-
-    DEBUG("Realloc()ing tmpset");
-    tmpset=realloc(tmpset, alloc_count*sizeof(char*)); /* TODO: check for failure */
-    DEBUG("memcpy()");
-    memcpy(tmpset, outset, alloc_count*sizeof(char*));
-    DEBUG("Realloc()ing outset");
-    out_count = alloc_count+sibcount;
-    outset=realloc(outset, out_count*sizeof(char*));
-
-    unsigned int k;
-
-    DEBUG("Set union");
-    alloc_count = set_union(tmpset, sibset, outset, alloc_count, sibcount, out_count, sizeof(char*), pstrcmp);
-    for (k=alloc_count; k<(unsigned int)out_count; k++) {
-      DEBUG("Freeing outset[%u] %p (\"%s\")", k, outset[k], outset[k]);
-      ifree(outset[k]);
+  }
+  afree(roots);
+
+  /* union the sets of siblings */
+  uint32_t *outset = arena_alloc((total+1)*sizeof(uint32_t));
+  uint32_t *tmpset = arena_alloc((total+1)*sizeof(uint32_t));
+  int out_count = 0;
+  if (!outset || !tmpset) {
+    if (outset) afree(outset);
+    if (tmpset) afree(tmpset);
+    afree(sibcounts);
+    afree(sibsets);
+    afree(path_set);
+    return NULL;
+  }
+  for (k=0; k<nsets; k++) {
+    uint32_t *swap;
+    out_count = set_union_u32(outset, sibsets[k], tmpset, out_count, sibcounts[k], total);
+    swap = outset; outset = tmpset; tmpset = swap;
+  }
+  afree(tmpset);
+  afree(sibcounts);
+  afree(sibsets);
+
+  /* the IDs of the elements in PATHS; anything not interned cannot be listed */
+  strsplit_foreach(t, path, '/') {
+    const char *tag = t.tok.ptr;
+    size_t len = t.tok.len;
+    while (len) {
+      const char *sep = _path_last_sep(tag, len);
+      if ((path_set[pathcount] = tag_dict_lookup(tag, len)))
+        pathcount++;
+      len = sep ? (size_t)(sep-tag) : 0;
     }
-    ifree(sibset);
-    ifree(curprefix);
   }
-  ifree(tmpset);
-
-  DEBUG("Calling set_uniq()");
-  out_count = set_uniq(outset, alloc_count, sizeof(char*), pstrcmp);
 
-  out_count = set_diff(outset, path_set, out_count, pathcount, sizeof(char*), pstrcmp);
-  ifree(path_set);
+  set_sort_u32(path_set, pathcount);
+  pathcount = u32set_uniq(path_set, pathcount);
 
-  for (i=out_count; i<alloc_count; i++) {
-    DEBUG("Freeing \"%s\" (%p)", outset[i], outset[i]);
-    ifree(outset[i]);
-  }
+  out_count = set_diff_u32(outset, path_set, outset, out_count, pathcount, out_count);
+  afree(path_set);
 
-  *count = out_count;
-  return outset;
+  const char **names = _path_dict_names(outset, out_count, 0);
+  if (names) *count = out_count;
+  afree(outset);
+  return names;
 }
 
 #if defined(_DEBUG_PATH_DIRS) && defined(_DEBUG_ONCE)
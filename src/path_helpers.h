@@ -36,7 +36,9 @@ int strcount(const char *haystack, const char needle);
 char *strlast(const char *input, const char sep);
 char **strsplit(const char *input, const char sep, int *count);
 char *get_canonical_path(const char *path);
+char *get_canonical_path_arena(const char *path);
 fileptr get_tag(const char *tagname);
+fileptr get_tag_span(const char *tagname, size_t len);
 fileptr get_last_tag(const char *tagname);
 int validate_path(const char *path);
 int checkdir(const char *path);
@@ -49,6 +51,8 @@ int get_file_link_by_hash(const unsigned long hash, struct stat *stat);
 int get_file_link_by_shash(const char *hash, struct stat *stat);
 char *basename_from_inode(const fileptr inode);
 char *fullname_from_inode(const fileptr inode);
-char **path_get_dirs(const char *path, unsigned int *count);
+fileptr *tags_from_inode(const fileptr inode, int *count);
+int inode_has_tag(const fileptr inode, const fileptr tag);
+const char **path_get_dirs(const char *path, unsigned int *count);
 
 #endif
@@ -40,7 +40,9 @@ int insight_plugin_import(const char *realpath, const char *filename) {
   }
 
   fileptr target = insight->get_inode(filename);
-  char attr[255];
+  char attr[4][255];
+  const char *attrs[4];
+  int attrcount=0;
 
   tag = taglib_file_tag(file);
   properties = taglib_file_audioproperties(file);
@@ -51,28 +53,33 @@ int insight_plugin_import(const char *realpath, const char *filename) {
   // NOTE: string cleanup handled by taglib_tag_free_strings() later
   char *field = taglib_tag_artist(tag);
   if (field) {
-    snprintf(attr, 254, "music%cartist%c%s", INSIGHT_SUBKEY_SEP_C, INSIGHT_SUBKEY_SEP_C, field);
-    insight->log(LOG_DEBUG, "Tagging: \"%s\"", attr);
-    insight->add_tag(target, attr);
+    snprintf(attr[attrcount], 254, "music%cartist%c%s", INSIGHT_SUBKEY_SEP_C, INSIGHT_SUBKEY_SEP_C, field);
+    insight->log(LOG_DEBUG, "Tagging: \"%s\"", attr[attrcount]);
+    attrs[attrcount] = attr[attrcount];
+    attrcount++;
   }
   field = taglib_tag_title(tag);
   if (field) {
-    snprintf(attr, 254, "music%ctitle%c%s", INSIGHT_SUBKEY_SEP_C, INSIGHT_SUBKEY_SEP_C, field);
-    insight->log(LOG_DEBUG, "Tagging: \"%s\"", attr);
-    insight->add_tag(target, attr);
+    snprintf(attr[attrcount], 254, "music%ctitle%c%s", INSIGHT_SUBKEY_SEP_C, INSIGHT_SUBKEY_SEP_C, field);
+    insight->log(LOG_DEBUG, "Tagging: \"%s\"", attr[attrcount]);
+    attrs[attrcount] = attr[attrcount];
+    attrcount++;
   }
   field = taglib_tag_album(tag);
   if (field) {
-    snprintf(attr, 254, "music%calbum%c%s", INSIGHT_SUBKEY_SEP_C, INSIGHT_SUBKEY_SEP_C, field);
-    insight->log(LOG_DEBUG, "Tagging: \"%s\"", attr);
-    insight->add_tag(target, attr);
+    snprintf(attr[attrcount], 254, "music%calbum%c%s", INSIGHT_SUBKEY_SEP_C, INSIGHT_SUBKEY_SEP_C, field);
+    insight->log(LOG_DEBUG, "Tagging: \"%s\"", attr[attrcount]);
+    attrs[attrcount] = attr[attrcount];
+    attrcount++;
   }
   unsigned int field_i = taglib_tag_track(tag);
   if (field_i) {
-    snprintf(attr, 254, "music%ctrack%c%02u", INSIGHT_SUBKEY_SEP_C, INSIGHT_SUBKEY_SEP_C, field_i);
-    insight->log(LOG_DEBUG, "Tagging: \"%s\"", attr);
-    insight->add_tag(target, attr);
+    snprintf(attr[attrcount], 254, "music%ctrack%c%02u", INSIGHT_SUBKEY_SEP_C, INSIGHT_SUBKEY_SEP_C, field_i);
+    insight->log(LOG_DEBUG, "Tagging: \"%s\"", attr[attrcount]);
+    attrs[attrcount] = attr[attrcount];
+    attrcount++;
   }
+  insight->add_tags(target, attrs, attrcount);
   field=NULL;
 
   insight->log(LOG_DEBUG, "Would tag: \"music`length`%i:%02i\"", minutes, seconds);
@@ -38,10 +38,23 @@
 #include <bplus.h>
 #include <path_helpers.h>
 #include <set_ops.h>
+#include <arena.h>
+#include <tag_cache.h>
+
+/** Query result cache, indexed by a hash of the canonical path */
+static qcache_ent query_cache[QUERY_CACHE_SIZE];
+
+/** Query expression parse cache, indexed by a hash of the path segment */
+static qparse_ent query_parse_cache[QUERY_PARSE_CACHE_SIZE];
+
+/** Registered materialised views */
+static qview query_views[QUERY_VIEW_MAX];
+
+static void _qcache_store(const char *path, fileptr *inodes, int count);
 
 
 static inline qelem *_qtree_make_isany() {
-  qelem *node=calloc(1, sizeof(qelem));
+  qelem *node=arena_calloc(1, sizeof(qelem));
   if (!node) {
     PMSG(LOG_ERR, "Failed to allocate space for query node");
     return NULL;
@@ -51,29 +64,29 @@ static inline qelem *_qtree_make_isany() {
 }
 
 static inline qelem *_qtree_make_is(const char *tag) {
-  qelem *node=calloc(1, sizeof(qelem));
+  qelem *node=arena_calloc(1, sizeof(qelem));
   if (!node) {
     PMSG(LOG_ERR, "Failed to allocate space for query node");
     return NULL;
   }
   node->type=QUERY_IS;
-  node->tag=strdup(tag);
+  node->tag=arena_strdup(tag);
   return node;
 }
 
 static inline qelem *_qtree_make_is_nosub(const char *tag) {
-  qelem *node=calloc(1, sizeof(qelem));
+  qelem *node=arena_calloc(1, sizeof(qelem));
   if (!node) {
     PMSG(LOG_ERR, "Failed to allocate space for query node");
     return NULL;
   }
   node->type=QUERY_IS_NOSUB;
-  node->tag=strdup(tag);
+  node->tag=arena_strdup(tag);
   return node;
 }
 
 static inline qelem *_qtree_make_is_inode(const fileptr inode) {
-  qelem *node=calloc(1, sizeof(qelem));
+  qelem *node=arena_calloc(1, sizeof(qelem));
   if (!node) {
     PMSG(LOG_ERR, "Failed to allocate space for query node");
     return NULL;
@@ -84,18 +97,18 @@ static inline qelem *_qtree_make_is_inode(const fileptr inode) {
 }
 
 static inline qelem *_qtree_make_not_tag(const char *tag) {
-  qelem *node=calloc(1, sizeof(qelem));
+  qelem *node=arena_calloc(1, sizeof(qelem));
   if (!node) {
     PMSG(LOG_ERR, "Failed to allocate space for query node");
     return NULL;
   }
   node->type=QUERY_NOT;
-  node->tag=strdup(tag);
+  node->tag=arena_strdup(tag);
   return node;
 }
 
 static inline qelem *_qtree_make_not(const qelem *target) {
-  qelem *node=calloc(1, sizeof(qelem));
+  qelem *node=arena_calloc(1, sizeof(qelem));
   if (!node) {
     PMSG(LOG_ERR, "Failed to allocate space for query node");
     return NULL;
@@ -106,7 +119,7 @@ static inline qelem *_qtree_make_not(const qelem *target) {
 }
 
 static inline qelem *_qtree_make_and(const qelem *node1, const qelem *node2) {
-  qelem *node=calloc(1, sizeof(qelem));
+  qelem *node=arena_calloc(1, sizeof(qelem));
   if (!node) {
     PMSG(LOG_ERR, "Failed to allocate space for query node");
     return NULL;
@@ -118,7 +131,7 @@ static inline qelem *_qtree_make_and(const qelem *node1, const qelem *node2) {
 }
 
 static inline qelem *_qtree_make_or(const qelem *node1, const qelem *node2) {
-  qelem *node=calloc(1, sizeof(qelem));
+  qelem *node=arena_calloc(1, sizeof(qelem));
   if (!node) {
     PMSG(LOG_ERR, "Failed to allocate space for query node");
     return NULL;
@@ -129,6 +142,19 @@ static inline qelem *_qtree_make_or(const qelem *node1, const qelem *node2) {
   return node;
 }
 
+static inline qelem *_qtree_make_range(const char *tag, const char *lo, const char *hi) {
+  qelem *node=arena_calloc(1, sizeof(qelem));
+  if (!node) {
+    PMSG(LOG_ERR, "Failed to allocate space for query node");
+    return NULL;
+  }
+  node->type=QUERY_RANGE;
+  node->tag=arena_strdup(tag);
+  if (lo) node->lo=arena_strdup(lo);
+  if (hi) node->hi=arena_strdup(hi);
+  return node;
+}
+
 /**
  * Traverse query tree to find a node of the given type.
  *
@@ -150,6 +176,7 @@ static int _qtree_contains(const qelem *root, const unsigned int type) {
     case QUERY_IS:
     case QUERY_IS_NOSUB:
     case QUERY_IS_INODE:
+    case QUERY_RANGE:
       return 0;
       break;
 
@@ -204,6 +231,10 @@ static void _qtree_dump(const qelem *node, int indent) {
       DEBUG("%sIS_INODE: %08lX", spc, node->inode);
       break;
 
+    case QUERY_RANGE:
+      DEBUG("%sRANGE: %s [%s, %s]", spc, node->tag, node->lo?node->lo:"", node->hi?node->hi:"");
+      break;
+
     case QUERY_NOT:
       if (node->tag) {
         DEBUG("%sNOT: %s", spc, node->tag);
@@ -236,7 +267,8 @@ static void _qtree_dump(const qelem *node, int indent) {
 
 
 /**
- * Recursively free a query tree.
+ * Recursively free a query tree. Trees built during a request live in the
+ * request arena, so only the parts allocated outside one are really freed.
  *
  * @param root      The address of the root element to be freed.
  * @param free_tags If true, will also free tags (if non-null).
@@ -247,15 +279,51 @@ void qtree_free(qelem **root, int free_tags) {
   if (!*root) return;
 
   if (free_tags && (*root)->tag) {
-    ifree((*root)->tag);
+    afree((*root)->tag);
+  }
+  if (free_tags && (*root)->lo) {
+    afree((*root)->lo);
+  }
+  if (free_tags && (*root)->hi) {
+    afree((*root)->hi);
   }
 
   qtree_free(&((*root)->next[0]), free_tags);
   qtree_free(&((*root)->next[1]), free_tags);
-  ifree(*root);
+  afree(*root);
   *root=NULL;
 }
 
+/**
+ * Recursively copy a query tree. The copy is allocated outside the request
+ * arena, so it may be kept after the request ends.
+ *
+ * @param root The root of the tree to copy.
+ * @returns The copy, to be freed with qtree_free(), or NULL on failure (or if
+ * \a root was NULL).
+ */
+static qelem *_qtree_copy(const qelem *root) {
+  qelem *node;
+
+  if (!root) return NULL;
+  if (!(node = calloc(1, sizeof(qelem)))) {
+    PMSG(LOG_ERR, "Failed to allocate space for query node");
+    return NULL;
+  }
+  node->type = root->type;
+  node->inode = root->inode;
+  if ((root->tag && !(node->tag = strdup(root->tag))) ||
+      (root->lo && !(node->lo = strdup(root->lo))) ||
+      (root->hi && !(node->hi = strdup(root->hi))) ||
+      (root->next[0] && !(node->next[0] = _qtree_copy(root->next[0]))) ||
+      (root->next[1] && !(node->next[1] = _qtree_copy(root->next[1])))) {
+    PMSG(LOG_ERR, "Failed to copy query tree");
+    qtree_free(&node, 1);
+    return NULL;
+  }
+  return node;
+}
+
 /**
  * Recursively check a query tree for consistency. This ensures that:
  *  - All QUERY_IS_ANY elements have no tag or next values [strict]
@@ -267,6 +335,8 @@ void qtree_free(qelem **root, int free_tags) {
  *  - All QUERY_AND elements have no tag [strict]
  *  - All QUERY_OR elements have two next values
  *  - All QUERY_OR elements have no tag [strict]
+ *  - All QUERY_RANGE elements have a tag (which may be empty)
+ *  - All QUERY_RANGE elements have no next values [strict]
  *
  * @param root    The address of the root element to be checked.
  * @param strict  If true, strict checking is enabled.
@@ -304,6 +374,13 @@ int qtree_consistent(qelem *root, int strict) {
       return 1;
       break;
 
+    case QUERY_RANGE:
+      if (!root->tag) return 0;
+      if (!strict) return 1;
+      if (root->inode || root->next[0] || root->next[1]) return 0;
+      return 1;
+      break;
+
     case QUERY_AND:
     case QUERY_OR:
       if (!root->next[0] || !root->next[1]) return 0;
@@ -318,530 +395,2137 @@ int qtree_consistent(qelem *root, int strict) {
   }
 }
 
+/** An operand of a flattened AND chain, with its estimated cost */
+typedef struct {
+  qelem *node;    /**< The operand subtree */
+  long   cost;    /**< Estimated number of inodes produced by the operand */
+  int    neg;     /**< Non-zero if the operand result is negated */
+} qplan_op;
+
 /**
- * Small procedure to create a basic conjunctive query tree from a tokenised path.
+ * Find the block whose subkey tree a range query element scans.
  *
- * @param str  Incoming path token.
- * @param data A qelem** in disguise that should be updated.
- * @return Always zero.
+ * @param query The QUERY_RANGE element.
+ * @returns The data block of the tag, the root tree if the tag is empty, or
+ * zero if the tag does not exist.
  */
-static int _path_to_query_proc(const char *str, unsigned long data) {
-  DEBUG("str: \"%s\"", str);
-  qelem *newnode=NULL;
-  qelem **qroot=(qelem**)data;
-  int is_tag = get_tag(str);
-  unsigned long path_hash = hash_path(str);
-  int is_file = have_file_by_hash(path_hash);
-
-  if (is_tag) {
-    tdata dblock;
-    if (tree_read(is_tag, (tblock*)&dblock)) {
-      PMSG(LOG_ERR, "I/O error reading block\n");
-      qtree_free(qroot, 1);
-      return -EIO;
-    }
-    if (dblock.flags & DATA_FLAGS_NOSUB) {
-      newnode=_qtree_make_is_nosub(str);
-    } else {
-      newnode=_qtree_make_is(str);
-    }
-
-  } else if (is_file) {
-    newnode=_qtree_make_is_inode(path_hash);
+static fileptr _qtree_range_base(const qelem *query) {
+  return *query->tag ? get_tag(query->tag) : tree_get_root();
+}
 
-  } else {
-    DEBUG("Tag \"%s\" does not exist");
-    qtree_free(qroot, 1);
-    return -ENOENT;
+/**
+ * Callback function mapped across a subkey tree to add up the inode counts of
+ * every data node below it.
+ *
+ * @param key  The key for the current item
+ * @param ptr  The pointer associated with the current item
+ * @param data User-defined data (in this case, a pointer to the running total)
+ * @return Zero on success, or <tt>-EIO</tt> on failure.
+ */
+static int _qplan_count_func(const char *key, const fileptr ptr, void *data) {
+  tdata dblock;
+  (void) key;
+  if (tree_read(ptr, (tblock*)&dblock)) {
+    PMSG(LOG_ERR, "I/O error reading block\n");
+    return -EIO;
   }
-
-  if (*qroot) {
-    *qroot=_qtree_make_and(newnode, *qroot);
-  } else {
-    *qroot=newnode;
+  *(long*)data += dblock.inodecount;
+  if (dblock.subkeys) {
+    return tree_map_keys(dblock.subkeys, _qplan_count_func, data);
   }
   return 0;
 }
 
 /**
- * Converts a path to a simple conjunctive query.
+ * Estimate the number of inodes a tag produces. If subtags are included and
+ * the tag has stored statistics, they give the exact figure; otherwise the
+ * inode counts of the tag's data block (and its subtags' data blocks) are
+ * added up. Inode lists are never fetched, and nothing is written.
  *
- * @param path The (not necessarily canonical) path to be parsed.
- * @returns A pointer to a tree structure representing the query, or NULL if an
- * error occurred. If an error occurs, \c errno is set appropriately.
+ * @param tag     The tag name.
+ * @param recurse Non-zero if inodes of subtags are included.
+ * @returns The estimated number of inodes.
  */
-qelem *path_to_query(const char *path) {
-  if (!path) return NULL;
-
-  char *dup = get_canonical_path(path);
-  DEBUG("Canonical path: \"%s\"", path);
-  if (!dup || errno) {
-    DEBUG("Error in get_canonical_path()");
-    if (dup) ifree(dup);
-    errno=ENOENT;
-    return NULL;
+static long _qplan_tag_cost(const char *tag, int recurse) {
+  fileptr dblock = get_tag(tag);
+  tdata datablock;
+  tstats stats;
+  long cost;
+
+  if (!dblock) return 0;
+  if (recurse && !tag_stats_get(dblock, &stats)) {
+    return stats.closure;
   }
-  char *tmp = dup;
-  qelem *qroot=NULL;
-
-  /* remove leading slash characters */
-  while (*tmp && *tmp=='/')
-    tmp++;
-
-  /* If we have a zero-length path, then that matches any tag */
-  if (!*tmp) {
-    DEBUG("Top-level ISANY");
-    qroot = _qtree_make_isany();
+  if (tree_read(dblock, (tblock*)&datablock)) {
+    PMSG(LOG_ERR, "I/O error reading block\n");
+    return LONG_MAX;
+  }
+  cost = datablock.inodecount;
+  if (recurse && datablock.subkeys &&
+      tree_map_keys(datablock.subkeys, _qplan_count_func, &cost)) {
+    return LONG_MAX;
+  }
+  return cost;
+}
 
-  } else {
-    int res = strsplitmap(tmp, '/', _path_to_query_proc, (unsigned long)&qroot);
+/**
+ * Estimate the number of inodes two tags have in common from their
+ * statistics. Tags whose inode bounds do not overlap share nothing;
+ * otherwise the merged sketches give the size of the union, and so of the
+ * intersection.
+ *
+ * @param a The first operand.
+ * @param b The second operand.
+ * @returns The estimated number of inodes, or -1 if the operands are not both
+ * (recursive) tags with statistics.
+ */
+static long _qplan_pair_cost(const qelem *a, const qelem *b) {
+  fileptr ablock, bblock;
+  tstats sa, sb;
+  long est;
 
-    if (res==0) {
-      DEBUG("Success");
-    } else if (res==-ENOENT) {
-      DEBUG("A component of the path does not exist");
-      qtree_free(&qroot, 1);
-      ifree(dup);
-      errno=ENOENT;
-      return NULL;
-    } else {
-      DEBUG("Problem with strsplitmap");
-      qtree_free(&qroot, 1);
-      ifree(dup);
-      errno=-res;
-      return NULL;
-    }
+  if (a->type!=QUERY_IS || b->type!=QUERY_IS) return -1;
+  if (!(ablock = get_tag(a->tag)) || !(bblock = get_tag(b->tag))) return 0;
+  if (tag_stats_get(ablock, &sa) || tag_stats_get(bblock, &sb)) return -1;
 
-    if (_qtree_contains(qroot, QUERY_IS_INODE) && !query_inode_count(qroot)) {
-      /* cannot find that inode with the query */
-      DEBUG("Could not find the given file");
-      qtree_free(&qroot, 1);
-      ifree(dup);
-      errno=ENOENT;
-      return NULL;
-    }
+  if (!sa.closure || !sb.closure ||
+      sa.max_inode < sb.min_inode || sb.max_inode < sa.min_inode) {
+    return 0;
   }
-
-  DEBUG("Dumping tree...");
-  _qtree_dump(qroot, 0);
-  DEBUG("Tree dump done.");
-
-  ifree(dup);
-  return qroot;
+  est = (long)tag_stats_estimate(&sa) + (long)tag_stats_estimate(&sb) - (long)tag_stats_union(&sa, &sb);
+  return MAX(0, MIN(est, (long)MIN(sa.closure, sb.closure)));
 }
 
 /**
- * Work out what tags we should display, based on a query tree. If \a parent is
- * an empty string, then we should display the root-level tags. Otherwise, we
- * should display the subtags of \a parent. If the subtag name is longer than
- * \a len then it will be truncated.
+ * Estimate the number of inodes a query subtree produces, and whether the
+ * result is negated (as for query_to_inodes()).
  *
- * @param[in]  query   The query tree to examine.
- * @param[out] parent  Pointer to a string to be filled with the subtag parent.
- * @param[in]  len     The maximum length for \a parent.
- * @returns Zero on success, 1 on failure, or 2 if the query tree gives an
- * ambiguous answer.
+ * @param[in]  query The query subtree.
+ * @param[out] neg   Set to non-zero if the result will be negated.
+ * @returns The estimated number of inodes.
  */
-int query_get_subtags(const qelem *query, char *parent, int len) {
-  if (!query || !parent) return 1;
+static long _qplan_cost(const qelem *query, int *neg) {
+  long cost1, cost2;
+  int neg1=0, neg2=0;
 
-  /* Essentially just search the tree for incomplete tags */
+  *neg=0;
   switch (query->type) {
     case QUERY_IS_ANY:
-    case QUERY_IS_INODE:
-      strncpy(parent, "", len);
-      return 0;
-      break;
+      return inode_get_all(0, NULL, 0);
 
     case QUERY_IS:
     case QUERY_IS_NOSUB:
-      if (last_char_in(query->tag)==INSIGHT_SUBKEY_IND_C) {
-        /* incomplete tag - aha! */
-        DEBUG("Found incomplete tag \"%s\"!", query->tag);
-        strncpy(parent, query->tag, len);
-        while (*parent && last_char_in(parent)==INSIGHT_SUBKEY_IND_C) {
-          last_char_in(parent)='\0';
+      return _qplan_tag_cost(query->tag, query->type==QUERY_IS);
+
+    case QUERY_IS_INODE:
+      return 1;
+
+    case QUERY_RANGE:
+      {
+        fileptr base = _qtree_range_base(query);
+        cost1 = 0;
+        if (base && tree_map_range(base, query->lo, query->hi, _qplan_count_func, &cost1)) {
+          return LONG_MAX;
         }
-      } else {
-        /* complete tag */
-        DEBUG("Found complete tag \"%s\"", query->tag);
-        strncpy(parent, "", len);
+        return cost1;
       }
-      return 0;
-      break;
 
     case QUERY_NOT:
       if (query->tag) {
-        if (last_char_in(query->tag)==INSIGHT_SUBKEY_IND_C) {
-          /* incomplete tag - aha! */
-          DEBUG("Found incomplete tag \"%s\"!", query->tag);
-          strncpy(parent, query->tag, len);
-          while (*parent && last_char_in(parent)==INSIGHT_SUBKEY_IND_C) {
-            last_char_in(parent)='\0';
-          }
-        } else {
-          /* complete tag */
-          DEBUG("Found complete tag \"%s\"", query->tag);
-          strncpy(parent, "", len);
-        }
-        return 0;
-      } else {
-        DEBUG("Recursing into NOT node");
-        return query_get_subtags(query->next[0], parent, len);
+        *neg=1;
+        return _qplan_tag_cost(query->tag, 1);
       }
-      break;
+      cost1 = _qplan_cost(query->next[0], neg);
+      *neg = !*neg;
+      return cost1;
 
-    /* Ambiguities can only arise when we have two tags to consider */
     case QUERY_AND:
+      if ((cost1 = _qplan_pair_cost(query->next[0], query->next[1])) >= 0) {
+        return cost1;
+      }
+      /* fall through */
     case QUERY_OR:
-      {
-        int wasset=0;
-
-        DEBUG("AND/OR: checking first branch");
-        int retval=query_get_subtags(query->next[0], parent, len);
-        if (retval) {
-          DEBUG("AND/OR: first branch returned an error");
-          return retval;
-        }
-        DEBUG("AND/OR: first branch gives us tag \"%s\"", parent);
-        wasset = (*parent) ? 1 : 0;
-
-        char *tmp;
-        if (wasset) {
-          tmp=calloc(len, sizeof(char));
-          if (!tmp) {
-            PMSG(LOG_ERR, "Failed to allocate space for temp string");
-            return 1;
-          }
-        } else {
-          tmp=parent;
-        }
-
-        DEBUG("AND/OR: checking second branch");
-        retval=query_get_subtags(query->next[1], tmp, len);
-        if (retval) {
-          DEBUG("AND/OR: second branch returned an error");
-          if (wasset) ifree(tmp);
-          return retval;
-        }
-        DEBUG("AND/OR: second branch gives us tag \"%s\"", tmp);
-
-        if (wasset && *tmp) {
-          PMSG(LOG_WARNING, "Ambiguous result detected in query tree!");
-          if (wasset) ifree(tmp);
-          return 2;
-        }
-
-        DEBUG("AND/OR: therefore our resulting tag is \"%s\"", parent);
-        if (wasset) ifree(tmp);
-        return 0;
+      cost1 = _qplan_cost(query->next[0], &neg1);
+      cost2 = _qplan_cost(query->next[1], &neg2);
+      if (query->type==QUERY_OR) {
+        neg1 = !neg1;
+        neg2 = !neg2;
       }
-      break;
+      /* same rules as query_to_inodes(): intersection, union or difference */
+      *neg = (neg1 && neg2) ^ (query->type==QUERY_OR);
+      if (!neg1 && !neg2) return MIN(cost1, cost2);
+      if (neg1 && neg2) return (cost1 > LONG_MAX - cost2) ? LONG_MAX : cost1 + cost2;
+      return neg1 ? cost2 : cost1;
 
     default:
-      PMSG(LOG_ERR, "Unrecognised query tree element type %d", query->type);
-      return 1;
-      break;
+      return LONG_MAX;
   }
-
-  return 0;
 }
 
 /**
- * Get number of inodes a query would return. May be optimised.
+ * Collect the operands of a chain of AND nodes, freeing the AND nodes.
  *
- * @param query The root of the query to use.
- * @returns The number of inodes that would be found by the query.
+ * @param[in]     query The root of the AND chain.
+ * @param[out]    ops   The operand array, grown as required.
+ * @param[in,out] count The number of operands in \a ops.
+ * @param[in,out] size  The allocated size of \a ops.
+ * @returns Zero on success, or <tt>-ENOMEM</tt> on failure.
  */
-int query_inode_count(const qelem * const query) {
-  int count=0, neg=0;
-  fileptr *inodes = query_to_inodes(query, &count, &neg);
-  if (!inodes) {
-    DEBUG("Error");
-    return 0;
+static int _qplan_flatten(qelem *query, qplan_op **ops, int *count, int *size) {
+  if (query->type==QUERY_AND) {
+    qelem *left=query->next[0], *right=query->next[1];
+    afree(query);
+    if (_qplan_flatten(left, ops, count, size)) {
+      qtree_free(&right, 1);
+      return -ENOMEM;
+    }
+    return _qplan_flatten(right, ops, count, size);
   }
-  ifree(inodes);
-  return count;
+  if (*count == *size) {
+    qplan_op *tmp = realloc(*ops, (*size ? *size*2 : 8) * sizeof(qplan_op));
+    if (!tmp) {
+      PMSG(LOG_ERR, "Failed to allocate space for query plan");
+      qtree_free(&query, 1);
+      return -ENOMEM;
+    }
+    *ops = tmp;
+    *size = *size ? *size*2 : 8;
+  }
+  if (!((*ops)[*count].node = query_plan(query))) return -ENOMEM;
+  (*count)++;
+  return 0;
 }
 
 /**
- * Get inode list from query tree. The returned list is allocated with malloc()
- * and should be freed with free().
+ * Compare two AND operands for evaluation order: positive operands come
+ * before negated ones (which can only be subtracted), cheapest first.
+ */
+static int _qplan_opcmp(const void *p1, const void *p2) {
+  const qplan_op *o1=p1, *o2=p2;
+  if (o1->neg != o2->neg) return o1->neg - o2->neg;
+  return (o1->cost > o2->cost) ? 1 : (o1->cost < o2->cost) ? -1 : 0;
+}
+
+/**
+ * Reorder a query tree for evaluation. Chains of AND nodes are flattened and
+ * rebuilt left-deep with the operands in order of estimated cardinality, so
+ * that evaluation starts from the most selective operand and stops as soon
+ * as the intersection is empty. OR and NOT subtrees are planned
+ * recursively.
  *
- * @param query The root of the query tree to calculate the inode list for.
- * @param count The number of inodes in the returned list.
- * @param neg   True if the query results should be negated.
- * @returns The list of inodes available given the query tree, or NULL on error
- * or if count is zero.
+ * @param query The query tree, which is consumed.
+ * @returns The reordered query tree, or NULL on error (in which case the
+ * original tree has been freed).
  */
-fileptr *query_to_inodes(const qelem * const query, int * const count, int * const neg) {
-  DEBUG("Function entry");
-  if (!query) {
-    PMSG(LOG_ERR, "Query was null");
-    return NULL;
+qelem *query_plan(qelem *query) {
+  qplan_op *ops=NULL;
+  int count=0, size=0, i, best;
+  long bestcost=0;
+
+  if (!query) return NULL;
+
+  switch (query->type) {
+    case QUERY_NOT:
+    case QUERY_OR:
+      for (i=0; i<2; i++) {
+        if (query->next[i] && !(query->next[i] = query_plan(query->next[i]))) {
+          qtree_free(&query, 1);
+          return NULL;
+        }
+      }
+      return query;
+
+    case QUERY_AND:
+      break;
+
+    default:
+      return query;
   }
-  if (!count) {
-    PMSG(LOG_ERR, "Count was null");
+
+  if (_qplan_flatten(query, &ops, &count, &size)) {
+    for (i=0; i<count; i++) {
+      qtree_free(&ops[i].node, 1);
+    }
+    if (ops) ifree(ops);
+    return NULL;
+  }
+  for (i=0; i<count; i++) {
+    ops[i].cost = _qplan_cost(ops[i].node, &ops[i].neg);
+    DEBUG("Operand %d: estimated %ld inodes%s", i, ops[i].cost, ops[i].neg?" (negated)":"");
+  }
+  qsort(ops, count, sizeof(qplan_op), _qplan_opcmp);
+
+  /* of the tags, the one sharing fewest inodes with the cheapest operand is
+   * the best to intersect with it first */
+  for (i=1, best=-1; i<count && !ops[i].neg; i++) {
+    long pair = _qplan_pair_cost(ops[0].node, ops[i].node);
+    if (pair >= 0 && (best < 0 || pair < bestcost)) {
+      best = i;
+      bestcost = pair;
+    }
+  }
+  if (best > 1) {
+    qplan_op tmp = ops[1];
+    ops[1] = ops[best];
+    ops[best] = tmp;
+  }
+
+  query = ops[0].node;
+  for (i=1; i<count; i++) {
+    qelem *node = _qtree_make_and(query, ops[i].node);
+    if (!node) {
+      for (; i<count; i++) {
+        qtree_free(&ops[i].node, 1);
+      }
+      qtree_free(&query, 1);
+      break;
+    }
+    query = node;
+  }
+  ifree(ops);
+  return query;
+}
+
+/**
+ * Parse a path token as a range of subtags. The last part of the tag name
+ * may be either <tt>lo..hi</tt> (inclusive, with either bound optional) or
+ * <tt>prefix*</tt>, e.g. <tt>music`year`1990..1999</tt>.
+ *
+ * @param str The path token.
+ * @returns A QUERY_RANGE element, or NULL if the token is not a range or its
+ * parent tag does not exist.
+ */
+static qelem *_qtree_parse_range(const char *str) {
+  const char *last = strrchr(str, INSIGHT_SUBKEY_SEP_C);
+  const char *dots;
+  char *tag, *lo=NULL, *hi=NULL;
+  qelem *node=NULL;
+  size_t len;
+
+  last = last ? last+1 : str;
+  len = strlen(last);
+  if ((dots = strstr(last, ".."))) {
+    if (dots > last) lo = arena_strndup(last, dots-last);
+    if (*(dots+2)) hi = arena_strdup(dots+2);
+  } else if (len && last[len-1]=='*') {
+    if (len > 1) {
+      /* every key starting with the prefix sorts below prefix + 0xFF */
+      lo = arena_strndup(last, len-1);
+      hi = arena_calloc(len+1, sizeof(char));
+      if (hi) {
+        memcpy(hi, last, len-1);
+        hi[len-1] = '\xff';
+      }
+    }
+  } else {
+    return NULL;
+  }
+
+  tag = arena_strndup(str, (last > str) ? (size_t)(last-str-1) : 0);
+  if (tag && (!*tag || get_tag(tag))) {
+    node = _qtree_make_range(tag, lo, hi);
+  }
+  if (tag) afree(tag);
+  if (lo) afree(lo);
+  if (hi) afree(hi);
+  return node;
+}
+
+/**
+ * Build a query element from a single tag, file or range of subtags.
+ *
+ * @param[in]  str  The tag name, file name or range.
+ * @param[out] node Set to the new query element.
+ * @returns Zero on success, <tt>-ENOENT</tt> if \a str is none of these, or
+ * another negative error code on failure.
+ */
+static int _qtree_parse_token(const char *str, qelem **node) {
+  fileptr is_tag = get_tag(str);
+  unsigned long path_hash;
+
+  *node = NULL;
+  if (is_tag) {
+    tdata dblock;
+    if (tree_read(is_tag, (tblock*)&dblock)) {
+      PMSG(LOG_ERR, "I/O error reading block\n");
+      return -EIO;
+    }
+    if (dblock.flags & DATA_FLAGS_NOSUB) {
+      *node=_qtree_make_is_nosub(str);
+    } else {
+      *node=_qtree_make_is(str);
+    }
+
+  } else if (have_file_by_hash(path_hash = hash_path(str))) {
+    *node=_qtree_make_is_inode(path_hash);
+
+  } else if ((*node=_qtree_parse_range(str))) {
+    DEBUG("Range of subtags");
+    return 0;
+
+  } else {
+    DEBUG("Tag \"%s\" does not exist", str);
+    return -ENOENT;
+  }
+  return *node ? 0 : -ENOMEM;
+}
+
+/** Recursive descent parser state for a query expression */
+typedef struct {
+  const char *pos;  /**< The next character to be read */
+  int         err;  /**< Zero, or a negative error code once parsing fails */
+} qexpr_parser;
+
+static qelem *_qexpr_parse_or(qexpr_parser *p);
+
+/**
+ * Parse a single term of a query expression: a negated term, a parenthesised
+ * expression, or a tag (in which subtag parts may be separated by
+ * INSIGHT_SUBKEY_IND_C as well as INSIGHT_SUBKEY_SEP_C), file or range.
+ *
+ * @param p The parser state.
+ * @returns The query tree for the term, or NULL on error (with \a p->err
+ * set).
+ */
+static qelem *_qexpr_parse_term(qexpr_parser *p) {
+  qelem *node=NULL, *sub;
+  char *token, *c;
+  size_t len;
+
+  if (*p->pos == INSIGHT_EXPR_NOT_C) {
+    p->pos++;
+    if (!(sub = _qexpr_parse_term(p))) return NULL;
+    if (!(node = _qtree_make_not(sub))) {
+      qtree_free(&sub, 1);
+      p->err = -ENOMEM;
+    }
+    return node;
+  }
+
+  if (*p->pos == INSIGHT_EXPR_OPEN_C) {
+    p->pos++;
+    if (!(node = _qexpr_parse_or(p))) return NULL;
+    if (*p->pos != INSIGHT_EXPR_CLOSE_C) {
+      DEBUG("Unbalanced parentheses in query expression");
+      qtree_free(&node, 1);
+      p->err = -ENOENT;
+      return NULL;
+    }
+    p->pos++;
+    return node;
+  }
+
+  if (!(len = strcspn(p->pos, INSIGHT_EXPR_CHARS))) {
+    DEBUG("Missing term in query expression at \"%s\"", p->pos);
+    p->err = -ENOENT;
+    return NULL;
+  }
+  if (!(token = arena_strndup(p->pos, len))) {
+    p->err = -ENOMEM;
+    return NULL;
+  }
+  p->pos += len;
+  for (c=token; *c; c++) {
+    if (*c == INSIGHT_SUBKEY_IND_C) *c = INSIGHT_SUBKEY_SEP_C;
+  }
+  p->err = _qtree_parse_token(token, &node);
+  afree(token);
+  return node;
+}
+
+/**
+ * Parse a conjunction of terms in a query expression.
+ *
+ * @param p The parser state.
+ * @returns The query tree, or NULL on error (with \a p->err set).
+ */
+static qelem *_qexpr_parse_and(qexpr_parser *p) {
+  qelem *node, *right, *tmp;
+
+  if (!(node = _qexpr_parse_term(p))) return NULL;
+  while (*p->pos == INSIGHT_EXPR_AND_C) {
+    p->pos++;
+    if (!(right = _qexpr_parse_term(p))) {
+      qtree_free(&node, 1);
+      return NULL;
+    }
+    if (!(tmp = _qtree_make_and(node, right))) {
+      qtree_free(&node, 1);
+      qtree_free(&right, 1);
+      p->err = -ENOMEM;
+      return NULL;
+    }
+    node = tmp;
+  }
+  return node;
+}
+
+/**
+ * Parse a disjunction of conjunctions in a query expression. Conjunction
+ * binds more tightly than disjunction.
+ *
+ * @param p The parser state.
+ * @returns The query tree, or NULL on error (with \a p->err set).
+ */
+static qelem *_qexpr_parse_or(qexpr_parser *p) {
+  qelem *node, *right, *tmp;
+
+  if (!(node = _qexpr_parse_and(p))) return NULL;
+  while (*p->pos == INSIGHT_EXPR_OR_C) {
+    p->pos++;
+    if (!(right = _qexpr_parse_and(p))) {
+      qtree_free(&node, 1);
+      return NULL;
+    }
+    if (!(tmp = _qtree_make_or(node, right))) {
+      qtree_free(&node, 1);
+      qtree_free(&right, 1);
+      p->err = -ENOMEM;
+      return NULL;
+    }
+    node = tmp;
+  }
+  return node;
+}
+
+/**
+ * Parse a query expression path segment, such as
+ * <tt>(jazz|blues)&!live</tt>. Parsed trees are kept in a small cache
+ * indexed by the segment, so repeated lookups of the same expression only
+ * pay for a copy.
+ *
+ * @param[in]  str  The path segment.
+ * @param[out] node Set to the query tree for the segment.
+ * @returns Zero on success, <tt>-ENOENT</tt> if the segment is not a valid
+ * expression over existing tags, or another negative error code on failure.
+ */
+static int _qexpr_parse(const char *str, qelem **node) {
+  qparse_ent *ent = &query_parse_cache[hash_path(str) % QUERY_PARSE_CACHE_SIZE];
+  qexpr_parser p;
+
+  if (ent->segment && ent->generation == tag_cache_generation() &&
+      ent->keygen == tree_get_key_generation() && strcmp(ent->segment, str)==0) {
+    DEBUG("Parse cache hit for \"%s\"", str);
+    *node = _qtree_copy(ent->query);
+    return *node ? 0 : -ENOMEM;
+  }
+
+  p.pos = str;
+  p.err = 0;
+  *node = _qexpr_parse_or(&p);
+  if (*node && *p.pos) {
+    DEBUG("Trailing characters in query expression: \"%s\"", p.pos);
+    qtree_free(node, 1);
+    p.err = -ENOENT;
+  }
+  if (!*node) return p.err ? p.err : -ENOMEM;
+
+  /* caching is only an optimisation */
+  if (ent->segment) ifree(ent->segment);
+  qtree_free(&ent->query, 1);
+  if ((ent->segment = strdup(str)) && !(ent->query = _qtree_copy(*node))) {
+    ifree(ent->segment);
+    ent->segment = NULL;
+  }
+  ent->generation = tag_cache_generation();
+  ent->keygen = tree_get_key_generation();
+  return 0;
+}
+
+/**
+ * Small procedure to create a basic conjunctive query tree from a tokenised
+ * path. Each token is a tag, a file, a range of subtags or a query
+ * expression.
+ *
+ * @param str   Incoming path token.
+ * @param qroot The query tree that should be updated.
+ * @return Zero on success, or a negative error code on failure.
+ */
+static int _path_to_query_proc(const char *str, qelem **qroot) {
+  DEBUG("str: \"%s\"", str);
+  qelem *newnode=NULL;
+  int res = _qtree_parse_token(str, &newnode);
+
+  if (res==-ENOENT && strpbrk(str, INSIGHT_EXPR_CHARS)) {
+    DEBUG("Query expression");
+    res = _qexpr_parse(str, &newnode);
+  }
+  if (res) {
+    qtree_free(qroot, 1);
+    return res;
+  }
+
+  if (*qroot) {
+    *qroot=_qtree_make_and(newnode, *qroot);
+  } else {
+    *qroot=newnode;
+  }
+  return 0;
+}
+
+/**
+ * Check whether a tag is, or is an ancestor of, one of the given tags.
+ *
+ * @param dblock The data block of the tag to look for.
+ * @param tags   The data blocks of the tags applied to a file, sorted.
+ * @param count  The number of tags in \a tags.
+ * @param nosub  If non-zero, only an exact match counts.
+ * @returns One if the tag matches, zero if not, or a negative error code on
+ * failure.
+ */
+static int _query_tag_matches(fileptr dblock, const fileptr *tags, int count, int nosub) {
+  tdata dnode;
+  int i;
+
+  if (!dblock) return 0;
+  if (bsearch(&dblock, tags, count, sizeof(fileptr), inodecmp)) return 1;
+  if (nosub) return 0;
+
+  /* walk up from each of the file's tags */
+  for (i=0; i<count; i++) {
+    fileptr cur = tags[i];
+    while (cur) {
+      if (tree_read(cur, (tblock*)&dnode)) {
+        PMSG(LOG_ERR, "I/O error reading block\n");
+        return -EIO;
+      }
+      cur = dnode.parent;
+      if (cur == dblock) return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Check whether one of the given tags is, or is below, a subtag of a range
+ * query element.
+ *
+ * @param query The QUERY_RANGE element.
+ * @param tags  The data blocks of the tags applied to a file, sorted.
+ * @param count The number of tags in \a tags.
+ * @returns One if the range matches, zero if not, or a negative error code on
+ * failure.
+ */
+static int _query_range_matches(const qelem *query, const fileptr *tags, int count) {
+  fileptr base = *query->tag ? get_tag(query->tag) : 0;
+  tdata dnode;
+  int i;
+
+  if (*query->tag && !base) return 0;
+  for (i=0; i<count; i++) {
+    fileptr cur = tags[i];
+    while (cur) {
+      if (tree_read(cur, (tblock*)&dnode)) {
+        PMSG(LOG_ERR, "I/O error reading block\n");
+        return -EIO;
+      }
+      if (dnode.parent == base) {
+        if ((!query->lo || strncmp(dnode.name, query->lo, TREEKEY_SIZE) >= 0) &&
+            (!query->hi || strncmp(dnode.name, query->hi, TREEKEY_SIZE) <= 0)) {
+          return 1;
+        }
+        break;
+      }
+      cur = dnode.parent;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Evaluate a query tree against a single file, given the tags applied to it.
+ *
+ * @param query The root of the query tree.
+ * @param inode The inode of the file.
+ * @param tags  The data blocks of the tags applied to the file, sorted.
+ * @param count The number of tags in \a tags.
+ * @returns One if the file matches, zero if not, or a negative error code on
+ * failure.
+ */
+static int _query_contains(const qelem *query, fileptr inode, const fileptr *tags, int count) {
+  int res;
+
+  switch (query->type) {
+    case QUERY_IS_ANY:
+      return count ? 0 : limbo_search(inode);
+
+    case QUERY_IS:
+    case QUERY_IS_NOSUB:
+      return _query_tag_matches(get_tag(query->tag), tags, count, query->type==QUERY_IS_NOSUB);
+
+    case QUERY_IS_INODE:
+      return query->inode == inode;
+
+    case QUERY_RANGE:
+      return _query_range_matches(query, tags, count);
+
+    case QUERY_NOT:
+      if (query->tag) {
+        res = _query_tag_matches(get_tag(query->tag), tags, count, 0);
+      } else {
+        res = _query_contains(query->next[0], inode, tags, count);
+      }
+      return (res < 0) ? res : !res;
+
+    case QUERY_AND:
+    case QUERY_OR:
+      res = _query_contains(query->next[0], inode, tags, count);
+      if (res < 0) return res;
+      /* short-circuit */
+      if (res == (query->type==QUERY_OR)) return res;
+      return _query_contains(query->next[1], inode, tags, count);
+
+    default:
+      PMSG(LOG_ERR, "Unknown query tree element type %d!", query->type);
+      return -EINVAL;
+  }
+}
+
+/**
+ * Check whether a single file matches a query. Only the tags applied to the
+ * file are examined, so the cost depends on the size of the query and the
+ * number of tags on the file rather than on the number of files under each
+ * tag.
+ *
+ * @param query The root of the query tree.
+ * @param inode The inode of the file.
+ * @returns One if the file matches, zero if not, or a negative error code on
+ * failure.
+ */
+int query_contains(const qelem * const query, fileptr inode) {
+  int count, res;
+  fileptr *tags;
+
+  if (!query) return -EINVAL;
+  tags = tags_from_inode(inode, &count);
+  if (!tags) return -EIO;
+  res = _query_contains(query, inode, tags, count);
+  ifree(tags);
+  return res;
+}
+
+/**
+ * Find the inode of the first QUERY_IS_INODE element of a query tree.
+ *
+ * @param root The root of the tree to search.
+ * @returns The inode, or zero if there is none.
+ */
+static fileptr _qtree_find_inode(const qelem *root) {
+  fileptr inode;
+  if (!root) return 0;
+  if (root->type == QUERY_IS_INODE) return root->inode;
+  if ((inode = _qtree_find_inode(root->next[0]))) return inode;
+  return _qtree_find_inode(root->next[1]);
+}
+
+/**
+ * Converts a path to a simple conjunctive query.
+ *
+ * @param path The (not necessarily canonical) path to be parsed.
+ * @returns A pointer to a tree structure representing the query, or NULL if an
+ * error occurred. If an error occurs, \c errno is set appropriately.
+ */
+qelem *path_to_query(const char *path) {
+  if (!path) return NULL;
+
+  char *dup = get_canonical_path_arena(path);
+  DEBUG("Canonical path: \"%s\"", path);
+  if (!dup || errno) {
+    DEBUG("Error in get_canonical_path_arena()");
+    if (dup) afree(dup);
+    errno=ENOENT;
+    return NULL;
+  }
+  char *tmp = dup;
+  qelem *qroot=NULL;
+
+  /* remove leading slash characters */
+  while (*tmp && *tmp=='/')
+    tmp++;
+
+  /* If we have a zero-length path, then that matches any tag */
+  if (!*tmp) {
+    DEBUG("Top-level ISANY");
+    qroot = _qtree_make_isany();
+
+  } else {
+    strtokenizer t;
+    char *bit;
+    int res = 0;
+    strsplit_foreach_inplace(t, bit, tmp, '/') {
+      if ((res = _path_to_query_proc(bit, &qroot))) break;
+    }
+
+    if (res==0) {
+      DEBUG("Success");
+    } else if (res==-ENOENT) {
+      DEBUG("A component of the path does not exist");
+      qtree_free(&qroot, 1);
+      afree(dup);
+      errno=ENOENT;
+      return NULL;
+    } else {
+      DEBUG("Problem parsing path component");
+      qtree_free(&qroot, 1);
+      afree(dup);
+      errno=-res;
+      return NULL;
+    }
+
+    if (_qtree_contains(qroot, QUERY_IS_INODE)) {
+      /* a file: check its own tags, as the query will never be listed */
+      if (query_contains(qroot, _qtree_find_inode(qroot)) <= 0) {
+        /* cannot find that inode with the query */
+        DEBUG("Could not find the given file");
+        qtree_free(&qroot, 1);
+        afree(dup);
+        errno=ENOENT;
+        return NULL;
+      }
+    }
+  }
+
+  DEBUG("Dumping tree...");
+  _qtree_dump(qroot, 0);
+  DEBUG("Tree dump done.");
+
+  afree(dup);
+  return qroot;
+}
+
+/**
+ * Work out what tags we should display, based on a query tree. If \a parent is
+ * an empty string, then we should display the root-level tags. Otherwise, we
+ * should display the subtags of \a parent. If the subtag name is longer than
+ * \a len then it will be truncated.
+ *
+ * @param[in]  query   The query tree to examine.
+ * @param[out] parent  Pointer to a string to be filled with the subtag parent.
+ * @param[in]  len     The maximum length for \a parent.
+ * @returns Zero on success, 1 on failure, or 2 if the query tree gives an
+ * ambiguous answer.
+ */
+int query_get_subtags(const qelem *query, char *parent, int len) {
+  if (!query || !parent) return 1;
+
+  /* Essentially just search the tree for incomplete tags */
+  switch (query->type) {
+    case QUERY_IS_ANY:
+    case QUERY_IS_INODE:
+    case QUERY_RANGE:
+      strncpy(parent, "", len);
+      return 0;
+      break;
+
+    case QUERY_IS:
+    case QUERY_IS_NOSUB:
+      if (last_char_in(query->tag)==INSIGHT_SUBKEY_IND_C) {
+        /* incomplete tag - aha! */
+        DEBUG("Found incomplete tag \"%s\"!", query->tag);
+        strncpy(parent, query->tag, len);
+        while (*parent && last_char_in(parent)==INSIGHT_SUBKEY_IND_C) {
+          last_char_in(parent)='\0';
+        }
+      } else {
+        /* complete tag */
+        DEBUG("Found complete tag \"%s\"", query->tag);
+        strncpy(parent, "", len);
+      }
+      return 0;
+      break;
+
+    case QUERY_NOT:
+      if (query->tag) {
+        if (last_char_in(query->tag)==INSIGHT_SUBKEY_IND_C) {
+          /* incomplete tag - aha! */
+          DEBUG("Found incomplete tag \"%s\"!", query->tag);
+          strncpy(parent, query->tag, len);
+          while (*parent && last_char_in(parent)==INSIGHT_SUBKEY_IND_C) {
+            last_char_in(parent)='\0';
+          }
+        } else {
+          /* complete tag */
+          DEBUG("Found complete tag \"%s\"", query->tag);
+          strncpy(parent, "", len);
+        }
+        return 0;
+      } else {
+        DEBUG("Recursing into NOT node");
+        return query_get_subtags(query->next[0], parent, len);
+      }
+      break;
+
+    /* Ambiguities can only arise when we have two tags to consider */
+    case QUERY_AND:
+    case QUERY_OR:
+      {
+        int wasset=0;
+
+        DEBUG("AND/OR: checking first branch");
+        int retval=query_get_subtags(query->next[0], parent, len);
+        if (retval) {
+          DEBUG("AND/OR: first branch returned an error");
+          return retval;
+        }
+        DEBUG("AND/OR: first branch gives us tag \"%s\"", parent);
+        wasset = (*parent) ? 1 : 0;
+
+        char *tmp;
+        if (wasset) {
+          tmp=calloc(len, sizeof(char));
+          if (!tmp) {
+            PMSG(LOG_ERR, "Failed to allocate space for temp string");
+            return 1;
+          }
+        } else {
+          tmp=parent;
+        }
+
+        DEBUG("AND/OR: checking second branch");
+        retval=query_get_subtags(query->next[1], tmp, len);
+        if (retval) {
+          DEBUG("AND/OR: second branch returned an error");
+          if (wasset) ifree(tmp);
+          return retval;
+        }
+        DEBUG("AND/OR: second branch gives us tag \"%s\"", tmp);
+
+        if (wasset && *tmp) {
+          PMSG(LOG_WARNING, "Ambiguous result detected in query tree!");
+          if (wasset) ifree(tmp);
+          return 2;
+        }
+
+        DEBUG("AND/OR: therefore our resulting tag is \"%s\"", parent);
+        if (wasset) ifree(tmp);
+        return 0;
+      }
+      break;
+
+    default:
+      PMSG(LOG_ERR, "Unrecognised query tree element type %d", query->type);
+      return 1;
+      break;
+  }
+
+  return 0;
+}
+
+/**
+ * Check whether a query tree was built from path components that (unlike
+ * tags) have no data block of their own: ranges of subtags and query
+ * expressions. Plain paths only ever produce conjunctions of tags and files.
+ *
+ * @param query The root of the query tree.
+ * @returns Non-zero if the tree contains a QUERY_RANGE, QUERY_OR or QUERY_NOT
+ * element.
+ */
+int query_has_virtual(const qelem *query) {
+  return _qtree_contains(query, QUERY_RANGE) || _qtree_contains(query, QUERY_OR) ||
+         _qtree_contains(query, QUERY_NOT);
+}
+
+/**
+ * Estimate the number of files a query matches from stored counts alone:
+ * tag statistics, data block and limbo counts. Nothing is walked or written,
+ * so this is cheap enough for getattr().
+ *
+ * @param query The root of the query tree.
+ * @returns The estimated number of files, or -1 if some term has no stored
+ * count (a tag without statistics, a range or a negation).
+ */
+long query_estimate(const qelem *query) {
+  long est1, est2;
+  fileptr dblock;
+  tdata datablock;
+  tstats stats;
+
+  if (!query) return -1;
+  switch (query->type) {
+    case QUERY_IS_ANY:
+      return inode_get_all(0, NULL, 0);
+
+    case QUERY_IS:
+    case QUERY_IS_NOSUB:
+      if (!(dblock = get_tag(query->tag))) return 0;
+      if (query->type==QUERY_IS) {
+        return tag_stats_get(dblock, &stats) ? -1 : (long)stats.closure;
+      }
+      if (tree_read(dblock, (tblock*)&datablock)) {
+        PMSG(LOG_ERR, "I/O error reading block\n");
+        return -1;
+      }
+      return datablock.inodecount;
+
+    case QUERY_IS_INODE:
+      return 1;
+
+    case QUERY_AND:
+      if ((est1 = _qplan_pair_cost(query->next[0], query->next[1])) >= 0) {
+        return est1;
+      }
+      /* fall through */
+    case QUERY_OR:
+      if ((est1 = query_estimate(query->next[0])) < 0 ||
+          (est2 = query_estimate(query->next[1])) < 0) {
+        return -1;
+      }
+      if (query->type==QUERY_AND) return MIN(est1, est2);
+      return (est1 > LONG_MAX - est2) ? LONG_MAX : est1 + est2;
+
+    default:
+      return -1;
+  }
+}
+
+/**
+ * Check whether an AND cursor is unread and all of its subcursors are arrays,
+ * as they are for conjunctions of tags with subtags, so that it can be
+ * evaluated with set_intersect_n_inode() rather than joined one inode at a
+ * time.
+ *
+ * @param cur The AND cursor.
+ * @returns Non-zero if every subcursor is an array.
+ */
+static int _qcursor_and_arrays(const qcursor *cur) {
+  int i;
+  if (cur->type != QCURSOR_AND || cur->state[0]) return 0;
+  for (i=0; i<cur->nsubs && cur->subs[i]->type == QCURSOR_ARRAY; i++);
+  return i == cur->nsubs;
+}
+
+/**
+ * Gather the unread parts of the array subcursors of an AND cursor, for
+ * set_intersect_n_inode().
+ *
+ * @param[in]  cur    The AND cursor.
+ * @param[out] sets   The unread part of each subcursor's array.
+ * @param[out] counts The number of unread inodes in each array.
+ * @returns The smallest number of unread inodes, or -ENOMEM.
+ */
+static int _qcursor_and_gather(const qcursor *cur, const fileptr ***sets, size_t **counts) {
+  int i, min=-1;
+
+  *sets = malloc(cur->nsubs * sizeof(fileptr*));
+  *counts = malloc(cur->nsubs * sizeof(size_t));
+  if (!*sets || !*counts) {
+    PMSG(LOG_ERR, "Failed to allocate memory for intersection");
+    if (*sets) ifree(*sets);
+    if (*counts) ifree(*counts);
+    return -ENOMEM;
+  }
+  for (i=0; i<cur->nsubs; i++) {
+    qcursor *sub = cur->subs[i];
+    (*sets)[i] = sub->list + sub->pos;
+    (*counts)[i] = sub->count - sub->pos;
+    if (min < 0 || sub->count - sub->pos < min) min = sub->count - sub->pos;
+  }
+  return min;
+}
+
+/**
+ * Turn an unread AND cursor over arrays into an array cursor holding their
+ * intersection. The arrays are intersected in one go, smallest first, which
+ * beats seeking through them one result at a time.
+ *
+ * @param cur The AND cursor. Its subcursors are closed.
+ * @returns Zero on success, or a negative error code on failure.
+ */
+static int _qcursor_and_flatten(qcursor *cur) {
+  const fileptr **sets;
+  size_t *counts;
+  fileptr *list;
+  int i, count;
+
+  if ((count = _qcursor_and_gather(cur, &sets, &counts)) < 0) return count;
+  if (!(list = malloc((count ? count : 1) * sizeof(fileptr)))) {
+    PMSG(LOG_ERR, "Failed to allocate memory for intersection");
+    ifree(sets);
+    ifree(counts);
+    return -ENOMEM;
+  }
+  count = count ? set_intersect_n_inode(sets, counts, cur->nsubs, list, count) : 0;
+  ifree(sets);
+  ifree(counts);
+  if (count < 0) {
+    ifree(list);
+    return count;
+  }
+
+  for (i=0; i<cur->nsubs; i++) {
+    query_cursor_close(&cur->subs[i]);
+  }
+  ifree(cur->subs);
+  ifree(cur->heads);
+  cur->subs = NULL;
+  cur->heads = NULL;
+  cur->nsubs = 0;
+  cur->type = QCURSOR_ARRAY;
+  cur->list = list;
+  cur->count = count;
+  cur->pos = 0;
+  return 0;
+}
+
+/**
+ * Count the inodes in the intersection of an AND cursor whose subcursors are
+ * all unread arrays. All but the largest array are intersected, smallest
+ * first, so that a narrow tag is searched for in the wide ones rather than
+ * merged with them, and the intersection with the largest is only counted.
+ *
+ * @param cur The AND cursor. Its subcursors are reordered.
+ * @returns The number of inodes, or a negative error code on failure.
+ */
+static int _qcursor_count_and(qcursor *cur) {
+  qcursor **subs = cur->subs;
+  const fileptr **sets;
+  size_t *counts;
+  fileptr *buf;
+  int i, j, k = cur->nsubs, count;
+
+  /* order by size; there are only ever a handful */
+  for (i=1; i<k; i++) {
+    qcursor *sub = subs[i];
+    for (j=i; j>0 && subs[j-1]->count - subs[j-1]->pos > sub->count - sub->pos; j--) {
+      subs[j] = subs[j-1];
+    }
+    subs[j] = sub;
+  }
+  count = subs[0]->count - subs[0]->pos;
+  if (!count) return 0;
+  if (k == 2) {
+    return set_intersect_count_inode(subs[0]->list + subs[0]->pos, subs[1]->list + subs[1]->pos,
+                                     count, subs[1]->count - subs[1]->pos);
+  }
+
+  if ((count = _qcursor_and_gather(cur, &sets, &counts)) < 0) return count;
+  if (!(buf = malloc(count * sizeof(fileptr)))) {
+    PMSG(LOG_ERR, "Failed to allocate memory for intersection");
+    count = -ENOMEM;
+  } else {
+    count = set_intersect_n_inode(sets, counts, k-1, buf, count);
+    if (count > 0) {
+      count = set_intersect_count_inode(buf, sets[k-1], count, counts[k-1]);
+    }
+    ifree(buf);
+  }
+  ifree(sets);
+  ifree(counts);
+  return count;
+}
+
+/**
+ * Count the inodes left in a cursor. Arrays are counted directly, and unread
+ * conjunctions of arrays (such as tags with subtags) are intersected without
+ * writing out the result; anything else is read to the end.
+ *
+ * @param cur The cursor to count. It is left in an unspecified position.
+ * @returns The number of inodes, or a negative error code on failure.
+ */
+static int _qcursor_count(qcursor *cur) {
+  fileptr inode;
+  int count=0, res;
+
+  if (cur->type == QCURSOR_ARRAY) {
+    return cur->count - cur->pos;
+  }
+  if (_qcursor_and_arrays(cur)) {
+    return _qcursor_count_and(cur);
+  }
+  while ((res = query_cursor_next(cur, &inode)) == 1) {
+    count++;
+  }
+  return res ? res : count;
+}
+
+/**
+ * Get number of inodes a query would return. May be optimised.
+ *
+ * @param query The root of the query to use.
+ * @returns The number of inodes that would be found by the query.
+ */
+int query_inode_count(const qelem * const query) {
+  int count=0, neg=0;
+  qcursor *cur = query_cursor_open(query, &neg);
+  if (cur && neg) {
+    cur = query_cursor_complement(cur);
+  }
+  if (!cur) {
+    DEBUG("Error");
+    return 0;
+  }
+  count = _qcursor_count(cur);
+  query_cursor_close(&cur);
+  return (count < 0) ? 0 : count;
+}
+
+/**
+ * Get inode list from query tree. The returned list is allocated with malloc()
+ * and should be freed with free().
+ *
+ * @param query The root of the query tree to calculate the inode list for.
+ * @param count The number of inodes in the returned list.
+ * @param neg   True if the query results should be negated.
+ * @returns The list of inodes available given the query tree, or NULL on error
+ * or if count is zero.
+ */
+fileptr *query_to_inodes(const qelem * const query, int * const count, int * const neg) {
+  fileptr *inodes, inode;
+  int size = 64, res;
+  qcursor *cur;
+
+  DEBUG("Function entry");
+  if (!query) {
+    PMSG(LOG_ERR, "Query was null");
+    return NULL;
+  }
+  if (!count) {
+    PMSG(LOG_ERR, "Count was null");
     return NULL;
   }
   if (!neg) {
     PMSG(LOG_ERR, "Neg was null");
     return NULL;
   }
+
+  /* the query is evaluated as a tree of cursors, so conjunctions only read
+   * the parts of each inode list near the result */
+  cur = query_cursor_open(query, neg);
+  if (!cur) {
+    DEBUG("Failed to open query cursor");
+    return NULL;
+  }
+  *count = 0;
+  inodes = malloc(size * sizeof(fileptr));
+  if (!inodes) {
+    PMSG(LOG_ERR, "Failed to allocate memory for return array");
+    query_cursor_close(&cur);
+    return NULL;
+  }
+  while ((res = query_cursor_next(cur, &inode)) == 1) {
+    if (*count == size) {
+      fileptr *tmp = realloc(inodes, size * 2 * sizeof(fileptr));
+      if (!tmp) {
+        PMSG(LOG_ERR, "Failed to allocate memory for return array");
+        res = -ENOMEM;
+        break;
+      }
+      inodes = tmp;
+      size *= 2;
+    }
+    inodes[(*count)++] = inode;
+  }
+  query_cursor_close(&cur);
+  if (res < 0) {
+    DEBUG("Error reading query cursor: %s", strerror(-res));
+    ifree(inodes);
+    return NULL;
+  }
+  DEBUG("Query produced %d inodes, negation %d", *count, *neg);
+  return inodes;
+}
+
+/**
+ * Allocate a query cursor of the given type.
+ *
+ * @param type The type of cursor.
+ * @returns The new cursor, or NULL if memory could not be allocated.
+ */
+static qcursor *_qcursor_make(enum qcursor_type type) {
+  qcursor *cur = calloc(1, sizeof(qcursor));
+  if (!cur) {
+    PMSG(LOG_ERR, "Failed to allocate space for query cursor");
+    errno = ENOMEM;
+    return NULL;
+  }
+  cur->type = type;
+  return cur;
+}
+
+/**
+ * Make a cursor combining two subcursors. If either subcursor is NULL, the
+ * other is closed and NULL is returned.
+ *
+ * @param type The type of cursor (QCURSOR_OR or QCURSOR_DIFF).
+ * @param sub1 The first subcursor.
+ * @param sub2 The second subcursor.
+ * @returns The new cursor, or NULL on error.
+ */
+static qcursor *_qcursor_make_pair(enum qcursor_type type, qcursor *sub1, qcursor *sub2) {
+  qcursor *cur = (sub1 && sub2) ? _qcursor_make(type) : NULL;
+  if (!cur) {
+    query_cursor_close(&sub1);
+    query_cursor_close(&sub2);
+    return NULL;
+  }
+  cur->sub[0] = sub1;
+  cur->sub[1] = sub2;
+  return cur;
+}
+
+/**
+ * Make a cursor producing the inodes common to two subcursors. AND cursors
+ * among the subcursors are absorbed, so a chain of conjunctions becomes a
+ * single leapfrog join over all of its operands. If either subcursor is NULL,
+ * the other is closed and NULL is returned.
+ *
+ * @param sub1 The first subcursor.
+ * @param sub2 The second subcursor.
+ * @returns The new cursor, or NULL on error.
+ */
+static qcursor *_qcursor_make_and(qcursor *sub1, qcursor *sub2) {
+  qcursor *parts[2] = {sub1, sub2};
+  qcursor *cur = NULL;
+  int i, n=0;
+
+  if (sub1 && sub2) {
+    for (i=0; i<2; i++) {
+      n += (parts[i]->type == QCURSOR_AND) ? parts[i]->nsubs : 1;
+    }
+    cur = _qcursor_make(QCURSOR_AND);
+  }
+  if (cur && (!(cur->subs = calloc(n, sizeof(qcursor*))) || !(cur->heads = calloc(n, sizeof(fileptr))))) {
+    PMSG(LOG_ERR, "Failed to allocate space for query cursor");
+    errno = ENOMEM;
+    query_cursor_close(&cur);
+  }
+  if (!cur) {
+    query_cursor_close(&sub1);
+    query_cursor_close(&sub2);
+    return NULL;
+  }
+
+  for (i=0; i<2; i++) {
+    if (parts[i]->type == QCURSOR_AND) {
+      memcpy(cur->subs + cur->nsubs, parts[i]->subs, parts[i]->nsubs * sizeof(qcursor*));
+      cur->nsubs += parts[i]->nsubs;
+      parts[i]->nsubs = 0;
+      query_cursor_close(&parts[i]);
+    } else {
+      cur->subs[cur->nsubs++] = parts[i];
+    }
+  }
+  return cur;
+}
+
+/**
+ * Sort the subcursors of an AND cursor by their buffered inodes. There are
+ * only ever a handful, so an insertion sort is plenty.
+ *
+ * @param cur The AND cursor to sort.
+ */
+static void _qcursor_leapfrog_sort(qcursor *cur) {
+  int i, j;
+  for (i=1; i<cur->nsubs; i++) {
+    qcursor *sub = cur->subs[i];
+    fileptr head = cur->heads[i];
+    for (j=i; j>0 && cur->heads[j-1] > head; j--) {
+      cur->subs[j] = cur->subs[j-1];
+      cur->heads[j] = cur->heads[j-1];
+    }
+    cur->subs[j] = sub;
+    cur->heads[j] = head;
+  }
+}
+
+/**
+ * Run the leapfrog join of an AND cursor until every subcursor has buffered
+ * the same inode. The buffered inodes must be in cyclic ascending order
+ * starting at \a pos, so the largest is just before it; the subcursor at
+ * \a pos repeatedly seeks to the largest, overtaking it.
+ *
+ * @param cur The AND cursor.
+ * @returns One if the subcursors agree on <tt>cur->heads[cur->pos]</tt>, zero
+ * if one of them is exhausted, or a negative error code on failure.
+ */
+static int _qcursor_leapfrog_search(qcursor *cur) {
+  int k = cur->nsubs, res;
+  fileptr max = cur->heads[(cur->pos + k - 1) % k];
+
+  while (cur->heads[cur->pos] != max) {
+    if ((res = query_cursor_seek(cur->subs[cur->pos], max))) return res;
+    if ((res = query_cursor_next(cur->subs[cur->pos], &cur->heads[cur->pos])) <= 0) return res;
+    max = cur->heads[cur->pos];
+    cur->pos = (cur->pos + 1) % k;
+  }
+  return 1;
+}
+
+/**
+ * Make a cursor over the inodes of a tag.
+ *
+ * @param tag     The tag name.
+ * @param recurse Non-zero if inodes of subtags should be included.
+ * @returns The new cursor, or NULL on error.
+ */
+static qcursor *_qcursor_make_tag(const char *tag, int recurse) {
+  fileptr dblock = get_tag(tag);
+  qcursor *cur;
+
+  if (!dblock) {
+    DEBUG("Tag \"%s\" not found; empty cursor", tag);
+    return _qcursor_make(QCURSOR_ARRAY);
+  }
+
+  if (recurse) {
+    tdata datablock;
+    if (tree_read(dblock, (tblock*)&datablock)) {
+      PMSG(LOG_ERR, "I/O error reading block\n");
+      errno = EIO;
+      return NULL;
+    }
+    if (datablock.subkeys) {
+      /* subtags have to be merged, so materialise the recursive union */
+      DEBUG("Tag \"%s\" has subtags; fetching recursive list", tag);
+      cur = _qcursor_make(QCURSOR_ARRAY);
+      if (!cur) return NULL;
+      cur->list = inode_get_all_recurse(dblock, &cur->count);
+      if (!cur->list) {
+        ifree(cur);
+        return NULL;
+      }
+      return cur;
+    }
+  }
+
+  cur = _qcursor_make(QCURSOR_INODES);
+  if (!cur) return NULL;
+  cur->inodes = inode_cursor_open(dblock);
+  if (!cur->inodes) {
+    ifree(cur);
+    return NULL;
+  }
+  return cur;
+}
+
+/**
+ * Refill a QCURSOR_FILES cursor with the inodes of the next inode tree leaf.
+ * Inode tree keys are fixed-width hexadecimal, so key order is inode order.
+ *
+ * @param cur The cursor to refill.
+ * @returns Zero on success (the buffer is empty at the end of the tree), or a
+ * negative error code on failure.
+ */
+static int _qcursor_files_fill(qcursor *cur) {
+  tnode node;
+  int i;
+
+  cur->count = cur->pos = 0;
+  while (!cur->count) {
+    if (!cur->state[0]) {
+      cur->state[0] = 1;
+      int res = tree_sub_get_min(tree_get_iroot(), &node);
+      if (res) {
+        PMSG(LOG_ERR, "IO error: tree_sub_get_min() failed: %s\n", strerror(res));
+        return -res;
+      }
+    } else if (!cur->leaf) {
+      return 0;
+    } else if (tree_read(cur->leaf, (tblock*)&node)) {
+      PMSG(LOG_ERR, "I/O error reading block\n");
+      return -EIO;
+    }
+    for (i=0; i<node.keycount; i++) {
+      cur->list[i] = strtoul(node.keys[i], NULL, 16);
+    }
+    cur->count = node.keycount;
+    cur->leaf = node.ptrs[0];
+  }
+  return 0;
+}
+
+/**
+ * Turn a cursor over a negated result into a cursor over the files that are
+ * NOT in that result. Tagged files and files in limbo are streamed and
+ * filtered, so the set of all files is never held in memory.
+ *
+ * @param cur The cursor over the negated result. On failure it is closed.
+ * @returns The complement cursor, or NULL on error.
+ */
+qcursor *query_cursor_complement(qcursor *cur) {
+  qcursor *files = _qcursor_make(QCURSOR_FILES);
+  qcursor *limbo = _qcursor_make(QCURSOR_INODES);
+
+  if (files && !(files->list = malloc((ORDER-1)*sizeof(fileptr)))) {
+    PMSG(LOG_ERR, "Failed to allocate space for query cursor");
+    errno = ENOMEM;
+    query_cursor_close(&files);
+  }
+  if (limbo && !(limbo->inodes = inode_cursor_open(0))) {
+    query_cursor_close(&limbo);
+  }
+  return _qcursor_make_pair(QCURSOR_DIFF, _qcursor_make_pair(QCURSOR_OR, files, limbo), cur);
+}
+
+/**
+ * Open a streaming cursor over the results of a query. As for
+ * query_to_inodes(), the results may be negated, in which case the cursor
+ * produces the inodes that do NOT match the query.
+ *
+ * @param query The root of the query tree.
+ * @param neg   Set to true if the cursor results should be negated.
+ * @returns A cursor to be closed with query_cursor_close(), or NULL on error
+ * (with \c errno set appropriately).
+ */
+qcursor *query_cursor_open(const qelem * const query, int * const neg) {
+  qcursor *cur;
+  int neg1=0, neg2=0;
+
+  if (!query || !neg) {
+    PMSG(LOG_ERR, "Query or neg was null");
+    errno = EINVAL;
+    return NULL;
+  }
+
   switch (query->type) {
     case QUERY_IS_ANY:
-      /* IS_ANY node, output set is the set of limbo inodes, with internal
-       * negation flag set to false
-       */
-      DEBUG("IS_ANY: creating list of limbo inodes, negation 0");
+      DEBUG("IS_ANY: cursor over limbo inodes, negation 0");
       *neg=0;
-      *count = inode_get_all(0, NULL, 0);
-      if (*count>0) {
-        fileptr *inodes = calloc(*count, sizeof(fileptr));
-        inode_get_all(0, inodes, *count);
-        return inodes;
-      } else if (*count==0) {
-        /* empty return list to avoid error; must still be freed though */
-        return calloc(1, sizeof(fileptr));
-      } else if (*count<0) {
-        DEBUG("Error calling inode_get_all(): %s", strerror(-*count));
-        return NULL;
+      cur = _qcursor_make(QCURSOR_INODES);
+      if (cur && !(cur->inodes = inode_cursor_open(0))) {
+        ifree(cur);
       }
-      break;
+      return cur;
 
     case QUERY_IS:
-      /* IS node, the output set is the recursive union of the inodes belonging
-       * to that tag and its subtags, with internal negation flag set to false
-       */
-      {
-        fileptr dblock = get_tag(query->tag);
+    case QUERY_IS_NOSUB:
+      DEBUG("IS: cursor over tag \"%s\", negation 0", query->tag);
+      *neg=0;
+      return _qcursor_make_tag(query->tag, query->type==QUERY_IS);
 
-        DEBUG("IS: fetching recursive list of inodes from block %lu, negation 0", dblock);
-        *neg=0;
-        fileptr *inodes = inode_get_all_recurse(dblock, count);
-        DEBUG("IS: %d inodes in block %lu", *count, dblock);
-        if (inodes && *count>=0) {
-          return inodes;
-        } else {
-          if (inodes) ifree(inodes);
-          DEBUG("Error calling inode_get_all(): %s", strerror(-*count));
-          return NULL;
-        }
+    case QUERY_IS_INODE:
+      DEBUG("IS_INODE: single inode 0x%08lx, negation 0", query->inode);
+      *neg=0;
+      cur = _qcursor_make(QCURSOR_ARRAY);
+      if (!cur) return NULL;
+      cur->list = malloc(sizeof(fileptr));
+      if (!cur->list) {
+        PMSG(LOG_ERR, "Failed to allocate space for query cursor");
+        ifree(cur);
+        errno = ENOMEM;
+        return NULL;
       }
-      break;
+      cur->list[0] = query->inode;
+      cur->count = 1;
+      return cur;
 
-    case QUERY_IS_NOSUB:
-      /* IS_NOSUB node, the output set is the set of inodes belonging tag, with
-       * internal negation flag set to false
-       */
+    case QUERY_RANGE:
       {
-        fileptr dblock = get_tag(query->tag);
-
-        DEBUG("IS_NOSUB: creating list of inodes from block %lu, negation 0", dblock);
+        fileptr base = _qtree_range_base(query);
+        DEBUG("RANGE: cursor over subtags of \"%s\", negation 0", query->tag);
         *neg=0;
-        *count = inode_get_all(dblock, NULL, 0);
-        DEBUG("IS_NOSUB: %d inodes in block %lu", *count, dblock);
-        if (*count>0) {
-          fileptr *inodes = calloc(*count, sizeof(fileptr));
-          inode_get_all(dblock, inodes, *count);
-          return inodes;
-        } else if (*count==0) {
-          /* empty return list to avoid error; must still be freed though */
-          return calloc(1, sizeof(fileptr));
-        } else if (*count<0) {
-          DEBUG("Error calling inode_get_all(): %s", strerror(-*count));
+        cur = _qcursor_make(QCURSOR_ARRAY);
+        if (!cur || !base) return cur;
+        cur->list = inode_get_all_range(base, query->lo, query->hi, &cur->count);
+        if (!cur->list) {
+          ifree(cur);
           return NULL;
         }
+        return cur;
       }
-      break;
-
-    case QUERY_IS_INODE:
-      /* IS_INODE node, the output set contains a single element: the inode. */
-      {
-        fileptr *ret = calloc(1, sizeof(fileptr));
-        DEBUG("IS_INODE: single inode 0x%08lx, negation 0", query->inode);
-        *count=1;
-        *neg=0;
-        *ret=query->inode;
-        return ret;
-      }
-      break;
 
     case QUERY_NOT:
       if (query->tag) {
-        /* IS_NOT node with a tag, the output set is the same as for an IS
-         * node, with an internal negation flag set to true */
-        PMSG(LOG_ERR, "Unhandled type of NOT query! Tag is available.");
-        return NULL;
+        DEBUG("NOT: cursor over tag \"%s\", negation 1", query->tag);
+        *neg=1;
+        return _qcursor_make_tag(query->tag, 1);
       } else if (query->next[0]) {
-        /* IS_NOT node with a subquery, the output set is identical to the
-         * subquery resultset, with an internal negation flag inverted */
-        fileptr *res = query_to_inodes(query, count, neg);
+        cur = query_cursor_open(query->next[0], neg);
         *neg = !*neg;
-        return res;
-      } else {
-        PMSG(LOG_ERR, "Unknown type of NOT query! Both tag and next[0] are null.");
-        return NULL;
+        return cur;
       }
-      break;
+      PMSG(LOG_ERR, "Unknown type of NOT query! Both tag and next[0] are null.");
+      errno = EINVAL;
+      return NULL;
 
     case QUERY_AND:
-      /* AND node output depends on the negation flags of its subqueries:
-       *  * Both false: output is the set intersection of its subqueries, with
-       *  negation flag clear
-       *  * Both true: output is union of subqueries, with negation flag set
-       *  * Otherwise: output is set difference, with the negation-true set
-       *  removed from the negation-false set, and the negation flag cleared
-       */
+    case QUERY_OR:
       {
-        DEBUG("AND: Conjunction of two query subtrees");
-        int count1=0, count2=0, neg1=0, neg2=0;
-        fileptr *res1 = query_to_inodes(query->next[0], &count1, &neg1);
-        if (!res1) {
-          DEBUG("Error in left branch");
-          return NULL;
+        qcursor *cur1 = query_cursor_open(query->next[0], &neg1);
+        qcursor *cur2 = cur1 ? query_cursor_open(query->next[1], &neg2) : NULL;
+        /* an OR is an AND of the negated subqueries, negated */
+        int or = (query->type==QUERY_OR);
+        if (or) {
+          neg1 = !neg1;
+          neg2 = !neg2;
         }
-        if (!count1 && !neg1) {
-          /* short-circuit query evaluation */
-          DEBUG("Short-circuit: first branch yielded no results");
-          *count=0;
-          *neg=neg1;
-          return res1;
-        }
-        fileptr *res2 = query_to_inodes(query->next[1], &count2, &neg2);
-        if (!res2) {
-          DEBUG("Error in right branch");
-          ifree(res1);
-          return NULL;
-        }
-        if (!count2 && !neg2) {
-          /* no need to perform set operations */
-          DEBUG("Short-circuit: second branch yielded no results");
-          *count=0;
-          *neg=neg2;
-          ifree(res1);
-          return res2;
-        }
-        /* both subtrees returned results */
         if (!neg1 && !neg2) {
-          fileptr *res = calloc(MIN(count1, count2), sizeof(fileptr));
-          if (!res) {
-            PMSG(LOG_ERR, "Failed to allocate memory for return array");
-            ifree(res1);
-            ifree(res2);
-            return NULL;
-          }
-          /* output is the intersection of subqueries, with negation flag clear */
-          *neg=0;
-          *count=set_intersect(res1, res2, res, count1, count2, MIN(count1, count2), sizeof(fileptr), inodecmp);
-          if (*count < 0) {
-            PMSG(LOG_ERR, "Error in set intersection operation.");
-            ifree(res1);
-            ifree(res2);
-            ifree(res);
-            return NULL;
-          } else {
-            DEBUG("Set intersection succeeded; %d results", *count);
-            ifree(res1);
-            ifree(res2);
-            return res;
-          }
-        /* } else if (neg1 && neg2) { */
-          /* output is union of subqueries, with negation flag set */
-        /* } else { */
-          /* output is set difference, with the negation-true set removed from
-           * the negation-false set, and the negation flag cleared */
+          *neg=or;
+          return _qcursor_make_and(cur1, cur2);
+        } else if (neg1 && neg2) {
+          *neg=!or;
+          return _qcursor_make_pair(QCURSOR_OR, cur1, cur2);
+        } else if (neg2) {
+          *neg=or;
+          return _qcursor_make_pair(QCURSOR_DIFF, cur1, cur2);
         } else {
-          PMSG(LOG_ERR, "Unhandled case in AND");
-          ifree(res1);
-          ifree(res2);
-          return NULL;
+          *neg=or;
+          return _qcursor_make_pair(QCURSOR_DIFF, cur2, cur1);
         }
       }
-      break;
 
-    case QUERY_OR:
-      /* OR node output depends on the negation flags of its subqueries:
-       *  * Both false: output is union of subquery results, with negation flag
-       *  clear
-       *  * Both true: output is intersection of subquery results, with
-       *  negation flag set
-       *  * Otherwise: output is ???
-       */
-      {
-        PMSG(LOG_ERR, "Cannot handle OR queries yet!");
-        return NULL;
+    default:
+      PMSG(LOG_ERR, "Unknown query tree element type %d!", query->type);
+      errno = EINVAL;
+      return NULL;
+  }
+}
 
-        DEBUG("OR: Disjunction of two query subtrees");
-        int count1=0, count2=0, neg1=0, neg2=0;
-        fileptr *res1 = query_to_inodes(query->next[0], &count1, &neg1);
-        if (!res1) {
-          DEBUG("Error in left branch");
-          return NULL;
+/**
+ * Fetch the next inode from a query cursor.
+ *
+ * @param[in]  cur   The cursor to read from.
+ * @param[out] inode Filled with the next inode, if there is one.
+ * @returns One if an inode was produced, zero if the cursor is exhausted, or a
+ * negative error code on failure.
+ */
+int query_cursor_next(qcursor *cur, fileptr *inode) {
+  fileptr a;
+  int res, i;
+
+  switch (cur->type) {
+    case QCURSOR_INODES:
+      return inode_cursor_next(cur->inodes, inode);
+
+    case QCURSOR_ARRAY:
+      if (cur->pos >= cur->count) return 0;
+      *inode = cur->list[cur->pos++];
+      return 1;
+
+    case QCURSOR_AND:
+      /* state[0] is 0 before the first read, 1 once the subcursors are
+       * buffered, 2 once their common inode has been produced, and -1 when
+       * the join is exhausted */
+      if (cur->state[0] < 0) return 0;
+      if (_qcursor_and_arrays(cur)) {
+        if ((res = _qcursor_and_flatten(cur))) return res;
+        return query_cursor_next(cur, inode);
+      }
+      res = 1;
+      if (!cur->state[0]) {
+        for (i=0; i<cur->nsubs && res > 0; i++) {
+          res = query_cursor_next(cur->subs[i], &cur->heads[i]);
         }
-        fileptr *res2 = query_to_inodes(query->next[1], &count2, &neg2);
-        if (!res2) {
-          DEBUG("Error in right branch");
-          ifree(res1);
-          return NULL;
+        _qcursor_leapfrog_sort(cur);
+        cur->pos = 0;
+      } else if (cur->state[0] == 2) {
+        /* every subcursor is at the last result; move one of them on */
+        res = query_cursor_next(cur->subs[cur->pos], &cur->heads[cur->pos]);
+        cur->pos = (cur->pos + 1) % cur->nsubs;
+      }
+      if (res > 0) res = _qcursor_leapfrog_search(cur);
+      if (res <= 0) {
+        if (!res) cur->state[0] = -1;
+        return res;
+      }
+      cur->state[0] = 2;
+      *inode = cur->heads[cur->pos];
+      return 1;
+
+    case QCURSOR_OR:
+      for (i=0; i<2; i++) {
+        if (!cur->state[i]) {
+          res = query_cursor_next(cur->sub[i], &cur->head[i]);
+          if (res < 0) return res;
+          cur->state[i] = res ? 1 : -1;
         }
-        if (!count1 && !neg1) {
-          /* no need to perform set operations */
-          DEBUG("Short-circuit: first branch yielded no results");
-          *count=0;
-          *neg=neg2;
-          ifree(res1);
-          return res2;
+      }
+      if (cur->state[0] < 0 && cur->state[1] < 0) return 0;
+      i = (cur->state[1] < 0 || (cur->state[0] > 0 && cur->head[0] <= cur->head[1])) ? 0 : 1;
+      *inode = cur->head[i];
+      cur->state[i] = 0;
+      if (cur->state[!i] > 0 && cur->head[!i] == *inode) {
+        cur->state[!i] = 0;
+      }
+      return 1;
+
+    case QCURSOR_DIFF:
+      while ((res = query_cursor_next(cur->sub[0], &a)) == 1) {
+        if (cur->state[1] > 0 && cur->head[1] < a) {
+          cur->state[1] = 0;
         }
-        if (!count2 && !neg2) {
-          /* no need to perform set operations */
-          DEBUG("Short-circuit: second branch yielded no results");
-          *count=0;
-          *neg=neg1;
-          ifree(res2);
-          return res1;
+        if (!cur->state[1]) {
+          if ((res = query_cursor_seek(cur->sub[1], a))) return res;
+          res = query_cursor_next(cur->sub[1], &cur->head[1]);
+          if (res < 0) return res;
+          cur->state[1] = res ? 1 : -1;
         }
-        /* both subtrees returned results */
-        if (!neg1 && !neg2) {
-          fileptr *res = calloc(count1 + count2, sizeof(fileptr));
-          if (!res) {
-            PMSG(LOG_ERR, "Failed to allocate memory for return array");
-            ifree(res1);
-            ifree(res2);
-            return NULL;
-          }
-          /* output is the union of subqueries, with negation flag clear */
-          *neg=0;
-          *count=set_union(res1, res2, res, count1, count2, MIN(count1, count2), sizeof(fileptr), inodecmp);
-          if (*count < 0) {
-            PMSG(LOG_ERR, "Error in set union operation.");
-            ifree(res1);
-            ifree(res2);
-            ifree(res);
-            return NULL;
-          } else {
-            DEBUG("Set union succeeded; %d results", *count);
-            ifree(res1);
-            ifree(res2);
-            return res;
-          }
-        /* } else if (neg1 && neg2) { */
-          /* output is union of subqueries, with negation flag set */
-        /* } else { */
-          /* output is set difference, with the negation-true set removed from
-           * the negation-false set, and the negation flag cleared */
+        if (cur->state[1] > 0 && cur->head[1] == a) continue;
+        *inode = a;
+        return 1;
+      }
+      return res;
+
+    case QCURSOR_FILES:
+      while (cur->pos >= cur->count) {
+        if (cur->state[0] && !cur->leaf) return 0;
+        if ((res = _qcursor_files_fill(cur))) return res;
+      }
+      *inode = cur->list[cur->pos++];
+      return 1;
+
+    case QCURSOR_RECORD:
+      res = query_cursor_next(cur->sub[0], inode);
+      if (cur->state[0] && res == 1) {
+        if (cur->count == QUERY_CACHE_MAX_INODES) {
+          DEBUG("Result too large to cache");
+          cur->state[0] = 0;
+          ifree(cur->list);
         } else {
-          PMSG(LOG_ERR, "Unhandled case in AND");
-          ifree(res1);
-          ifree(res2);
-          return NULL;
+          /* pos holds the allocated size of the list while recording */
+          if (cur->count == cur->pos) {
+            fileptr *tmp = realloc(cur->list, (cur->pos ? cur->pos*2 : 64) * sizeof(fileptr));
+            if (!tmp) {
+              cur->state[0] = 0;
+              if (cur->list) ifree(cur->list);
+              return res;
+            }
+            cur->list = tmp;
+            cur->pos = cur->pos ? cur->pos*2 : 64;
+          }
+          cur->list[cur->count++] = *inode;
         }
+      } else if (cur->state[0] && !res) {
+        _qcache_store(cur->key, cur->list, cur->count);
+        cur->state[0] = 0;
+        cur->list = NULL;
       }
-      break;
+      return res;
+  }
+  return -EINVAL;
+}
 
-    default:
-      PMSG(LOG_ERR, "Unknown query tree element type %d!", query->type);
-      return NULL;
+/**
+ * Move a query cursor forward so that the next inode it produces is the first
+ * one not less than \a target. Cursors only move forward.
+ *
+ * @param cur    The cursor to move.
+ * @param target The inode to seek to.
+ * @returns Zero on success, or a negative error code on failure.
+ */
+int query_cursor_seek(qcursor *cur, fileptr target) {
+  int res, i;
+
+  switch (cur->type) {
+    case QCURSOR_INODES:
+      return inode_cursor_seek(cur->inodes, target);
+
+    case QCURSOR_FILES:
+      /* leaves are chained, so skip whole leaves below the target */
+      while (cur->pos >= cur->count || cur->list[cur->count-1] < target) {
+        if (cur->state[0] && !cur->leaf) {
+          cur->pos = cur->count;
+          return 0;
+        }
+        if ((res = _qcursor_files_fill(cur))) return res;
+      }
+      /* fall through */
+
+    case QCURSOR_ARRAY:
+      {
+        /* gallop forward from the current position, then binary search */
+        int lo = cur->pos, hi, step = 1;
+        while (lo + step < cur->count && cur->list[lo + step - 1] < target) {
+          lo += step;
+          step *= 2;
+        }
+        hi = MIN(lo + step, cur->count);
+        while (lo < hi) {
+          int mid = lo + (hi-lo)/2;
+          if (cur->list[mid] < target)
+            lo = mid+1;
+          else
+            hi = mid;
+        }
+        cur->pos = lo;
+      }
+      return 0;
+
+    case QCURSOR_AND:
+      if (cur->state[0] < 0) return 0;
+      if (!cur->state[0]) {
+        for (i=0; i<cur->nsubs; i++) {
+          if ((res = query_cursor_seek(cur->subs[i], target))) return res;
+        }
+        return 0;
+      }
+      if (cur->state[0] == 2 && cur->heads[cur->pos] >= target) return 0;
+      /* bring every subcursor that is behind the target forward */
+      for (i=0; i<cur->nsubs; i++) {
+        if (cur->heads[i] >= target) continue;
+        if ((res = query_cursor_seek(cur->subs[i], target))) return res;
+        if ((res = query_cursor_next(cur->subs[i], &cur->heads[i])) <= 0) {
+          if (!res) cur->state[0] = -1;
+          return res;
+        }
+      }
+      _qcursor_leapfrog_sort(cur);
+      cur->pos = 0;
+      cur->state[0] = 1;
+      return 0;
+
+    case QCURSOR_DIFF:
+      /* the second subcursor is always sought before it is read */
+      return query_cursor_seek(cur->sub[0], target);
+
+    case QCURSOR_RECORD:
+      /* skipped results cannot be recorded */
+      cur->state[0] = 0;
+      if (cur->list) ifree(cur->list);
+      return query_cursor_seek(cur->sub[0], target);
+
+    case QCURSOR_OR:
+      for (i=0; i<2; i++) {
+        if (cur->state[i] < 0 || (cur->state[i] > 0 && cur->head[i] >= target)) continue;
+        cur->state[i] = 0;
+        if ((res = query_cursor_seek(cur->sub[i], target))) return res;
+      }
+      return 0;
+  }
+  return -EINVAL;
+}
+
+/**
+ * Close a query cursor and any subcursors, and set the pointer to NULL.
+ *
+ * @param cur A pointer to the cursor to close.
+ */
+void query_cursor_close(qcursor **cur) {
+  int i;
+
+  if (!cur || !*cur) return;
+  query_cursor_close(&(*cur)->sub[0]);
+  query_cursor_close(&(*cur)->sub[1]);
+  for (i=0; i<(*cur)->nsubs; i++) {
+    query_cursor_close(&(*cur)->subs[i]);
+  }
+  if ((*cur)->subs) ifree((*cur)->subs);
+  if ((*cur)->heads) ifree((*cur)->heads);
+  if ((*cur)->inodes) inode_cursor_close((*cur)->inodes);
+  if ((*cur)->view) {
+    /* the list belongs to the view */
+    (*cur)->view->users--;
+    (*cur)->list = NULL;
+  }
+  if ((*cur)->cached) {
+    /* the list belongs to the cache */
+    (*cur)->cached->users--;
+    (*cur)->list = NULL;
+  }
+  if ((*cur)->list) ifree((*cur)->list);
+  if ((*cur)->key) ifree((*cur)->key);
+  ifree(*cur);
+}
+
+/**
+ * Store a result set in the query result cache. If the slot for \a path is
+ * being read by an open cursor, the results are discarded instead.
+ *
+ * @param path   The canonical path the results belong to.
+ * @param inodes The results, which the cache takes ownership of.
+ * @param count  The number of inodes in \a inodes.
+ */
+static void _qcache_store(const char *path, fileptr *inodes, int count) {
+  qcache_ent *ent = &query_cache[hash_path(path) % QUERY_CACHE_SIZE];
+  char *key;
+
+  if (ent->users || !(key = strdup(path))) {
+    DEBUG("Not caching results for \"%s\"", path);
+    if (inodes) ifree(inodes);
+    return;
+  }
+  DEBUG("Caching %d results for \"%s\"", count, path);
+  if (ent->path) ifree(ent->path);
+  if (ent->inodes) ifree(ent->inodes);
+  ent->path = key;
+  ent->inodes = inodes;
+  ent->count = count;
+  ent->generation = tree_get_generation();
+}
+
+/**
+ * Find the materialised view registered for a path.
+ *
+ * @param path The canonical path.
+ * @returns The view, or NULL if the path is not a view.
+ */
+static qview *_qview_find(const char *path) {
+  int i;
+  for (i=0; i<QUERY_VIEW_MAX; i++) {
+    if (query_views[i].path && strcmp(query_views[i].path, path)==0) {
+      return &query_views[i];
+    }
   }
   return NULL;
 }
+
+/**
+ * Recompute the results of a view from scratch if they are not valid at the
+ * current store generation. Views in use by a cursor cannot be rebuilt.
+ *
+ * @param view The view to refresh.
+ * @returns Zero on success, or a negative error code on failure.
+ */
+static int _qview_refresh(qview *view) {
+  qcursor *cur;
+  fileptr inode;
+  int neg, res;
+
+  if (view->valid && view->generation == tree_get_generation()) return 0;
+  if (view->users) return -EBUSY;
+
+  DEBUG("Rebuilding view \"%s\"", view->path);
+  view->valid = 0;
+  view->count = 0;
+  cur = query_cursor_open(view->query, &neg);
+  if (cur && neg) {
+    cur = query_cursor_complement(cur);
+  }
+  if (!cur) return errno ? -errno : -EIO;
+
+  while ((res = query_cursor_next(cur, &inode)) == 1) {
+    if (view->count == view->size) {
+      fileptr *tmp = realloc(view->inodes, (view->size ? view->size*2 : 64) * sizeof(fileptr));
+      if (!tmp) {
+        PMSG(LOG_ERR, "Failed to allocate space for view");
+        res = -ENOMEM;
+        break;
+      }
+      view->inodes = tmp;
+      view->size = view->size ? view->size*2 : 64;
+    }
+    view->inodes[view->count++] = inode;
+  }
+  query_cursor_close(&cur);
+  if (res < 0) return res;
+
+  view->valid = 1;
+  view->generation = tree_get_generation();
+  return 0;
+}
+
+/**
+ * Bring a view up to date with a change to the tags of a single file, by
+ * adding the file to or removing it from the view's results.
+ *
+ * @param view  The view to update.
+ * @param inode The inode of the changed file.
+ * @returns Zero on success, or a negative error code on failure.
+ */
+static int _qview_apply(qview *view, fileptr inode) {
+  int lo = 0, hi = view->count, member;
+
+  while (lo < hi) {
+    int mid = lo + (hi-lo)/2;
+    if (view->inodes[mid] < inode)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  member = query_contains(view->query, inode);
+  if (member < 0) return member;
+
+  if (lo < view->count && view->inodes[lo] == inode) {
+    if (!member) {
+      view->count--;
+      memmove(&view->inodes[lo], &view->inodes[lo+1], (view->count - lo) * sizeof(fileptr));
+    }
+  } else if (member) {
+    if (view->count == view->size) {
+      fileptr *tmp = realloc(view->inodes, (view->size ? view->size*2 : 64) * sizeof(fileptr));
+      if (!tmp) {
+        PMSG(LOG_ERR, "Failed to allocate space for view");
+        return -ENOMEM;
+      }
+      view->inodes = tmp;
+      view->size = view->size ? view->size*2 : 64;
+    }
+    memmove(&view->inodes[lo+1], &view->inodes[lo], (view->count - lo) * sizeof(fileptr));
+    view->inodes[lo] = inode;
+    view->count++;
+  }
+  return 0;
+}
+
+/**
+ * Register a path as a materialised view. Its results are computed now and
+ * then maintained by query_view_update() as files are tagged and untagged.
+ *
+ * @param path The path to register. Every tag in it must already exist.
+ * @returns Zero on success, or a negative error code on failure.
+ */
+int query_view_add(const char *path) {
+  qview *view = NULL;
+  qelem *query;
+  char *canon;
+  int i, res;
+
+  canon = get_canonical_path(path);
+  if (!canon) return -ENOMEM;
+  if (_qview_find(canon)) {
+    DEBUG("\"%s\" is already a view", canon);
+    ifree(canon);
+    return 0;
+  }
+  for (i=0; i<QUERY_VIEW_MAX && !view; i++) {
+    if (!query_views[i].path) view = &query_views[i];
+  }
+  if (!view) {
+    PMSG(LOG_ERR, "Too many views; not adding \"%s\"", canon);
+    ifree(canon);
+    return -ENOSPC;
+  }
+
+  query = query_plan(path_to_query(canon));
+  if (!query) {
+    res = errno ? -errno : -EINVAL;
+    PMSG(LOG_ERR, "Could not build query for view \"%s\": %s", canon, strerror(-res));
+    ifree(canon);
+    return res;
+  }
+  /* the view outlives any request it was added in, so keep its tree out of
+   * the request arena */
+  view->query = _qtree_copy(query);
+  qtree_free(&query, 1);
+  if (!view->query) {
+    ifree(canon);
+    return -ENOMEM;
+  }
+  view->path = canon;
+  if ((res = _qview_refresh(view))) {
+    /* the view is rebuilt when it is next read */
+    PMSG(LOG_WARNING, "Could not compute view \"%s\": %s", canon, strerror(-res));
+  }
+  DEBUG("Added view \"%s\" with %d results", canon, view->count);
+  return 0;
+}
+
+/**
+ * Update the materialised views after the tags of some files have changed.
+ * Only views that were valid at \a generation (the store generation before
+ * the change) are updated; others are rebuilt when they are next read.
+ *
+ * @param inodes     The inodes of the changed files.
+ * @param n          The number of inodes in \a inodes.
+ * @param generation The store generation before the change.
+ */
+void query_view_update(const fileptr *inodes, int n, unsigned long generation) {
+  int i, j;
+
+  for (i=0; i<QUERY_VIEW_MAX; i++) {
+    qview *view = &query_views[i];
+    if (!view->path || !view->valid || view->users || view->generation != generation) continue;
+    for (j=0; j<n; j++) {
+      if (_qview_apply(view, inodes[j])) {
+        DEBUG("Failed to update view \"%s\"", view->path);
+        view->valid = 0;
+        break;
+      }
+    }
+    if (view->valid) view->generation = tree_get_generation();
+  }
+}
+
+/**
+ * Remove every materialised view. Views still being read by open cursors
+ * are left alone.
+ */
+void query_view_clear(void) {
+  int i;
+  for (i=0; i<QUERY_VIEW_MAX; i++) {
+    qview *view = &query_views[i];
+    if (!view->path || view->users) continue;
+    ifree(view->path);
+    qtree_free(&view->query, 1);
+    if (view->inodes) ifree(view->inodes);
+    bzero(view, sizeof(qview));
+  }
+}
+
+/**
+ * Open a cursor over the results of the query for the given path. Unlike
+ * query_cursor_open(), negated results are complemented, so the cursor
+ * produces exactly the files the path lists. Paths registered as views with
+ * query_view_add() are served from the view. Otherwise, results are served
+ * from the query result cache while the store is unchanged, or else recorded
+ * as the cursor is read and cached once it is exhausted.
+ *
+ * @param path  The canonical path the query was built from.
+ * @param query The root of the query tree.
+ * @returns A cursor to be closed with query_cursor_close(), or NULL on error
+ * (with \c errno set appropriately).
+ */
+qcursor *query_cursor_open_path(const char *path, const qelem * const query) {
+  qcache_ent *ent = &query_cache[hash_path(path) % QUERY_CACHE_SIZE];
+  qview *view = _qview_find(path);
+  qcursor *cur, *rec;
+  qelem *plan;
+  int neg;
+
+  if (view && !_qview_refresh(view)) {
+    DEBUG("Serving \"%s\" from its view", path);
+    cur = _qcursor_make(QCURSOR_ARRAY);
+    if (!cur) return NULL;
+    cur->list = view->inodes;
+    cur->count = view->count;
+    cur->view = view;
+    view->users++;
+    return cur;
+  }
+
+  if (ent->path && ent->generation == tree_get_generation() && strcmp(ent->path, path)==0) {
+    DEBUG("Query cache hit for \"%s\"", path);
+    cur = _qcursor_make(QCURSOR_ARRAY);
+    if (!cur) return NULL;
+    cur->list = ent->inodes;
+    cur->count = ent->count;
+    cur->cached = ent;
+    ent->users++;
+    return cur;
+  }
+
+  DEBUG("Query cache miss for \"%s\"", path);
+  /* evaluate the most selective parts of the path first */
+  plan = query_plan(_qtree_copy(query));
+  cur = query_cursor_open(plan ? plan : query, &neg);
+  qtree_free(&plan, 1);
+  if (cur && neg) {
+    cur = query_cursor_complement(cur);
+  }
+  if (!cur) return NULL;
+
+  rec = _qcursor_make(QCURSOR_RECORD);
+  if (!rec || !(rec->key = strdup(path))) {
+    /* caching is only an optimisation */
+    if (rec) ifree(rec);
+    return cur;
+  }
+  rec->sub[0] = cur;
+  rec->state[0] = 1;
+  return rec;
+}
+
+/**
+ * Empty the query expression parse cache.
+ */
+void query_parse_cache_clear(void) {
+  int i;
+  for (i=0; i<QUERY_PARSE_CACHE_SIZE; i++) {
+    if (query_parse_cache[i].segment) ifree(query_parse_cache[i].segment);
+    qtree_free(&query_parse_cache[i].query, 1);
+    bzero(&query_parse_cache[i], sizeof(qparse_ent));
+  }
+}
+
+/**
+ * Empty the query result cache. Entries still being read by open cursors are
+ * left alone.
+ */
+void query_cache_clear(void) {
+  int i;
+  for (i=0; i<QUERY_CACHE_SIZE; i++) {
+    if (query_cache[i].users) continue;
+    if (query_cache[i].path) ifree(query_cache[i].path);
+    if (query_cache[i].inodes) ifree(query_cache[i].inodes);
+  }
+}
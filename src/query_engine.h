@@ -42,7 +42,8 @@ enum qelem_type {
   QUERY_IS_INODE, /**< Matches a specific tag */
   QUERY_NOT,      /**< Matches if not a specific tag or subquery */
   QUERY_AND,      /**< Matches if both subqueries match */
-  QUERY_OR        /**< Matches is at least one subquery matches */
+  QUERY_OR,       /**< Matches is at least one subquery matches */
+  QUERY_RANGE     /**< Matches subtags of a tag whose keys lie in a range */
 };
 
 /**
@@ -50,16 +51,124 @@ enum qelem_type {
  */
 typedef struct qelem {
   enum qelem_type  type;      /**< Type of this element (see qelem_type) */
-  char            *tag;       /**< The tag. Only used in QUERY_IS and QUERY_NOT nodes */
+  char            *tag;       /**< The tag. Only used in QUERY_IS, QUERY_NOT and QUERY_RANGE nodes */
   fileptr          inode;     /**< The target inode. Only used in QUERY_IS_INODE nodes */
+  char            *lo;        /**< Lowest subtag key, or NULL. Only used in QUERY_RANGE nodes */
+  char            *hi;        /**< Highest subtag key, or NULL. Only used in QUERY_RANGE nodes */
   struct qelem    *next[2];   /**< Pointers to subparts of query */
 } qelem;
 
+/**
+ * Kinds of streaming query cursor
+ */
+enum qcursor_type {
+  QCURSOR_INODES, /**< Streams an inode list from the tree */
+  QCURSOR_ARRAY,  /**< Streams a materialised inode array */
+  QCURSOR_AND,    /**< Inodes produced by every subcursor (leapfrog join) */
+  QCURSOR_OR,     /**< Inodes produced by either subcursor */
+  QCURSOR_DIFF,   /**< Inodes produced by the first subcursor but not the second */
+  QCURSOR_FILES,  /**< Streams the inodes of every tagged file from the inode tree */
+  QCURSOR_RECORD  /**< Passes through a subcursor, recording its results for the cache */
+};
+
+/** Number of entries in the query result cache */
+#define QUERY_CACHE_SIZE 64
+
+/** Largest result set that will be kept in the query result cache */
+#define QUERY_CACHE_MAX_INODES 8192
+
+/**
+ * Query result cache entry. Results are stored fully resolved (negated
+ * results are complemented), and are only valid while the store generation
+ * is unchanged.
+ */
+typedef struct {
+  char          *path;        /**< Canonical path the results belong to */
+  unsigned long  generation;  /**< Store generation the results were computed at */
+  fileptr       *inodes;      /**< The results, in ascending order */
+  int            count;       /**< Number of inodes in \a inodes */
+  int            users;       /**< Number of open cursors reading \a inodes */
+} qcache_ent;
+
+/** Number of entries in the query expression parse cache */
+#define QUERY_PARSE_CACHE_SIZE 32
+
+/**
+ * Query expression parse cache entry. The parsed tree depends only on which
+ * tags and files exist and on the tags' no-subtags flags, so it stays valid
+ * however files are tagged in the meantime. Creating or removing a tag
+ * changes the generations recorded here; adding or removing a file, or
+ * changing the flag, clears the cache with query_parse_cache_clear().
+ */
+typedef struct {
+  char          *segment;     /**< The expression path segment */
+  unsigned long  generation;  /**< Tag generation the tree was parsed at */
+  unsigned long  keygen;      /**< Tree key generation the tree was parsed at */
+  qelem         *query;       /**< The parsed query tree */
+} qparse_ent;
+
+/** Maximum number of materialised views */
+#define QUERY_VIEW_MAX 16
+
+/**
+ * Materialised view: a path whose results are kept up to date as files are
+ * tagged and untagged, instead of being recomputed each time it is listed.
+ * Results are stored fully resolved, as for the query result cache.
+ */
+typedef struct {
+  char          *path;        /**< Canonical path of the view */
+  qelem         *query;       /**< Query tree built from \a path */
+  int            valid;       /**< Non-zero if \a inodes has been computed */
+  unsigned long  generation;  /**< Store generation the results are valid at */
+  fileptr       *inodes;      /**< The results, in ascending order */
+  int            count;       /**< Number of inodes in \a inodes */
+  int            size;        /**< Allocated size of \a inodes */
+  int            users;       /**< Number of open cursors reading \a inodes */
+} qview;
+
+/**
+ * Streaming cursor over the results of a query. Cursors produce inodes in
+ * ascending order and compose in the same way as the query tree they were
+ * opened from.
+ */
+typedef struct qcursor {
+  enum qcursor_type  type;      /**< Type of this cursor (see qcursor_type) */
+  inode_cursor      *inodes;    /**< Tree cursor. Only used in QCURSOR_INODES cursors */
+  fileptr           *list;      /**< Inode array. Only used in QCURSOR_ARRAY cursors */
+  int                count;     /**< Number of inodes in \a list */
+  int                pos;       /**< Index of the next inode in \a list */
+  fileptr            leaf;      /**< Next inode tree leaf. Only used in QCURSOR_FILES cursors */
+  qcache_ent        *cached;    /**< Cache entry that \a list belongs to, if any */
+  qview             *view;      /**< Materialised view that \a list belongs to, if any */
+  char              *key;       /**< Cache key. Only used in QCURSOR_RECORD cursors */
+  struct qcursor    *sub[2];    /**< Subcursors of OR, DIFF and RECORD cursors */
+  fileptr            head[2];   /**< Inodes buffered from the subcursors */
+  int                state[2];  /**< 1 if \a head is buffered, 0 if not, -1 if the subcursor is exhausted */
+  struct qcursor   **subs;      /**< Subcursors of AND cursors */
+  fileptr           *heads;     /**< Inodes buffered from \a subs */
+  int                nsubs;     /**< Number of cursors in \a subs */
+} qcursor;
+
 /* Prototypes */
 void qtree_free(qelem **root, int free_tags);
 int qtree_consistent(qelem *root, int strict);
 qelem *path_to_query(const char *path);
+qelem *query_plan(qelem *query);
 int query_get_subtags(const qelem *query, char *parent, int len);
+int query_has_virtual(const qelem *query);
+long query_estimate(const qelem *query);
 int query_inode_count(const qelem * const query);
+int query_contains(const qelem * const query, fileptr inode);
 fileptr *query_to_inodes(const qelem * const query, int * const count, int * const neg);
+qcursor *query_cursor_open(const qelem * const query, int * const neg);
+int query_cursor_next(qcursor *cur, fileptr *inode);
+int query_cursor_seek(qcursor *cur, fileptr target);
+qcursor *query_cursor_complement(qcursor *cur);
+void query_cursor_close(qcursor **cur);
+qcursor *query_cursor_open_path(const char *path, const qelem * const query);
+void query_cache_clear(void);
+void query_parse_cache_clear(void);
+int query_view_add(const char *path);
+void query_view_update(const fileptr *inodes, int n, unsigned long generation);
+void query_view_clear(void);
 #endif
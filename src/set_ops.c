@@ -110,6 +110,424 @@ inline void _doSwap(void *a, void *b, size_t elem_size) {
 }
 
 
+/* The integer set kernels compare whole blocks of elements at once where the
+ * processor allows it. Choosing a kernel at run time needs GCC's target
+ * attributes and CPU builtins, so other compilers and architectures only get
+ * the scalar kernels. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define SET_OPS_SIMD
+#include <immintrin.h>
+#endif
+
+/** Instruction set found on this processor, or -1 before the first check. */
+static int set_simd_found = -1;
+
+/** Most capable instruction set the kernels are allowed to use. */
+static enum set_simd_level set_simd_max = SET_SIMD_AVX2;
+
+/**
+ * Find the most capable instruction set that both this build and the
+ * processor support.
+ *
+ * @returns The instruction set level.
+ */
+static enum set_simd_level _set_simd_detect(void) {
+#ifdef SET_OPS_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return SET_SIMD_AVX2;
+  if (__builtin_cpu_supports("sse4.2")) return SET_SIMD_SSE42;
+#endif
+  return SET_SIMD_NONE;
+}
+
+/**
+ * Get the instruction set the integer set kernels currently use. The
+ * processor is only queried the first time.
+ *
+ * @returns The instruction set level.
+ */
+enum set_simd_level set_ops_simd_level(void) {
+  if (set_simd_found < 0) {
+    set_simd_found = _set_simd_detect();
+    DEBUG("Set kernels can use SIMD level %d", set_simd_found);
+  }
+  return MIN((enum set_simd_level)set_simd_found, set_simd_max);
+}
+
+/**
+ * Restrict the instruction sets the integer set kernels may use, for example
+ * to compare the kernels against each other.
+ *
+ * @param max The most capable instruction set level to allow.
+ * @returns The previous limit.
+ */
+enum set_simd_level set_ops_simd_limit(enum set_simd_level max) {
+  enum set_simd_level old = set_simd_max;
+  set_simd_max = max;
+  return old;
+}
+
+#ifdef SET_OPS_SIMD
+/*
+ * Block primitives. _set_match_* compares a block of \a a against every
+ * rotation of a block of \a b, giving a bitmask of the elements of \a a that
+ * appear anywhere in the block of \a b. _set_copy_* copies one block.
+ */
+static inline __attribute__((target("sse4.2"))) unsigned int _set_match_u32_sse42(const uint32_t *a, const uint32_t *b) {
+  __m128i va = _mm_loadu_si128((const __m128i*)a);
+  __m128i vb = _mm_loadu_si128((const __m128i*)b);
+  __m128i m = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi32(va, vb),
+                   _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, 0x39))),
+      _mm_or_si128(_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, 0x4e)),
+                   _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, 0x93))));
+  return _mm_movemask_ps(_mm_castsi128_ps(m));
+}
+
+static inline __attribute__((target("sse4.2"))) void _set_copy_u32_sse42(uint32_t *out, const uint32_t *in) {
+  _mm_storeu_si128((__m128i*)out, _mm_loadu_si128((const __m128i*)in));
+}
+
+static inline __attribute__((target("sse4.2"))) unsigned int _set_match_u64_sse42(const uint64_t *a, const uint64_t *b) {
+  __m128i va = _mm_loadu_si128((const __m128i*)a);
+  __m128i vb = _mm_loadu_si128((const __m128i*)b);
+  __m128i m = _mm_or_si128(_mm_cmpeq_epi64(va, vb),
+                           _mm_cmpeq_epi64(va, _mm_shuffle_epi32(vb, 0x4e)));
+  return _mm_movemask_pd(_mm_castsi128_pd(m));
+}
+
+static inline __attribute__((target("sse4.2"))) void _set_copy_u64_sse42(uint64_t *out, const uint64_t *in) {
+  _mm_storeu_si128((__m128i*)out, _mm_loadu_si128((const __m128i*)in));
+}
+
+static inline __attribute__((target("avx2"))) unsigned int _set_match_u32_avx2(const uint32_t *a, const uint32_t *b) {
+  const __m256i rot = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+  __m256i va = _mm256_loadu_si256((const __m256i*)a);
+  __m256i vb = _mm256_loadu_si256((const __m256i*)b);
+  __m256i m = _mm256_cmpeq_epi32(va, vb);
+  int r;
+  for (r=1; r<8; r++) {
+    vb = _mm256_permutevar8x32_epi32(vb, rot);
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi32(va, vb));
+  }
+  return _mm256_movemask_ps(_mm256_castsi256_ps(m));
+}
+
+static inline __attribute__((target("avx2"))) void _set_copy_u32_avx2(uint32_t *out, const uint32_t *in) {
+  _mm256_storeu_si256((__m256i*)out, _mm256_loadu_si256((const __m256i*)in));
+}
+
+static inline __attribute__((target("avx2"))) unsigned int _set_match_u64_avx2(const uint64_t *a, const uint64_t *b) {
+  __m256i va = _mm256_loadu_si256((const __m256i*)a);
+  __m256i vb = _mm256_loadu_si256((const __m256i*)b);
+  __m256i m = _mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi64(va, vb),
+                      _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x39))),
+      _mm256_or_si256(_mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x4e)),
+                      _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x93))));
+  return _mm256_movemask_pd(_mm256_castsi256_pd(m));
+}
+
+static inline __attribute__((target("avx2"))) void _set_copy_u64_avx2(uint64_t *out, const uint64_t *in) {
+  _mm256_storeu_si256((__m256i*)out, _mm256_loadu_si256((const __m256i*)in));
+}
+
+/*
+ * Block kernels, W elements per block. Intersection and difference compare a
+ * block of each set and then move past whichever block ends first (or both),
+ * so every pair of overlapping blocks is compared exactly once. Union copies
+ * whole blocks that lie entirely before the other set's next element, and
+ * merges one element at a time where the sets interleave. The scalar
+ * building blocks from SET_OPS_DEFINE() finish off whatever is left.
+ */
+#define SET_SIMD_KERNELS(sfx, type, isa, tag, W) \
+static __attribute__((target(isa))) size_t _set_union_##sfx##_##tag(const type *a, const type *b, type *out, size_t na, size_t nb, size_t outmax) { \
+  size_t i=0, j=0, oi=0; \
+  while (oi+W <= outmax) { \
+    if (i+W <= na && (j>=nb || a[i+W-1] < b[j])) { \
+      _set_copy_##sfx##_##tag(out+oi, a+i); \
+      i+=W; oi+=W; \
+    } else if (j+W <= nb && (i>=na || b[j+W-1] < a[i])) { \
+      _set_copy_##sfx##_##tag(out+oi, b+j); \
+      j+=W; oi+=W; \
+    } else if (i<na && j<nb) { \
+      if (a[i] < b[j]) { \
+        out[oi++] = a[i++]; \
+      } else if (a[i] > b[j]) { \
+        out[oi++] = b[j++]; \
+      } else { \
+        if (!oi || out[oi-1] != a[i]) out[oi++] = a[i]; \
+        i++; j++; \
+      } \
+    } else { \
+      break; \
+    } \
+  } \
+  sfx##set_union_at(a, b, out, na, nb, outmax, &i, &j, &oi); \
+  return oi; \
+} \
+static __attribute__((target(isa))) size_t _set_intersect_##sfx##_##tag(const type *a, const type *b, type *out, size_t na, size_t nb, size_t outmax) { \
+  size_t i=0, j=0, oi=0; \
+  type last=0; \
+  while (i+W <= na && j+W <= nb && oi+W <= outmax) { \
+    unsigned int mask = _set_match_##sfx##_##tag(a+i, b+j); \
+    type amax = a[i+W-1], bmax = b[j+W-1]; \
+    while (mask) { \
+      type v = a[i+__builtin_ctz(mask)]; \
+      if (!oi || last != v) { \
+        if (out) out[oi] = v; \
+        last = v; \
+        oi++; \
+      } \
+      mask &= mask-1; \
+    } \
+    if (amax <= bmax) i+=W; \
+    if (bmax <= amax) j+=W; \
+  } \
+  sfx##set_intersect_at(a, b, out, na, nb, outmax, &i, &j, &oi, &last); \
+  return oi; \
+} \
+static __attribute__((target(isa))) size_t _set_diff_##sfx##_##tag(const type *a, const type *b, type *out, size_t na, size_t nb, size_t outmax) { \
+  size_t i=0, j=0, oi=0, k, end; \
+  unsigned int seen = 0; \
+  while (i+W <= na && j+W <= nb && oi+W <= outmax) { \
+    type amax = a[i+W-1], bmax = b[j+W-1]; \
+    seen |= _set_match_##sfx##_##tag(a+i, b+j); \
+    if (bmax <= amax) j+=W; \
+    if (amax <= bmax) { \
+      for (k=0; k<W; k++) { \
+        if (!(seen & (1U<<k))) out[oi++] = a[i+k]; \
+      } \
+      i+=W; \
+      seen = 0; \
+    } \
+  } \
+  if (seen) { \
+    /* elements of a half-compared block already found in b are skipped */ \
+    for (k=0; k<W; k++) { \
+      end = i+1; \
+      if (!(seen & (1U<<k))) sfx##set_diff_at(a, b, out, end, nb, outmax, &i, &j, &oi); \
+      i = end; \
+    } \
+  } \
+  sfx##set_diff_at(a, b, out, na, nb, outmax, &i, &j, &oi); \
+  return oi; \
+}
+
+SET_SIMD_KERNELS(u32, uint32_t, "sse4.2", sse42, 4)
+SET_SIMD_KERNELS(u64, uint64_t, "sse4.2", sse42, 2)
+SET_SIMD_KERNELS(u32, uint32_t, "avx2", avx2, 8)
+SET_SIMD_KERNELS(u64, uint64_t, "avx2", avx2, 4)
+
+#define SET_SIMD_DISPATCH(op, sfx, a, b, out, na, nb, outmax) \
+  case SET_SIMD_AVX2:  return _set_##op##_##sfx##_avx2(a, b, out, na, nb, outmax); \
+  case SET_SIMD_SSE42: return _set_##op##_##sfx##_sse42(a, b, out, na, nb, outmax);
+#else
+#define SET_SIMD_DISPATCH(op, sfx, a, b, out, na, nb, outmax)
+#endif
+
+/* Scalar kernels for SET_DISPATCH(), from the SET_OPS_DEFINE() families. */
+#define _set_union_scalar(sfx, a, b, out, na, nb, outmax)     sfx##set_union(a, b, out, na, nb, outmax)
+#define _set_intersect_scalar(sfx, a, b, out, na, nb, outmax) sfx##set_intersect_adaptive(a, b, out, na, nb, outmax)
+#define _set_diff_scalar(sfx, a, b, out, na, nb, outmax)      sfx##set_diff(a, b, out, na, nb, outmax)
+
+/** Run the best kernel for operation \a op on elements of type suffix \a sfx. */
+#define SET_DISPATCH(op, sfx, a, b, out, na, nb, outmax) do { \
+  switch (set_ops_simd_level()) { \
+    SET_SIMD_DISPATCH(op, sfx, a, b, out, na, nb, outmax) \
+    default: return _set_##op##_scalar(sfx, a, b, out, na, nb, outmax); \
+  } \
+} while (0)
+
+/*
+ * Intersection of two sets of very different sizes probes the larger set for
+ * each element of the smaller one, rather than merging. \a out may be NULL to
+ * count the intersection without writing it.
+ */
+#define SET_INTERSECT_ADAPTIVE(sfx, type) \
+static size_t _set_intersect_##sfx(const type *a, const type *b, type *out, size_t na, size_t nb, size_t outmax) { \
+  if (na > SET_GALLOP_RATIO*nb) return sfx##set_intersect_gallop(b, a, out, nb, na, outmax); \
+  if (nb > SET_GALLOP_RATIO*na) return sfx##set_intersect_gallop(a, b, out, na, nb, outmax); \
+  SET_DISPATCH(intersect, sfx, a, b, out, na, nb, outmax); \
+}
+
+SET_INTERSECT_ADAPTIVE(u32, uint32_t)
+SET_INTERSECT_ADAPTIVE(u64, uint64_t)
+
+
+/**
+ * Creates the union of two sorted arrays of 32-bit integers. The output array
+ * should be \a in1count + \a in2count unless the output size is already known.
+ * Uses SIMD instructions where the processor supports them.
+ *
+ * @param set1      The first set to be unioned.
+ * @param set2      The second set to be unioned.
+ * @param out       The output array.
+ * @param in1count  The number of items in \a set1.
+ * @param in2count  The number of items in \a set2.
+ * @param outmax    The maximum number of items in \a out.
+ * @returns A negative error code, or the number of items written to the output
+ * array.
+ */
+int set_union_u32(const uint32_t *set1, const uint32_t *set2, uint32_t *out, size_t in1count, size_t in2count, size_t outmax) {
+  if (!set1 || !set2 || !out || (in1count && in2count && !outmax)) {
+    DEBUG("At least one argument was null or zero");
+    return -EINVAL;
+  }
+  SET_DISPATCH(union, u32, set1, set2, out, in1count, in2count, outmax);
+}
+
+/**
+ * Creates the union of two sorted arrays of 64-bit integers. The output array
+ * should be \a in1count + \a in2count unless the output size is already known.
+ * Uses SIMD instructions where the processor supports them.
+ *
+ * @param set1      The first set to be unioned.
+ * @param set2      The second set to be unioned.
+ * @param out       The output array.
+ * @param in1count  The number of items in \a set1.
+ * @param in2count  The number of items in \a set2.
+ * @param outmax    The maximum number of items in \a out.
+ * @returns A negative error code, or the number of items written to the output
+ * array.
+ */
+int set_union_u64(const uint64_t *set1, const uint64_t *set2, uint64_t *out, size_t in1count, size_t in2count, size_t outmax) {
+  if (!set1 || !set2 || !out || (in1count && in2count && !outmax)) {
+    DEBUG("At least one argument was null or zero");
+    return -EINVAL;
+  }
+  SET_DISPATCH(union, u64, set1, set2, out, in1count, in2count, outmax);
+}
+
+/**
+ * Creates the intersection of two sorted arrays of 32-bit integers. The output
+ * array is guaranteed never to be larger than MIN(\a in1count, \a in2count).
+ * Uses SIMD instructions where the processor supports them, or searches the
+ * larger set if the sizes are very different.
+ *
+ * @param set1      The first set to be used.
+ * @param set2      The second set to be used.
+ * @param out       The output array.
+ * @param in1count  The number of items in \a set1.
+ * @param in2count  The number of items in \a set2.
+ * @param outmax    The maximum number of items in \a out.
+ * @returns A negative error code, or the number of items written to the output
+ * array.
+ */
+int set_intersect_u32(const uint32_t *set1, const uint32_t *set2, uint32_t *out, size_t in1count, size_t in2count, size_t outmax) {
+  if (!set1 || !set2 || !out || !outmax) {
+    DEBUG("At least one argument was null or zero");
+    return -EINVAL;
+  }
+  return _set_intersect_u32(set1, set2, out, in1count, in2count, outmax);
+}
+
+/**
+ * Creates the intersection of two sorted arrays of 64-bit integers. The output
+ * array is guaranteed never to be larger than MIN(\a in1count, \a in2count).
+ * Uses SIMD instructions where the processor supports them, or searches the
+ * larger set if the sizes are very different.
+ *
+ * @param set1      The first set to be used.
+ * @param set2      The second set to be used.
+ * @param out       The output array.
+ * @param in1count  The number of items in \a set1.
+ * @param in2count  The number of items in \a set2.
+ * @param outmax    The maximum number of items in \a out.
+ * @returns A negative error code, or the number of items written to the output
+ * array.
+ */
+int set_intersect_u64(const uint64_t *set1, const uint64_t *set2, uint64_t *out, size_t in1count, size_t in2count, size_t outmax) {
+  if (!set1 || !set2 || !out || !outmax) {
+    DEBUG("At least one argument was null or zero");
+    return -EINVAL;
+  }
+  return _set_intersect_u64(set1, set2, out, in1count, in2count, outmax);
+}
+
+/**
+ * Counts the items two sorted arrays of 32-bit integers have in common,
+ * without writing out the intersection.
+ *
+ * @param set1      The first set to be used.
+ * @param set2      The second set to be used.
+ * @param in1count  The number of items in \a set1.
+ * @param in2count  The number of items in \a set2.
+ * @returns A negative error code, or the number of items in the intersection.
+ */
+int set_intersect_count_u32(const uint32_t *set1, const uint32_t *set2, size_t in1count, size_t in2count) {
+  if (!set1 || !set2) {
+    DEBUG("At least one argument was null");
+    return -EINVAL;
+  }
+  return _set_intersect_u32(set1, set2, NULL, in1count, in2count, MIN(in1count, in2count));
+}
+
+/**
+ * Counts the items two sorted arrays of 64-bit integers have in common,
+ * without writing out the intersection.
+ *
+ * @param set1      The first set to be used.
+ * @param set2      The second set to be used.
+ * @param in1count  The number of items in \a set1.
+ * @param in2count  The number of items in \a set2.
+ * @returns A negative error code, or the number of items in the intersection.
+ */
+int set_intersect_count_u64(const uint64_t *set1, const uint64_t *set2, size_t in1count, size_t in2count) {
+  if (!set1 || !set2) {
+    DEBUG("At least one argument was null");
+    return -EINVAL;
+  }
+  return _set_intersect_u64(set1, set2, NULL, in1count, in2count, MIN(in1count, in2count));
+}
+
+/**
+ * Creates the difference of two sorted arrays of 32-bit integers, keeping the
+ * items of \a set1 that are not in \a set2. The output array never needs to be
+ * larger than \a in1count, and may be \a set1 itself. Uses SIMD instructions
+ * where the processor supports them.
+ *
+ * @param set1      The first set to be used.
+ * @param set2      The second set to be used (subtracted from the first).
+ * @param out       The output array.
+ * @param in1count  The number of items in \a set1.
+ * @param in2count  The number of items in \a set2.
+ * @param outmax    The maximum number of items in \a out.
+ * @returns A negative error code, or the number of items written to the output
+ * array.
+ */
+int set_diff_u32(const uint32_t *set1, const uint32_t *set2, uint32_t *out, size_t in1count, size_t in2count, size_t outmax) {
+  if (!set1 || !set2 || !out) {
+    DEBUG("At least one argument was null");
+    return -EINVAL;
+  }
+  SET_DISPATCH(diff, u32, set1, set2, out, in1count, in2count, outmax);
+}
+
+/**
+ * Creates the difference of two sorted arrays of 64-bit integers, keeping the
+ * items of \a set1 that are not in \a set2. The output array never needs to be
+ * larger than \a in1count, and may be \a set1 itself. Uses SIMD instructions
+ * where the processor supports them.
+ *
+ * @param set1      The first set to be used.
+ * @param set2      The second set to be used (subtracted from the first).
+ * @param out       The output array.
+ * @param in1count  The number of items in \a set1.
+ * @param in2count  The number of items in \a set2.
+ * @param outmax    The maximum number of items in \a out.
+ * @returns A negative error code, or the number of items written to the output
+ * array.
+ */
+int set_diff_u64(const uint64_t *set1, const uint64_t *set2, uint64_t *out, size_t in1count, size_t in2count, size_t outmax) {
+  if (!set1 || !set2 || !out) {
+    DEBUG("At least one argument was null");
+    return -EINVAL;
+  }
+  SET_DISPATCH(diff, u64, set1, set2, out, in1count, in2count, outmax);
+}
+
 /**
  * Creates the union of two sorted inode arrays. The output array should be \a
  * in1count + \a in2count unless the output size is already known. Optimised
@@ -124,54 +542,283 @@ inline void _doSwap(void *a, void *b, size_t elem_size) {
  * @returns A negative error code, or the number of items written to the output
  * array.
  */
-int set_union_inode(fileptr *set1, fileptr *set2, fileptr *out, size_t in1count, size_t in2count, size_t outmax) {
+int set_union_inode(const fileptr *set1, const fileptr *set2, fileptr *out, size_t in1count, size_t in2count, size_t outmax) {
   DEBUG("set_union_inode(set1: %p, set2: %p, out: %p, in1count: %lu, in2count: %lu, outmax: %lu)", set1, set2, out, in1count, in2count, outmax);
-  if (!set1 || !set2 || !out || (in1count && in2count && !outmax)) {
+  if (sizeof(fileptr) == sizeof(uint64_t)) {
+    return set_union_u64((const uint64_t*)set1, (const uint64_t*)set2, (uint64_t*)out, in1count, in2count, outmax);
+  }
+  return set_union_u32((const uint32_t*)set1, (const uint32_t*)set2, (uint32_t*)out, in1count, in2count, outmax);
+}
+
+/**
+ * Creates the intersection of two sorted inode arrays. The output array is
+ * guaranteed never to be larger than MIN(\a in1count, \a in2count). Optimised
+ * for inode arrays.
+ *
+ * @param set1      The first set to be used.
+ * @param set2      The second set to be used.
+ * @param out       The output array.
+ * @param in1count  The number of items in \a set1.
+ * @param in2count  The number of items in \a set2.
+ * @param outmax    The maximum number of items in \a out.
+ * @returns A negative error code, or the number of items written to the output
+ * array.
+ */
+int set_intersect_inode(const fileptr *set1, const fileptr *set2, fileptr *out, size_t in1count, size_t in2count, size_t outmax) {
+  if (sizeof(fileptr) == sizeof(uint64_t)) {
+    return set_intersect_u64((const uint64_t*)set1, (const uint64_t*)set2, (uint64_t*)out, in1count, in2count, outmax);
+  }
+  return set_intersect_u32((const uint32_t*)set1, (const uint32_t*)set2, (uint32_t*)out, in1count, in2count, outmax);
+}
+
+/**
+ * Counts the inodes two sorted inode arrays have in common, without writing
+ * out the intersection.
+ *
+ * @param set1      The first set to be used.
+ * @param set2      The second set to be used.
+ * @param in1count  The number of items in \a set1.
+ * @param in2count  The number of items in \a set2.
+ * @returns A negative error code, or the number of items in the intersection.
+ */
+int set_intersect_count_inode(const fileptr *set1, const fileptr *set2, size_t in1count, size_t in2count) {
+  if (sizeof(fileptr) == sizeof(uint64_t)) {
+    return set_intersect_count_u64((const uint64_t*)set1, (const uint64_t*)set2, in1count, in2count);
+  }
+  return set_intersect_count_u32((const uint32_t*)set1, (const uint32_t*)set2, in1count, in2count);
+}
+
+/**
+ * Creates the difference of two sorted inode arrays, keeping the inodes of \a
+ * set1 that are not in \a set2. The output array never needs to be larger than
+ * \a in1count, and may be \a set1 itself. Optimised for inode arrays.
+ *
+ * @param set1      The first set to be used.
+ * @param set2      The second set to be used (subtracted from the first).
+ * @param out       The output array.
+ * @param in1count  The number of items in \a set1.
+ * @param in2count  The number of items in \a set2.
+ * @param outmax    The maximum number of items in \a out.
+ * @returns A negative error code, or the number of items written to the output
+ * array.
+ */
+int set_diff_inode(const fileptr *set1, const fileptr *set2, fileptr *out, size_t in1count, size_t in2count, size_t outmax) {
+  if (sizeof(fileptr) == sizeof(uint64_t)) {
+    return set_diff_u64((const uint64_t*)set1, (const uint64_t*)set2, (uint64_t*)out, in1count, in2count, outmax);
+  }
+  return set_diff_u32((const uint32_t*)set1, (const uint32_t*)set2, (uint32_t*)out, in1count, in2count, outmax);
+}
+
+/*
+ * Least-significant-digit radix sort over 8-bit digits. The histograms for
+ * every digit are built in a single pass over the input, and any digit shared
+ * by every item (such as the high bytes of small inode numbers) is skipped
+ * entirely. Input that is already sorted is detected and left alone, and short
+ * arrays are sorted by insertion.
+ */
+#define SET_RADIX_SORT(sfx, type) \
+int set_sort_##sfx(type *set, size_t count) { \
+  size_t hist[sizeof(type)][256]; \
+  type *buf, *src, *dst, *tmp; \
+  size_t i, d, sum, n; \
+  if (!set && count) return -EINVAL; \
+  if (sfx##set_sorted(set, count)) return 0; \
+  if (count < SET_RADIX_MIN) { \
+    sfx##set_insertion_sort(set, count); \
+    return 0; \
+  } \
+  buf = malloc(count * sizeof(type)); \
+  if (!buf) return -ENOMEM; \
+  memset(hist, 0, sizeof(hist)); \
+  for (i=0; i<count; i++) { \
+    for (d=0; d<sizeof(type); d++) \
+      hist[d][(set[i] >> (d*8)) & 0xff]++; \
+  } \
+  src = set; \
+  dst = buf; \
+  for (d=0; d<sizeof(type); d++) { \
+    if (hist[d][(set[0] >> (d*8)) & 0xff] == count) continue; \
+    for (i=sum=0; i<256; i++) { \
+      n = hist[d][i]; \
+      hist[d][i] = sum; \
+      sum += n; \
+    } \
+    for (i=0; i<count; i++) \
+      dst[hist[d][(src[i] >> (d*8)) & 0xff]++] = src[i]; \
+    tmp = src; src = dst; dst = tmp; \
+  } \
+  if (src != set) memcpy(set, src, count * sizeof(type)); \
+  free(buf); \
+  return 0; \
+}
+
+/**
+ * Sorts an array of 32-bit integers into ascending order. Duplicates are kept.
+ *
+ * @param set    The array to be sorted.
+ * @param count  The number of items in \a set.
+ * @returns Zero on success, or a negative error code.
+ */
+SET_RADIX_SORT(u32, uint32_t)
+
+/**
+ * Sorts an array of 64-bit integers into ascending order. Duplicates are kept.
+ *
+ * @param set    The array to be sorted.
+ * @param count  The number of items in \a set.
+ * @returns Zero on success, or a negative error code.
+ */
+SET_RADIX_SORT(u64, uint64_t)
+
+/**
+ * Sorts an inode array into ascending order, without going through a
+ * comparison callback as qsort() would. Arrays that are already sorted are
+ * only scanned. Duplicates are kept.
+ *
+ * @param set    The array to be sorted.
+ * @param count  The number of items in \a set.
+ * @returns Zero on success, or a negative error code.
+ */
+int set_sort_inode(fileptr *set, size_t count) {
+  if (sizeof(fileptr) == sizeof(uint64_t)) {
+    return set_sort_u64((uint64_t*)set, count);
+  }
+  return set_sort_u32((uint32_t*)set, count);
+}
+
+/**
+ * Creates the intersection of several sorted inode arrays. The smallest set is
+ * intersected with each of the others in turn, in place in \a out, so every
+ * step runs the SIMD or galloping kernels against a result that only gets
+ * smaller. If \a outmax is less than the size of the smallest set, only the
+ * part of the intersection that fits is produced.
+ *
+ * @param sets      The sets to be intersected.
+ * @param counts    The number of items in each of \a sets.
+ * @param k         The number of sets.
+ * @param out       The output array, which must not be one of \a sets.
+ * @param outmax    The maximum number of items in \a out.
+ * @returns A negative error code, or the number of items written to the output
+ * array.
+ */
+int set_intersect_n_inode(const fileptr * const *sets, const size_t *counts, size_t k, fileptr *out, size_t outmax) {
+  size_t i, first=0;
+  int count;
+
+  if (!sets || !counts || !k || !out || !outmax) {
     DEBUG("At least one argument was null or zero");
     return -EINVAL;
   }
+  for (i=0; i<k; i++) {
+    if (!sets[i]) {
+      DEBUG("Set %lu was null", i);
+      return -EINVAL;
+    }
+    if (counts[i] < counts[first]) first = i;
+  }
 
-  if (!in1count && !in2count) {
-    DEBUG("No elements in both input arrays means no union possible");
-    return 0;
+  count = MIN(counts[first], outmax);
+  memcpy(out, sets[first], count * sizeof(fileptr));
+  for (i=0; i<k && count>0; i++) {
+    if (i == first) continue;
+    count = set_intersect_inode(out, sets[i], out, count, counts[i], count);
   }
+  return count;
+}
 
-  size_t s1=0, s2=0, oi=0, eq=0;
-  fileptr oldval=0;
-  while (s1<in1count && s2<in2count && oi<outmax) {
-    if (set1[s1] == set2[s2]) {
-      DEBUG("Equal");
-      if (!eq || set1[s1] != oldval) {
-        DEBUG("Copying set1[%u] to output[%u]", s1, oi);
-        /* make sure that the output array has distinct elements */
-        out[oi++] = set1[s1];
-        /* keep the old value so we can tell if there are repeated elements */
-        oldval = set2[s2];
-      }
-      s1++; s2++;
-      eq=1;
-    } else if (set1[s1] < set2[s2]) {
-      DEBUG("Copying set1[%u] to output[%u]", s1, oi);
-      oldval = set1[s1];
-      out[oi++] = set1[s1++];
-      eq=0;
-    } else if (set1[s1] > set2[s2]) {
-      DEBUG("Copying set2[%u] to output[%u]", s2, oi);
-      oldval = set2[s2];
-      out[oi++] = set2[s2++];
-      eq=0;
+/** Position in one input of set_union_n_inode() */
+typedef struct {
+  const fileptr *head;  /**< The next item to be merged */
+  const fileptr *end;   /**< The end of the input */
+} set_run;
+
+/**
+ * Restore the min-heap property of \a heap by sifting entry \a p down.
+ *
+ * @param heap     The heap of inputs, ordered by their current heads.
+ * @param heapsize The number of entries in \a heap.
+ * @param p        The index of the entry to sift down.
+ */
+static void _set_heap_sift(set_run *heap, size_t heapsize, size_t p) {
+  while (1) {
+    size_t c = 2*p+1;
+    if (c >= heapsize) break;
+    if (c+1 < heapsize && *heap[c+1].head < *heap[c].head) c++;
+    if (*heap[p].head <= *heap[c].head) break;
+    set_run tmp = heap[p]; heap[p] = heap[c]; heap[c] = tmp;
+    p = c;
+  }
+}
+
+/**
+ * Creates the union of several sorted inode arrays, dropping duplicates. Two
+ * sets are merged with set_union_inode(); more are merged in one pass with the
+ * heads of the sets kept in a binary min-heap, so the merge takes O(N log k)
+ * comparisons for N inodes in total. The output array should be the total
+ * size of the sets unless the output size is already known.
+ *
+ * @param sets      The sets to be unioned.
+ * @param counts    The number of items in each of \a sets.
+ * @param k         The number of sets.
+ * @param out       The output array.
+ * @param outmax    The maximum number of items in \a out.
+ * @returns A negative error code, or the number of items written to the output
+ * array.
+ */
+int set_union_n_inode(const fileptr * const *sets, const size_t *counts, size_t k, fileptr *out, size_t outmax) {
+  set_run *heap;
+  size_t heapsize=0, i, oi=0;
+
+  if (!sets || !counts || !out) {
+    DEBUG("At least one argument was null");
+    return -EINVAL;
+  }
+  for (i=0; i<k; i++) {
+    if (!sets[i]) {
+      DEBUG("Set %lu was null", i);
+      return -EINVAL;
     }
   }
-  DEBUG("Copying from set1?");
-  while (s1<in1count && oi<outmax) {
-    DEBUG("Copying set1[%u] to output[%u]", s1, oi);
-    out[oi++] = set1[s1++];
+
+  if (!k) return 0;
+  if (k==1) {
+    oi = MIN(counts[0], outmax);
+    memcpy(out, sets[0], oi * sizeof(fileptr));
+    return oi;
   }
-  DEBUG("Copying from set2?");
-  while (s2<in2count && oi<outmax) {
-    DEBUG("Copying set2[%u] to output[%u]", s2, oi);
-    out[oi++] = set2[s2++];
+  if (k==2) {
+    return set_union_inode(sets[0], sets[1], out, counts[0], counts[1], outmax);
+  }
+
+  heap = malloc(k * sizeof(set_run));
+  if (!heap) {
+    PMSG(LOG_ERR, "Failed to allocate merge heap");
+    return -ENOMEM;
+  }
+  for (i=0; i<k; i++) {
+    if (!counts[i]) continue;
+    heap[heapsize].head = sets[i];
+    heap[heapsize].end = sets[i] + counts[i];
+    heapsize++;
+  }
+  /* heapify */
+  for (i=heapsize/2; i>0; i--) {
+    _set_heap_sift(heap, heapsize, i-1);
+  }
+
+  while (heapsize && oi<outmax) {
+    fileptr val = *heap[0].head;
+    if (!oi || out[oi-1] != val) {
+      out[oi++] = val;
+    }
+    if (++heap[0].head >= heap[0].end) {
+      /* this input is exhausted, so replace it with the last one */
+      heap[0] = heap[--heapsize];
+    }
+    _set_heap_sift(heap, heapsize, 0);
   }
+
+  ifree(heap);
   return oi;
 }
 
@@ -271,57 +918,99 @@ int set_union(void *set1, void *set2, void *out, size_t in1count, size_t in2coun
 }
 
 /**
- * Creates the intersection of two sorted inode arrays. The output array is
- * guaranteed never to be larger than MIN(\a in1count, \a in2count). Optimised
- * for inode arrays.
+ * Merge two sorted arrays to find their intersection.
  *
  * @param set1      The first set to be used.
  * @param set2      The second set to be used.
- * @param out       The output array.
+ * @param out       The output array, or NULL to count the intersection only.
  * @param in1count  The number of items in \a set1.
  * @param in2count  The number of items in \a set2.
  * @param outmax    The maximum number of items in \a out.
- * @returns A negative error code, or the number of items written to the output
- * array.
+ * @param elem_size The size of an element in the set arrays.
+ * @param cmp       A comparison function that can be used on the array
+ * elements.
+ * @returns The number of items in the intersection.
  */
-int set_intersect_inode(fileptr *set1, fileptr *set2, fileptr *out, size_t in1count, size_t in2count, size_t outmax) {
-  if (!set1 || !set2 || !out || !outmax) {
-    DEBUG("At least one argument was null or zero");
-    return -EINVAL;
-  }
-
-  if (!in1count || !in2count) {
-    DEBUG("No elements in an input array means no intersection possible");
-    return 0;
-  }
-
+static size_t _set_intersect_merge(const void *set1, const void *set2, void *out, size_t in1count, size_t in2count, size_t outmax, size_t elem_size, int (*cmp)(const void*, const void*)) {
   size_t s1=0, s2=0, oi=0, eq=0;
-  fileptr oldval=0;
+  const void *oldval=NULL;
   while (s1<in1count && s2<in2count && oi<outmax) {
-    if (set1[s1] == set2[s2]) {
+    int val = cmp((set1 + s1 * elem_size), (set2 + s2 * elem_size));
+    if (val==0) {
       DEBUG("Equal");
-      if (!eq || set1[s1] != oldval) {
+      if (!eq || cmp((set1 + s1 * elem_size), oldval)!=0) {
         /* make sure that the output array has distinct elements */
-        out[oi++] = set1[s1];
+        if (out) memcpy((out + oi * elem_size), (set1 + s1 * elem_size), elem_size);
+        oi++;
         /* keep the old value so we can tell if there are repeated elements */
-        oldval = set2[s2];
+        oldval = (set2 + s2 * elem_size);
       }
       s1++; s2++;
       eq=1;
-    } else if (set1[s1] < set2[s2]) {
-      oldval = set1[s1];
+    } else if (val < 0) {
+      oldval = (set1 + s1++ * elem_size);
       eq=0;
-    } else if (set1[s1] > set2[s2]) {
-      oldval = set2[s2];
+    } else if (val > 0) {
+      oldval = (set2 + s2++ * elem_size);
       eq=0;
     }
   }
   return oi;
 }
 
+/**
+ * Find the intersection of two sorted arrays of very different sizes by
+ * searching the larger one for each item of the smaller one. Each search
+ * gallops forward from where the last one finished, so the cost grows with the
+ * size of the smaller set rather than the larger. Matching items are always
+ * copied from \a set1.
+ *
+ * @param set1      The first set to be used.
+ * @param set2      The second set to be used.
+ * @param out       The output array, or NULL to count the intersection only.
+ * @param in1count  The number of items in \a set1.
+ * @param in2count  The number of items in \a set2.
+ * @param outmax    The maximum number of items in \a out.
+ * @param elem_size The size of an element in the set arrays.
+ * @param cmp       A comparison function that can be used on the array
+ * elements.
+ * @returns The number of items in the intersection.
+ */
+static size_t _set_intersect_gallop(const void *set1, const void *set2, void *out, size_t in1count, size_t in2count, size_t outmax, size_t elem_size, int (*cmp)(const void*, const void*)) {
+  int small1 = in1count <= in2count;
+  const void *small = small1 ? set1 : set2, *large = small1 ? set2 : set1;
+  size_t ns = small1 ? in1count : in2count, nl = small1 ? in2count : in1count;
+  size_t i, lo=0, hi, mid, step, oi=0;
+  const void *match, *last=NULL;
+
+  for (i=0; i<ns && lo<nl && oi<outmax; i++) {
+    const void *item = small + i * elem_size;
+    for (step=1; lo+step < nl && cmp(large + (lo+step-1) * elem_size, item) < 0; step<<=1) {
+      lo += step;
+    }
+    hi = MIN(lo+step, nl);
+    while (lo < hi) {
+      mid = lo + (hi-lo)/2;
+      if (cmp(large + mid * elem_size, item) < 0)
+        lo = mid+1;
+      else
+        hi = mid;
+    }
+    if (lo >= nl || cmp(large + lo * elem_size, item) != 0) continue;
+    match = small1 ? item : large + lo * elem_size;
+    if (!last || cmp(match, last) != 0) {
+      if (out) memcpy((out + oi * elem_size), match, elem_size);
+      oi++;
+      last = match;
+    }
+  }
+  return oi;
+}
+
 /**
  * Creates the intersection of two sorted arrays. The output array is
- * guaranteed never to be larger than MIN(\a in1count, \a in2count).
+ * guaranteed never to be larger than MIN(\a in1count, \a in2count). If one set
+ * is much larger than the other, it is searched rather than merged.
  *
  * @param set1      The first set to be used.
  * @param set2      The second set to be used.
@@ -346,29 +1035,35 @@ int set_intersect(void *set1, void *set2, void *out, size_t in1count, size_t in2
     return 0;
   }
 
-  size_t s1=0, s2=0, oi=0, eq=0;
-  void *oldval=NULL;
-  while (s1<in1count && s2<in2count && oi<outmax) {
-    int val = cmp((set1 + s1 * elem_size), (set2 + s2 * elem_size));
-    if (val==0) {
-      DEBUG("Equal");
-      if (!eq || cmp((set1 + s1 * elem_size), oldval)!=0) {
-        /* make sure that the output array has distinct elements */
-        memcpy((out + oi++ * elem_size), (set1 + s1 * elem_size), elem_size);
-        /* keep the old value so we can tell if there are repeated elements */
-        oldval = (set2 + s2 * elem_size);
-      }
-      s1++; s2++;
-      eq=1;
-    } else if (val < 0) {
-      oldval = (set1 + s1++ * elem_size);
-      eq=0;
-    } else if (val > 0) {
-      oldval = (set2 + s2++ * elem_size);
-      eq=0;
-    }
+  if (in1count > SET_GALLOP_RATIO*in2count || in2count > SET_GALLOP_RATIO*in1count) {
+    return _set_intersect_gallop(set1, set2, out, in1count, in2count, outmax, elem_size, cmp);
   }
-  return oi;
+  return _set_intersect_merge(set1, set2, out, in1count, in2count, outmax, elem_size, cmp);
+}
+
+/**
+ * Counts the items two sorted arrays have in common, without writing out the
+ * intersection.
+ *
+ * @param set1      The first set to be used.
+ * @param set2      The second set to be used.
+ * @param in1count  The number of items in \a set1.
+ * @param in2count  The number of items in \a set2.
+ * @param elem_size The size of an element in the set arrays.
+ * @param cmp       A comparison function that can be used on the array
+ * elements.
+ * @returns A negative error code, or the number of items in the intersection.
+ */
+int set_intersect_count(const void *set1, const void *set2, size_t in1count, size_t in2count, size_t elem_size, int (*cmp)(const void*, const void*)) {
+  if (!set1 || !set2 || !elem_size || !cmp) {
+    DEBUG("At least one argument was null or zero");
+    return -EINVAL;
+  }
+
+  if (in1count > SET_GALLOP_RATIO*in2count || in2count > SET_GALLOP_RATIO*in1count) {
+    return _set_intersect_gallop(set1, set2, NULL, in1count, in2count, in1count, elem_size, cmp);
+  }
+  return _set_intersect_merge(set1, set2, NULL, in1count, in2count, in1count, elem_size, cmp);
 }
 
 /**
@@ -30,11 +30,246 @@
  * Your fair use and other rights are in no way affected by the above.
  */
 
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#ifndef _TYPE_FILEPTR
+#define _TYPE_FILEPTR
+/** An address within a file */
+typedef unsigned long fileptr;
+#endif
+
+/** Instruction sets the integer set kernels can use, from least to most capable. */
+enum set_simd_level {
+  SET_SIMD_NONE = 0,
+  SET_SIMD_SSE42,
+  SET_SIMD_AVX2
+};
+
+/**
+ * Size ratio beyond which intersections search the larger set for each item of
+ * the smaller one instead of merging the two.
+ */
+#define SET_GALLOP_RATIO 32
+
+/**
+ * Arrays shorter than this are sorted by insertion rather than by radix sort,
+ * whose passes over the digit histograms cost more than they save.
+ */
+#define SET_RADIX_MIN 64
+
+/** Three-way comparison of two numeric values, for use with SET_OPS_DEFINE(). */
+#define SET_CMP_NUM(x, y) (((x) > (y)) - ((x) < (y)))
+
+/**
+ * Define a family of set operations over sorted arrays of \a type, ordered by
+ * \a cmp, a macro or function that compares two values (not pointers) in the
+ * same way as strcmp(). Everything is generated as static inline functions, so
+ * each element is compared and copied directly rather than through a function
+ * pointer and memcpy(). For a family called \a name, the functions are:
+ *
+ *  - <tt>int name_union(set1, set2, out, in1count, in2count, outmax)</tt>
+ *  - <tt>int name_intersect(set1, set2, out, in1count, in2count, outmax)</tt>
+ *  - <tt>int name_intersect_count(set1, set2, in1count, in2count)</tt>
+ *  - <tt>int name_diff(set1, set2, out, in1count, in2count, outmax)</tt>
+ *  - <tt>int name_uniq(set, count)</tt>
+ *  - <tt>int name_sorted(set, count)</tt>
+ *  - <tt>void name_insertion_sort(set, count)</tt>
+ *  - <tt>size_t name_insert(set, count, item)</tt>
+ *  - <tt>size_t name_remove(set, count, item)</tt>
+ *
+ * which behave like set_union_inode(), set_intersect_inode(),
+ * set_intersect_count_inode() and set_diff_inode(), and like set_uniq()
+ * except that discarded items are not kept. <tt>name_sorted()</tt> checks
+ * that a set is in ascending order; <tt>name_insert()</tt> and
+ * <tt>name_remove()</tt> add or drop a single item by shifting the rest of
+ * the set, which must have room for one more item when inserting, and return
+ * the new size. The <tt>name_*_at()</tt> and
+ * <tt>name_intersect_gallop()</tt> building blocks carry on from given
+ * positions, and accept a NULL output array to count only.
+ */
+#define SET_OPS_DEFINE(name, type, cmp) \
+static inline void name##_union_at(const type *a, const type *b, type *out, size_t na, size_t nb, size_t outmax, size_t *pi, size_t *pj, size_t *poi) { \
+  size_t i=*pi, j=*pj, oi=*poi; \
+  while (i<na && j<nb && oi<outmax) { \
+    int c = cmp(a[i], b[j]); \
+    if (c < 0) { \
+      out[oi++] = a[i++]; \
+    } else if (c > 0) { \
+      out[oi++] = b[j++]; \
+    } else { \
+      if (!oi || cmp(out[oi-1], a[i]) != 0) out[oi++] = a[i]; \
+      i++; j++; \
+    } \
+  } \
+  while (i<na && oi<outmax) out[oi++] = a[i++]; \
+  while (j<nb && oi<outmax) out[oi++] = b[j++]; \
+  *pi=i; *pj=j; *poi=oi; \
+} \
+static inline void name##_intersect_at(const type *a, const type *b, type *out, size_t na, size_t nb, size_t outmax, size_t *pi, size_t *pj, size_t *poi, type *plast) { \
+  size_t i=*pi, j=*pj, oi=*poi; \
+  type last=*plast; \
+  while (i<na && j<nb && oi<outmax) { \
+    int c = cmp(a[i], b[j]); \
+    if (c < 0) { \
+      i++; \
+    } else if (c > 0) { \
+      j++; \
+    } else { \
+      if (!oi || cmp(last, a[i]) != 0) { \
+        if (out) out[oi] = a[i]; \
+        last = a[i]; \
+        oi++; \
+      } \
+      i++; j++; \
+    } \
+  } \
+  *pi=i; *pj=j; *poi=oi; *plast=last; \
+} \
+static inline size_t name##_intersect_gallop(const type *s, const type *l, type *out, size_t ns, size_t nl, size_t outmax) { \
+  size_t i, lo=0, hi, mid, step, oi=0; \
+  type last; \
+  memset(&last, 0, sizeof(last)); \
+  for (i=0; i<ns && lo<nl && oi<outmax; i++) { \
+    /* gallop forward from the last position, then binary search */ \
+    for (step=1; lo+step < nl && cmp(l[lo+step-1], s[i]) < 0; step<<=1) lo += step; \
+    hi = (lo+step < nl) ? lo+step : nl; \
+    while (lo < hi) { \
+      mid = lo + (hi-lo)/2; \
+      if (cmp(l[mid], s[i]) < 0) \
+        lo = mid+1; \
+      else \
+        hi = mid; \
+    } \
+    if (lo < nl && cmp(l[lo], s[i]) == 0 && (!oi || cmp(last, s[i]) != 0)) { \
+      if (out) out[oi] = s[i]; \
+      last = s[i]; \
+      oi++; \
+    } \
+  } \
+  return oi; \
+} \
+static inline void name##_diff_at(const type *a, const type *b, type *out, size_t na, size_t nb, size_t outmax, size_t *pi, size_t *pj, size_t *poi) { \
+  size_t i=*pi, j=*pj, oi=*poi; \
+  while (i<na && oi<outmax) { \
+    while (j<nb && cmp(b[j], a[i]) < 0) j++; \
+    if (j<nb && cmp(b[j], a[i]) == 0) { \
+      i++; \
+    } else { \
+      out[oi++] = a[i++]; \
+    } \
+  } \
+  *pi=i; *pj=j; *poi=oi; \
+} \
+static inline size_t name##_intersect_adaptive(const type *a, const type *b, type *out, size_t na, size_t nb, size_t outmax) { \
+  size_t i=0, j=0, oi=0; \
+  type last; \
+  memset(&last, 0, sizeof(last)); \
+  if (na > SET_GALLOP_RATIO*nb) return name##_intersect_gallop(b, a, out, nb, na, outmax); \
+  if (nb > SET_GALLOP_RATIO*na) return name##_intersect_gallop(a, b, out, na, nb, outmax); \
+  name##_intersect_at(a, b, out, na, nb, outmax, &i, &j, &oi, &last); \
+  return oi; \
+} \
+static inline int name##_union(const type *set1, const type *set2, type *out, size_t in1count, size_t in2count, size_t outmax) { \
+  size_t i=0, j=0, oi=0; \
+  if (!set1 || !set2 || !out || (in1count && in2count && !outmax)) return -EINVAL; \
+  name##_union_at(set1, set2, out, in1count, in2count, outmax, &i, &j, &oi); \
+  return oi; \
+} \
+static inline int name##_intersect(const type *set1, const type *set2, type *out, size_t in1count, size_t in2count, size_t outmax) { \
+  if (!set1 || !set2 || !out || !outmax) return -EINVAL; \
+  return name##_intersect_adaptive(set1, set2, out, in1count, in2count, outmax); \
+} \
+static inline int name##_intersect_count(const type *set1, const type *set2, size_t in1count, size_t in2count) { \
+  if (!set1 || !set2) return -EINVAL; \
+  return name##_intersect_adaptive(set1, set2, NULL, in1count, in2count, (in1count < in2count) ? in1count : in2count); \
+} \
+static inline int name##_diff(const type *set1, const type *set2, type *out, size_t in1count, size_t in2count, size_t outmax) { \
+  size_t i=0, j=0, oi=0; \
+  if (!set1 || !set2 || !out) return -EINVAL; \
+  name##_diff_at(set1, set2, out, in1count, in2count, outmax, &i, &j, &oi); \
+  return oi; \
+} \
+static inline int name##_uniq(type *set, size_t count) { \
+  size_t i, oi; \
+  if (!set) return -EINVAL; \
+  for (i=oi=(count ? 1 : 0); i<count; i++) { \
+    if (cmp(set[oi-1], set[i]) != 0) set[oi++] = set[i]; \
+  } \
+  return oi; \
+} \
+static inline int name##_sorted(const type *set, size_t count) { \
+  size_t i; \
+  for (i=1; i<count; i++) { \
+    if (cmp(set[i-1], set[i]) > 0) return 0; \
+  } \
+  return 1; \
+} \
+static inline void name##_insertion_sort(type *set, size_t count) { \
+  size_t i, j; \
+  for (i=1; i<count; i++) { \
+    type item = set[i]; \
+    for (j=i; j>0 && cmp(set[j-1], item) > 0; j--) set[j] = set[j-1]; \
+    set[j] = item; \
+  } \
+} \
+static inline size_t name##_search(const type *set, size_t count, type item) { \
+  size_t lo=0, hi=count, mid; \
+  while (lo < hi) { \
+    mid = lo + (hi-lo)/2; \
+    if (cmp(set[mid], item) < 0) \
+      lo = mid+1; \
+    else \
+      hi = mid; \
+  } \
+  return lo; \
+} \
+static inline size_t name##_insert(type *set, size_t count, type item) { \
+  size_t i = name##_search(set, count, item); \
+  if (i<count && cmp(set[i], item) == 0) return count; \
+  memmove(&set[i+1], &set[i], (count-i) * sizeof(type)); \
+  set[i] = item; \
+  return count+1; \
+} \
+static inline size_t name##_remove(type *set, size_t count, type item) { \
+  size_t i = name##_search(set, count, item); \
+  if (i>=count || cmp(set[i], item) != 0) return count; \
+  memmove(&set[i], &set[i+1], (count-i-1) * sizeof(type)); \
+  return count-1; \
+}
+
+SET_OPS_DEFINE(u32set, uint32_t, SET_CMP_NUM)
+SET_OPS_DEFINE(u64set, uint64_t, SET_CMP_NUM)
+SET_OPS_DEFINE(inodeset, fileptr, SET_CMP_NUM)
+
 int inodecmp(const void *p1, const void *p2);
 int pstrcmp(const void *p1, const void *p2);
 int set_union(void *set1, void *set2, void *out, size_t in1count, size_t in2count, size_t outmax, size_t elem_size, int (*cmp)(const void*, const void*));
 int set_intersect(void *set1, void *set2, void *out, size_t in1count, size_t in2count, size_t outmax, size_t elem_size, int (*cmp)(const void*, const void*));
+int set_intersect_count(const void *set1, const void *set2, size_t in1count, size_t in2count, size_t elem_size, int (*cmp)(const void*, const void*));
 int set_diff(void *set1, const void const * const set2, size_t in1count, size_t in2count, size_t elem_size, int (*cmp)(const void*, const void*));
 int set_uniq(void *set, size_t count, size_t elem_size, int (*cmp)(const void*, const void*));
 
+enum set_simd_level set_ops_simd_level(void);
+enum set_simd_level set_ops_simd_limit(enum set_simd_level max);
+int set_union_u32(const uint32_t *set1, const uint32_t *set2, uint32_t *out, size_t in1count, size_t in2count, size_t outmax);
+int set_union_u64(const uint64_t *set1, const uint64_t *set2, uint64_t *out, size_t in1count, size_t in2count, size_t outmax);
+int set_intersect_u32(const uint32_t *set1, const uint32_t *set2, uint32_t *out, size_t in1count, size_t in2count, size_t outmax);
+int set_intersect_u64(const uint64_t *set1, const uint64_t *set2, uint64_t *out, size_t in1count, size_t in2count, size_t outmax);
+int set_intersect_count_u32(const uint32_t *set1, const uint32_t *set2, size_t in1count, size_t in2count);
+int set_intersect_count_u64(const uint64_t *set1, const uint64_t *set2, size_t in1count, size_t in2count);
+int set_diff_u32(const uint32_t *set1, const uint32_t *set2, uint32_t *out, size_t in1count, size_t in2count, size_t outmax);
+int set_diff_u64(const uint64_t *set1, const uint64_t *set2, uint64_t *out, size_t in1count, size_t in2count, size_t outmax);
+int set_union_inode(const fileptr *set1, const fileptr *set2, fileptr *out, size_t in1count, size_t in2count, size_t outmax);
+int set_intersect_inode(const fileptr *set1, const fileptr *set2, fileptr *out, size_t in1count, size_t in2count, size_t outmax);
+int set_intersect_count_inode(const fileptr *set1, const fileptr *set2, size_t in1count, size_t in2count);
+int set_diff_inode(const fileptr *set1, const fileptr *set2, fileptr *out, size_t in1count, size_t in2count, size_t outmax);
+int set_intersect_n_inode(const fileptr * const *sets, const size_t *counts, size_t k, fileptr *out, size_t outmax);
+int set_union_n_inode(const fileptr * const *sets, const size_t *counts, size_t k, fileptr *out, size_t outmax);
+int set_sort_u32(uint32_t *set, size_t count);
+int set_sort_u64(uint64_t *set, size_t count);
+int set_sort_inode(fileptr *set, size_t count);
+
 #endif
@@ -35,6 +35,7 @@
 #endif
 #include <debug.h>
 #include <string_helpers.h>
+#include <arena.h>
 
 /**
  * Count the number of occurences of a character within a string.
@@ -76,70 +77,19 @@ char *strlast(const char *input, const char sep) {
 }
 
 /**
- * Split a string into multiple substrings based on one character, and call a
- * user-defined function on each substring.
+ * Get the last component of a string, as split by \a sep, allocated from the
+ * request arena.
  *
- * The user-defined function should return zero, although it may return 1 to
- * cause the loop to immediately terminate successfully or any negative value
- * to indicate an internal error, terminating the loop and exiting
- * strsplitmap() with that value as its return value.
- *
- * @param[in] input The string to be split.
- * @param[in] sep   The character which the string should be used to split \a input.
- * @param[in] func  The function to be called.
- * @param[in] data  Data passed to the user-defined function on each invocation.
- * @returns Zero on success, non-zero on failure.
+ * @param input The input string.
+ * @param sep   The character to split by.
+ * @returns The last component of the string, as for strlast(), to be released
+ * with afree().
  */
-int strsplitmap(const char *input, const char sep, int (*func)(const char *, unsigned long), unsigned long data) {
-
-  DEBUG("Splitting \"%s\" by \"%c\" with user function call", input, sep);
-
-  int i=0, ret=0;
-  char *dup = strdup(input);
-  char *sepstr=calloc(2, sizeof(char));
-  if (!sepstr) {
-    PMSG(LOG_ERR, "Could not allocate space for sepstr");
-    ifree(dup);
-    return ENOMEM;
-  }
-  sepstr[0]=sep;
-
-  if (!strcount(input, sep)) {
-    DEBUG("Dealing with entire string (\"%s\")", input);
-    ret = func(input, data);
-    DEBUG("User function returned %d", ret);
-    if (ret>0) ret=0;
-    ifree(sepstr);
-    ifree(dup);
-    return ret;
-  }
-
-  char *saveptr;
-
-  while (1) {
-    char *tmptok;
-    tmptok = strtok_r(i++?NULL:dup, sepstr, &saveptr);
-    if (!tmptok || !*tmptok) {
-      DEBUG("Done");
-      break;
-    }
-    DEBUG("Dealing with token[%d] \"%s\"", i, tmptok);
-    ret = func(tmptok, data);
-    DEBUG("User function returned %d", ret);
-    if (ret) {
-      if (ret>0) ret=0;
-      break;
-    }
-  }
-  ifree(sepstr);
-
-  DEBUG("Freeing dup");
-  ifree(dup);
-
-  return ret;
+char *strlast_arena(const char *input, const char sep) {
+  char *ret=rindex(input, sep);
+  return arena_strdup(ret ? ret+1 : input);
 }
 
-
 /**
  * Split a string into multiple substrings based on one character.
  *
@@ -184,6 +134,47 @@ char **strsplit(const char *input, const char sep, int *count) {
   return bits;
 }
 
+/**
+ * Split a string into multiple substrings based on one character, as for
+ * strsplit(), with the array and the substrings in a single allocation from
+ * the request arena.
+ *
+ * @param[in]  input The string to be split.
+ * @param[in]  sep   The character which the string should be used to split \a input.
+ * @param[out] count The number of items in the array.
+ * @returns A pointer to the array, or NULL if an error occured. The array and
+ * its substrings are released together with afree().
+ */
+char **strsplit_arena(const char *input, const char sep, int *count) {
+  char sepstr[2] = { sep, '\0' };
+  size_t len = strlen(input);
+  char **bits;
+  char *tmp, *saveptr;
+  int i;
+
+  DEBUG("Splitting \"%s\" by \"%c\"", input, sep);
+
+  *count=strcount(input, sep)+1;
+  /* the pointers, then a copy of the input, then an empty string for any
+   * missing substrings */
+  bits = arena_alloc(*count * sizeof(char*) + len + 2);
+  if (!bits) {
+    PMSG(LOG_ERR, "Failed to allocate \"bits\" array.");
+    *count = 0;
+    return NULL;
+  }
+  tmp = (char*)(bits + *count);
+  memcpy(tmp, input, len);
+  tmp[len] = tmp[len+1] = '\0';
+
+  for (i=0; i<*count; i++) {
+    bits[i] = strtok_r(i?NULL:tmp, sepstr, &saveptr);
+    if (!bits[i]) bits[i] = tmp + len + 1;
+    DUMPSTR(bits[i]);
+  }
+  return bits;
+}
+
 /**
  * Very efficient conversion of a value to its eight-digit uppercase
  * hexadecimal representation.
@@ -30,10 +30,118 @@
  * Your fair use and other rights are in no way affected by the above.
  */
 
+#include <stdint.h>
+#include <string.h>
+
+/** A run of characters within a larger string, which need not be terminated */
+typedef struct {
+  const char *ptr;  /**< The first character of the span */
+  size_t      len;  /**< The number of characters in the span */
+} strspan;
+
+/**
+ * State for splitting a string into spans without copying it. Every
+ * component is produced, including empty ones, so <tt>"/a//b"</tt> split by
+ * <tt>'/'</tt> gives <tt>""</tt>, <tt>"a"</tt>, <tt>""</tt> and <tt>"b"</tt>.
+ */
+typedef struct {
+  strspan     tok;  /**< The current component */
+  const char *next; /**< The start of the next component, or NULL after the last */
+  const char *end;  /**< The end of the string being split */
+  char        sep;  /**< The separator */
+} strtokenizer;
+
+/**
+ * Start splitting a string.
+ *
+ * @param t     The tokenizer state.
+ * @param input The string to be split, which need not be terminated.
+ * @param len   The number of characters of \a input to split.
+ * @param sep   The separator.
+ */
+static inline void strtokenizer_init(strtokenizer *t, const char *input, size_t len, char sep) {
+  t->tok.ptr = NULL;
+  t->tok.len = 0;
+  t->next = input;
+  t->end = input+len;
+  t->sep = sep;
+}
+
+/**
+ * Move on to the next component of a string.
+ *
+ * @param t The tokenizer state.
+ * @returns Non-zero if \a t->tok holds the next component, or zero if there
+ * are no more.
+ */
+static inline int strtokenizer_next(strtokenizer *t) {
+  const char *p;
+  if (!t->next) return 0;
+  t->tok.ptr = t->next;
+  p = memchr(t->next, t->sep, t->end - t->next);
+  if (p) {
+    t->tok.len = p - t->next;
+    t->next = p+1;
+  } else {
+    t->tok.len = t->end - t->next;
+    t->next = NULL;
+  }
+  return 1;
+}
+
+/**
+ * Hash a span of characters (FNV-1a).
+ *
+ * @param ptr The characters to hash, which need not be terminated.
+ * @param len The number of characters to hash.
+ * @returns The 32-bit hash of the characters.
+ */
+static inline uint32_t strspan_hash(const char *ptr, size_t len) {
+  uint32_t hash = 2166136261u;
+  while (len--) {
+    hash ^= (unsigned char)*ptr++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/** Non-zero if the current component of tokenizer \a t is the last one. */
+#define strtokenizer_last(t) (!(t)->next)
+
+/** Non-zero if span \a s is non-empty and ends with character \a c. */
+#define strspan_ends_with(s, c) ((s).len && (s).ptr[(s).len-1]==(c))
+
+/**
+ * Loop over every component of the first \a len characters of \a input, as
+ * split by \a sep. Each component is in turn available as the span \a
+ * t.tok.
+ */
+#define strspan_foreach(t, input, len, sep) \
+  for (strtokenizer_init(&(t), (input), (len), (sep)); strtokenizer_next(&(t)); )
+
+/**
+ * Loop over the non-empty components of the terminated string \a input, as
+ * split by \a sep.
+ */
+#define strsplit_foreach(t, input, sep) \
+  strspan_foreach(t, input, strlen(input), sep) \
+    if (!(t).tok.len) continue; else
+
+/**
+ * Loop over the non-empty components of the writable string \a input, as
+ * split by \a sep, terminating each component in place so that \a var can be
+ * used as an ordinary string. This replaces the old strsplitmap(), without
+ * copying the input or calling back through a function pointer.
+ */
+#define strsplit_foreach_inplace(t, var, input, sep) \
+  strsplit_foreach(t, input, sep) \
+    if ((var) = (char*)(t).tok.ptr, (var)[(t).tok.len] = '\0', 0) {} else
+
 int strcount(const char *haystack, const char needle);
 char *strlast(const char *input, const char sep);
-int strsplitmap(const char *input, const char sep, int (*func)(const char *, unsigned long), unsigned long data);
 char **strsplit(const char *input, const char sep, int *count);
+char *strlast_arena(const char *input, const char sep);
+char **strsplit_arena(const char *input, const char sep, int *count);
 void hex_to_string(char *buf, unsigned long val);
 unsigned long hash_path_old(const char *path);
 unsigned long hash_path(const char *path);
@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2008 David Ingram
+ *
+ * This program is released under a Creative Commons
+ * Attribution-NonCommerical-ShareAlike2.5 License.
+ *
+ * For more information, please see
+ *   http://creativecommons.org/licenses/by-nc-sa/2.5/
+ *
+ * You are free:
+ *
+ *   * to copy, distribute, display, and perform the work
+ *   * to make derivative works
+ *
+ * Under the following conditions:
+ *   Attribution:   You must attribute the work in the manner specified by the
+ *                  author or licensor.
+ *   Noncommercial: You may not use this work for commercial purposes.
+ *   Share Alike:   If you alter, transform, or build upon this work, you may
+ *                  distribute the resulting work only under a license identical
+ *                  to this one.
+ *
+ *   * For any reuse or distribution, you must make clear to others the
+ *     license terms of this work.
+ *   * Any of these conditions can be waived if you get permission from the
+ *     copyright holder.
+ *
+ * Your fair use and other rights are in no way affected by the above.
+ */
+
+#include <pthread.h>
+#include <insight.h>
+#if defined(_DEBUG_TAG_CACHE) && !defined(_DEBUG)
+#define _DEBUG
+#endif
+#include <debug.h>
+#include <string_helpers.h>
+#include <tag_cache.h>
+
+/*
+ * The tag resolution cache maps fully-qualified tag names to their data
+ * blocks, so that resolving the same tag again costs a hash and a compare
+ * rather than a descent through one subkey tree per segment. Names known not
+ * to exist are cached too, with a data block of zero.
+ *
+ * The cache is direct-mapped: each name has one slot, and a new name simply
+ * replaces whatever was there. Slots are guarded by a set of locks, each
+ * covering every TAG_CACHE_STRIPES'th slot.
+ *
+ * Entries are never removed one by one. Instead each records the generations
+ * it was made in, and is ignored once any of them moves on:
+ *  - tag_cache_invalidate() drops every entry;
+ *  - tag_cache_created() drops the entries for names that did not exist;
+ *  - removing a key from the tag trees drops every entry, through
+ *    tree_get_key_generation().
+ */
+
+/** A cached tag resolution */
+typedef struct {
+  uint32_t      hash;     /**< Hash of \a name */
+  uint32_t      len;      /**< Length of \a name, or zero if the slot is empty */
+  unsigned long gen;      /**< Value of #cache_gen when the entry was made */
+  unsigned long keygen;   /**< Key generation of the tree when the entry was made */
+  unsigned long neggen;   /**< Value of #cache_neg_gen when the entry was made */
+  fileptr       block;    /**< The tag's data block, or zero if it does not exist */
+  char          name[TAG_CACHE_NAME_SIZE]; /**< The fully-qualified tag name */
+} tag_cache_entry;
+
+static tag_cache_entry cache[TAG_CACHE_SIZE];
+static pthread_mutex_t cache_locks[TAG_CACHE_STRIPES];
+static pthread_once_t cache_locks_once = PTHREAD_ONCE_INIT;
+
+/** Changes whenever every entry is invalidated */
+static volatile unsigned long cache_gen = 1;
+/** Changes whenever a tag is created, invalidating negative entries */
+static volatile unsigned long cache_neg_gen = 1;
+
+static void _tag_cache_init_locks(void) {
+  int i;
+  for (i=0; i<TAG_CACHE_STRIPES; i++) {
+    pthread_mutex_init(&cache_locks[i], NULL);
+  }
+}
+
+/**
+ * Look up a fully-qualified tag name in the cache.
+ *
+ * @param[in]  tagname The tag name, which need not be terminated.
+ * @param[in]  len     The length of \a tagname.
+ * @param[out] block   Set to the tag's data block, or to zero if the tag is
+ *                     known not to exist.
+ * @returns Non-zero if the name was found in the cache, or zero if it must be
+ * resolved from the tree.
+ */
+int tag_cache_get(const char *tagname, size_t len, fileptr *block) {
+  uint32_t hash = strspan_hash(tagname, len);
+  size_t slot = hash & (TAG_CACHE_SIZE-1);
+  tag_cache_entry *e = &cache[slot];
+  int found;
+
+  if (len >= TAG_CACHE_NAME_SIZE) return 0;
+
+  pthread_once(&cache_locks_once, _tag_cache_init_locks);
+  pthread_mutex_lock(&cache_locks[slot % TAG_CACHE_STRIPES]);
+  found = e->len==len && e->hash==hash &&
+          e->gen==cache_gen && e->keygen==tree_get_key_generation() &&
+          (e->block || e->neggen==cache_neg_gen) &&
+          memcmp(e->name, tagname, len)==0;
+  if (found) *block = e->block;
+  pthread_mutex_unlock(&cache_locks[slot % TAG_CACHE_STRIPES]);
+
+  DEBUG("%s for \"%.*s\"", found ? "Hit" : "Miss", (int)len, tagname);
+  return found;
+}
+
+/**
+ * Record the result of resolving a fully-qualified tag name.
+ *
+ * @param tagname The tag name, which need not be terminated.
+ * @param len     The length of \a tagname.
+ * @param block   The tag's data block, or zero if the tag does not exist.
+ */
+void tag_cache_put(const char *tagname, size_t len, fileptr block) {
+  uint32_t hash = strspan_hash(tagname, len);
+  size_t slot = hash & (TAG_CACHE_SIZE-1);
+  tag_cache_entry *e = &cache[slot];
+
+  if (!len || len >= TAG_CACHE_NAME_SIZE) return;
+
+  pthread_once(&cache_locks_once, _tag_cache_init_locks);
+  pthread_mutex_lock(&cache_locks[slot % TAG_CACHE_STRIPES]);
+  memcpy(e->name, tagname, len);
+  e->hash = hash;
+  e->len = len;
+  e->gen = cache_gen;
+  e->keygen = tree_get_key_generation();
+  e->neggen = cache_neg_gen;
+  e->block = block;
+  pthread_mutex_unlock(&cache_locks[slot % TAG_CACHE_STRIPES]);
+}
+
+/**
+ * Note that a tag has been created. Cached resolutions of existing tags stay
+ * valid, but names cached as not existing are looked up again.
+ */
+void tag_cache_created(void) {
+  __sync_fetch_and_add(&cache_neg_gen, 1);
+}
+
+/**
+ * Get the tag generation, which changes whenever tag_cache_created() or
+ * tag_cache_invalidate() is called. Together with tree_get_key_generation(),
+ * it tells whether anything derived from the set of existing tags is still
+ * valid.
+ *
+ * @returns The current tag generation.
+ */
+unsigned long tag_cache_generation(void) {
+  /* both counters only ever grow, so their sum changes when either does */
+  return cache_gen + cache_neg_gen;
+}
+
+/**
+ * Invalidate every cached tag resolution. This must be called whenever a tag
+ * is removed, as its data block may be reused.
+ */
+void tag_cache_invalidate(void) {
+  __sync_fetch_and_add(&cache_gen, 1);
+}
@@ -0,0 +1,51 @@
+#ifndef __TAG_CACHE_H
+#define __TAG_CACHE_H
+/*
+ * Copyright (C) 2008 David Ingram
+ *
+ * This program is released under a Creative Commons
+ * Attribution-NonCommerical-ShareAlike2.5 License.
+ *
+ * For more information, please see
+ *   http://creativecommons.org/licenses/by-nc-sa/2.5/
+ *
+ * You are free:
+ *
+ *   * to copy, distribute, display, and perform the work
+ *   * to make derivative works
+ *
+ * Under the following conditions:
+ *   Attribution:   You must attribute the work in the manner specified by the
+ *                  author or licensor.
+ *   Noncommercial: You may not use this work for commercial purposes.
+ *   Share Alike:   If you alter, transform, or build upon this work, you may
+ *                  distribute the resulting work only under a license identical
+ *                  to this one.
+ *
+ *   * For any reuse or distribution, you must make clear to others the
+ *     license terms of this work.
+ *   * Any of these conditions can be waived if you get permission from the
+ *     copyright holder.
+ *
+ * Your fair use and other rights are in no way affected by the above.
+ */
+
+#include <bplus.h>
+
+/** Number of entries in the tag resolution cache (a power of two) */
+#define TAG_CACHE_SIZE 1024
+
+/** Number of locks the tag resolution cache is divided between */
+#define TAG_CACHE_STRIPES 16
+
+/** Space for each tag name in the cache; longer names are not cached */
+#define TAG_CACHE_NAME_SIZE 104
+
+/* Prototypes */
+int tag_cache_get(const char *tagname, size_t len, fileptr *block);
+void tag_cache_put(const char *tagname, size_t len, fileptr block);
+void tag_cache_created(void);
+void tag_cache_invalidate(void);
+unsigned long tag_cache_generation(void);
+
+#endif
@@ -0,0 +1,312 @@
+/*
+ * Copyright (C) 2008 David Ingram
+ *
+ * This program is released under a Creative Commons
+ * Attribution-NonCommerical-ShareAlike2.5 License.
+ *
+ * For more information, please see
+ *   http://creativecommons.org/licenses/by-nc-sa/2.5/
+ *
+ * You are free:
+ *
+ *   * to copy, distribute, display, and perform the work
+ *   * to make derivative works
+ *
+ * Under the following conditions:
+ *   Attribution:   You must attribute the work in the manner specified by the
+ *                  author or licensor.
+ *   Noncommercial: You may not use this work for commercial purposes.
+ *   Share Alike:   If you alter, transform, or build upon this work, you may
+ *                  distribute the resulting work only under a license identical
+ *                  to this one.
+ *
+ *   * For any reuse or distribution, you must make clear to others the
+ *     license terms of this work.
+ *   * Any of these conditions can be waived if you get permission from the
+ *     copyright holder.
+ *
+ * Your fair use and other rights are in no way affected by the above.
+ */
+
+#include <insight.h>
+#if defined(_DEBUG_TAG_DICT) && !defined(_DEBUG)
+#define _DEBUG
+#endif
+#include <debug.h>
+#include <set_ops.h>
+#include <string_helpers.h>
+#include <tag_dict.h>
+
+/*
+ * The tag dictionary gives every fully-qualified tag name that has been seen a
+ * small integer ID, and remembers the IDs of the children of each tag, so that
+ * directory listings can be built with set operations on sorted integer arrays
+ * rather than on strings.
+ *
+ * IDs are handed out densely from 1, and are only valid until the next call to
+ * tag_dict_invalidate(), which must be made whenever a tag is created or
+ * removed. Like the tree itself, the dictionary is not locked.
+ */
+
+/** An interned tag name */
+typedef struct {
+  char     *name;   /**< The fully-qualified name */
+  size_t    len;    /**< Length of \a name */
+  uint32_t  hash;   /**< Hash of \a name */
+} tag_dict_entry;
+
+/** The cached children of a tag */
+typedef struct {
+  fileptr   root;   /**< The tag's data block, or zero for the root tree */
+  uint32_t *ids;    /**< Sorted IDs of the children's fully-qualified names */
+  unsigned  count;  /**< Number of items in \a ids */
+  int       used;   /**< Whether this slot is occupied */
+} tag_dict_kids;
+
+/** Interned names, indexed by ID; entry zero is unused */
+static tag_dict_entry *dict_entries = NULL;
+static uint32_t dict_count = 0, dict_alloc = 0;
+
+/** Open-addressed hash table of IDs by name; zero marks an empty slot */
+static uint32_t *dict_slots = NULL;
+static size_t dict_nslots = 0;
+
+/** Open-addressed hash table of children by data block */
+static tag_dict_kids *dict_kids = NULL;
+static size_t dict_nkids = 0, dict_kids_used = 0;
+
+/**
+ * Find the slot of the name hash table that holds the given name, or the empty
+ * slot where it would go.
+ */
+static size_t _tag_dict_find(const char *name, size_t len, uint32_t hash) {
+  size_t i = hash & (dict_nslots-1);
+  while (dict_slots[i]) {
+    tag_dict_entry *e = &dict_entries[dict_slots[i]];
+    if (e->hash==hash && e->len==len && memcmp(e->name, name, len)==0) break;
+    i = (i+1) & (dict_nslots-1);
+  }
+  return i;
+}
+
+/**
+ * Double the size of the name hash table (or create it).
+ *
+ * @returns Zero on success, or a negative error code.
+ */
+static int _tag_dict_grow(void) {
+  size_t nslots = dict_nslots ? dict_nslots*2 : TAG_DICT_INIT_SIZE;
+  uint32_t *slots = calloc(nslots, sizeof(uint32_t));
+  uint32_t id, *old = dict_slots;
+  if (!slots) return -ENOMEM;
+  dict_slots = slots;
+  dict_nslots = nslots;
+  for (id=1; id<=dict_count; id++) {
+    tag_dict_entry *e = &dict_entries[id];
+    dict_slots[_tag_dict_find(e->name, e->len, e->hash)] = id;
+  }
+  if (old) ifree(old);
+  return 0;
+}
+
+/**
+ * Look up the ID of a fully-qualified tag name, interning it if it has not
+ * been seen before.
+ *
+ * @param name The tag name, which need not be terminated.
+ * @param len  The length of \a name.
+ * @returns The ID of the name, or zero if memory could not be allocated.
+ */
+uint32_t tag_dict_intern(const char *name, size_t len) {
+  uint32_t hash = strspan_hash(name, len);
+  size_t slot;
+
+  /* keep the table at most half full */
+  if ((dict_count+1)*2 > dict_nslots && _tag_dict_grow()) return 0;
+
+  slot = _tag_dict_find(name, len, hash);
+  if (dict_slots[slot]) return dict_slots[slot];
+
+  if (dict_count+1 >= dict_alloc) {
+    uint32_t alloc = dict_alloc ? dict_alloc*2 : TAG_DICT_INIT_SIZE;
+    tag_dict_entry *entries = realloc(dict_entries, alloc * sizeof(tag_dict_entry));
+    if (!entries) return 0;
+    dict_entries = entries;
+    dict_alloc = alloc;
+  }
+
+  tag_dict_entry *e = &dict_entries[dict_count+1];
+  if (!(e->name = malloc(len+1))) return 0;
+  memcpy(e->name, name, len);
+  e->name[len] = '\0';
+  e->len = len;
+  e->hash = hash;
+  dict_slots[slot] = ++dict_count;
+  DEBUG("Interned \"%s\" as %u", e->name, dict_count);
+  return dict_count;
+}
+
+/**
+ * Look up the ID of a fully-qualified tag name, without interning it.
+ *
+ * @param name The tag name, which need not be terminated.
+ * @param len  The length of \a name.
+ * @returns The ID of the name, or zero if it has not been interned.
+ */
+uint32_t tag_dict_lookup(const char *name, size_t len) {
+  if (!dict_count) return 0;
+  return dict_slots[_tag_dict_find(name, len, strspan_hash(name, len))];
+}
+
+/**
+ * Retrieve the fully-qualified tag name with the given ID.
+ *
+ * @param id The ID of the name.
+ * @returns The name, which belongs to the dictionary, or NULL if \a id is not
+ * valid.
+ */
+const char *tag_dict_name(uint32_t id) {
+  if (!id || id > dict_count) return NULL;
+  return dict_entries[id].name;
+}
+
+/**
+ * Find the slot of the children hash table for the given data block, or the
+ * empty slot where it would go.
+ */
+static size_t _tag_dict_kids_find(fileptr root) {
+  size_t i = strspan_hash((const char*)&root, sizeof(root)) & (dict_nkids-1);
+  while (dict_kids[i].used && dict_kids[i].root != root) {
+    i = (i+1) & (dict_nkids-1);
+  }
+  return i;
+}
+
+/**
+ * Double the size of the children hash table (or create it).
+ *
+ * @returns Zero on success, or a negative error code.
+ */
+static int _tag_dict_kids_grow(void) {
+  size_t i, nkids = dict_nkids ? dict_nkids*2 : TAG_DICT_INIT_SIZE;
+  tag_dict_kids *kids = calloc(nkids, sizeof(tag_dict_kids)), *old = dict_kids;
+  size_t oldn = dict_nkids;
+  if (!kids) return -ENOMEM;
+  dict_kids = kids;
+  dict_nkids = nkids;
+  for (i=0; i<oldn; i++) {
+    if (old[i].used) dict_kids[_tag_dict_kids_find(old[i].root)] = old[i];
+  }
+  if (old) ifree(old);
+  return 0;
+}
+
+/** State for _tag_dict_kids_callback() */
+struct tag_dict_fill {
+  uint32_t   *ids;      /**< Output array */
+  unsigned    count;    /**< Number of items in \a ids */
+  unsigned    max;      /**< Size of \a ids */
+  char       *buf;      /**< Buffer holding the prefix and each key in turn */
+  size_t      prefixlen;/**< Length of the prefix in \a buf */
+};
+
+static int _tag_dict_kids_callback(const char *key, const fileptr val, void *data) {
+  struct tag_dict_fill *fill = data;
+  size_t keylen = strnlen(key, TREEKEY_SIZE);
+  (void) val;
+  if (fill->count >= fill->max) return -1;
+  memcpy(fill->buf + fill->prefixlen, key, keylen);
+  if (!(fill->ids[fill->count] = tag_dict_intern(fill->buf, fill->prefixlen+keylen))) return -1;
+  fill->count++;
+  return 0;
+}
+
+/**
+ * Retrieve the IDs of the fully-qualified names of the children of a tag. The
+ * first call for each tag reads its subkey tree and interns the names; later
+ * calls are answered from the dictionary until it is invalidated.
+ *
+ * @param[in]  tree_root The tag's data block, or zero for the root tree.
+ * @param[in]  tagname   The tag's fully-qualified name, which need not be
+ *                       terminated.
+ * @param[in]  len       The length of \a tagname, which is zero for the root
+ *                       tree.
+ * @param[out] count     The number of children.
+ * @returns The IDs of the children in ascending order, which belong to the
+ * dictionary, or NULL on failure.
+ */
+const uint32_t *tag_dict_children(fileptr tree_root, const char *tagname, size_t len, unsigned int *count) {
+  struct tag_dict_fill fill;
+  tag_dict_kids *kids;
+  int sibcount;
+
+  if ((dict_kids_used+1)*2 > dict_nkids && _tag_dict_kids_grow()) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  kids = &dict_kids[_tag_dict_kids_find(tree_root)];
+  if (kids->used) {
+    *count = kids->count;
+    return kids->ids;
+  }
+
+  DEBUG("Reading children of %lu (\"%.*s\")", tree_root, (int)len, tagname);
+  if ((sibcount = tree_sub_key_count(tree_root)) < 0) {
+    errno = EIO;
+    return NULL;
+  }
+
+  /* children are named by the tag's name and a separator, then their key */
+  fill.prefixlen = len ? len+1 : 0;
+  fill.ids = malloc((sibcount+1) * sizeof(uint32_t));
+  fill.buf = malloc(fill.prefixlen + TREEKEY_SIZE + 1);
+  if (!fill.ids || !fill.buf) {
+    if (fill.ids) ifree(fill.ids);
+    if (fill.buf) ifree(fill.buf);
+    errno = ENOMEM;
+    return NULL;
+  }
+  memcpy(fill.buf, tagname, len);
+  if (len) fill.buf[len] = INSIGHT_SUBKEY_SEP_C;
+  fill.count = 0;
+  fill.max = sibcount;
+
+  if (tree_map_keys(tree_root, _tag_dict_kids_callback, &fill)) {
+    PMSG(LOG_ERR, "Could not read the children of block %lu", tree_root);
+    ifree(fill.ids);
+    ifree(fill.buf);
+    errno = EIO;
+    return NULL;
+  }
+  ifree(fill.buf);
+
+  set_sort_u32(fill.ids, fill.count);
+  kids->root = tree_root;
+  kids->ids = fill.ids;
+  kids->count = fill.count;
+  kids->used = 1;
+  dict_kids_used++;
+
+  *count = kids->count;
+  return kids->ids;
+}
+
+/**
+ * Forget every interned name and cached list of children. This must be called
+ * whenever a tag is created or removed; any IDs or names handed out before the
+ * call are no longer valid.
+ */
+void tag_dict_invalidate(void) {
+  size_t i;
+  DEBUG("Invalidating tag dictionary (%u names)", dict_count);
+  for (i=1; i<=dict_count; i++) {
+    ifree(dict_entries[i].name);
+  }
+  dict_count = 0;
+  if (dict_slots) memset(dict_slots, 0, dict_nslots * sizeof(uint32_t));
+  for (i=0; i<dict_nkids; i++) {
+    if (dict_kids[i].used) ifree(dict_kids[i].ids);
+  }
+  if (dict_kids) memset(dict_kids, 0, dict_nkids * sizeof(tag_dict_kids));
+  dict_kids_used = 0;
+}
@@ -0,0 +1,45 @@
+#ifndef __TAG_DICT_H
+#define __TAG_DICT_H
+/*
+ * Copyright (C) 2008 David Ingram
+ *
+ * This program is released under a Creative Commons
+ * Attribution-NonCommerical-ShareAlike2.5 License.
+ *
+ * For more information, please see
+ *   http://creativecommons.org/licenses/by-nc-sa/2.5/
+ *
+ * You are free:
+ *
+ *   * to copy, distribute, display, and perform the work
+ *   * to make derivative works
+ *
+ * Under the following conditions:
+ *   Attribution:   You must attribute the work in the manner specified by the
+ *                  author or licensor.
+ *   Noncommercial: You may not use this work for commercial purposes.
+ *   Share Alike:   If you alter, transform, or build upon this work, you may
+ *                  distribute the resulting work only under a license identical
+ *                  to this one.
+ *
+ *   * For any reuse or distribution, you must make clear to others the
+ *     license terms of this work.
+ *   * Any of these conditions can be waived if you get permission from the
+ *     copyright holder.
+ *
+ * Your fair use and other rights are in no way affected by the above.
+ */
+
+#include <bplus.h>
+
+/** Initial number of slots in the tag dictionary's hash tables */
+#define TAG_DICT_INIT_SIZE 256
+
+/* Prototypes */
+uint32_t tag_dict_intern(const char *name, size_t len);
+uint32_t tag_dict_lookup(const char *name, size_t len);
+const char *tag_dict_name(uint32_t id);
+const uint32_t *tag_dict_children(fileptr tree_root, const char *tagname, size_t len, unsigned int *count);
+void tag_dict_invalidate(void);
+
+#endif
@@ -0,0 +1,244 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <set_ops.h>
+
+/*
+ * Throughput benchmark for the set operations. Every combination of element
+ * type, set size, size ratio and overlap is run through both the generic
+ * (callback-driven) and the specialised implementations of union, intersect
+ * and diff, and the results are written to stdout as JSON so that runs can be
+ * compared between releases.
+ */
+
+#define array_size(x) (sizeof(x)/sizeof((x)[0]))
+#ifndef MAX
+#define MAX(a,b)      ((a) > (b) ? (a) : (b))
+#endif
+
+/** Minimum number of input elements processed by each timed batch. */
+#define BENCH_MIN_ELEMS (1<<22)
+/** Number of timed batches per measurement; the fastest one is reported. */
+#define BENCH_BATCHES 3
+
+static const size_t bench_sizes[] = { 10, 100, 1000, 10000, 100000, 1000000, 10000000 };
+static const size_t bench_ratios[] = { 1, 8, 64 };
+static const double bench_overlaps[] = { 0.1, 0.5, 0.9 };
+
+static const char *simd_names[] = { "none", "sse42", "avx2" };
+
+/** The inputs of a single measurement. */
+typedef struct {
+  void *a, *b, *out;
+  size_t na, nb;
+  size_t elem_size;
+} bench_input;
+
+typedef int (*bench_fn)(const bench_input *in);
+
+/** An implementation of one operation on one element type. */
+typedef struct {
+  const char *op;
+  const char *impl;
+  bench_fn fn;
+  int copies;   /**< The implementation copies \a a to \a out first. */
+} bench_impl;
+
+/** An element type and the implementations that work on it. */
+typedef struct {
+  const char *name;
+  size_t elem_size;
+  void (*fill)(bench_input *in, double overlap);
+  const bench_impl *impls;
+  size_t nimpls;
+} bench_type;
+
+/*
+ * The generic set_diff() works in place, so both diff implementations copy
+ * set \a a to the output first and run in place there. The cost of that copy is
+ * measured separately and taken off their timings.
+ *
+ * The sets are filled so that \a a holds even values with random gaps, and \a
+ * b picks items spread evenly through \a a, keeping each with probability \a
+ * overlap and otherwise replacing it with the odd value after it.
+ */
+#define BENCH_TYPE(sfx, type) \
+static int bench_cmp_##sfx(const void *p1, const void *p2) { \
+  return SET_CMP_NUM(*(const type*)p1, *(const type*)p2); \
+} \
+static int bench_union_generic_##sfx(const bench_input *in) { \
+  return set_union(in->a, in->b, in->out, in->na, in->nb, in->na+in->nb, sizeof(type), bench_cmp_##sfx); \
+} \
+static int bench_union_special_##sfx(const bench_input *in) { \
+  return set_union_##sfx(in->a, in->b, in->out, in->na, in->nb, in->na+in->nb); \
+} \
+static int bench_intersect_generic_##sfx(const bench_input *in) { \
+  return set_intersect(in->a, in->b, in->out, in->na, in->nb, in->na+in->nb, sizeof(type), bench_cmp_##sfx); \
+} \
+static int bench_intersect_special_##sfx(const bench_input *in) { \
+  return set_intersect_##sfx(in->a, in->b, in->out, in->na, in->nb, in->na+in->nb); \
+} \
+static int bench_diff_generic_##sfx(const bench_input *in) { \
+  memcpy(in->out, in->a, in->na*sizeof(type)); \
+  return set_diff(in->out, in->b, in->na, in->nb, sizeof(type), bench_cmp_##sfx); \
+} \
+static int bench_diff_special_##sfx(const bench_input *in) { \
+  memcpy(in->out, in->a, in->na*sizeof(type)); \
+  return set_diff_##sfx(in->out, in->b, in->out, in->na, in->nb, in->na); \
+} \
+static void bench_fill_##sfx(bench_input *in, double overlap) { \
+  type *a = in->a, *b = in->b; \
+  size_t i; \
+  a[0] = 2 * (random() % 4); \
+  for (i=1; i<in->na; i++) a[i] = a[i-1] + 2 * (1 + random() % 4); \
+  for (i=0; i<in->nb; i++) { \
+    type v = a[(size_t)((double)i * in->na / in->nb)]; \
+    b[i] = (random() < overlap * RAND_MAX) ? v : v+1; \
+  } \
+} \
+static const bench_impl bench_impls_##sfx[] = { \
+  { "union",     "generic",     bench_union_generic_##sfx,     0 }, \
+  { "union",     "specialised", bench_union_special_##sfx,     0 }, \
+  { "intersect", "generic",     bench_intersect_generic_##sfx, 0 }, \
+  { "intersect", "specialised", bench_intersect_special_##sfx, 0 }, \
+  { "diff",      "generic",     bench_diff_generic_##sfx,      1 }, \
+  { "diff",      "specialised", bench_diff_special_##sfx,      1 }, \
+};
+
+BENCH_TYPE(u32, uint32_t)
+BENCH_TYPE(u64, uint64_t)
+
+static const bench_type bench_types[] = {
+  { "u32", sizeof(uint32_t), bench_fill_u32, bench_impls_u32, array_size(bench_impls_u32) },
+  { "u64", sizeof(uint64_t), bench_fill_u64, bench_impls_u64, array_size(bench_impls_u64) },
+};
+
+static int bench_copy(const bench_input *in) {
+  memcpy(in->out, in->a, in->na * in->elem_size);
+  return 0;
+}
+
+static double bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Time an implementation over the given input.
+ *
+ * @param fn     The implementation to run.
+ * @param in     The input sets.
+ * @param reps   The number of calls in each timed batch.
+ * @param result Set to the result of the last call.
+ * @returns The time taken by a single call in the fastest batch, in
+ * nanoseconds.
+ */
+static double bench_time(bench_fn fn, const bench_input *in, size_t reps, int *result) {
+  double best=0, start, t;
+  size_t batch, i;
+  int res=0;
+  for (batch=0; batch<BENCH_BATCHES; batch++) {
+    start = bench_now();
+    for (i=0; i<reps; i++) res = fn(in);
+    t = bench_now() - start;
+    if (!batch || t<best) best = t;
+  }
+  *result = res;
+  return best / reps;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-m max_size] [-s none|sse42|avx2]\n", prog);
+}
+
+int main(int argc, char **argv) {
+  size_t max_size = bench_sizes[array_size(bench_sizes)-1];
+  size_t ti, si, ri, oi, ii, reps;
+  const char *sep = "";
+  bench_input in;
+  int opt, i, failed=0;
+
+  while ((opt = getopt(argc, argv, "m:s:h")) != -1) {
+    switch (opt) {
+      case 'm':
+        max_size = strtoul(optarg, NULL, 10);
+        break;
+      case 's':
+        for (i=0; i<(int)array_size(simd_names) && strcmp(optarg, simd_names[i]); i++);
+        if (i == (int)array_size(simd_names)) {
+          usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        set_ops_simd_limit((enum set_simd_level)i);
+        break;
+      default:
+        usage(argv[0]);
+        return opt=='h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  in.a = malloc(max_size * sizeof(uint64_t));
+  in.b = malloc(max_size * sizeof(uint64_t));
+  in.out = malloc(2 * max_size * sizeof(uint64_t));
+  if (!in.a || !in.b || !in.out) {
+    fprintf(stderr, "Could not allocate buffers for %zu items\n", max_size);
+    return EXIT_FAILURE;
+  }
+
+  srandom(42);
+  printf("{\n  \"benchmark\": \"set_ops\",\n  \"simd\": \"%s\",\n", simd_names[set_ops_simd_level()]);
+  printf("  \"min_elems\": %d,\n  \"batches\": %d,\n  \"results\": [", BENCH_MIN_ELEMS, BENCH_BATCHES);
+
+  for (ti=0; ti<array_size(bench_types); ti++) {
+    const bench_type *type = &bench_types[ti];
+    for (si=0; si<array_size(bench_sizes) && bench_sizes[si]<=max_size; si++)
+    for (ri=0; ri<array_size(bench_ratios); ri++)
+    for (oi=0; oi<array_size(bench_overlaps); oi++) {
+      double copy_ns, ns;
+      int generic=0, res;
+      in.na = bench_sizes[si];
+      in.nb = MAX(in.na / bench_ratios[ri], 1);
+      type->fill(&in, bench_overlaps[oi]);
+      reps = MAX(BENCH_MIN_ELEMS / (in.na+in.nb), 1);
+
+      in.elem_size = type->elem_size;
+      copy_ns = bench_time(bench_copy, &in, reps, &res);
+
+      for (ii=0; ii<type->nimpls; ii++) {
+        const bench_impl *impl = &type->impls[ii];
+        ns = bench_time(impl->fn, &in, reps, &res);
+        if (impl->copies) ns = MAX(ns - copy_ns, 0);
+
+        /* generic and specialised implementations come in pairs */
+        if (ii % 2 == 0) {
+          generic = res;
+        } else if (res != generic) {
+          fprintf(stderr, "%s %s of %zu and %zu items: %d items, generic gave %d\n",
+              type->name, impl->op, in.na, in.nb, res, generic);
+          failed = 1;
+        }
+
+        printf("%s\n    { \"type\": \"%s\", \"op\": \"%s\", \"impl\": \"%s\", "
+               "\"size\": %zu, \"ratio\": %zu, \"overlap\": %.2f, \"count1\": %zu, \"count2\": %zu, "
+               "\"result\": %d, \"reps\": %zu, \"ns_per_elem\": %.4f, \"gb_per_s\": %.4f }",
+               sep, type->name, impl->op, impl->impl,
+               bench_sizes[si], bench_ratios[ri], bench_overlaps[oi], in.na, in.nb,
+               res, reps, ns / (in.na+in.nb),
+               ns>0 ? (in.na+in.nb) * type->elem_size / ns : 0.0);
+        sep = ",";
+        fflush(stdout);
+      }
+    }
+  }
+  printf("\n  ]\n}\n");
+
+  free(in.out);
+  free(in.b);
+  free(in.a);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1115,6 +1115,545 @@ START_TEST(test_bplus_ins_complex_bf)
 END_TEST
 
 
+inline void _limbo_check_n(const int n) {
+  fileptr inodes[n];
+  int i, r;
+  tsblock sb;
+  for (i=0; i<n; i++) {
+    /* insert in a scrambled order */
+    r = inode_insert(0, ((fileptr)(i*7919) % n) + 1);
+    fail_if(r, "Limbo insertion failed with error number %d (%s)", r, strerror(r));
+  }
+  r = inode_insert(0, 1);
+  fail_if(r, "Duplicate limbo insertion failed with error number %d (%s)", r, strerror(r));
+  fail_unless(inode_get_all(0, NULL, 0)==n, "Limbo count wrong: %d instead of %d", inode_get_all(0, NULL, 0), n);
+  for (i=0; i<n; i++) {
+    fail_unless(limbo_search(i+1)==1, "Limbo search for %d failed", i+1);
+  }
+  fail_if(limbo_search(n+1), "Limbo search for %d succeeded", n+1);
+
+  r = inode_get_all(0, inodes, n);
+  fail_if(r, "Fetching limbo failed with error number %d (%s)", -r, strerror(-r));
+  for (i=0; i<n; i++) {
+    fail_unless(inodes[i]==(fileptr)(i+1), "Limbo inode %d is %lu; should be %d", i, inodes[i], i+1);
+  }
+
+  for (i=0; i<n; i+=2) {
+    r = inode_remove(0, i+1);
+    fail_if(r, "Limbo removal of %d failed with error number %d (%s)", i+1, r, strerror(r));
+  }
+  fail_unless(inode_remove(0, 1)==ENOENT, "Removal of missing inode did not fail");
+  fail_unless(inode_get_all(0, NULL, 0)==n/2, "Limbo count wrong: %d instead of %d", inode_get_all(0, NULL, 0), n/2);
+  for (i=0; i<n; i++) {
+    fail_unless(limbo_search(i+1)==(i%2), "Limbo search for %d returned wrong result", i+1);
+  }
+
+  for (i=1; i<n; i+=2) {
+    r = inode_remove(0, i+1);
+    fail_if(r, "Limbo removal of %d failed with error number %d (%s)", i+1, r, strerror(r));
+  }
+  fail_if(tree_read_sb(&sb), "Reading superblock failed");
+  fail_unless(sb.inode_limbo == 0, "Inode limbo index wrong: %lu instead of %lu", sb.inode_limbo, 0);
+  fail_unless(sb.limbo_count == 0, "Inode limbo count wrong: %lu instead of %lu", sb.limbo_count, 0);
+}
+
+START_TEST(test_bplus_limbo_10)
+{
+  printf("   Limbo insertion and removal ");
+  _limbo_check_n(10);
+  printf(".");
+}
+END_TEST
+
+START_TEST(test_bplus_limbo_100)
+{
+  _limbo_check_n(100);
+  printf(".");
+}
+END_TEST
+
+START_TEST(test_bplus_limbo_5000)
+{
+  _limbo_check_n(5000);
+  printf(".\n");
+}
+END_TEST
+
+
+inline void _iref_check_n(const int n) {
+  tidata iblock;
+  fileptr refs[n];
+  fileptr piblock;
+  int i, r;
+
+  initInodeDataBlock(&iblock);
+  piblock = tree_sub_insert(tree_get_iroot(), "0000BEEF", (tblock*)&iblock);
+  fail_unless(piblock, "Inode tree insertion failed with error number %d (%s)", errno, strerror(errno));
+
+  for (i=0; i<n; i++) {
+    /* insert in a scrambled order */
+    r = inode_ref_insert(piblock, ((fileptr)(i*7919) % n) + 1);
+    fail_if(r, "Reference insertion failed with error number %d (%s)", r, strerror(r));
+  }
+  r = inode_ref_insert(piblock, 1);
+  fail_if(r, "Duplicate reference insertion failed with error number %d (%s)", r, strerror(r));
+  fail_unless(inode_ref_get_all(piblock, NULL, 0)==n, "Reference count wrong: %d instead of %d", inode_ref_get_all(piblock, NULL, 0), n);
+  for (i=0; i<n; i++) {
+    fail_unless(inode_ref_search(piblock, i+1)==1, "Reference search for %d failed", i+1);
+  }
+  fail_if(inode_ref_search(piblock, n+1), "Reference search for %d succeeded", n+1);
+
+  r = inode_ref_get_all(piblock, refs, n);
+  fail_if(r, "Fetching references failed with error number %d (%s)", -r, strerror(-r));
+  for (i=0; i<n; i++) {
+    fail_unless(refs[i]==(fileptr)(i+1), "Reference %d is %lu; should be %d", i, refs[i], i+1);
+  }
+
+  for (i=0; i<n; i+=2) {
+    r = inode_ref_remove(piblock, i+1);
+    fail_if(r, "Reference removal of %d failed with error number %d (%s)", i+1, r, strerror(r));
+  }
+  fail_unless(inode_ref_remove(piblock, 1)==ENOENT, "Removal of missing reference did not fail");
+  for (i=0; i<n; i++) {
+    fail_unless(inode_ref_search(piblock, i+1)==(i%2), "Reference search for %d returned wrong result", i+1);
+  }
+  for (i=1; i<n; i+=2) {
+    r = inode_ref_remove(piblock, i+1);
+    fail_if(r, "Reference removal of %d failed with error number %d (%s)", i+1, r, strerror(r));
+  }
+  fail_unless(inode_ref_get_all(piblock, NULL, 0)==0, "References remain after removing all");
+
+  r = tree_sub_remove(tree_get_iroot(), "0000BEEF");
+  fail_if(r, "Inode tree removal failed with error number %d (%s)", -r, strerror(-r));
+  fail_if(tree_sub_search(tree_get_iroot(), "0000BEEF"), "Inode tree entry still present after removal");
+}
+
+START_TEST(test_bplus_iref_10)
+{
+  printf("   Inode reference insertion and removal ");
+  _iref_check_n(10);
+  printf(".");
+}
+END_TEST
+
+START_TEST(test_bplus_iref_500)
+{
+  _iref_check_n(500);
+  printf(".\n");
+}
+END_TEST
+
+START_TEST(test_bplus_iref_upgrade)
+{
+  tdata datan;
+  tidata iblock;
+  tsblock sb;
+  char key[TREEKEY_SIZE];
+  fileptr genre, rock, jazz, piblock[40], refs[3], expect[3];
+  int i, j, r, n;
+
+  printf("   Inode reference upgrade ");
+  initDataNode(&datan);
+  strncpy(datan.name, "genre", TREEKEY_SIZE);
+  genre = tree_sub_insert(tree_get_root(), "genre", (tblock*)&datan);
+  initDataNode(&datan);
+  strncpy(datan.name, "jazz", TREEKEY_SIZE);
+  jazz = tree_sub_insert(tree_get_root(), "jazz", (tblock*)&datan);
+  initDataNode(&datan);
+  strncpy(datan.name, "rock", TREEKEY_SIZE);
+  datan.parent = genre;
+  rock = tree_sub_insert(genre, "rock", (tblock*)&datan);
+  fail_unless(genre && jazz && rock, "Tree insertion failed with error number %d (%s)", errno, strerror(errno));
+
+  /* inode data blocks as version 1.0 wrote them: refs hold the inode itself,
+   * and a full block has a stray value where the chain pointer now is */
+  for (i=0; i<40; i++) {
+    initInodeDataBlock(&iblock);
+    iblock.refcount = (i%4) ? 1 : REF_MAX;
+    for (j=0; j<(int)REF_MAX; j++) iblock.refs[j] = 0x100+i;
+    iblock.next_refs = 0x100+i;
+    snprintf(key, TREEKEY_SIZE, "%08lX", (unsigned long)0x100+i);
+    piblock[i] = tree_sub_insert(tree_get_iroot(), key, (tblock*)&iblock);
+    fail_unless(piblock[i], "Inode tree insertion failed with error number %d (%s)", errno, strerror(errno));
+    if (!(i%3)) fail_if(inode_insert(genre, 0x100+i), "Inode insertion failed");
+    if (!(i%2)) fail_if(inode_insert(rock, 0x100+i), "Inode insertion failed");
+    if (!(i%5)) fail_if(inode_insert(jazz, 0x100+i), "Inode insertion failed");
+  }
+
+  r = tree_read_sb(&sb);
+  fail_if(r, "Reading superblock failed with error number %d (%s)", r, strerror(r));
+  sb.version = 0x0100;
+  r = tree_write_sb(&sb);
+  fail_if(r, "Writing superblock failed with error number %d (%s)", r, strerror(r));
+  tree_close();
+
+  r = tree_open(TEST_TREE_FILENAME);
+  fail_if(r, "Opening old tree failed with error number %d (%s)", r, strerror(r));
+  r = tree_read_sb(&sb);
+  fail_if(r, "Reading superblock failed with error number %d (%s)", r, strerror(r));
+  fail_unless(sb.version == TREE_FILE_VERSION, "Version %04x not upgraded", sb.version);
+
+  for (i=0; i<40; i++) {
+    n = 0;
+    if (!(i%3)) expect[n++] = genre;
+    if (!(i%2)) expect[n++] = rock;
+    if (!(i%5)) expect[n++] = jazz;
+    for (j=1; j<n; j++) {
+      for (r=j; r>0 && expect[r-1] > expect[r]; r--) {
+        fileptr t = expect[r]; expect[r] = expect[r-1]; expect[r-1] = t;
+      }
+    }
+    r = inode_ref_get_all(piblock[i], NULL, 0);
+    fail_unless(r==n, "Inode %x has %d references instead of %d", 0x100+i, r, n);
+    r = inode_ref_get_all(piblock[i], refs, 3);
+    fail_if(r, "Fetching references failed with error number %d (%s)", -r, strerror(-r));
+    for (j=0; j<n; j++) {
+      fail_unless(refs[j]==expect[j], "Inode %x reference %d is %lu instead of %lu", 0x100+i, j, refs[j], expect[j]);
+    }
+  }
+  printf(".\n");
+}
+END_TEST
+
+
+inline void _cursor_check_n(fileptr block, const int n) {
+  fileptr inodes[n], inode;
+  inode_cursor *cur;
+  int i, r, count;
+
+  for (i=0; i<n; i++) {
+    r = inode_insert(block, (fileptr)(i+1)*3);
+    fail_if(r, "Inode insertion failed with error number %d (%s)", r, strerror(r));
+  }
+  /* leave gaps in the list */
+  for (i=0; i<n; i+=5) {
+    r = inode_remove(block, (fileptr)(i+1)*3);
+    fail_if(r, "Inode removal failed with error number %d (%s)", r, strerror(r));
+  }
+  count = inode_get_all(block, NULL, 0);
+  r = inode_get_all(block, inodes, count);
+  fail_if(r, "Fetching inodes failed with error number %d (%s)", -r, strerror(-r));
+
+  cur = inode_cursor_open(block);
+  fail_unless(cur!=NULL, "Opening cursor failed");
+  for (i=0; (r = inode_cursor_next(cur, &inode)) == 1; i++) {
+    fail_unless(i<count, "Cursor produced too many inodes");
+    fail_unless(inode==inodes[i], "Cursor inode %d is %lu; should be %lu", i, inode, inodes[i]);
+  }
+  fail_if(r, "Cursor failed with error number %d (%s)", -r, strerror(-r));
+  fail_unless(i==count, "Cursor produced %d inodes instead of %d", i, count);
+  inode_cursor_close(cur);
+
+  /* seek forward in steps, checking we land on the first inode >= target */
+  cur = inode_cursor_open(block);
+  fail_unless(cur!=NULL, "Opening cursor failed");
+  for (i=0; i<count; ) {
+    fileptr target = inodes[i] - 1;
+    r = inode_cursor_seek(cur, target);
+    fail_if(r, "Seek failed with error number %d (%s)", -r, strerror(-r));
+    r = inode_cursor_next(cur, &inode);
+    fail_unless(r==1, "Cursor ended early after seeking to %lu", target);
+    fail_unless(inode==inodes[i], "Seek to %lu gave %lu; should be %lu", target, inode, inodes[i]);
+    i += 1 + i%37;
+  }
+  fail_if(inode_cursor_seek(cur, (fileptr)n*3+1), "Seek past end failed");
+  fail_if(inode_cursor_next(cur, &inode), "Cursor produced an inode past the end");
+  inode_cursor_close(cur);
+}
+
+START_TEST(test_bplus_cursor_limbo)
+{
+  printf("   Limbo cursor ");
+  _cursor_check_n(0, 2000);
+  printf(".\n");
+}
+END_TEST
+
+START_TEST(test_bplus_cursor_data)
+{
+  tdata datan;
+  fileptr block;
+
+  printf("   Data block cursor ");
+  initDataNode(&datan);
+  strncpy(datan.name, "cursor", TREEKEY_SIZE);
+  block = tree_sub_insert(tree_get_root(), "cursor", (tblock*)&datan);
+  fail_unless(block, "Tree insertion failed with error number %d (%s)", errno, strerror(errno));
+  _cursor_check_n(block, 2000);
+  printf(".\n");
+}
+END_TEST
+
+START_TEST(test_bplus_insert_all)
+{
+  tdata datan;
+  fileptr batch1[300], batch2[300], inodes[500];
+  fileptr block;
+  int i, r;
+
+  printf("   Batch inode insertion ");
+  initDataNode(&datan);
+  strncpy(datan.name, "batch", TREEKEY_SIZE);
+  block = tree_sub_insert(tree_get_root(), "batch", (tblock*)&datan);
+  fail_unless(block, "Tree insertion failed with error number %d (%s)", errno, strerror(errno));
+
+  /* evens, then multiples of three */
+  for (i=0; i<300; i++) {
+    batch1[i] = (i+1)*2;
+    batch2[i] = (i+1)*3;
+  }
+  r = inode_insert_all(block, batch1, 300);
+  fail_if(r, "Batch insertion failed with error number %d (%s)", r, strerror(r));
+  r = inode_insert_all(block, batch2, 300);
+  fail_if(r, "Batch insertion failed with error number %d (%s)", r, strerror(r));
+
+  /* 300 evens + 300 multiples of three - 100 shared multiples of six */
+  fail_unless(inode_get_all(block, NULL, 0)==500, "Inode count wrong: %d instead of %d", inode_get_all(block, NULL, 0), 500);
+  r = inode_get_all(block, inodes, 500);
+  fail_if(r, "Fetching inodes failed with error number %d (%s)", -r, strerror(-r));
+  for (i=1; i<500; i++) {
+    fail_unless(inodes[i-1] < inodes[i], "Inodes not sorted and unique at %d", i);
+  }
+  printf(".\n");
+}
+END_TEST
+
+START_TEST(test_bplus_get_all_recurse)
+{
+  tdata datan;
+  char name[TREEKEY_SIZE];
+  char seen[1000];
+  fileptr parent, child, grandchild;
+  fileptr *inodes;
+  int i, j, r, count, expected=0;
+
+  printf("   Recursive inode fetch ");
+  bzero(seen, sizeof(seen));
+  initDataNode(&datan);
+  strncpy(datan.name, "parent", TREEKEY_SIZE);
+  parent = tree_sub_insert(tree_get_root(), "parent", (tblock*)&datan);
+  fail_unless(parent, "Tree insertion failed with error number %d (%s)", errno, strerror(errno));
+  for (j=0; j<1000; j+=7) {
+    r = inode_insert(parent, j+1);
+    fail_if(r, "Inode insertion failed with error number %d (%s)", r, strerror(r));
+    seen[j]=1;
+  }
+
+  /* enough children to split the subkey tree, each with one grandchild */
+  for (i=0; i<40; i++) {
+    initDataNode(&datan);
+    snprintf(name, TREEKEY_SIZE, "child%02d", i);
+    strncpy(datan.name, name, TREEKEY_SIZE);
+    child = tree_sub_insert(parent, name, (tblock*)&datan);
+    fail_unless(child, "Tree insertion failed with error number %d (%s)", errno, strerror(errno));
+    initDataNode(&datan);
+    strncpy(datan.name, "grandchild", TREEKEY_SIZE);
+    grandchild = tree_sub_insert(child, "grandchild", (tblock*)&datan);
+    fail_unless(grandchild, "Tree insertion failed with error number %d (%s)", errno, strerror(errno));
+    for (j=i; j<1000; j+=40+i) {
+      r = inode_insert((j%3) ? child : grandchild, j+1);
+      fail_if(r, "Inode insertion failed with error number %d (%s)", r, strerror(r));
+      seen[j]=1;
+    }
+  }
+  for (j=0; j<1000; j++) {
+    expected += seen[j];
+  }
+
+  inodes = inode_get_all_recurse(parent, &count);
+  fail_unless(inodes!=NULL, "Recursive fetch failed with error number %d (%s)", errno, strerror(errno));
+  fail_unless(count==expected, "Inode count wrong: %d instead of %d", count, expected);
+  for (i=0; i<count; i++) {
+    fail_unless(seen[inodes[i]-1], "Unexpected inode %lu", inodes[i]);
+    fail_unless(!i || inodes[i-1] < inodes[i], "Inodes not sorted and unique at %d", i);
+  }
+  free(inodes);
+  printf(".\n");
+}
+END_TEST
+
+START_TEST(test_bplus_get_all_range)
+{
+  tdata datan;
+  char name[TREEKEY_SIZE];
+  fileptr parent, child, grandchild;
+  fileptr *inodes;
+  int i, r, count;
+  const char *lo[] = { "1990", NULL,   "2005", "199",     "1990x", "3000" };
+  const char *hi[] = { "1999", "1952", NULL,   "199\xff", "1991",  NULL   };
+  int first[]      = { 1990,   1950,   2005,   1990,      1991,    0      };
+  int last[]       = { 1999,   1952,   2009,   1999,      1991,    -1     };
+
+  printf("   Range inode fetch ");
+  initDataNode(&datan);
+  strncpy(datan.name, "year", TREEKEY_SIZE);
+  parent = tree_sub_insert(tree_get_root(), "year", (tblock*)&datan);
+  fail_unless(parent, "Tree insertion failed with error number %d (%s)", errno, strerror(errno));
+
+  /* enough subtags to split the subkey tree; every tenth has a subtag */
+  for (i=1950; i<2010; i++) {
+    initDataNode(&datan);
+    snprintf(name, TREEKEY_SIZE, "%d", i);
+    strncpy(datan.name, name, TREEKEY_SIZE);
+    child = tree_sub_insert(parent, name, (tblock*)&datan);
+    fail_unless(child, "Tree insertion failed with error number %d (%s)", errno, strerror(errno));
+    r = inode_insert(child, i);
+    fail_if(r, "Inode insertion failed with error number %d (%s)", r, strerror(r));
+    if (i%10==0) {
+      initDataNode(&datan);
+      strncpy(datan.name, "live", TREEKEY_SIZE);
+      grandchild = tree_sub_insert(child, "live", (tblock*)&datan);
+      fail_unless(grandchild, "Tree insertion failed with error number %d (%s)", errno, strerror(errno));
+      r = inode_insert(grandchild, i+10000);
+      fail_if(r, "Inode insertion failed with error number %d (%s)", r, strerror(r));
+    }
+  }
+
+  for (r=0; r<6; r++) {
+    int expected = last[r]-first[r]+1, j=0;
+    for (i=first[r]; i<=last[r]; i++) {
+      if (i%10==0) expected++;
+    }
+    inodes = inode_get_all_range(parent, lo[r], hi[r], &count);
+    fail_unless(inodes!=NULL, "Range fetch failed with error number %d (%s)", errno, strerror(errno));
+    fail_unless(count==expected, "Range %d: inode count wrong: %d instead of %d", r, count, expected);
+    for (i=first[r]; i<=last[r]; i++, j++) {
+      fail_unless(inodes[j]==(fileptr)i, "Range %d: expected inode %d, got %lu", r, i, inodes[j]);
+    }
+    for (i=first[r]; i<=last[r]; i++) {
+      if (i%10==0) {
+        fail_unless(inodes[j++]==(fileptr)i+10000, "Range %d: subtag inode %d missing", r, i+10000);
+      }
+    }
+    free(inodes);
+  }
+  printf(".\n");
+}
+END_TEST
+
+START_TEST(test_bplus_tag_stats)
+{
+  tdata datan;
+  tstats stats, other;
+  char name[TREEKEY_SIZE];
+  fileptr parent, child[300];
+  unsigned long est;
+  int i, r;
+
+  printf("   Tag statistics ");
+  initDataNode(&datan);
+  strncpy(datan.name, "genre", TREEKEY_SIZE);
+  parent = tree_sub_insert(tree_get_root(), "genre", (tblock*)&datan);
+  fail_unless(parent, "Tree insertion failed with error number %d (%s)", errno, strerror(errno));
+
+  /* subtags with overlapping inodes: subtag i has inodes i*10 to i*10+19 */
+  for (i=0; i<300; i++) {
+    initDataNode(&datan);
+    snprintf(name, TREEKEY_SIZE, "g%03d", i);
+    strncpy(datan.name, name, TREEKEY_SIZE);
+    child[i] = tree_sub_insert(parent, name, (tblock*)&datan);
+    fail_unless(child[i], "Tree insertion failed with error number %d (%s)", errno, strerror(errno));
+    for (r=0; r<20; r++) {
+      int res = inode_insert(child[i], 1000+i*10+r);
+      fail_if(res, "Inode insertion failed with error number %d (%s)", res, strerror(res));
+    }
+  }
+
+  /* statistics are never built just by reading them */
+  r = tag_stats_get(child[0], &stats);
+  fail_unless(r==ENOENT, "Statistics fetch returned %d instead of ENOENT", r);
+
+  /* build every subtag's statistics, so that the statistics tree splits */
+  for (i=0; i<300; i++) {
+    r = tag_stats_build(child[i], &stats);
+    fail_if(r, "Statistics failed with error number %d (%s)", r, strerror(r));
+    fail_unless(stats.closure==20, "Subtag %d: closure %lu instead of 20", i, stats.closure);
+    fail_unless(stats.min_inode==(fileptr)1000+i*10 && stats.max_inode==(fileptr)1019+i*10,
+        "Subtag %d: bounds %lu-%lu wrong", i, stats.min_inode, stats.max_inode);
+  }
+
+  r = tag_stats_build(parent, &stats);
+  fail_if(r, "Statistics failed with error number %d (%s)", r, strerror(r));
+  r = tag_stats_get(parent, &stats);
+  fail_if(r, "Statistics failed with error number %d (%s)", r, strerror(r));
+  fail_unless(stats.closure==3010, "Closure %lu instead of 3010", stats.closure);
+  fail_unless(stats.min_inode==1000 && stats.max_inode==4009, "Bounds %lu-%lu wrong", stats.min_inode, stats.max_inode);
+  est = tag_stats_estimate(&stats);
+  fail_unless(est > 2700 && est < 3300, "Estimate %lu too far from 3010", est);
+
+  /* neighbours share half their inodes; distant subtags share none */
+  tag_stats_get(child[0], &stats);
+  tag_stats_get(child[1], &other);
+  est = tag_stats_union(&stats, &other);
+  fail_unless(est >= 28 && est <= 32, "Union estimate %lu too far from 30", est);
+  tag_stats_get(child[100], &other);
+  est = tag_stats_union(&stats, &other);
+  fail_unless(est >= 38 && est <= 42, "Union estimate %lu too far from 40", est);
+
+  /* updates are recorded in the stored statistics */
+  r = tag_stats_update(parent, 5000, 1);
+  fail_if(r, "Update failed with error number %d (%s)", r, strerror(r));
+  r = tag_stats_update(parent, 1000, -1);
+  fail_if(r, "Update failed with error number %d (%s)", r, strerror(r));
+  tag_stats_get(parent, &stats);
+  fail_unless(stats.closure==3010, "Closure %lu instead of 3010 after updates", stats.closure);
+  fail_unless(stats.max_inode==5000, "Upper bound %lu not extended", stats.max_inode);
+
+  /* removed statistics are rebuilt from the inode lists */
+  r = tag_stats_remove(parent);
+  fail_if(r, "Removal failed with error number %d (%s)", r, strerror(r));
+  r = tag_stats_get(parent, &stats);
+  fail_unless(r==ENOENT, "Removed statistics still found");
+  r = inode_insert(child[0], 999);
+  fail_if(r, "Inode insertion failed with error number %d (%s)", r, strerror(r));
+  r = tag_stats_update(parent, 999, 1);
+  fail_if(r, "Update failed with error number %d (%s)", r, strerror(r));
+  r = tag_stats_get(parent, &stats);
+  fail_if(r, "Statistics failed with error number %d (%s)", r, strerror(r));
+  fail_unless(stats.closure==3011 && stats.min_inode==999 && stats.max_inode==4009, "Rebuilt statistics wrong");
+  printf(".\n");
+}
+END_TEST
+
+START_TEST(test_bplus_key_generation)
+{
+  tdata datan;
+  tstats stats;
+  fileptr parent;
+  unsigned long gen;
+  int r;
+
+  printf("   Key generation ");
+  initDataNode(&datan);
+  strncpy(datan.name, "genre", TREEKEY_SIZE);
+  parent = tree_sub_insert(tree_get_root(), "genre", (tblock*)&datan);
+  fail_unless(parent, "Tree insertion failed with error number %d (%s)", errno, strerror(errno));
+  initDataNode(&datan);
+  strncpy(datan.name, "rock", TREEKEY_SIZE);
+  fail_unless(tree_sub_insert(parent, "rock", (tblock*)&datan), "Tree insertion failed");
+  r = inode_insert(parent, 1000);
+  fail_if(r, "Inode insertion failed with error number %d (%s)", r, strerror(r));
+
+  /* insertions and statistics do not remove tag keys */
+  gen = tree_get_key_generation();
+  r = tag_stats_build(parent, &stats);
+  fail_if(r, "Statistics failed with error number %d (%s)", r, strerror(r));
+  r = tag_stats_remove(parent);
+  fail_if(r, "Removal failed with error number %d (%s)", r, strerror(r));
+  fail_unless(tree_get_key_generation()==gen, "Key generation changed without a tag removal");
+
+  /* failed removals do not count */
+  r = tree_sub_remove(parent, "jazz");
+  fail_unless(r, "Removal of missing key succeeded");
+  fail_unless(tree_get_key_generation()==gen, "Key generation changed on a failed removal");
+
+  r = tree_sub_remove(parent, "rock");
+  fail_if(r, "Removal failed with error number %d (%s)", -r, strerror(-r));
+  fail_unless(tree_get_key_generation()!=gen, "Key generation unchanged after a tag removal");
+  printf(".\n");
+}
+END_TEST
+
 Suite * bplus_core_suite (void) {
   Suite *s = suite_create("bplus core");
 
@@ -1344,6 +1883,45 @@ Suite *bplus_complex_insert_suite (void) {
   return s;
 }
 
+Suite *bplus_inode_suite (void) {
+  Suite *s = suite_create("bplus inode lists");
+
+  TCase *tc_limbo = tcase_create("Limbo insertion and removal");
+  tcase_add_checked_fixture(tc_limbo, bplus_core_open_setup, bplus_teardown);
+  tcase_add_test(tc_limbo, test_bplus_limbo_10);
+  tcase_add_test(tc_limbo, test_bplus_limbo_100);
+  tcase_add_test(tc_limbo, test_bplus_limbo_5000);
+  suite_add_tcase(s, tc_limbo);
+
+  TCase *tc_iref = tcase_create("Inode reference insertion and removal");
+  tcase_add_checked_fixture(tc_iref, bplus_core_open_setup, bplus_teardown);
+  tcase_add_test(tc_iref, test_bplus_iref_10);
+  tcase_add_test(tc_iref, test_bplus_iref_500);
+  tcase_add_test(tc_iref, test_bplus_iref_upgrade);
+  suite_add_tcase(s, tc_iref);
+
+  TCase *tc_insert_all = tcase_create("Batch inode insertion");
+  tcase_add_checked_fixture(tc_insert_all, bplus_core_open_setup, bplus_teardown);
+  tcase_add_test(tc_insert_all, test_bplus_insert_all);
+  suite_add_tcase(s, tc_insert_all);
+
+  TCase *tc_recurse = tcase_create("Recursive inode fetch");
+  tcase_add_checked_fixture(tc_recurse, bplus_core_open_setup, bplus_teardown);
+  tcase_add_test(tc_recurse, test_bplus_get_all_recurse);
+  tcase_add_test(tc_recurse, test_bplus_get_all_range);
+  tcase_add_test(tc_recurse, test_bplus_tag_stats);
+  tcase_add_test(tc_recurse, test_bplus_key_generation);
+  suite_add_tcase(s, tc_recurse);
+
+  TCase *tc_cursor = tcase_create("Inode cursors");
+  tcase_add_checked_fixture(tc_cursor, bplus_core_open_setup, bplus_teardown);
+  tcase_add_test(tc_cursor, test_bplus_cursor_limbo);
+  tcase_add_test(tc_cursor, test_bplus_cursor_data);
+  suite_add_tcase(s, tc_cursor);
+
+  return s;
+}
+
 // TODO: reverse-order insertion
 // TODO: random-order insertion
 
@@ -1354,6 +1932,7 @@ int main (void) {
   SRunner *sr = srunner_create( bplus_core_suite() );
   srunner_add_suite(sr, bplus_simple_insert_suite() );
   srunner_add_suite(sr, bplus_complex_insert_suite() );
+  srunner_add_suite(sr, bplus_inode_suite() );
 
   srunner_run_all(sr, CK_NORMAL);
 
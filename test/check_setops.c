@@ -603,6 +603,42 @@ START_TEST(test_setops_intersect_last2_identical_int)
 }
 END_TEST
 
+START_TEST(test_setops_intersect_skewed_int)
+{
+  int a[3] = { 40, 41, 200 };
+  int b[100];
+  int c[3] = { 0 };
+  int xc[2] = { 40, 41 };
+  int i;
+  for (i=0; i<100; i++) b[i] = i;
+  INTERSECT_TEST(int, "%d");
+}
+END_TEST
+
+START_TEST(test_setops_intersect_skewed_large_first_int)
+{
+  int a[100];
+  int b[4] = { -1, 0, 99, 99 };
+  int c[4] = { 0 };
+  int xc[2] = { 0, 99 };
+  int i;
+  for (i=0; i<100; i++) a[i] = i;
+  INTERSECT_TEST(int, "%d");
+}
+END_TEST
+
+START_TEST(test_setops_intersect_count_int)
+{
+  int a[100], b[7] = { 1, 3, 5, 7, 9, 11, 500 };
+  int i;
+  for (i=0; i<100; i++) a[i] = 2*i+1;
+  fail_unless(set_intersect_count(a, b, 100, 7, sizeof(int), pintcmp)==6, "Skewed count should be 6");
+  fail_unless(set_intersect_count(a, a, 100, 100, sizeof(int), pintcmp)==100, "Self count should be 100");
+  fail_unless(set_intersect_count(a, b, 0, 7, sizeof(int), pintcmp)==0, "Empty count should be 0");
+  fail_unless(set_intersect_count(NULL, b, 0, 7, sizeof(int), pintcmp)==-EINVAL, "Null input should be rejected");
+}
+END_TEST
+
 
 Suite *setops_intersect_suite (void) {
   Suite *s = suite_create("set_ops intersect");
@@ -634,6 +670,12 @@ Suite *setops_intersect_suite (void) {
   tcase_add_test(tc_edge, test_setops_intersect_last2_identical_int);
   suite_add_tcase(s, tc_edge);
 
+  TCase *tc_skewed = tcase_create("Skewed sets");
+  tcase_add_test(tc_skewed, test_setops_intersect_skewed_int);
+  tcase_add_test(tc_skewed, test_setops_intersect_skewed_large_first_int);
+  tcase_add_test(tc_skewed, test_setops_intersect_count_int);
+  suite_add_tcase(s, tc_skewed);
+
   return s;
 }
 
@@ -906,6 +948,605 @@ Suite *setops_uniq_suite (void) {
 /* ************************************************************************ */
 
 
+/* The integer kernels are checked against these straightforward merges, once
+ * for every instruction set level the processor supports. */
+#define KERNEL_REF(type) \
+static size_t ref_union_##type(const type *a, const type *b, type *out, size_t na, size_t nb) { \
+  size_t i=0, j=0, o=0; \
+  while (i<na || j<nb) { \
+    if (j>=nb || (i<na && a[i]<b[j])) out[o++]=a[i++]; \
+    else if (i>=na || b[j]<a[i]) out[o++]=b[j++]; \
+    else { out[o++]=a[i++]; j++; } \
+  } \
+  return o; \
+} \
+static size_t ref_intersect_##type(const type *a, const type *b, type *out, size_t na, size_t nb) { \
+  size_t i=0, j=0, o=0; \
+  while (i<na && j<nb) { \
+    if (a[i]<b[j]) i++; \
+    else if (b[j]<a[i]) j++; \
+    else { out[o++]=a[i++]; j++; } \
+  } \
+  return o; \
+} \
+static size_t ref_diff_##type(const type *a, const type *b, type *out, size_t na, size_t nb) { \
+  size_t i=0, j=0, o=0; \
+  for (i=0; i<na; i++) { \
+    while (j<nb && b[j]<a[i]) j++; \
+    if (j>=nb || b[j]!=a[i]) out[o++]=a[i]; \
+  } \
+  return o; \
+} \
+static size_t random_set_##type(type *set, size_t max, type range) { \
+  size_t n=0; \
+  type v=0; \
+  while (n<max) { \
+    v += 1 + (type)(random() % range); \
+    set[n++] = v; \
+  } \
+  return n; \
+}
+
+KERNEL_REF(uint32_t)
+KERNEL_REF(uint64_t)
+
+#define KERNEL_SIZES { 0, 1, 3, 7, 8, 9, 31, 100, 1000 }
+#define KERNEL_MAX 1000
+
+#define KERNEL_TEST(op, type, sfx) do {\
+  static type a[KERNEL_MAX], b[KERNEL_MAX], c[2*KERNEL_MAX], xc[2*KERNEL_MAX];\
+  size_t sizes[] = KERNEL_SIZES;\
+  size_t si, sj, i, na, nb, nx;\
+  int level, maxlevel = set_ops_simd_level(), r;\
+  type range;\
+  srandom(42);\
+  for (level=SET_SIMD_NONE; level<=maxlevel; level++) {\
+    set_ops_simd_limit(level);\
+    for (range=1; range<=64; range*=4)\
+    for (si=0; si<array_size(sizes); si++)\
+    for (sj=0; sj<array_size(sizes); sj++) {\
+      na = random_set_##type(a, sizes[si], range);\
+      nb = random_set_##type(b, sizes[sj], range);\
+      nx = ref_##op##_##type(a, b, xc, na, nb);\
+      r = set_##op##_##sfx(a, b, c, na, nb, 2*KERNEL_MAX);\
+      fail_if(r<0, "Internal error: %d", -r);\
+      fail_unless((size_t)r==nx, "Level %d, sizes %lu/%lu: should output %lu items, actually returned %d", level, na, nb, nx, r);\
+      for (i=0; i<nx; i++)\
+        fail_unless(c[i]==xc[i], "Level %d, sizes %lu/%lu: incorrect output at %lu", level, na, nb, i);\
+    }\
+  }\
+} while (0)
+
+START_TEST (test_setops_kernel_union_u32)
+{
+  KERNEL_TEST(union, uint32_t, u32);
+}
+END_TEST
+
+START_TEST (test_setops_kernel_union_u64)
+{
+  KERNEL_TEST(union, uint64_t, u64);
+}
+END_TEST
+
+START_TEST (test_setops_kernel_intersect_u32)
+{
+  KERNEL_TEST(intersect, uint32_t, u32);
+}
+END_TEST
+
+START_TEST (test_setops_kernel_intersect_u64)
+{
+  KERNEL_TEST(intersect, uint64_t, u64);
+}
+END_TEST
+
+START_TEST (test_setops_kernel_intersect_count)
+{
+  static uint32_t a[KERNEL_MAX], b[KERNEL_MAX], xc[KERNEL_MAX];
+  static uint64_t a64[KERNEL_MAX], b64[KERNEL_MAX];
+  size_t sizes[] = KERNEL_SIZES;
+  size_t si, sj, na, nb, nx, i;
+  int level, maxlevel = set_ops_simd_level(), r;
+  srandom(11);
+  for (level=SET_SIMD_NONE; level<=maxlevel; level++) {
+    set_ops_simd_limit(level);
+    for (si=0; si<array_size(sizes); si++)
+    for (sj=0; sj<array_size(sizes); sj++) {
+      na = random_set_uint32_t(a, sizes[si], 4);
+      nb = random_set_uint32_t(b, sizes[sj], 4);
+      nx = ref_intersect_uint32_t(a, b, xc, na, nb);
+      r = set_intersect_count_u32(a, b, na, nb);
+      fail_unless((size_t)r==nx, "Level %d, sizes %lu/%lu: should count %lu items, actually returned %d", level, na, nb, nx, r);
+      for (i=0; i<na; i++) a64[i] = a[i];
+      for (i=0; i<nb; i++) b64[i] = b[i];
+      r = set_intersect_count_u64(a64, b64, na, nb);
+      fail_unless((size_t)r==nx, "Level %d, sizes %lu/%lu: should count %lu items, actually returned %d", level, na, nb, nx, r);
+    }
+  }
+}
+END_TEST
+
+START_TEST (test_setops_kernel_diff_u32)
+{
+  KERNEL_TEST(diff, uint32_t, u32);
+}
+END_TEST
+
+START_TEST (test_setops_kernel_diff_u64)
+{
+  KERNEL_TEST(diff, uint64_t, u64);
+}
+END_TEST
+
+START_TEST (test_setops_kernel_diff_inplace)
+{
+  uint64_t a[64], b[64], xc[64];
+  size_t na, nb, nx, i;
+  int level, maxlevel = set_ops_simd_level(), r;
+  srandom(7);
+  for (level=SET_SIMD_NONE; level<=maxlevel; level++) {
+    set_ops_simd_limit(level);
+    na = random_set_uint64_t(a, 64, 3);
+    nb = random_set_uint64_t(b, 64, 3);
+    nx = ref_diff_uint64_t(a, b, xc, na, nb);
+    r = set_diff_u64(a, b, a, na, nb, na);
+    fail_unless((size_t)r==nx, "Level %d: should output %lu items, actually returned %d", level, nx, r);
+    for (i=0; i<nx; i++)
+      fail_unless(a[i]==xc[i], "Level %d: incorrect output at %lu", level, i);
+  }
+}
+END_TEST
+
+START_TEST (test_setops_kernel_truncate)
+{
+  uint32_t a[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
+  uint32_t b[] = { 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30, 32 };
+  uint32_t c[32] = { 0 };
+  int level, maxlevel = set_ops_simd_level(), r;
+  for (level=SET_SIMD_NONE; level<=maxlevel; level++) {
+    set_ops_simd_limit(level);
+    memset(c, 0, sizeof(c));
+    r = set_intersect_u32(a, b, c, array_size(a), array_size(b), 3);
+    fail_unless(r==3 && c[2]==6 && !c[3], "Level %d: intersection should stop after 3 items, returned %d", level, r);
+    r = set_union_u32(a, b, c, array_size(a), array_size(b), 5);
+    fail_unless(r==5 && c[4]==5 && c[5]==0, "Level %d: union should stop after 5 items, returned %d", level, r);
+    r = set_diff_u32(a, b, c, array_size(a), array_size(b), 2);
+    fail_unless(r==2 && c[1]==3, "Level %d: difference should stop after 2 items, returned %d", level, r);
+  }
+}
+END_TEST
+
+START_TEST (test_setops_kernel_invalid)
+{
+  uint32_t a[] = { 1, 2 };
+  uint32_t c[2];
+  fail_unless(set_union_u32(NULL, a, c, 0, 2, 2)==-EINVAL, "Null input should be rejected");
+  fail_unless(set_union_u32(a, a, c, 2, 2, 0)==-EINVAL, "Zero-sized output should be rejected");
+  fail_unless(set_intersect_u32(a, a, NULL, 2, 2, 2)==-EINVAL, "Null output should be rejected");
+  fail_unless(set_intersect_u32(a, a, c, 2, 2, 0)==-EINVAL, "Zero-sized output should be rejected");
+  fail_unless(set_diff_u32(a, NULL, c, 2, 0, 2)==-EINVAL, "Null input should be rejected");
+  fail_unless(set_diff_u32(a, a, c, 2, 0, 0)==0, "Difference into no space should be empty");
+}
+END_TEST
+
+
+Suite *setops_kernel_suite (void) {
+  Suite *s = suite_create("set_ops integer kernels");
+
+  TCase *tc_parity = tcase_create("Parity with reference");
+  tcase_add_test(tc_parity, test_setops_kernel_union_u32);
+  tcase_add_test(tc_parity, test_setops_kernel_union_u64);
+  tcase_add_test(tc_parity, test_setops_kernel_intersect_u32);
+  tcase_add_test(tc_parity, test_setops_kernel_intersect_u64);
+  tcase_add_test(tc_parity, test_setops_kernel_intersect_count);
+  tcase_add_test(tc_parity, test_setops_kernel_diff_u32);
+  tcase_add_test(tc_parity, test_setops_kernel_diff_u64);
+  suite_add_tcase(s, tc_parity);
+
+  TCase *tc_edge = tcase_create("Edge cases");
+  tcase_add_test(tc_edge, test_setops_kernel_diff_inplace);
+  tcase_add_test(tc_edge, test_setops_kernel_truncate);
+  tcase_add_test(tc_edge, test_setops_kernel_invalid);
+  suite_add_tcase(s, tc_edge);
+
+  return s;
+}
+
+
+/* ************************************************************************ */
+
+
+/* The SET_OPS_DEFINE() families should agree with the generic set
+ * operations, which take an element size and comparison function. */
+static int puint64_tcmp(const void *p1, const void *p2) {
+  return (*(const uint64_t*)p1>*(const uint64_t*)p2) ?  1 :
+         (*(const uint64_t*)p1<*(const uint64_t*)p2) ? -1 :
+         0;
+}
+
+static int puint32_tcmp(const void *p1, const void *p2) {
+  return (*(const uint32_t*)p1>*(const uint32_t*)p2) ?  1 :
+         (*(const uint32_t*)p1<*(const uint32_t*)p2) ? -1 :
+         0;
+}
+
+#define FAMILY_TEST(family, op, type) do {\
+  static type a[KERNEL_MAX], b[KERNEL_MAX], c[2*KERNEL_MAX], xc[2*KERNEL_MAX];\
+  size_t sizes[] = KERNEL_SIZES;\
+  size_t si, sj, i, na, nb;\
+  int r, xr;\
+  type range;\
+  srandom(5);\
+  for (range=1; range<=16; range*=4)\
+  for (si=0; si<array_size(sizes); si++)\
+  for (sj=0; sj<array_size(sizes); sj++) {\
+    na = random_set_##type(a, sizes[si], range);\
+    nb = random_set_##type(b, sizes[sj], range);\
+    xr = set_##op(a, b, xc, na, nb, 2*KERNEL_MAX, sizeof(type), p##type##cmp);\
+    r = family##_##op(a, b, c, na, nb, 2*KERNEL_MAX);\
+    fail_unless(r==xr, "Sizes %lu/%lu: should output %d items, actually returned %d", na, nb, xr, r);\
+    for (i=0; i<(size_t)r; i++)\
+      fail_unless(c[i]==xc[i], "Sizes %lu/%lu: incorrect output at %lu", na, nb, i);\
+  }\
+} while (0)
+
+#define pfileptrcmp inodecmp
+#define random_set_fileptr(set, max, range) random_set_uint64_t((uint64_t*)(set), max, range)
+
+START_TEST (test_setops_family_union_u32)
+{
+  FAMILY_TEST(u32set, union, uint32_t);
+}
+END_TEST
+
+START_TEST (test_setops_family_union_inode)
+{
+  if (sizeof(fileptr) != sizeof(uint64_t)) return;
+  FAMILY_TEST(inodeset, union, fileptr);
+}
+END_TEST
+
+START_TEST (test_setops_family_intersect_u32)
+{
+  FAMILY_TEST(u32set, intersect, uint32_t);
+}
+END_TEST
+
+START_TEST (test_setops_family_intersect_u64)
+{
+  FAMILY_TEST(u64set, intersect, uint64_t);
+}
+END_TEST
+
+START_TEST (test_setops_family_intersect_count)
+{
+  static uint32_t a[KERNEL_MAX], b[KERNEL_MAX];
+  size_t sizes[] = KERNEL_SIZES;
+  size_t si, sj, na, nb;
+  srandom(9);
+  for (si=0; si<array_size(sizes); si++)
+  for (sj=0; sj<array_size(sizes); sj++) {
+    na = random_set_uint32_t(a, sizes[si], 3);
+    nb = random_set_uint32_t(b, sizes[sj], 3);
+    fail_unless(u32set_intersect_count(a, b, na, nb) == set_intersect_count(a, b, na, nb, sizeof(uint32_t), puint32_tcmp),
+        "Sizes %lu/%lu: counts differ", na, nb);
+  }
+}
+END_TEST
+
+START_TEST (test_setops_family_diff_u64)
+{
+  static uint64_t a[KERNEL_MAX], b[KERNEL_MAX], c[KERNEL_MAX], xc[KERNEL_MAX];
+  size_t sizes[] = KERNEL_SIZES;
+  size_t si, sj, i, na, nb, nx;
+  int r;
+  srandom(13);
+  for (si=0; si<array_size(sizes); si++)
+  for (sj=0; sj<array_size(sizes); sj++) {
+    na = random_set_uint64_t(a, sizes[si], 3);
+    nb = random_set_uint64_t(b, sizes[sj], 3);
+    nx = ref_diff_uint64_t(a, b, xc, na, nb);
+    r = u64set_diff(a, b, c, na, nb, na);
+    fail_unless((size_t)r==nx, "Sizes %lu/%lu: should output %lu items, actually returned %d", na, nb, nx, r);
+    for (i=0; i<nx; i++)
+      fail_unless(c[i]==xc[i], "Sizes %lu/%lu: incorrect output at %lu", na, nb, i);
+  }
+}
+END_TEST
+
+START_TEST (test_setops_family_uniq_u32)
+{
+  uint32_t a[] = { 1, 1, 2, 3, 3, 3, 4, 9, 9 };
+  uint32_t b[array_size(a)];
+  size_t i;
+  int r, xr;
+  memcpy(b, a, sizeof(a));
+  xr = set_uniq(b, array_size(b), sizeof(uint32_t), puint32_tcmp);
+  r = u32set_uniq(a, array_size(a));
+  fail_unless(r==xr, "Should output %d items, actually returned %d", xr, r);
+  for (i=0; i<(size_t)r; i++)
+    fail_unless(a[i]==b[i], "Incorrect output at %lu", i);
+  fail_unless(u32set_uniq(a, 0)==0, "Empty set should stay empty");
+  fail_unless(u32set_uniq(NULL, 1)==-EINVAL, "Null set should be rejected");
+}
+END_TEST
+
+START_TEST (test_setops_family_invalid)
+{
+  uint64_t a[] = { 1, 2 };
+  uint64_t c[2];
+  fail_unless(u64set_union(NULL, a, c, 0, 2, 2)==-EINVAL, "Null input should be rejected");
+  fail_unless(u64set_intersect(a, a, NULL, 2, 2, 2)==-EINVAL, "Null output should be rejected");
+  fail_unless(u64set_intersect(a, a, c, 2, 2, 0)==-EINVAL, "Zero-sized output should be rejected");
+  fail_unless(u64set_intersect_count(a, NULL, 2, 2)==-EINVAL, "Null input should be rejected");
+  fail_unless(u64set_diff(a, a, NULL, 2, 2, 2)==-EINVAL, "Null output should be rejected");
+}
+END_TEST
+
+
+Suite *setops_family_suite (void) {
+  Suite *s = suite_create("set_ops families");
+
+  TCase *tc_parity = tcase_create("Parity with generic operations");
+  tcase_add_test(tc_parity, test_setops_family_union_u32);
+  tcase_add_test(tc_parity, test_setops_family_union_inode);
+  tcase_add_test(tc_parity, test_setops_family_intersect_u32);
+  tcase_add_test(tc_parity, test_setops_family_intersect_u64);
+  tcase_add_test(tc_parity, test_setops_family_intersect_count);
+  tcase_add_test(tc_parity, test_setops_family_diff_u64);
+  tcase_add_test(tc_parity, test_setops_family_uniq_u32);
+  suite_add_tcase(s, tc_parity);
+
+  TCase *tc_edge = tcase_create("Edge cases");
+  tcase_add_test(tc_edge, test_setops_family_invalid);
+  suite_add_tcase(s, tc_edge);
+
+  return s;
+}
+
+
+/* ************************************************************************ */
+
+
+#define MULTI_SETS 5
+
+/* Fill \a set with up to \a max ascending inodes, spaced by up to \a range */
+static size_t random_set_inode(fileptr *set, size_t max, unsigned long range) {
+  size_t n=0;
+  fileptr v=0;
+  while (n<max) {
+    v += 1 + (fileptr)(random() % range);
+    set[n++] = v;
+  }
+  return n;
+}
+
+START_TEST (test_setops_multi_intersect)
+{
+  static fileptr sets[MULTI_SETS][KERNEL_MAX], c[KERNEL_MAX], xc[KERNEL_MAX];
+  const fileptr *in[MULTI_SETS];
+  size_t counts[MULTI_SETS];
+  size_t sizes[] = KERNEL_SIZES;
+  size_t k, si, i, nx;
+  int r;
+  srandom(17);
+  for (k=1; k<=MULTI_SETS; k++)
+  for (si=0; si<array_size(sizes); si++) {
+    for (i=0; i<k; i++) {
+      /* later sets are sparser, so the smallest is not always the first */
+      counts[i] = random_set_inode(sets[i], sizes[(si+i) % array_size(sizes)], 2+i);
+      in[i] = sets[i];
+    }
+    memcpy(xc, sets[0], counts[0] * sizeof(fileptr));
+    nx = counts[0];
+    for (i=1; i<k && nx; i++) {
+      nx = set_intersect(xc, sets[i], xc, nx, counts[i], nx, sizeof(fileptr), inodecmp);
+    }
+    r = set_intersect_n_inode(in, counts, k, c, KERNEL_MAX);
+    fail_unless((size_t)r==nx, "%lu sets: should output %lu items, actually returned %d", k, nx, r);
+    for (i=0; i<nx; i++)
+      fail_unless(c[i]==xc[i], "%lu sets: incorrect output at %lu", k, i);
+  }
+}
+END_TEST
+
+START_TEST (test_setops_multi_union)
+{
+  static fileptr sets[MULTI_SETS][KERNEL_MAX], c[MULTI_SETS*KERNEL_MAX], xc[MULTI_SETS*KERNEL_MAX], t[MULTI_SETS*KERNEL_MAX];
+  const fileptr *in[MULTI_SETS];
+  size_t counts[MULTI_SETS];
+  size_t sizes[] = KERNEL_SIZES;
+  size_t k, si, i, nx;
+  int r;
+  srandom(19);
+  for (k=0; k<=MULTI_SETS; k++)
+  for (si=0; si<array_size(sizes); si++) {
+    nx = 0;
+    for (i=0; i<k; i++) {
+      counts[i] = random_set_inode(sets[i], sizes[(si+i) % array_size(sizes)], 2+i);
+      in[i] = sets[i];
+      memcpy(t, xc, nx * sizeof(fileptr));
+      nx = set_union(t, sets[i], xc, nx, counts[i], MULTI_SETS*KERNEL_MAX, sizeof(fileptr), inodecmp);
+    }
+    r = set_union_n_inode(in, counts, k, c, MULTI_SETS*KERNEL_MAX);
+    fail_unless((size_t)r==nx, "%lu sets: should output %lu items, actually returned %d", k, nx, r);
+    for (i=0; i<nx; i++)
+      fail_unless(c[i]==xc[i], "%lu sets: incorrect output at %lu", k, i);
+  }
+}
+END_TEST
+
+START_TEST (test_setops_multi_truncate)
+{
+  fileptr a[] = { 1, 3, 5, 7, 9 };
+  fileptr b[] = { 2, 3, 4, 5, 6, 7 };
+  fileptr d[] = { 3, 5, 7, 8 };
+  const fileptr *in[] = { a, b, d };
+  size_t counts[] = { array_size(a), array_size(b), array_size(d) };
+  fileptr c[3];
+  fail_unless(set_intersect_n_inode(in, counts, 3, c, 2)==2, "Intersection should be truncated to two items");
+  fail_unless(c[0]==3 && c[1]==5, "Truncated intersection is incorrect");
+  fail_unless(set_union_n_inode(in, counts, 3, c, 3)==3, "Union should be truncated to three items");
+  fail_unless(c[0]==1 && c[1]==2 && c[2]==3, "Truncated union is incorrect");
+}
+END_TEST
+
+START_TEST (test_setops_multi_invalid)
+{
+  fileptr a[] = { 1, 2 };
+  const fileptr *in[] = { a, NULL };
+  size_t counts[] = { 2, 2 };
+  fileptr c[4];
+  fail_unless(set_intersect_n_inode(in, counts, 0, c, 4)==-EINVAL, "No sets should be rejected");
+  fail_unless(set_intersect_n_inode(in, counts, 2, c, 4)==-EINVAL, "Null set should be rejected");
+  fail_unless(set_intersect_n_inode(in, counts, 1, NULL, 4)==-EINVAL, "Null output should be rejected");
+  fail_unless(set_intersect_n_inode(in, counts, 1, c, 0)==-EINVAL, "Zero-sized output should be rejected");
+  fail_unless(set_union_n_inode(in, counts, 2, c, 4)==-EINVAL, "Null set should be rejected");
+  fail_unless(set_union_n_inode(NULL, counts, 1, c, 4)==-EINVAL, "Null set list should be rejected");
+  fail_unless(set_union_n_inode(in, counts, 0, c, 4)==0, "Union of no sets should be empty");
+}
+END_TEST
+
+
+Suite *setops_multi_suite (void) {
+  Suite *s = suite_create("set_ops multi-way");
+
+  TCase *tc_parity = tcase_create("Parity with pairwise operations");
+  tcase_add_test(tc_parity, test_setops_multi_intersect);
+  tcase_add_test(tc_parity, test_setops_multi_union);
+  suite_add_tcase(s, tc_parity);
+
+  TCase *tc_edge = tcase_create("Edge cases");
+  tcase_add_test(tc_edge, test_setops_multi_truncate);
+  tcase_add_test(tc_edge, test_setops_multi_invalid);
+  suite_add_tcase(s, tc_edge);
+
+  return s;
+}
+
+
+/* ************************************************************************ */
+
+
+#define SORT_MAX 5000
+
+/* Fill \a set according to \a shape, then check it sorts the same as qsort(). */
+#define SORT_CHECK(sfx, type, cmpfn) do { \
+  static type set[SORT_MAX], xset[SORT_MAX]; \
+  size_t sizes[] = { 0, 1, 2, 63, 64, 65, 1000, SORT_MAX }; \
+  size_t si, i, n; \
+  int shape; \
+  srandom(23); \
+  for (shape=0; shape<5; shape++) \
+  for (si=0; si<array_size(sizes); si++) { \
+    n = sizes[si]; \
+    for (i=0; i<n; i++) { \
+      switch (shape) { \
+        case 0: set[i] = (type)random() * (type)random(); break; \
+        case 1: set[i] = i; break; \
+        case 2: set[i] = n-i; break; \
+        case 3: set[i] = random() % 4; break; \
+        default: set[i] = (i % 2) ? (type)-1 - i : i; break; \
+      } \
+    } \
+    memcpy(xset, set, n*sizeof(type)); \
+    qsort(xset, n, sizeof(type), cmpfn); \
+    fail_unless(set_sort_##sfx(set, n)==0, "Sort of %zu items (shape %d) failed", n, shape); \
+    fail_unless(memcmp(set, xset, n*sizeof(type))==0, "Sort of %zu items (shape %d) is incorrect", n, shape); \
+  } \
+} while (0)
+
+static int u32cmp(const void *p1, const void *p2) {
+  return SET_CMP_NUM(*(const uint32_t*)p1, *(const uint32_t*)p2);
+}
+
+static int u64cmp(const void *p1, const void *p2) {
+  return SET_CMP_NUM(*(const uint64_t*)p1, *(const uint64_t*)p2);
+}
+
+START_TEST (test_setops_sort_u32)
+{
+  SORT_CHECK(u32, uint32_t, u32cmp);
+}
+END_TEST
+
+START_TEST (test_setops_sort_u64)
+{
+  SORT_CHECK(u64, uint64_t, u64cmp);
+}
+END_TEST
+
+START_TEST (test_setops_sort_inode)
+{
+  SORT_CHECK(inode, fileptr, inodecmp);
+}
+END_TEST
+
+START_TEST (test_setops_sorted)
+{
+  fileptr a[] = { 1, 2, 2, 5 };
+  fileptr b[] = { 1, 3, 2 };
+  fail_unless(inodeset_sorted(a, 0), "Empty set should be sorted");
+  fail_unless(inodeset_sorted(a, array_size(a)), "Ascending set should be sorted");
+  fail_if(inodeset_sorted(b, array_size(b)), "Unordered set should not be sorted");
+}
+END_TEST
+
+START_TEST (test_setops_insert)
+{
+  fileptr a[6] = { 3, 5, 7 };
+  size_t n = 3;
+  n = inodeset_insert(a, n, 5);
+  fail_unless(n==3, "Inserting a present item should not change the set");
+  n = inodeset_insert(a, n, 1);
+  n = inodeset_insert(a, n, 6);
+  n = inodeset_insert(a, n, 9);
+  fail_unless(n==6, "Set should have six items");
+  fail_unless(a[0]==1 && a[1]==3 && a[2]==5 && a[3]==6 && a[4]==7 && a[5]==9, "Inserted set is incorrect");
+  n = inodeset_insert(a, 0, 4);
+  fail_unless(n==1 && a[0]==4, "Insertion into an empty set is incorrect");
+}
+END_TEST
+
+START_TEST (test_setops_remove)
+{
+  fileptr a[] = { 1, 3, 5, 7 };
+  size_t n = array_size(a);
+  n = inodeset_remove(a, n, 4);
+  fail_unless(n==4, "Removing an absent item should not change the set");
+  n = inodeset_remove(a, n, 1);
+  n = inodeset_remove(a, n, 7);
+  fail_unless(n==2 && a[0]==3 && a[1]==5, "Removal from the ends is incorrect");
+  n = inodeset_remove(a, n, 3);
+  n = inodeset_remove(a, n, 5);
+  fail_unless(n==0, "Set should be empty");
+  fail_unless(inodeset_remove(a, 0, 5)==0, "Removal from an empty set is incorrect");
+}
+END_TEST
+
+
+Suite *setops_sort_suite (void) {
+  Suite *s = suite_create("set_ops sort");
+
+  TCase *tc_sort = tcase_create("Parity with qsort");
+  tcase_add_test(tc_sort, test_setops_sort_u32);
+  tcase_add_test(tc_sort, test_setops_sort_u64);
+  tcase_add_test(tc_sort, test_setops_sort_inode);
+  suite_add_tcase(s, tc_sort);
+
+  TCase *tc_single = tcase_create("Single-item updates");
+  tcase_add_test(tc_single, test_setops_sorted);
+  tcase_add_test(tc_single, test_setops_insert);
+  tcase_add_test(tc_single, test_setops_remove);
+  suite_add_tcase(s, tc_single);
+
+  return s;
+}
+
+/* ************************************************************************ */
+
+
 int main (void) {
   int number_failed;
   printf("\n\033[1;32m>>>\033[m BEGIN TESTS \033[1;37m==========================================================================\033[m\n\n");
@@ -914,6 +1555,10 @@ int main (void) {
   srunner_add_suite(sr, setops_intersect_suite() );
   srunner_add_suite(sr, setops_diff_suite() );
   srunner_add_suite(sr, setops_uniq_suite() );
+  srunner_add_suite(sr, setops_kernel_suite() );
+  srunner_add_suite(sr, setops_family_suite() );
+  srunner_add_suite(sr, setops_multi_suite() );
+  srunner_add_suite(sr, setops_sort_suite() );
 
   srunner_run_all(sr, CK_NORMAL);
 